@@ -100,6 +100,10 @@ using swarm_id_t = uint64_t;
 
 constexpr swarm_id_t INVALID_SWARM_ID = UINT64_MAX;
 
+/// Maps a pubkey into a 64-bit "swarm space" value; the swarm you belong to is whichever one has a
+/// swarm id closest to this pubkey-derived value.
+uint64_t pubkey_to_swarm_space(const user_pubkey_t& pk);
+
 } // namespace beldex
 
 namespace std {
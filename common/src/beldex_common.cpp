@@ -1,6 +1,8 @@
 #include "beldex_common.h"
 #include <bmq/hex.h>
 
+#include <cassert>
+
 namespace beldex {
 
 user_pubkey_t& user_pubkey_t::load(std::string_view pk) {
@@ -51,4 +53,17 @@ std::string user_pubkey_t::prefixed_raw() const {
     return bytes;
 }
 
+uint64_t pubkey_to_swarm_space(const user_pubkey_t& pk) {
+
+    const auto& bytes = pk.raw();
+    assert(bytes.size() == 32);
+
+    // XOR of the pubkey's four 64-bit big-endian words
+    uint64_t res = 0;
+    for (size_t i = 0; i < 32; i++)
+        res ^= uint64_t{static_cast<uint8_t>(bytes[i])} << (8 * (7 - i % 8));
+
+    return res;
+}
+
 }
@@ -129,6 +129,32 @@ void bmqServer::handle_storage_test(bmq::Message& message) {
             });
 }
 
+void bmqServer::handle_sync_digest(bmq::Message& message) {
+    if (message.data.size() != 1) {
+        BELDEX_LOG(warn, "invalid mn.sync_digest bmq request from {}: expected 1 data part, received {}",
+                message.remote, message.data.size());
+        return message.send_reply("invalid parameters");
+    }
+    // Answered on the swarm sync's own thread, keeping these workers free for mn.data
+    master_node_->sync_digest(std::string{message.data[0]},
+            [reply = message.send_later()](std::vector<std::string> parts) {
+                reply.reply(bmq::send_option::data_parts(parts.begin(), parts.end()));
+            });
+}
+
+void bmqServer::handle_sync_fetch(bmq::Message& message) {
+    if (message.data.size() != 3) {
+        BELDEX_LOG(warn, "invalid mn.sync_fetch bmq request from {}: expected 3 data parts, received {}",
+                message.remote, message.data.size());
+        return message.send_reply("invalid parameters");
+    }
+    master_node_->sync_fetch(
+            std::string{message.data[0]}, std::string{message.data[1]}, std::string{message.data[2]},
+            [reply = message.send_later()](std::vector<std::string> parts) {
+                reply.reply(bmq::send_option::data_parts(parts.begin(), parts.end()));
+            });
+}
+
 void bmqServer::handle_onion_request(
         std::string_view payload,
         OnionRequestMetadata&& data,
@@ -403,6 +429,8 @@ bmqServer::bmqServer(
         .add_request_command("ping", [this](auto& m) { handle_ping(m); })
         .add_request_command("storage_test", [this](auto& m) { handle_storage_test(m); }) // NB: requires a 60s request timeout
         .add_request_command("onion_request", [this](auto& m) { handle_onion_request(m); })
+        .add_request_command("sync_digest", [this](auto& m) { handle_sync_digest(m); })
+        .add_request_command("sync_fetch", [this](auto& m) { handle_sync_fetch(m); })
         .add_request_command("storage_cc", [this](auto& m) {
             if (m.data.size() >= 2) return handle_client_request(m.data[0], m, true);
             BELDEX_LOG(warn, "Invalid forwarded client request: incorrect number of message parts ({})",  m.data.size());
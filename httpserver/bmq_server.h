@@ -61,6 +61,11 @@ class bmqServer {
     // mn.storage_test
     void handle_storage_test(bmq::Message& message);
 
+    // mn.sync_digest and mn.sync_fetch - anti-entropy requests from our swarm peers (see
+    // SwarmSync).  These reply with ["OK", ...] on success or an error string on failure.
+    void handle_sync_digest(bmq::Message& message);
+    void handle_sync_fetch(bmq::Message& message);
+
     /// storage.(whatever) -- client request handling.  These reply with [BODY] on success or [CODE,
     /// BODY] on failure (where BODY typically is some sort of error message).
     ///
@@ -3,7 +3,9 @@
 #include "string_utils.hpp"
 #include "time.hpp"
 
+#include <algorithm>
 #include <chrono>
+#include <limits>
 #include <type_traits>
 #include <unordered_set>
 
@@ -259,16 +261,18 @@ bt_value store::to_bt() const {
 
 template <typename Dict>
 static void load(retrieve& r, Dict& d) {
-    auto [lastHash, last_hash, pubKey, pubkey, pk_ed25519, sig, ts] =
+    auto [lastHash, last_hash, max_count, max_size, pubKey, pubkey, pk_ed25519, sig, ts] =
         load_fields<
             std::string,
             std::string,
+            uint64_t,
+            uint64_t,
             std::string,
             std::string,
             std::string_view,
             std::string_view,
             system_clock::time_point
-            >(d, "lastHash", "last_hash", "pubKey", "pubkey", "pubkey_ed25519", "signature", "timestamp");
+            >(d, "lastHash", "last_hash", "max_count", "max_size", "pubKey", "pubkey", "pubkey_ed25519", "signature", "timestamp");
 
     require_exactly_one_of("pubkey", pubkey, "pubKey", pubKey, true);
 
@@ -301,6 +305,14 @@ static void load(retrieve& r, Dict& d) {
             throw parse_error{"Invalid last_hash: expected base64 (43 chars) or hex (128 chars)"};
     }
     r.last_hash = std::move(last_hash);
+
+    if (max_count) {
+        if (*max_count == 0)
+            throw parse_error{"Invalid max_count: must be at least 1"};
+        r.max_count = static_cast<int>(std::min<uint64_t>(*max_count, std::numeric_limits<int>::max()));
+    }
+    if (max_size)
+        r.max_size = static_cast<size_t>(std::min<uint64_t>(*max_size, std::numeric_limits<size_t>::max()));
 }
 void retrieve::load_from(json params) { load(*this, params); }
 void retrieve::load_from(bt_dict_consumer params) { load(*this, params); }
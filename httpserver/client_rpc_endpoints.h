@@ -120,6 +120,17 @@ struct store final : recursive {
 /// - `last_hash` (optional) retrieve messages stored by this storage server since `last_hash` was
 /// stored.  Can also be specified as `lastHash`.  An empty string (or null) is treated as an
 /// omitted value.
+/// - `max_count` (optional) the maximum number of messages to return.  Values above the server's
+/// own limit (currently 100) are reduced to it.
+/// - `max_size` (optional) the maximum total size of the returned message data, in bytes as
+/// returned (i.e. after base64 encoding for json requests).  At least one message is always
+/// returned (if there are any) even if it is larger than this.
+///
+/// Returns dict of:
+/// - `messages` -- list of messages, each a dict of `hash`, `timestamp`, `expiration` and `data`.
+/// - `more` -- true if further messages were left out because of the count or size limit; to
+/// fetch them, retrieve again with `last_hash` set to the `hash` of the last returned message.
+/// - `t` -- the current time, in milliseconds since unix epoch.
 ///
 /// Authentication parameters: these are currently optional during a transition period, and will
 /// eventually become required.  New clients should always pass them.  *If* provided then the
@@ -141,6 +152,8 @@ struct retrieve final : endpoint {
 
     user_pubkey_t pubkey;
     std::optional<std::string> last_hash;
+    std::optional<int> max_count;
+    std::optional<size_t> max_size;
 
     bool check_signature = false;
     std::optional<std::array<unsigned char, 32>> pubkey_ed25519;
@@ -39,6 +39,15 @@ void command_line_parser::parse_args(int argc, char* argv[]) {
         ("bmq-port", po::value(&options_.bmq_port), "Public port to listen on for BMQ connections")
         ("testnet", po::bool_switch(&options_.testnet), "Start storage server in testnet mode")
         ("force-start", po::bool_switch(&options_.force_start), "Ignore the initialisation ready check")
+        ("blob-segments", po::bool_switch(&options_.blob_segments), "Store message bodies in memory-mapped segment files rather than in the database")
+        ("partitioned-db", po::bool_switch(&options_.partitioned_db), "Partition stored messages into per-day tables by expiry (irreversibly migrates an existing database)")
+        ("owner-max-messages", po::value(&options_.owner_max_messages), "Maximum number of messages stored per pubkey (0 for no limit)")
+        ("owner-max-bytes", po::value(&options_.owner_max_bytes), "Maximum total size of the messages stored per pubkey (0 for no limit)")
+        ("no-eviction", po::bool_switch(&options_.no_eviction), "Never evict unexpired messages when the database nears capacity; stores fail once it is full instead")
+        ("retrieve-cache-mb", po::value(&options_.retrieve_cache_mb), "Memory (in MiB) for caching the newest messages of recently polled pubkeys (0 to disable)")
+        ("db-shards", po::value(&options_.db_shards), "Spread stored messages over this many database files, for parallel writes (migrates an existing single-file database; can't be changed afterwards)")
+        ("db-engine", po::value(&options_.db_engine), "Storage engine: `sqlite' (default), or `memory' for testing and benchmarking (nothing is persisted)")
+        ("rebalance-kbps", po::value(&options_.rebalance_kbps), "Bandwidth (in KiB/s) for pushing stored messages to other nodes when the swarms change (0 for no limit)")
         ("bind-ip", po::value(&options_.ip)->default_value("0.0.0.0"), "IP to which to bind the server")
         ("version,v", po::bool_switch(&options_.print_version), "Print the version of this binary")
         ("help", po::bool_switch(&options_.print_help),"Shows this help message")
@@ -109,6 +118,16 @@ void command_line_parser::parse_args(int argc, char* argv[]) {
         };
     }
 
+    if (options_.rebalance_kbps < 0) {
+        throw std::runtime_error(
+            "Invalid option: --rebalance-kbps must not be negative");
+    }
+
+    if (options_.db_engine != "sqlite" && options_.db_engine != "memory") {
+        throw std::runtime_error(
+            "Invalid option: --db-engine must be sqlite or memory");
+    }
+
     if (!vm.count("bmq-port") && !vm.count("lmq-port")) {
         throw std::runtime_error(
             "bmq-port command line option is not specified");
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <boost/program_options.hpp>
+#include <cstdint>
 #include <string>
 
 namespace beldex {
@@ -16,6 +17,15 @@ struct command_line_options {
     std::string ip;
     std::string log_level = "info";
     std::string data_dir;
+    bool blob_segments = false;
+    bool partitioned_db = false;
+    int64_t owner_max_messages = 0;
+    int64_t owner_max_bytes = 0;
+    bool no_eviction = false;
+    int64_t retrieve_cache_mb = 64;
+    size_t db_shards = 1;
+    std::string db_engine = "sqlite";
+    int64_t rebalance_kbps = 4096;
     std::string beldexd_key; // test only (but needed for backwards compatibility)
     std::string beldexd_x25519_key;  // test only
     std::string beldexd_ed25519_key; // test only
@@ -188,8 +188,25 @@ int main(int argc, char* argv[]) {
         auto bmq_server_ptr = std::make_unique<bmqServer>(me, private_key_x25519, stats_access_keys);
         auto& bmq_server = *bmq_server_ptr;
 
+        database_options db_options;
+        db_options.blob_segments = options.blob_segments;
+        db_options.partitioned = options.partitioned_db;
+        db_options.owner_max_messages = options.owner_max_messages;
+        db_options.owner_max_bytes = options.owner_max_bytes;
+        if (options.no_eviction) {
+            db_options.evict_watermark = 2.0;
+            db_options.store_evict_max = 0;
+        }
+        db_options.shards = options.db_shards;
+        if (options.db_engine == "memory") {
+            BELDEX_LOG(warn, "Using the in-memory storage engine: stored messages will be lost on shutdown");
+            db_options.engine = storage_engine::memory;
+        }
+        db_options.retrieve_cache_size = options.retrieve_cache_mb > 0 ? options.retrieve_cache_mb * 1024 * 1024 : 0;
+        rebalance_options rebalance_opts;
+        rebalance_opts.bytes_per_second = options.rebalance_kbps * 1024;
         MasterNode master_node{
-            me, private_key, bmq_server, data_dir, options.force_start};
+            me, private_key, bmq_server, data_dir, db_options, rebalance_opts, options.force_start};
 
         RequestHandler request_handler{master_node, channel_encryption, private_key_ed25519};
 
@@ -1,6 +1,8 @@
 #include "master_node.h"
 
 #include "Database.hpp"
+#include "DbMaintainer.hpp"
+#include "ExpirySweeper.hpp"
 #include "http.h"
 #include "bmq_server.h"
 #include "beldex_logger.h"
@@ -27,41 +29,91 @@ using json = nlohmann::json;
 
 namespace beldex {
 
-// Threshold of missing data records at which we start warning and consult bootstrap nodes (mainly
-// so that we don't bother producing warning spam or going to the bootstrap just for a few new nodes
-// that will often have missing info for a few minutes).
-using MISSING_PUBKEY_THRESHOLD = std::ratio<3, 100>;
-
 /// TODO: there should be config.h to store constants like these
 constexpr std::chrono::seconds BELDEXD_PING_INTERVAL = 30s;
 constexpr int CLIENT_RETRIEVE_MESSAGE_LIMIT = 100;
 
+// Starts a T (an ExpirySweeper or DbMaintainer) on each shard of the database
+template <typename T>
+static std::vector<std::unique_ptr<T>> start_per_shard(Database& db) {
+    std::vector<std::unique_ptr<T>> workers;
+    for (size_t i = 0; i < db.shard_count(); i++)
+        workers.push_back(std::make_unique<T>(db.shard(i)));
+    return workers;
+}
+
+// Swarm syncs push the messages a peer lacks within the same bandwidth budget as rebalancing
+static swarm_sync_options swarm_sync_opts(const rebalance_options& rebalance_opts) {
+    swarm_sync_options opts;
+    opts.bytes_per_second = rebalance_opts.bytes_per_second;
+    return opts;
+}
+
 MasterNode::MasterNode(
         mn_record address,
         const legacy_seckey& skey,
         bmqServer& bmq_server,
         const std::filesystem::path& db_location,
+        const database_options& db_options,
+        const rebalance_options& rebalance_opts,
         const bool force_start) :
       force_start_{force_start},
-      db_{std::make_unique<Database>(db_location)},
+      db_{std::make_unique<Database>(db_location, db_options)},
+      expiry_sweepers_{start_per_shard<ExpirySweeper>(*db_)},
+      db_maintainers_{start_per_shard<DbMaintainer>(*db_)},
+      rebalancer_{std::make_unique<Rebalancer>(
+              *db_,
+              [this](const mn_record& mn, const std::string& blob, std::function<void(bool)> done) {
+                  bmq_server_->request(
+                          mn.pubkey_x25519.view(),
+                          "mn.data",
+                          [done = std::move(done)](bool success, auto&&) { done(success); },
+                          bmq::send_option::request_timeout{REBALANCE_TIMEOUT},
+                          blob);
+              },
+              [this] {
+                  return hf_at_least(HARDFORK_BT_MESSAGE_SERIALIZATION)
+                      ? SERIALIZATION_VERSION_BT : SERIALIZATION_VERSION_OLD;
+              },
+              rebalance_opts)},
+      swarm_sync_{std::make_unique<SwarmSync>(
+              *db_,
+              [this](const mn_record& mn, std::string command, std::vector<std::string> parts,
+                      std::function<void(bool, std::vector<std::string>)> cb) {
+                  bmq_server_->request(
+                          mn.pubkey_x25519.view(),
+                          std::move(command),
+                          [cb = std::move(cb)](bool success, std::vector<std::string> data) {
+                              cb(success, std::move(data));
+                          },
+                          bmq::send_option::request_timeout{SWARM_SYNC_TIMEOUT},
+                          bmq::send_option::data_parts(parts.begin(), parts.end()));
+              },
+              [this](const mn_record& mn, std::vector<std::pair<uint64_t, uint64_t>> ranges) {
+                  rebalancer_->relay_all({mn}, std::move(ranges));
+              },
+              [this] {
+                  return hf_at_least(HARDFORK_BT_MESSAGE_SERIALIZATION)
+                      ? SERIALIZATION_VERSION_BT : SERIALIZATION_VERSION_OLD;
+              },
+              swarm_sync_opts(rebalance_opts))},
       our_address_{std::move(address)},
       our_seckey_{skey},
       bmq_server_{bmq_server},
       all_stats_{*bmq_server} {
 
-    swarm_ = std::make_unique<Swarm>(our_address_);
-
-    BELDEX_LOG(info, "Requesting initial swarm state");
-
+    state_.update([this](mnode_state& s) {
+        s.swarm = std::make_shared<Swarm>(our_address_);
 #ifdef INTEGRATION_TEST
-    syncing_ = false;
+        s.syncing = false;
 #endif
+    });
 
-    bmq_server->add_timer([this] { std::lock_guard l{mn_mutex_}; db_->clean_expired(); },
-            Database::CLEANUP_PERIOD);
+    BELDEX_LOG(info, "Requesting initial swarm state");
 
     // Periodically clean up any https request futures
     bmq_server_->add_timer([this] {
+        std::lock_guard lock{https_reqs_mutex_};
         outstanding_https_reqs_.remove_if(
                 [](auto& f) { return f.wait_for(0ms) == std::future_status::ready; });
     }, 1s);
@@ -72,11 +124,11 @@ MasterNode::MasterNode(
     auto& dtimer = *delay_timer; // Get reference before we move away the shared_ptr
     bmq_server_->add_timer(dtimer, [this, timer=std::move(delay_timer)] {
         bmq_server_->cancel_timer(*timer);
-        std::lock_guard lock{mn_mutex_};
-        if (!syncing_)
-            return;
-        BELDEX_LOG(warn, "Block syncing is taking too long, activating SS regardless");
-        syncing_ = false;
+        state_.update([](mnode_state& s) {
+            if (s.syncing)
+                BELDEX_LOG(warn, "Block syncing is taking too long, activating SS regardless");
+            s.syncing = false;
+        });
     }, 1h);
 }
 
@@ -87,6 +139,7 @@ void MasterNode::on_beldexd_connected() {
     bmq_server_->add_timer([this] { beldexd_ping(); }, BELDEXD_PING_INTERVAL);
     bmq_server_->add_timer([this] { ping_peers(); },
             reachability_testing::TESTING_TIMER_INTERVAL);
+    bmq_server_->add_timer([this] { sync_swarm(); }, SWARM_SYNC_INTERVAL);
 
     std::unique_lock lock{first_response_mutex_};
     while (true) {
@@ -99,108 +152,8 @@ void MasterNode::on_beldexd_connected() {
     }
 }
 
-template <typename T>
-static T get_or(const json& j, std::string_view key, std::common_type_t<T> default_val) {
-    if (auto it = j.find(key); it != j.end())
-        return it->get<T>();
-    return default_val;
-}
-
-static block_update
-parse_swarm_update(const std::string& response_body) {
-
-    if (response_body.empty()) {
-        BELDEX_LOG(critical, "Bad beldexd rpc response: no response body");
-        throw std::runtime_error("Failed to parse swarm update");
-    }
-
-    std::map<swarm_id_t, std::vector<mn_record>> swarm_map;
-    block_update bu;
-
-    BELDEX_LOG(trace, "swarm repsonse: <{}>", response_body);
-
-    try {
-        json result = json::parse(response_body, nullptr, true);
-
-        bu.height = result.at("height").get<uint64_t>();
-        bu.block_hash = result.at("block_hash").get<std::string>();
-        bu.hardfork = result.at("hardfork").get<int>();
-        bu.mnode_revision = get_or<int>(result, "mnode_revision", 0);
-        bu.unchanged = get_or<bool>(result, "unchanged", false);
-        if (bu.unchanged)
-            return bu;
-
-        const json master_node_states = result.at("master_node_states");
-
-        int missing_aux_pks = 0, total = 0;
-
-        for (const auto& mn_json : master_node_states) {
-            /// We want to include (test) decommissioned nodes, but not
-            /// partially funded ones.
-            if (!mn_json.at("funded").get<bool>()) {
-                continue;
-            }
-
-            total++;
-            const auto& pk_hex = mn_json.at("master_node_pubkey").get_ref<const std::string&>();
-            const auto& pk_x25519_hex =
-                mn_json.at("pubkey_x25519").get_ref<const std::string&>();
-            const auto& pk_ed25519_hex =
-                mn_json.at("pubkey_ed25519").get_ref<const std::string&>();
-
-            if (pk_x25519_hex.empty() || pk_ed25519_hex.empty()) {
-                // These will always either both be present or neither present.  If they are missing
-                // there isn't much we can do: it means the remote hasn't transmitted them yet (or
-                // our local beldexd hasn't received them yet).
-                missing_aux_pks++;
-                BELDEX_LOG(debug, "ed25519/x25519 pubkeys are missing from master node info {}", pk_hex);
-                continue;
-            }
-
-            auto mn = mn_record{
-                mn_json.at("public_ip").get_ref<const std::string&>(),
-                mn_json.at("storage_port").get<uint16_t>(),
-                mn_json.at("storage_lmq_port").get<uint16_t>(),
-                legacy_pubkey::from_hex(pk_hex),
-                ed25519_pubkey::from_hex(pk_ed25519_hex),
-                x25519_pubkey::from_hex(pk_x25519_hex)};
-
-            const swarm_id_t swarm_id =
-                mn_json.at("swarm_id").get<swarm_id_t>();
-
-            /// Storing decommissioned nodes (with dummy swarm id) in
-            /// a separate data structure as it seems less error prone
-            if (swarm_id == INVALID_SWARM_ID) {
-                bu.decommissioned_nodes.push_back(std::move(mn));
-            } else {
-                bu.active_x25519_pubkeys.emplace(mn.pubkey_x25519.view());
-
-                swarm_map[swarm_id].push_back(std::move(mn));
-            }
-        }
-
-        if (missing_aux_pks >
-                MISSING_PUBKEY_THRESHOLD::num*total/MISSING_PUBKEY_THRESHOLD::den) {
-            BELDEX_LOG(warn, "Missing ed25519/x25519 pubkeys for {}/{} master nodes; "
-                    "beldexd may be out of sync with the network", missing_aux_pks, total);
-        }
-
-    } catch (const std::exception& e) {
-        BELDEX_LOG(critical, "Bad beldexd rpc response: invalid json ({})", e.what());
-        throw std::runtime_error("Failed to parse swarm update");
-    }
-
-    for (auto const& swarm : swarm_map) {
-        bu.swarms.emplace_back(SwarmInfo{swarm.first, swarm.second});
-    }
-
-    return bu;
-}
-
 void MasterNode::bootstrap_data() {
 
-    std::lock_guard guard(mn_mutex_);
-
     BELDEX_LOG(trace, "Bootstrapping peer data");
 
     std::string params = json{
@@ -272,7 +225,7 @@ void MasterNode::bootstrap_data() {
 
                 if (++(*req_counter) == node_count) {
                     BELDEX_LOG(info, "Bootstrapping done");
-                    if (target_height_ > 0)
+                    if (state_.load()->target_height > 0)
                         update_swarms();
                     else {
                         // If target height is still 0 after having contacted
@@ -282,7 +235,7 @@ void MasterNode::bootstrap_data() {
                         BELDEX_LOG(warn,
                             "Could not contact any bootstrap nodes to get target "
                             "height. Assuming our local height is correct.");
-                        syncing_ = false;
+                        state_.update([](mnode_state& s) { s.syncing = false; });
                     }
                 }
             },
@@ -294,24 +247,29 @@ void MasterNode::bootstrap_data() {
 
 void MasterNode::shutdown() {
     shutting_down_ = true;
+    // Stop sending while we still have a bmq server to send with
+    rebalancer_->stop();
+    swarm_sync_->stop();
 }
 
 bool MasterNode::mnode_ready(std::string* reason) {
+    return mnode_ready(*state_.load(), reason);
+}
+
+bool MasterNode::mnode_ready(const mnode_state& state, std::string* reason) const {
     if (shutting_down()) {
         if (reason) *reason = "shutting down";
         return false;
     }
 
-    std::lock_guard guard(mn_mutex_);
-
     std::vector<std::string> problems;
 
-    if (!hf_at_least(STORAGE_SERVER_HARDFORK))
+    if (state.hardfork < STORAGE_SERVER_HARDFORK)
         problems.push_back(fmt::format("not yet on hardfork {}.{}",
                     STORAGE_SERVER_HARDFORK.first, STORAGE_SERVER_HARDFORK.second));
-    if (!swarm_ || !swarm_->is_valid())
+    if (!state.swarm->is_valid())
         problems.push_back("not in any swarm");
-    if (syncing_)
+    if (state.syncing)
         problems.push_back("not done syncing");
 
     if (reason)
@@ -355,16 +313,9 @@ void MasterNode::record_proxy_request() { all_stats_.bump_proxy_requests(); }
 
 void MasterNode::record_onion_request() { all_stats_.bump_onion_requests(); }
 
-bool MasterNode::process_store(message msg, bool* new_msg) {
-
-    std::lock_guard guard{mn_mutex_};
+void MasterNode::record_coalesced_retrieve() { all_stats_.bump_coalesced_retrieve_requests(); }
 
-    /// only accept a message if we are in a swarm
-    if (!swarm_) {
-        // This should never be printed now that we have "mnode_ready"
-        BELDEX_LOG(err, "error: my swarm in not initialized");
-        return false;
-    }
+bool MasterNode::process_store(message msg, bool* new_msg) {
 
     all_stats_.bump_store_requests();
 
@@ -379,18 +330,17 @@ bool MasterNode::process_store(message msg, bool* new_msg) {
     if (legacy_store) {
         auto serialized = std::move(serialize_messages(&msg, &msg+1, SERIALIZATION_VERSION_OLD).front());
 
-        for (auto& peer : swarm_->other_nodes())
+        auto state = state_.load();
+        for (auto& peer : state->swarm->other_nodes())
             relay_data_reliable(serialized, peer);
 
-        BELDEX_LOG(debug, "Relayed message to {} swarm peers", swarm_->other_nodes().size());
+        BELDEX_LOG(debug, "Relayed message to {} swarm peers", state->swarm->other_nodes().size());
     }
     return true;
 }
 
 void MasterNode::save_bulk(const std::vector<message>& msgs) {
 
-    std::lock_guard guard(mn_mutex_);
-
     try { db_->bulk_store(msgs); }
     catch (const std::exception& e) {
         BELDEX_LOG(err, "failed to save batch to the database: {}", e.what());
@@ -402,13 +352,14 @@ void MasterNode::save_bulk(const std::vector<message>& msgs) {
 
 void MasterNode::on_bootstrap_update(block_update&& bu) {
 
-    // Used in a callback to needs a mutex even if it is private
-    std::lock_guard guard(mn_mutex_);
-
-    swarm_->apply_swarm_changes(bu.swarms);
-    target_height_ = std::max(target_height_, bu.height);
+    auto state = state_.update([&bu](mnode_state& s) {
+        auto swarm = std::make_shared<Swarm>(*s.swarm);
+        swarm->apply_swarm_changes(bu.swarms);
+        s.swarm = std::move(swarm);
+        s.target_height = std::max(s.target_height, bu.height);
+    });
 
-    if (syncing_)
+    if (state->syncing)
         bmq_server_->set_active_mns(std::move(bu.active_x25519_pubkeys));
 }
 
@@ -454,92 +405,136 @@ static MnodeStatus derive_mnode_status(const block_update& bu,
 void MasterNode::on_swarm_update(block_update&& bu) {
 
     hf_revision net_ver{bu.hardfork, bu.mnode_revision};
-    if (hardfork_ != net_ver) {
-        BELDEX_LOG(info, "New hardfork: {}.{}", net_ver.first, net_ver.second);
-        hardfork_ = net_ver;
-    }
 
-    if (syncing_ && target_height_ != 0) {
-        syncing_ = bu.height < target_height_;
-    }
+    // Most polls bring nothing new (we are still syncing, or have already seen the block), so check
+    // that against the current state first and only publish a new one if something changed.
+    auto cur = state_.load();
+    bool syncing = cur->syncing && (cur->target_height == 0 || bu.height < cur->target_height);
+    if (syncing || bu.block_hash == cur->block_hash) {
+        /// We don't have anything to do until we have synced
+        if (syncing)
+            BELDEX_LOG(debug, "Still syncing: {}/{}", bu.height, cur->target_height);
+        else
+            BELDEX_LOG(trace, "already seen this block");
 
-    /// We don't have anything to do until we have synced
-    if (syncing_) {
-        BELDEX_LOG(debug, "Still syncing: {}/{}", bu.height, target_height_);
-        // Note that because we are still syncing, we won't update our swarm id
+        if (cur->hardfork != net_ver || cur->syncing != syncing) {
+            state_.update([&](mnode_state& s) {
+                if (s.hardfork != net_ver) {
+                    BELDEX_LOG(info, "New hardfork: {}.{}", net_ver.first, net_ver.second);
+                    s.hardfork = net_ver;
+                }
+                // Note that while we are still syncing we don't update our swarm id
+                s.syncing = syncing;
+            });
+        }
         return;
     }
 
-    if (bu.block_hash != block_hash_) {
+    // The changes to our swarm, set if we are (still) ready to serve after the new block; we act on
+    // them once the new state is published.
+    std::optional<SwarmEvents> events;
+    bool ready = false;
+
+    auto state = state_.update([&](mnode_state& s) {
+        if (s.hardfork != net_ver) {
+            BELDEX_LOG(info, "New hardfork: {}.{}", net_ver.first, net_ver.second);
+            s.hardfork = net_ver;
+        }
+        s.syncing = false;
 
         BELDEX_LOG(debug, "new block, height: {}, hash: {}", bu.height,
                  bu.block_hash);
 
-        if (bu.height > block_height_ + 1 && block_height_ != 0) {
+        if (bu.height > s.block_height + 1 && s.block_height != 0) {
             BELDEX_LOG(warn, "Skipped some block(s), old: {} new: {}",
-                     block_height_, bu.height);
+                     s.block_height, bu.height);
             /// TODO: if we skipped a block, should we try to run peer tests for
             /// them as well?
-        } else if (bu.height <= block_height_) {
+        } else if (bu.height <= s.block_height) {
             // TODO: investigate how testing will be affected under reorg
             BELDEX_LOG(warn,
                      "new block height is not higher than the current height");
         }
 
-        block_height_ = bu.height;
-        block_hash_ = bu.block_hash;
+        s.block_height = bu.height;
+        s.block_hash = bu.block_hash;
 
-        while (block_hashes_cache_.size() >= BLOCK_HASH_CACHE_SIZE)
-            block_hashes_cache_.erase(block_hashes_cache_.begin());
+        while (s.block_hashes.size() >= BLOCK_HASH_CACHE_SIZE)
+            s.block_hashes.erase(s.block_hashes.begin());
 
-        block_hashes_cache_.insert_or_assign(block_hashes_cache_.end(), bu.height, std::move(bu.block_hash));
-    } else {
-        BELDEX_LOG(trace, "already seen this block");
-        return;
-    }
+        s.block_hashes.insert_or_assign(s.block_hashes.end(), bu.height, bu.block_hash);
 
-    bmq_server_->set_active_mns(std::move(bu.active_x25519_pubkeys));
-
-    const SwarmEvents events = swarm_->derive_swarm_events(bu.swarms);
+        auto swarm = std::make_shared<Swarm>(*s.swarm);
+        SwarmEvents swarm_events = swarm->derive_swarm_events(bu.swarms);
 
-    // TODO: check our node's state
+        // TODO: check our node's state
 
-    const auto status = derive_mnode_status(bu, our_address_);
+        const auto status = derive_mnode_status(bu, our_address_);
 
-    if (status_ != status) {
-        BELDEX_LOG(info, "Node status updated: {}", status);
-        status_ = status;
-    }
+        if (s.status != status) {
+            BELDEX_LOG(info, "Node status updated: {}", status);
+            s.status = status;
+        }
 
-    swarm_->set_swarm_id(events.our_swarm_id);
+        swarm->set_swarm_id(swarm_events.our_swarm_id);
+        s.swarm = swarm;
 
-    if (std::string reason; !mnode_ready(&reason)) {
-        BELDEX_LOG(warn, "Storage server is still not ready: {}", reason);
-        swarm_->update_state(bu.swarms, bu.decommissioned_nodes, events, false);
-        return;
-    } else {
-        if (!active_) {
-            // NOTE: because we never reset `active_` after we get
-            // decommissioned, this code won't run when the node comes back
-            // again
-            BELDEX_LOG(info, "Storage server is now active!");
-            active_ = true;
+        if (std::string reason; !mnode_ready(s, &reason)) {
+            BELDEX_LOG(warn, "Storage server is still not ready: {}", reason);
+            swarm->update_state(bu.swarms, bu.decommissioned_nodes, swarm_events, false);
+            return;
         }
-    }
 
-    swarm_->update_state(bu.swarms, bu.decommissioned_nodes, events, true);
+        swarm->update_state(bu.swarms, bu.decommissioned_nodes, swarm_events, true);
+        events = std::move(swarm_events);
+        ready = true;
+    });
+
+    bmq_server_->set_active_mns(std::move(bu.active_x25519_pubkeys));
+
+    if (!ready)
+        return;
 
-    if (!events.new_mnodes.empty()) {
-        relay_messages(get_all_messages(), events.new_mnodes);
+    bool became_active = false;
+    if (!active_) {
+        // NOTE: because we never reset `active_` after we get
+        // decommissioned, this code won't run when the node comes back
+        // again
+        BELDEX_LOG(info, "Storage server is now active!");
+        active_ = true;
+        became_active = true;
     }
 
-    if (!events.new_swarms.empty()) {
-        bootstrap_swarms(events.new_swarms);
+    // Catch up with our swarm peers (and them with us), and bring new members up to date; a new
+    // member that we can't sync with (e.g. one that doesn't know the sync requests) gets all our
+    // messages instead.  Only one of the existing members does that for each new one, so that it
+    // doesn't get a full copy of the swarm's messages from every member.
+    auto& swarm = *state->swarm;
+    std::vector<mn_record> existing;
+    for (auto& mn : events->our_swarm_members)
+        if (std::find(events->new_mnodes.begin(), events->new_mnodes.end(), mn) == events->new_mnodes.end())
+            existing.push_back(mn);
+    if (!existing.empty())
+        events->new_mnodes.erase(std::remove_if(events->new_mnodes.begin(), events->new_mnodes.end(),
+                    [&](const mn_record& mn) {
+                        return swarm_sync::relaying_member(existing, mn) != our_address_;
+                    }),
+                events->new_mnodes.end());
+    if (auto space = swarm_space_range(swarm.all_valid_swarms(), swarm.our_swarm_id())) {
+        if (became_active)
+            swarm_sync_->sync(swarm.other_nodes(), *space);
+        swarm_sync_->sync(events->new_mnodes, *space,
+                [this](const mn_record& mn) { rebalancer_->relay_all({mn}); });
+    } else
+        rebalancer_->relay_all(std::move(events->new_mnodes));
+
+    if (!events->new_swarms.empty()) {
+        rebalancer_->bootstrap(state->swarm, std::move(events->new_swarms));
     }
 
-    if (events.dissolved) {
+    if (events->dissolved) {
         /// Go through all our PK and push them accordingly
-        bootstrap_swarms();
+        rebalancer_->bootstrap(state->swarm);
     }
 
 #ifndef INTEGRATION_TEST
@@ -554,8 +549,6 @@ void MasterNode::update_swarms() {
         return;
     }
 
-    std::lock_guard lock{mn_mutex_};
-
     BELDEX_LOG(debug, "Swarm update triggered");
 
     json params{
@@ -575,8 +568,8 @@ void MasterNode::update_swarms() {
         }},
         {"active_only", false}
     };
-    if (got_first_response_ && !block_hash_.empty())
-        params["poll_block_hash"] = block_hash_;
+    if (auto state = state_.load(); got_first_response_ && !state->block_hash.empty())
+        params["poll_block_hash"] = state->block_hash;
 
     bmq_server_.beldexd_request("rpc.get_master_nodes",
         [this](bool success, std::vector<std::string> data) {
@@ -586,7 +579,6 @@ void MasterNode::update_swarms() {
                 return;
             }
             try {
-                std::lock_guard lock{mn_mutex_};
                 block_update bu = parse_swarm_update(data[1]);
                 if (!got_first_response_) {
                     BELDEX_LOG(info, "Got initial swarm information from local Beldexd");
@@ -610,7 +602,9 @@ void MasterNode::update_swarms() {
                                     std::string_view hash{data[1].data() + 1, data[1].size() - 2};
                                     if (bmq::is_hex(hash)) {
                                         BELDEX_LOG(debug, "Pre-loaded hash {} for height {}", hash, h);
-                                        block_hashes_cache_.insert_or_assign(h, hash);
+                                        state_.update([&](mnode_state& s) {
+                                            s.block_hashes.insert_or_assign(h, std::string{hash});
+                                        });
                                     }
                                 },
                                 "{\"height\":[" + util::int_to_string(h) + "]}");
@@ -634,7 +628,7 @@ void MasterNode::update_swarms() {
                                 MISSING_PUBKEY_THRESHOLD::num*total/MISSING_PUBKEY_THRESHOLD::den) {
                         BELDEX_LOG(info, "Initialized from beldexd with {}/{} MN records",
                                 total-missing, total);
-                        syncing_ = false;
+                        state_.update([](mnode_state& s) { s.syncing = false; });
                     } else {
                         BELDEX_LOG(info, "Detected some missing MN data ({}/{}); "
                                 "querying bootstrap nodes for help", missing, total);
@@ -662,30 +656,35 @@ void MasterNode::update_last_ping(ReachType type) {
 
 void MasterNode::ping_peers() {
 
-    std::lock_guard lock{mn_mutex_};
+    auto state = state_.load();
 
     // TODO: Don't do anything until we are fully funded
 
-    if (status_ == MnodeStatus::UNSTAKED || status_ == MnodeStatus::UNKNOWN) {
+    if (state->status == MnodeStatus::UNSTAKED || state->status == MnodeStatus::UNKNOWN) {
         BELDEX_LOG(trace, "Skipping peer testing (unstaked)");
         return;
     }
 
     auto now = std::chrono::steady_clock::now();
 
-    // Check if we've been tested (reached) recently ourselves
-    reach_records_.check_incoming_tests(now);
+    std::vector<std::pair<mn_record, int>> to_test;
+    {
+        std::lock_guard lock{reach_mutex_};
 
-    if (status_ == MnodeStatus::DECOMMISSIONED) {
-        BELDEX_LOG(trace, "Skipping peer testing (decommissioned)");
-        return;
-    }
+        // Check if we've been tested (reached) recently ourselves
+        reach_records_.check_incoming_tests(now);
 
-    /// We always test nodes due to be tested plus one general, non-failing node.
+        if (state->status == MnodeStatus::DECOMMISSIONED) {
+            BELDEX_LOG(trace, "Skipping peer testing (decommissioned)");
+            return;
+        }
 
-    auto to_test = reach_records_.get_failing(*swarm_, now);
-    if (auto rando = reach_records_.next_random(*swarm_, now))
-        to_test.emplace_back(std::move(*rando), 0);
+        /// We always test nodes due to be tested plus one general, non-failing node.
+
+        to_test = reach_records_.get_failing(*state->swarm, now);
+        if (auto rando = reach_records_.next_random(*state->swarm, now))
+            to_test.emplace_back(std::move(*rando), 0);
+    }
 
     if (to_test.empty())
         BELDEX_LOG(trace, "no nodes to test this tick");
@@ -742,7 +741,7 @@ void MasterNode::test_reachability(const mn_record& mn, int previous_failures) {
             headers[h] = std::move(v);
 
     BELDEX_LOG(debug, "Sending HTTPS ping to {} @ {}", mn.pubkey_legacy, url);
-    outstanding_https_reqs_.emplace_front(
+    track_https_request(
         cpr::PostCallback(
             [this, &bmq=*bmq_server(), old_ping_test, test_results, previous_failures]
             (cpr::Response r) {
@@ -814,9 +813,12 @@ void MasterNode::test_reachability(const mn_record& mn, int previous_failures) {
     );
 }
 
-void MasterNode::beldexd_ping() {
+void MasterNode::track_https_request(std::future<void> req) {
+    std::lock_guard lock{https_reqs_mutex_};
+    outstanding_https_reqs_.push_front(std::move(req));
+}
 
-    std::lock_guard guard(mn_mutex_);
+void MasterNode::beldexd_ping() {
 
     json beldexd_params{
         {"version", STORAGE_SERVER_VERSION},
@@ -907,6 +909,8 @@ void MasterNode::send_storage_test_req(const mn_record& testee,
                                         uint64_t test_height,
                                         const message& msg) {
 
+    const uint64_t height = state_.load()->block_height;
+
     if (!hf_at_least(HARDFORK_BMQ_STORAGE_TESTS)) {
         // Deprecated HTTPS storage test: remove after HF18.1
         cpr::Body body{json{{"height", test_height}, {"hash", msg.hash}}.dump()};
@@ -920,9 +924,9 @@ void MasterNode::send_storage_test_req(const mn_record& testee,
         for (auto& [h, v] : sign_request(body.str()))
             headers[h] = std::move(v);
 
-        outstanding_https_reqs_.emplace_front(
+        track_https_request(
             cpr::PostCallback(
-                [this, testee, msg, height=block_height_]
+                [this, testee, msg, height]
                 (cpr::Response r) {
                     auto& pk = testee.pubkey_legacy;
                     std::string status;
@@ -977,7 +981,7 @@ void MasterNode::send_storage_test_req(const mn_record& testee,
 
     bmq_server_->request(
         testee.pubkey_x25519.view(), "mn.storage_test",
-        [this, testee, msg, height=block_height_](bool success, auto data) {
+        [this, testee, msg, height](bool success, auto data) {
             if (!success || data.size() != 2) {
                 BELDEX_LOG(debug, "Storage test request failed: {}",
                         !success ? "request timed out" : "wrong number of elements in response");
@@ -988,7 +992,7 @@ void MasterNode::send_storage_test_req(const mn_record& testee,
         },
         bmq::send_option::request_timeout{STORAGE_TEST_TIMEOUT},
         // Data parts: test height and msg hash (in bytes)
-        std::to_string(block_height_),
+        std::to_string(height),
         is_hex ? bmq::from_hex(msg.hash) : bmq::from_base64(msg.hash)
     );
 }
@@ -1031,7 +1035,7 @@ void MasterNode::report_reachability(const mn_record& mn, bool reachable, int pr
             std::move(cb), params.dump());
 
     if (!reachable || previous_failures > 0) {
-        std::lock_guard guard(mn_mutex_);
+        std::lock_guard guard(reach_mutex_);
         if (!reachable)
             reach_records_.add_failing_node(mn.pubkey_legacy, previous_failures);
         else
@@ -1041,11 +1045,10 @@ void MasterNode::report_reachability(const mn_record& mn, bool reachable, int pr
 
 // Deterministically selects two random swarm members; returns the pair on success, nullopt on
 // failure.
-std::optional<std::pair<mn_record, mn_record>> MasterNode::derive_tester_testee(uint64_t blk_height) {
-
-    std::lock_guard guard(mn_mutex_);
+std::optional<std::pair<mn_record, mn_record>> MasterNode::derive_tester_testee(
+        const mnode_state& state, uint64_t blk_height) const {
 
-    std::vector<mn_record> members = swarm_->other_nodes();
+    std::vector<mn_record> members = state.swarm->other_nodes();
     members.push_back(our_address_);
 
     if (members.size() < 2) {
@@ -1057,14 +1060,14 @@ std::optional<std::pair<mn_record, mn_record>> MasterNode::derive_tester_testee(
             [](const auto& a, const auto& b) { return a.pubkey_legacy < b.pubkey_legacy; });
 
     std::string block_hash;
-    if (blk_height == block_height_) {
-        block_hash = block_hash_;
-    } else if (blk_height < block_height_) {
+    if (blk_height == state.block_height) {
+        block_hash = state.block_hash;
+    } else if (blk_height < state.block_height) {
 
         BELDEX_LOG(trace, "got storage test request for an older block: {}/{}",
-                 blk_height, block_height_);
+                 blk_height, state.block_height);
 
-        if (auto it = block_hashes_cache_.find(blk_height); it != block_hashes_cache_.end()) {
+        if (auto it = state.block_hashes.find(blk_height); it != state.block_hashes.end()) {
             block_hash = it->second;
         } else {
             BELDEX_LOG(debug, "Could not find hash for a given block height");
@@ -1100,20 +1103,20 @@ std::pair<MessageTestStatus, std::string> MasterNode::process_storage_test_req(
     const legacy_pubkey& tester_pk,
     const std::string& msg_hash_hex) {
 
-    std::lock_guard guard(mn_mutex_);
+    auto state = state_.load();
 
     // 1. Check height, retry if we are behind
     std::string block_hash;
 
-    if (blk_height > block_height_) {
+    if (blk_height > state->block_height) {
         BELDEX_LOG(debug, "Our blockchain is behind, height: {}, requested: {}",
-                 block_height_, blk_height);
+                 state->block_height, blk_height);
         return {MessageTestStatus::RETRY, ""};
     }
 
     // 2. Check tester/testee pair
     {
-        auto tester_testee = derive_tester_testee(blk_height);
+        auto tester_testee = derive_tester_testee(*state, blk_height);
         if (!tester_testee) {
             BELDEX_LOG(err, "We have no mnodes to derive tester/testee from");
             return {MessageTestStatus::WRONG_REQ, ""};
@@ -1148,19 +1151,19 @@ std::pair<MessageTestStatus, std::string> MasterNode::process_storage_test_req(
 
 void MasterNode::initiate_peer_test() {
 
-    std::lock_guard guard(mn_mutex_);
+    auto state = state_.load();
 
     // 1. Select the tester/testee pair
 
-    if (block_height_ < TEST_BLOCKS_BUFFER) {
+    if (state->block_height < TEST_BLOCKS_BUFFER) {
         BELDEX_LOG(debug, "Height {} is too small, skipping all tests",
-                 block_height_);
+                 state->block_height);
         return;
     }
 
-    const uint64_t test_height = block_height_ - TEST_BLOCKS_BUFFER;
+    const uint64_t test_height = state->block_height - TEST_BLOCKS_BUFFER;
 
-    auto tester_testee = derive_tester_testee(test_height);
+    auto tester_testee = derive_tester_testee(*state, test_height);
     if (!tester_testee)
         return;
     auto [tester, testee] = *std::move(tester_testee);
@@ -1182,74 +1185,19 @@ void MasterNode::initiate_peer_test() {
     }
 }
 
-void MasterNode::bootstrap_swarms(
-    const std::vector<swarm_id_t>& swarms) const {
-
-    std::lock_guard guard(mn_mutex_);
-
-    if (swarms.empty())
-        BELDEX_LOG(info, "Bootstrapping all swarms");
-    else if (BELDEX_LOG_ENABLED(info))
-        BELDEX_LOG(info, "Bootstrapping swarms: [{}]", util::join(", ", swarms));
-
-    const auto& all_swarms = swarm_->all_valid_swarms();
-
-    std::unordered_map<user_pubkey_t, swarm_id_t> pk_swarm_cache;
-    std::unordered_map<swarm_id_t, std::vector<message>> to_relay;
-
-    std::vector<message> all_entries = get_all_messages();
-    BELDEX_LOG(debug, "We have {} messages", all_entries.size());
-    for (auto& entry : all_entries) {
-        if (!entry.pubkey) {
-            BELDEX_LOG(err, "Invalid pubkey in a message while bootstrapping other nodes");
-            continue;
-        }
-
-        auto [it, ins] = pk_swarm_cache.try_emplace(entry.pubkey);
-        if (ins)
-            it->second = get_swarm_by_pk(all_swarms, entry.pubkey).swarm_id;
-        auto swarm_id = it->second;
-
-        if (swarms.empty() || std::find(swarms.begin(), swarms.end(), swarm_id) != swarms.end())
-            to_relay[swarm_id].push_back(std::move(entry));
-    }
-
-    BELDEX_LOG(trace, "Bootstrapping {} swarms", to_relay.size());
-
-    std::unordered_map<swarm_id_t, size_t> swarm_id_to_idx;
-    for (size_t i = 0; i < all_swarms.size(); ++i)
-        swarm_id_to_idx.emplace(all_swarms[i].swarm_id, i);
-
-    for (const auto& [swarm_id, items] : to_relay)
-        relay_messages(items, all_swarms[swarm_id_to_idx[swarm_id]].mnodes);
-}
-
-void MasterNode::relay_messages(const std::vector<message>& messages,
-                                 const std::vector<mn_record>& mnodes) const {
-    std::vector<std::string> batches = serialize_messages(messages.begin(), messages.end(),
-            !hf_at_least(HARDFORK_BT_MESSAGE_SERIALIZATION)
-                ? SERIALIZATION_VERSION_OLD : SERIALIZATION_VERSION_BT);
-
-    if (BELDEX_LOG_ENABLED(debug)) {
-        BELDEX_LOG(debug, "Relayed messages:");
-        for (auto msg : batches)
-            BELDEX_LOG(debug, "    {}", msg);
-        BELDEX_LOG(debug, "To Mnodes:");
-        for (auto mn : mnodes)
-            BELDEX_LOG(debug, "    {}", mn.pubkey_legacy);
-
-        BELDEX_LOG(debug, "Serialised batches: {}", batches.size());
-    }
-
-    for (const mn_record& mn : mnodes)
-        for (auto& batch : batches)
-            relay_data_reliable(batch, mn);
-}
-
-std::vector<message> MasterNode::retrieve(
-        const user_pubkey_t& pubkey, const std::string& last_hash) {
+bool MasterNode::retrieve(
+        const user_pubkey_t& pubkey,
+        const std::string& last_hash,
+        std::optional<int> max_count,
+        std::optional<size_t> max_size,
+        size_encoding encoding,
+        const std::function<void(const message_view& msg)>& f) {
     all_stats_.bump_retrieve_requests();
-    return db_->retrieve(pubkey, last_hash, CLIENT_RETRIEVE_MESSAGE_LIMIT);
+    return db_->retrieve_each(pubkey, last_hash,
+            std::min(max_count.value_or(CLIENT_RETRIEVE_MESSAGE_LIMIT), CLIENT_RETRIEVE_MESSAGE_LIMIT),
+            max_size.value_or(std::numeric_limits<size_t>::max()),
+            encoding,
+            f);
 }
 
 std::optional<std::vector<std::string>> MasterNode::delete_all_messages(
@@ -1303,6 +1251,7 @@ static nlohmann::json to_json(const all_stats_t& stats) {
     return json{
         {"total_store_requests", stats.get_total_store_requests()},
         {"total_retrieve_requests", stats.get_total_retrieve_requests()},
+        {"total_coalesced_retrieve_requests", stats.get_total_coalesced_retrieve_requests()},
         {"total_onion_requests", stats.get_total_onion_requests()},
         {"total_proxy_requests", stats.get_total_proxy_requests()},
 
@@ -1325,12 +1274,140 @@ std::string MasterNode::get_stats() const {
     auto val = to_json(all_stats_);
 
     val["version"] = STORAGE_SERVER_VERSION_STRING;
-    val["height"] = block_height_;
-    val["target_height"] = target_height_;
+    auto state = state_.load();
+    val["height"] = state->block_height;
+    val["target_height"] = state->target_height;
 
     val["total_stored"] = db_->get_message_count();
+    val["total_data_bytes"] = db_->get_data_bytes();
     val["db_used"] = db_->get_used_bytes();
     val["db_max"] = Database::SIZE_LIMIT;
+    val["db_shards"] = db_->shard_count();
+
+    // Totals over the shards (and the slowest chunks and checkpoints of any shard)
+    ExpirySweeper::stats_t sweep;
+    for (auto& sweeper : expiry_sweepers_) {
+        auto s = sweeper->get_stats();
+        sweep.backlog += s.backlog;
+        sweep.removed += s.removed;
+        sweep.chunks += s.chunks;
+        sweep.last_chunk = std::max(sweep.last_chunk, s.last_chunk);
+        sweep.max_chunk = std::max(sweep.max_chunk, s.max_chunk);
+        sweep.total_chunk += s.total_chunk;
+        sweep.blob_bytes_reclaimed += s.blob_bytes_reclaimed;
+        sweep.evicted += s.evicted;
+    }
+    using ms_double = std::chrono::duration<double, std::milli>;
+    val["expiry_sweeper"] = json{
+        {"backlog", sweep.backlog},
+        {"removed", sweep.removed},
+        {"chunks", sweep.chunks},
+        {"last_chunk_ms", ms_double{sweep.last_chunk}.count()},
+        {"max_chunk_ms", ms_double{sweep.max_chunk}.count()},
+        {"avg_chunk_ms", sweep.chunks > 0 ? ms_double{sweep.total_chunk}.count() / sweep.chunks : 0.0},
+        {"blob_bytes_reclaimed", sweep.blob_bytes_reclaimed},
+        {"evicted", sweep.evicted},
+    };
+
+    DbMaintainer::stats_t maint;
+    for (auto& maintainer : db_maintainers_) {
+        auto m = maintainer->get_stats();
+        maint.wal_bytes += m.wal_bytes;
+        maint.log_bytes += m.log_bytes;
+        maint.checkpoints += m.checkpoints;
+        maint.restarts += m.restarts;
+        maint.truncates += m.truncates;
+        maint.busy += m.busy;
+        maint.last_checkpoint = std::max(maint.last_checkpoint, m.last_checkpoint);
+        maint.max_checkpoint = std::max(maint.max_checkpoint, m.max_checkpoint);
+        maint.total_checkpoint += m.total_checkpoint;
+        maint.freelist_pages += m.freelist_pages;
+        maint.vacuumed_pages += m.vacuumed_pages;
+    }
+    val["db_maintenance"] = json{
+        {"wal_bytes", maint.wal_bytes},
+        {"wal_log_bytes", maint.log_bytes},
+        {"checkpoints", maint.checkpoints},
+        {"restarts", maint.restarts},
+        {"truncates", maint.truncates},
+        {"busy", maint.busy},
+        {"last_checkpoint_ms", ms_double{maint.last_checkpoint}.count()},
+        {"max_checkpoint_ms", ms_double{maint.max_checkpoint}.count()},
+        {"avg_checkpoint_ms", maint.checkpoints > 0 ? ms_double{maint.total_checkpoint}.count() / maint.checkpoints : 0.0},
+        {"freelist_pages", maint.freelist_pages},
+        {"vacuumed_pages", maint.vacuumed_pages},
+    };
+
+    auto filter = db_->get_hash_filter_stats();
+    val["hash_filter"] = json{
+        {"ready", filter.ready},
+        {"entries", filter.entries},
+        {"memory_bytes", filter.memory_bytes},
+        {"lookups", filter.lookups},
+        {"hits", filter.hits},
+        {"duplicates", filter.duplicates},
+        {"hit_rate", filter.lookups > 0 ? double(filter.hits) / filter.lookups : 0.0},
+    };
+
+    auto capacity = db_->get_capacity_stats();
+    val["capacity"] = json{
+        {"fill_level", capacity.fill_level},
+        {"evicting", capacity.evicting},
+        {"evicted", capacity.evicted},
+        {"store_evicted", capacity.store_evicted},
+        {"quota_rejections", capacity.quota_rejections},
+        {"full_rejections", capacity.full_rejections},
+    };
+
+    auto cache = db_->get_retrieve_cache_stats();
+    val["retrieve_cache"] = json{
+        {"enabled", cache.enabled},
+        {"entries", cache.entries},
+        {"memory_bytes", cache.memory_bytes},
+        {"hits", cache.hits},
+        {"empty", cache.empty},
+        {"misses", cache.misses},
+        {"evictions", cache.evictions},
+        {"hit_rate", cache.hits + cache.misses > 0 ? double(cache.hits) / (cache.hits + cache.misses) : 0.0},
+    };
+
+    auto rebalance = rebalancer_->get_stats();
+    val["rebalancing"] = json{
+        {"running", rebalance.running},
+        {"jobs_queued", rebalance.jobs_queued},
+        {"jobs_done", rebalance.jobs_done},
+        {"job_messages", rebalance.job_messages},
+        {"job_estimate", rebalance.job_estimate},
+        {"job_progress", rebalance.job_estimate > 0
+            ? std::min(double(rebalance.job_messages) / rebalance.job_estimate, 1.0) : 0.0},
+        {"job_eta_s", rebalance.job_eta ? json(rebalance.job_eta->count()) : json(nullptr)},
+        {"messages", rebalance.messages},
+        {"batches_sent", rebalance.batches_sent},
+        {"bytes_sent", rebalance.bytes_sent},
+        {"retries", rebalance.retries},
+        {"dropped", rebalance.dropped},
+        {"in_flight", rebalance.in_flight},
+        {"pending_bytes", rebalance.pending_bytes},
+    };
+
+    auto sync_stats = swarm_sync_->get_stats();
+    val["swarm_sync"] = json{
+        {"queued", sync_stats.queued},
+        {"synced", sync_stats.synced},
+        {"in_sync", sync_stats.in_sync},
+        {"failed", sync_stats.failed},
+        {"ranges", sync_stats.ranges},
+        {"fetched", sync_stats.fetched},
+        {"pushed", sync_stats.pushed},
+        {"relayed", sync_stats.relayed},
+        {"deferred", sync_stats.deferred},
+        {"bytes", sync_stats.bytes},
+        {"full_dump_bytes", sync_stats.full_dump_bytes},
+        {"bytes_saved", std::max<int64_t>(sync_stats.full_dump_bytes - sync_stats.bytes, 0)},
+        {"served", sync_stats.served},
+        {"busy", sync_stats.busy},
+        {"indexes", sync_stats.indexes},
+    };
 
     return val.dump();
 }
@@ -1341,7 +1418,11 @@ std::string MasterNode::get_status_line() const {
     // status message has to be fairly short: has to fit on one line, and if
     // it's too long systemd just truncates it when displaying it.
 
-    std::lock_guard guard(mn_mutex_);
+    auto msg_count = db_->get_message_count();
+    auto bytes_stored = db_->get_used_bytes();
+    auto owner_count = db_->get_owner_count();
+
+    auto state = state_.load();
 
     // v2.3.4; sw=abcd…789(n=7); 1234 msgs (47.3MB) for 567 users; reqs(S/R/O/P): 123/456/789/1011 (last 62.3min)
     std::ostringstream s;
@@ -1349,19 +1430,19 @@ std::string MasterNode::get_status_line() const {
     if (!beldex::is_mainnet)
         s << " (TESTNET)";
 
-    if (syncing_)
+    if (state->syncing)
         s << "; SYNCING";
     s << "; sw=";
-    if (!swarm_ || !swarm_->is_valid())
+    if (!state->swarm->is_valid())
         s << "NONE";
     else {
-        std::string swarm = fmt::format("{:016x}", swarm_->our_swarm_id());
+        std::string swarm = fmt::format("{:016x}", state->swarm->our_swarm_id());
         s << swarm.substr(0, 4) << u8"…" << swarm.substr(swarm.size()-3);
-        s << "(n=" << (1 + swarm_->other_nodes().size()) << ")";
+        s << "(n=" << (1 + state->swarm->other_nodes().size()) << ")";
     }
-    s << "; " << db_->get_message_count() << " msgs";
+    s << "; " << msg_count << " msgs";
 
-    if (auto bytes_stored = db_->get_used_bytes(); bytes_stored > 0) {
+    if (bytes_stored > 0) {
         s << " (";
         auto oldprec = s.precision(3);
         if (bytes_stored >= 999'500'000)
@@ -1376,7 +1457,7 @@ std::string MasterNode::get_status_line() const {
         s << "B)";
     }
 
-    s << " for " << db_->get_owner_count() << " users";
+    s << " for " << owner_count << " users";
 
     auto [window, stats] = all_stats_.get_recent_requests();
     s << "; reqs(S/R/O/P): " << stats.client_store_requests << '/'
@@ -1392,9 +1473,28 @@ std::vector<message> MasterNode::get_all_messages() const {
     return db_->retrieve_all();
 }
 
-void MasterNode::process_push_batch(const std::string& blob) {
+void MasterNode::sync_swarm() {
+    auto state = state_.load();
+    if (!mnode_ready(*state, nullptr))
+        return;
+    auto& swarm = *state->swarm;
+    auto& peers = swarm.other_nodes();
+    auto space = swarm_space_range(swarm.all_valid_swarms(), swarm.our_swarm_id());
+    if (peers.empty() || !space)
+        return;
+    swarm_sync_->sync({peers[util::uniform_distribution_portable(util::rng(), peers.size())]}, *space);
+}
 
-    std::lock_guard guard(mn_mutex_);
+void MasterNode::sync_digest(std::string ranges, SwarmSync::reply_fn reply) {
+    swarm_sync_->digest(std::move(ranges), std::move(reply));
+}
+
+void MasterNode::sync_fetch(
+        std::string ranges, std::string hashes, std::string after, SwarmSync::reply_fn reply) {
+    swarm_sync_->fetch(std::move(ranges), std::move(hashes), std::move(after), std::move(reply));
+}
+
+void MasterNode::process_push_batch(const std::string& blob) {
 
     if (blob.empty())
         return;
@@ -1412,33 +1512,16 @@ void MasterNode::process_push_batch(const std::string& blob) {
 }
 
 bool MasterNode::is_pubkey_for_us(const user_pubkey_t& pk) const {
-
-    std::lock_guard guard(mn_mutex_);
-
-    if (!swarm_) {
-        BELDEX_LOG(err, "Swarm data missing");
-        return false;
-    }
-    return swarm_->is_pubkey_for_us(pk);
+    return state_.load()->swarm->is_pubkey_for_us(pk);
 }
 
 SwarmInfo MasterNode::get_swarm(const user_pubkey_t& pk) {
-
-    std::lock_guard guard(mn_mutex_);
-
-    if (!swarm_) {
-        BELDEX_LOG(err, "Swarm data missing");
-        return {};
-    }
-
-    return get_swarm_by_pk(swarm_->all_valid_swarms(), pk);
+    return state_.load()->swarm->get_swarm(pk);
 }
 
 std::vector<mn_record>
 MasterNode::get_swarm_peers() {
-    std::lock_guard guard{mn_mutex_};
-
-    return swarm_->other_nodes();
+    return state_.load()->swarm->other_nodes();
 }
 
 } // namespace beldex
@@ -2,6 +2,7 @@
 
 #include <chrono>
 #include <forward_list>
+#include <functional>
 #include <future>
 #include <map>
 #include <memory>
@@ -11,11 +12,16 @@
 #include <string_view>
 
 #include "Database.hpp"
+#include "DbMaintainer.hpp"
+#include "ExpirySweeper.hpp"
 #include "beldex_common.h"
 #include "beldexd_key.h"
 #include "reachability_testing.h"
+#include "rebalancer.h"
+#include "snapshot.h"
 #include "stats.h"
 #include "swarm.h"
+#include "swarm_sync.h"
 
 namespace beldex {
 
@@ -30,6 +36,15 @@ inline constexpr auto STORAGE_TEST_TIMEOUT = 15s;
 // Timeout for bootstrap node BMQ requests
 inline constexpr auto BOOTSTRAP_TIMEOUT = 10s;
 
+// Timeout for the batches of messages we push to other nodes when the swarms change (which the
+// receiver only acknowledges once it has stored them)
+inline constexpr auto REBALANCE_TIMEOUT = 30s;
+
+// How often we sync our swarm's messages with a random swarm peer (see SwarmSync), and the timeout
+// for each of the requests of a sync
+inline constexpr auto SWARM_SYNC_INTERVAL = 10min;
+inline constexpr auto SWARM_SYNC_TIMEOUT = 30s;
+
 /// We test based on the height a few blocks back to minimise discrepancies between nodes (we could
 /// also use checkpoints, but that is still not bulletproof: swarms are calculated based on the
 /// latest block, so they might be still different and thus derive different pairs)
@@ -61,30 +76,47 @@ enum class MessageTestStatus { SUCCESS, RETRY, ERROR, WRONG_REQ };
 
 enum class MnodeStatus { UNKNOWN, UNSTAKED, DECOMMISSIONED, ACTIVE };
 
+// The chain and swarm state of a master node, as of the last block update.  A published state is
+// never modified: updates publish a new one (see `snapshot`), so that request handling reads it
+// without locking.
+struct mnode_state {
+    hf_revision hardfork = {0, 0};
+    uint64_t block_height = 0;
+    // The height beldexd (or the bootstrap nodes) are synced to; 0 if not yet known
+    uint64_t target_height = 0;
+    std::string block_hash;
+    /// Cache for block_height/block_hash mapping
+    std::map<uint64_t, std::string> block_hashes;
+    bool syncing = true;
+    MnodeStatus status = MnodeStatus::UNKNOWN;
+    // Always set; shared by the states of updates that don't change the swarms.
+    std::shared_ptr<const Swarm> swarm;
+};
+
 /// All master node logic that is not network-specific
 class MasterNode {
-    bool syncing_ = true;
+    // Only changed during state updates
     bool active_ = false;
     bool got_first_response_ = false;
     std::condition_variable first_response_cv_;
     std::mutex first_response_mutex_;
     bool force_start_ = false;
     std::atomic<bool> shutting_down_ = false;
-    hf_revision hardfork_ = {0, 0};
-    uint64_t block_height_ = 0;
-    uint64_t target_height_ = 0;
-    std::string block_hash_;
-    std::unique_ptr<Swarm> swarm_;
+    snapshot<mnode_state> state_;
     std::unique_ptr<Database> db_;
-
-    MnodeStatus status_ = MnodeStatus::UNKNOWN;
+    // Remove expired messages in the background, one per database shard; declared after db_ so
+    // that they stop first.
+    std::vector<std::unique_ptr<ExpirySweeper>> expiry_sweepers_;
+    // Checkpoint the WAL and release free pages in the background, per shard; likewise after db_.
+    std::vector<std::unique_ptr<DbMaintainer>> db_maintainers_;
+    // Pushes messages to the nodes they belong to when the swarms change; likewise after db_.
+    std::unique_ptr<Rebalancer> rebalancer_;
+    // Reconciles our swarm's messages with our swarm peers; likewise after db_.
+    std::unique_ptr<SwarmSync> swarm_sync_;
 
     const mn_record our_address_;
     const legacy_seckey our_seckey_;
 
-    /// Cache for block_height/block_hash mapping
-    std::map<uint64_t, std::string> block_hashes_cache_;
-
     // Need to make sure we only use this to get BMQ object and
     // not call any method that would in turn call a method in MN
     // causing a deadlock
@@ -98,12 +130,17 @@ class MasterNode {
     std::atomic<bool> updating_swarms_ = false;
 
     reachability_testing reach_records_;
+    std::mutex reach_mutex_;
 
     mutable all_stats_t all_stats_;
 
-    mutable std::recursive_mutex mn_mutex_;
-
     std::forward_list<std::future<void>> outstanding_https_reqs_;
+    std::mutex https_reqs_mutex_;
+
+    // Keeps the future of an HTTPS request until the request completes
+    void track_https_request(std::future<void> req);
+
+    bool mnode_ready(const mnode_state& state, std::string* reason) const;
 
     // Save multiple messages to the database at once (i.e. in a single transaction)
     void save_bulk(const std::vector<message>& msgs);
@@ -114,8 +151,6 @@ class MasterNode {
 
     void bootstrap_data();
 
-    void bootstrap_swarms(const std::vector<swarm_id_t>& swarms = {}) const;
-
     /// Distribute all our data to where it belongs
     /// (called when our old node got dissolved)
     void salvage_data() const; // mutex not needed
@@ -125,19 +160,19 @@ class MasterNode {
     relay_data_reliable(const std::string& blob,
                         const mn_record& address) const; // mutex not needed
 
-    void relay_messages(
-        const std::vector<message>& msgs,
-        const std::vector<mn_record>& mnodes) const; // mutex not needed
-
     // Conducts any ping peer tests that are due; (this is designed to be called frequently and does
     // nothing if there are no tests currently due).
     void ping_peers();
 
+    // Syncs our swarm's messages with a random swarm peer
+    void sync_swarm();
+
     /// Pings beldexd (as required for uptime proofs)
     void beldexd_ping();
 
     /// Return tester/testee pair based on block_height
-    std::optional<std::pair<mn_record, mn_record>> derive_tester_testee(uint64_t block_height);
+    std::optional<std::pair<mn_record, mn_record>> derive_tester_testee(
+            const mnode_state& state, uint64_t block_height) const;
 
     /// Send a request to a MN under test
     void send_storage_test_req(const mn_record& testee, uint64_t test_height,
@@ -167,6 +202,8 @@ class MasterNode {
                 const legacy_seckey& skey,
                 bmqServer& bmq_server,
                 const std::filesystem::path& db_location,
+                const database_options& db_options,
+                const rebalance_options& rebalance_opts,
                 bool force_start);
 
     // Return info about this node as it is advertised to other nodes
@@ -179,6 +216,8 @@ class MasterNode {
     // might move it out later
     void record_proxy_request();
     void record_onion_request();
+    // Records a retrieve request that shared the response of another (see RequestHandler)
+    void record_coalesced_retrieve();
 
     /// Sends an onion request to the next SS
     void send_onion_to_mn(
@@ -187,7 +226,7 @@ class MasterNode {
             OnionRequestMetadata&& data,
             std::function<void(bool success, std::vector<std::string> data)> cb) const;
 
-    bool hf_at_least(hf_revision version) const { return hardfork_ >= version; }
+    bool hf_at_least(hf_revision version) const { return state_.load()->hardfork >= version; }
 
     // Return true if the master node is ready to handle requests, which means the storage server
     // is fully initialized (and not trying to shut down), the master node is active and assigned
@@ -215,6 +254,11 @@ class MasterNode {
     /// Process incoming blob of messages: add to DB if new
     void process_push_batch(const std::string& blob);
 
+    // Queue answering a swarm peer's mn.sync_digest and mn.sync_fetch requests (off the calling
+    // thread); see SwarmSync::digest() and SwarmSync::fetch().
+    void sync_digest(std::string ranges, SwarmSync::reply_fn reply);
+    void sync_fetch(std::string ranges, std::string hashes, std::string after, SwarmSync::reply_fn reply);
+
     // Attempt to find an answer (message body) to the storage test
     std::pair<MessageTestStatus, std::string> process_storage_test_req(uint64_t blk_height,
                                                const legacy_pubkey& tester_addr,
@@ -228,8 +272,18 @@ class MasterNode {
 
     std::vector<message> get_all_messages() const;
 
-    /// return all messages for a particular PK
-    std::vector<message> retrieve(const user_pubkey_t& pubkey, const std::string& last_hash);
+    /// passes messages for a particular PK stored since `last_hash` to `f`: at most `max_count`
+    /// (and never more than CLIENT_RETRIEVE_MESSAGE_LIMIT) with at most `max_size` bytes of data in
+    /// total, counted as `encoding` (except that the first message is always included).  The
+    /// messages are views of the database rows; see Database::retrieve_each().  Returns true if more
+    /// messages remain.
+    bool retrieve(
+            const user_pubkey_t& pubkey,
+            const std::string& last_hash,
+            std::optional<int> max_count,
+            std::optional<size_t> max_size,
+            size_encoding encoding,
+            const std::function<void(const message_view& msg)>& f);
 
     /// Deletes all messages belonging to a pubkey; returns the deleted hashes
     std::optional<std::vector<std::string>> delete_all_messages(
@@ -276,10 +330,7 @@ class MasterNode {
     template <typename PubKey>
     std::optional<mn_record>
     find_node(const PubKey& pk) const {
-        std::lock_guard guard{mn_mutex_};
-        if (swarm_)
-            return swarm_->find_node(pk);
-        return std::nullopt;
+        return state_.load()->swarm->find_node(pk);
     }
 
     // Called once we have established the initial connection to our local beldexd to set up initial
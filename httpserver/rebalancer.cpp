@@ -0,0 +1,356 @@
+#include "rebalancer.h"
+
+#include "Database.hpp"
+#include "beldex_logger.h"
+#include "serialization.h"
+#include "string_utils.hpp"
+
+#include <algorithm>
+#include <exception>
+#include <unordered_set>
+
+namespace beldex {
+
+Rebalancer::Rebalancer(Database& db, send_fn send, version_fn version, rebalance_options opts) :
+      db_{db}, send_{std::move(send)}, version_{std::move(version)}, opts_{std::move(opts)} {
+    thread_ = std::thread{[this] { run(); }};
+}
+
+Rebalancer::~Rebalancer() { stop(); }
+
+void Rebalancer::stop() {
+    {
+        std::lock_guard lock{p_->mutex};
+        p_->stop = true;
+    }
+    p_->cv.notify_all();
+    if (thread_.joinable())
+        thread_.join();
+}
+
+void Rebalancer::relay_all(
+        std::vector<mn_record> mnodes, std::vector<std::pair<uint64_t, uint64_t>> ranges) {
+    if (mnodes.empty())
+        return;
+    {
+        std::lock_guard lock{p_->mutex};
+        p_->jobs.push_back(job{std::move(mnodes), nullptr, {}, std::move(ranges)});
+        p_->stats.jobs_queued = p_->jobs.size();
+    }
+    p_->cv.notify_all();
+}
+
+void Rebalancer::bootstrap(std::shared_ptr<const Swarm> swarm, std::vector<swarm_id_t> swarms) {
+    {
+        std::lock_guard lock{p_->mutex};
+        auto& jobs = p_->jobs;
+        auto all = std::find_if(jobs.begin(), jobs.end(),
+                [](const job& j) { return j.mnodes.empty() && j.swarms.empty(); });
+        if (swarms.empty())
+            jobs.erase(std::remove_if(jobs.begin(), jobs.end(),
+                        [](const job& j) { return j.mnodes.empty(); }),
+                    jobs.end());
+        else if (all != jobs.end()) {
+            // The queued job covers these swarms too, once it knows about them
+            all->swarm = std::move(swarm);
+            return;
+        }
+        jobs.push_back(job{{}, std::move(swarm), std::move(swarms), {}});
+        p_->stats.jobs_queued = jobs.size();
+    }
+    p_->cv.notify_all();
+}
+
+Rebalancer::stats_t Rebalancer::get_stats() const {
+    std::lock_guard lock{p_->mutex};
+    auto stats = p_->stats;
+    if (stats.running && stats.job_messages > 0) {
+        // Assumes that the rest of the job goes at the same rate as it has so far
+        auto elapsed = std::chrono::steady_clock::now() - p_->job_started;
+        auto left = std::max<int64_t>(stats.job_estimate - stats.job_messages, 0);
+        stats.job_eta = std::chrono::duration_cast<std::chrono::seconds>(
+                elapsed * (double(left) / stats.job_messages));
+    }
+    return stats;
+}
+
+// Releases one send's hold on a blob
+static void release(Rebalancer::stats_t& stats, size_t& sends_left, size_t size) {
+    if (--sends_left == 0)
+        stats.pending_bytes -= size;
+}
+
+void Rebalancer::on_sent(
+        pipeline& p,
+        const rebalance_options& opts,
+        const legacy_pubkey& pk,
+        const std::shared_ptr<blob>& b,
+        bool success) {
+    p.stats.in_flight--;
+    auto it = p.targets.find(pk);
+    auto* t = it != p.targets.end() ? &it->second : nullptr;
+    if (t)
+        t->in_flight--;
+
+    if (success) {
+        p.stats.batches_sent++;
+        p.stats.bytes_sent += b->data.size();
+        if (t)
+            t->failures = 0;
+    } else if (t && !t->failed && ++t->failures < opts.max_attempts) {
+        // Retry it (ahead of the rest of the node's queue) once the backoff has passed
+        auto delay = opts.retry_delay;
+        for (int i = 1; i < t->failures && delay < opts.max_retry_delay; i++)
+            delay *= 2;
+        t->retry_at = std::chrono::steady_clock::now() + std::min(delay, opts.max_retry_delay);
+        t->queue.push_front(b);
+        p.stats.retries++;
+        return;
+    } else {
+        p.stats.dropped++;
+        if (t && !t->failed) {
+            BELDEX_LOG(warn, "Failed to send messages to {} {} times; skipping it for the rest of this rebalancing",
+                    pk, t->failures);
+            t->failed = true;
+            for (auto& queued : t->queue) {
+                p.stats.dropped++;
+                release(p.stats, queued->sends_left, queued->data.size());
+            }
+            t->queue.clear();
+        }
+    }
+    release(p.stats, b->sends_left, b->data.size());
+}
+
+bool Rebalancer::pump(const std::function<bool()>& done) {
+    auto& p = *p_;
+    const bool limited = opts_.bytes_per_second > 0;
+    std::vector<std::pair<mn_record, std::shared_ptr<blob>>> sends;
+    std::unique_lock lock{p.mutex};
+    while (!p.stop) {
+        if (done())
+            return true;
+
+        auto now = std::chrono::steady_clock::now();
+        if (limited) {
+            // We allow a second's worth of sending in a burst
+            p.budget = std::min<double>(opts_.bytes_per_second,
+                    p.budget + std::chrono::duration<double>(now - p.budget_time).count() * opts_.bytes_per_second);
+            p.budget_time = now;
+        }
+
+        std::optional<std::chrono::steady_clock::time_point> wake;
+        bool over_budget = false;
+        for (auto& [pk, t] : p.targets) {
+            if (t.failed || t.queue.empty() || t.in_flight >= opts_.max_in_flight)
+                continue;
+            if (t.retry_at > now) {
+                wake = std::min(wake.value_or(t.retry_at), t.retry_at);
+                continue;
+            }
+            if (limited && p.budget <= 0) {
+                over_budget = true;
+                break;
+            }
+            while (!t.queue.empty() && t.in_flight < opts_.max_in_flight && !(limited && p.budget <= 0)) {
+                auto& b = sends.emplace_back(t.mn, std::move(t.queue.front())).second;
+                t.queue.pop_front();
+                t.in_flight++;
+                p.stats.in_flight++;
+                p.budget -= b->data.size();
+            }
+        }
+        if (over_budget) {
+            auto refilled = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double>{(1 - p.budget) / opts_.bytes_per_second});
+            wake = std::min(wake.value_or(refilled), refilled);
+        }
+
+        if (!sends.empty()) {
+            lock.unlock();
+            for (auto& [mn, b] : sends)
+                send_(mn, b->data, [p = p_, opts = opts_, pk = mn.pubkey_legacy, b = b](bool success) {
+                    std::lock_guard lock{p->mutex};
+                    on_sent(*p, opts, pk, b, success);
+                    p->cv.notify_all();
+                });
+            sends.clear();
+            lock.lock();
+            continue;
+        }
+
+        if (wake)
+            p.cv.wait_until(lock, *wake);
+        else
+            p.cv.wait(lock);
+    }
+    return false;
+}
+
+void Rebalancer::enqueue(const std::vector<message>& msgs, const std::vector<mn_record>& mnodes) {
+    if (msgs.empty() || mnodes.empty())
+        return;
+    auto blobs = serialize_messages(msgs.begin(), msgs.end(), version_());
+
+    std::lock_guard lock{p_->mutex};
+    for (auto& data : blobs) {
+        auto b = std::make_shared<blob>(blob{std::move(data), 0});
+        for (auto& mn : mnodes) {
+            auto [it, inserted] = p_->targets.try_emplace(mn.pubkey_legacy);
+            auto& t = it->second;
+            if (inserted)
+                t.mn = mn;
+            if (t.failed) {
+                p_->stats.dropped++;
+                continue;
+            }
+            t.queue.push_back(b);
+            b->sends_left++;
+        }
+        if (b->sends_left > 0)
+            p_->stats.pending_bytes += b->data.size();
+    }
+}
+
+void Rebalancer::run_job(const job& j) {
+    const auto started = std::chrono::steady_clock::now();
+    const int64_t total = db_.get_message_count();
+
+    // The swarm space ranges to stream (all of it, if none), from which we estimate the number of
+    // messages we'll go through: pubkeys are spread evenly over the swarm space.
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    std::unordered_set<swarm_id_t> only;
+    if (!j.mnodes.empty() && j.ranges.empty())
+        BELDEX_LOG(info, "Relaying all messages to {} new swarm members", j.mnodes.size());
+    else if (!j.mnodes.empty()) {
+        BELDEX_LOG(info, "Relaying the messages of {} swarm space ranges to {} swarm members",
+                j.ranges.size(), j.mnodes.size());
+        ranges = j.ranges;
+    } else if (j.swarms.empty())
+        BELDEX_LOG(info, "Bootstrapping all swarms");
+    else {
+        if (BELDEX_LOG_ENABLED(info))
+            BELDEX_LOG(info, "Bootstrapping swarms: [{}]", util::join(", ", j.swarms));
+        for (auto swarm_id : j.swarms) {
+            if (auto range = swarm_space_range(j.swarm->all_valid_swarms(), swarm_id)) {
+                ranges.push_back(*range);
+                only.insert(swarm_id);
+            }
+        }
+        if (ranges.empty())
+            return;
+    }
+    int64_t estimate = total;
+    if (!ranges.empty()) {
+        long double space = 0;
+        for (auto& [first, last] : ranges)
+            // A range with first > last wraps around
+            space += static_cast<long double>(last - first) + 1;
+        estimate = static_cast<int64_t>(total * std::min(space / 0x1p64L, 1.0L));
+    }
+
+    {
+        std::lock_guard lock{p_->mutex};
+        p_->job_started = started;
+        p_->stats.job_messages = 0;
+        p_->stats.job_estimate = estimate;
+    }
+
+    // Once a batch is queued we keep sending until every node's backlog is back within its window
+    // (and the queued data within bounds) before loading the next one.
+    auto caught_up = [this] {
+        if (p_->stats.pending_bytes > static_cast<int64_t>(opts_.max_pending_bytes))
+            return false;
+        for (auto& [pk, t] : p_->targets)
+            if (t.queue.size() + t.in_flight > opts_.max_in_flight)
+                return false;
+        return true;
+    };
+
+    auto send_batch = [&](std::vector<message>& batch) {
+        if (!j.mnodes.empty())
+            enqueue(batch, j.mnodes);
+        else {
+            std::unordered_map<const SwarmInfo*, std::vector<message>> to_relay;
+            for (auto& entry : batch) {
+                if (!entry.pubkey) {
+                    BELDEX_LOG(err, "Invalid pubkey in a message while bootstrapping other nodes");
+                    continue;
+                }
+                auto& swarm = j.swarm->get_swarm(entry.pubkey);
+                if (swarm.swarm_id != INVALID_SWARM_ID && (only.empty() || only.count(swarm.swarm_id)))
+                    to_relay[&swarm].push_back(std::move(entry));
+            }
+            for (const auto& [swarm, items] : to_relay)
+                enqueue(items, swarm->mnodes);
+        }
+        {
+            std::lock_guard lock{p_->mutex};
+            p_->stats.job_messages += batch.size();
+            p_->stats.messages += batch.size();
+        }
+        return pump(caught_up);
+    };
+
+    stream_options opts;
+    opts.batch_bytes = opts_.batch_bytes;
+    size_t count = 0;
+    if (ranges.empty())
+        count = db_.for_each(send_batch, opts);
+    for (auto& range : ranges) {
+        opts.swarm_space = range;
+        count += db_.for_each(send_batch, opts);
+    }
+
+    // Finish sending what's left
+    bool finished = pump([this] {
+        for (auto& [pk, t] : p_->targets)
+            if (!t.queue.empty() || t.in_flight > 0)
+                return false;
+        return true;
+    });
+
+    if (finished)
+        BELDEX_LOG(info, "Rebalancing: sent {} messages in {}", count,
+                util::short_duration(std::chrono::steady_clock::now() - started));
+}
+
+void Rebalancer::run() {
+    std::unique_lock lock{p_->mutex};
+    while (true) {
+        p_->cv.wait(lock, [this] { return p_->stop || !p_->jobs.empty(); });
+        if (p_->stop)
+            break;
+
+        auto j = std::move(p_->jobs.front());
+        p_->jobs.pop_front();
+        p_->stats.jobs_queued = p_->jobs.size();
+        p_->stats.running = true;
+        lock.unlock();
+
+        try {
+            run_job(j);
+        } catch (const std::exception& e) {
+            BELDEX_LOG(err, "Failed to rebalance messages: {}", e.what());
+        }
+
+        lock.lock();
+        // Drop whatever a failed or stopped job left queued, and let its outstanding sends finish
+        // so that they don't count against the next job's nodes.
+        for (auto& [pk, t] : p_->targets) {
+            for (auto& b : t.queue) {
+                p_->stats.dropped++;
+                release(p_->stats, b->sends_left, b->data.size());
+            }
+            t.queue.clear();
+        }
+        p_->cv.wait(lock, [this] { return p_->stop || p_->stats.in_flight == 0; });
+        p_->targets.clear();
+        p_->stats.running = false;
+        p_->stats.job_messages = 0;
+        p_->stats.job_estimate = 0;
+        p_->stats.jobs_done++;
+    }
+}
+
+} // namespace beldex
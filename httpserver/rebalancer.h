@@ -0,0 +1,175 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "beldex_common.h"
+#include "mn_record.h"
+#include "swarm.h"
+
+namespace beldex {
+
+using namespace std::literals;
+
+class Database;
+
+struct rebalance_options {
+    // Maximum number of batches sent to a node that it hasn't yet acknowledged
+    size_t max_in_flight = 2;
+
+    // We stop loading messages from the database while the serialized batches waiting to be sent
+    // (or acknowledged) take up more than this many bytes.
+    size_t max_pending_bytes = 32'000'000;
+
+    // Bandwidth budget for sending batches, in bytes per second; 0 for no limit
+    int64_t bytes_per_second = 4 * 1024 * 1024;
+
+    // Number of consecutive failed sends to a node after which we give up on it (for the rest of
+    // the job), and the delay before the first retry, doubling with each further failure.
+    int max_attempts = 5;
+    std::chrono::milliseconds retry_delay = 1s;
+    std::chrono::milliseconds max_retry_delay = 30s;
+
+    // Size of the batches loaded from the database (and so, roughly, of the batches sent)
+    size_t batch_bytes = 1'000'000;
+};
+
+// Background pipeline that pushes stored messages to the nodes they belong to when the swarms
+// change: all of them to new members of our swarm, and those of new swarms (or of every swarm, when
+// ours dissolves) to the members of those swarms.
+//
+// Jobs run one at a time on the rebalancer's thread, which streams messages from the database a
+// batch at a time and serializes each batch into a blob per swarm it touches, queued for each
+// member of the swarm.  A node gets at most `max_in_flight` blobs at a time, and the next database
+// batch is only loaded once every node's backlog is back within that window and the blobs held in
+// memory are within `max_pending_bytes`, so that neither our memory nor the receivers' request
+// queues blow up.  Sends are paced to the bandwidth budget; a failed send is retried after a
+// backoff, and a node that keeps failing is skipped for the rest of the job.
+class Rebalancer {
+  public:
+    // Sends a blob of serialized messages to a node, calling `done` (from any thread, but not from
+    // within the call) with whether the node accepted it.
+    using send_fn = std::function<void(
+            const mn_record& mn, const std::string& blob, std::function<void(bool success)> done)>;
+
+    // Returns the serialization version to send messages with
+    using version_fn = std::function<uint8_t()>;
+
+    struct stats_t {
+        int64_t jobs_queued = 0;     // Jobs waiting to run
+        int64_t jobs_done = 0;       // Jobs finished (or given up on)
+        bool running = false;        // Whether a job is running
+        int64_t job_messages = 0;    // Messages streamed by the running job so far
+        int64_t job_estimate = 0;    // Estimated number of messages the running job will stream
+        std::optional<std::chrono::seconds> job_eta; // Estimated time left of the running job
+        int64_t messages = 0;        // Total messages streamed
+        int64_t batches_sent = 0;    // Blobs accepted by the receiving node
+        int64_t bytes_sent = 0;      // Size of the accepted blobs
+        int64_t retries = 0;         // Failed sends that were retried
+        int64_t dropped = 0;         // Blobs given up on
+        int64_t in_flight = 0;       // Blobs sent but not yet acknowledged
+        int64_t pending_bytes = 0;   // Size of the blobs held until all their sends finish
+    };
+
+    // Starts the rebalancer thread.  The database must outlive the rebalancer.
+    Rebalancer(Database& db, send_fn send, version_fn version, rebalance_options opts);
+
+    // Stops the rebalancer; see stop().
+    ~Rebalancer();
+
+    Rebalancer(const Rebalancer&) = delete;
+    Rebalancer& operator=(const Rebalancer&) = delete;
+
+    // Queues sending all our messages (or only those in the given swarm space ranges, as given by
+    // swarm_space_range(), if any) to the given nodes
+    void relay_all(
+            std::vector<mn_record> mnodes,
+            std::vector<std::pair<uint64_t, uint64_t>> ranges = {});
+
+    // Queues sending the messages that belong to the given swarms (to all swarms, if empty) to the
+    // members of those swarms.  This replaces any queued job sending to all swarms (or to some
+    // swarms, if this is for all of them).
+    void bootstrap(std::shared_ptr<const Swarm> swarm, std::vector<swarm_id_t> swarms = {});
+
+    // Abandons the running and queued jobs and waits for the thread to finish.  Nothing is sent
+    // after this returns, though acknowledgements of earlier sends can still come in.
+    void stop();
+
+    stats_t get_stats() const;
+
+  private:
+    struct job {
+        // Send all messages to these nodes, if set; otherwise send to the swarms' members
+        std::vector<mn_record> mnodes;
+        std::shared_ptr<const Swarm> swarm;
+        std::vector<swarm_id_t> swarms;
+        // Only send the messages in these swarm space ranges to `mnodes`, if set
+        std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    };
+
+    // A serialized batch, held until all of its sends have finished
+    struct blob {
+        std::string data;
+        size_t sends_left;
+    };
+
+    struct target {
+        mn_record mn;
+        std::deque<std::shared_ptr<blob>> queue;
+        size_t in_flight = 0;
+        int failures = 0;  // Consecutive failed sends
+        std::chrono::steady_clock::time_point retry_at{};
+        bool failed = false;
+    };
+
+    // The state shared with send callbacks (which can outlive the rebalancer)
+    struct pipeline {
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool stop = false;
+        std::deque<job> jobs;
+        std::unordered_map<legacy_pubkey, target> targets;
+        double budget = 0; // Bytes we can send before pausing; can go negative
+        std::chrono::steady_clock::time_point budget_time{};
+        std::chrono::steady_clock::time_point job_started{};
+        stats_t stats;
+    };
+
+    void run();
+    void run_job(const job& j);
+
+    // Queues the blob(s) of a batch of messages for the given nodes
+    void enqueue(const std::vector<message>& msgs, const std::vector<mn_record>& mnodes);
+
+    // Starts whatever sends the windows, backoffs and budget allow, waiting for acknowledgements
+    // (or retry times, or budget) in between, until `done()` (called with the lock held) is true.
+    // Returns false if we are stopping.
+    bool pump(const std::function<bool()>& done);
+
+    // Handles the acknowledgement (or failure) of a send; called with the lock held
+    static void on_sent(
+            pipeline& p,
+            const rebalance_options& opts,
+            const legacy_pubkey& pk,
+            const std::shared_ptr<blob>& b,
+            bool success);
+
+    Database& db_;
+    const send_fn send_;
+    const version_fn version_;
+    const rebalance_options opts_;
+    const std::shared_ptr<pipeline> p_ = std::make_shared<pipeline>();
+    std::thread thread_;
+};
+
+} // namespace beldex
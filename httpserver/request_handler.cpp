@@ -7,11 +7,13 @@
 #include "bmq/bmq.h"
 #include "signature.h"
 #include "master_node.h"
+#include "retrieve_response.h"
 #include "string_utils.hpp"
 #include "time.hpp"
 #include "utils.hpp"
 #include "version.h"
 
+#include <algorithm>
 #include <chrono>
 #include <future>
 
@@ -506,6 +508,19 @@ void RequestHandler::process_client_req(
     cb(Response{http::OK, std::move(body)});
 }
 
+// Key of the retrieves that produce identical responses: the pubkey, limits and encoding, with
+// the (variable length) last hash at the end.
+static std::string retrieve_flight_key(const rpc::retrieve& req) {
+    auto key = req.pubkey.prefixed_raw();
+    key += req.b64 ? 'j' : 'b';
+    key += std::to_string(req.max_count.value_or(-1));
+    key += ':';
+    key += req.max_size ? std::to_string(*req.max_size) : "-";
+    key += ':';
+    key += req.last_hash.value_or("");
+    return key;
+}
+
 void RequestHandler::process_client_req(
         rpc::retrieve&& req, std::function<void(beldex::Response)> cb) {
 
@@ -524,32 +539,37 @@ void RequestHandler::process_client_req(
         }
     }
 
-    std::vector<message> msgs;
-    try {
-        msgs = master_node_.retrieve(req.pubkey, req.last_hash.value_or(""));
-    } catch (const std::exception& e) {
-        auto msg = fmt::format("Internal Server Error. Could not retrieve messages for {}",
-                obfuscate_pubkey(req.pubkey));
-        BELDEX_LOG(critical, msg);
-        return cb(Response{http::INTERNAL_SERVER_ERROR, std::move(msg)});
-    }
-
-    BELDEX_LOG(trace, "Retrieved {} messages for {}", msgs.size(), obfuscate_pubkey(req.pubkey));
+    // The size limit is of the data as we return it: each message's data is base64-encoded
+    // (padding included) for json requests
+    auto encoding = req.b64 ? size_encoding::base64 : size_encoding::raw;
 
-    json messages = json::array();
-    for (const auto& msg : msgs) {
-        messages.push_back(json{
-            {"hash", msg.hash},
-            {"timestamp", to_epoch_ms(msg.timestamp)},
-            {"expiration", to_epoch_ms(msg.expiry)},
-            {"data", req.b64 ? bmq::to_base64(msg.data) : std::move(msg.data)},
-        });
-    }
-
-    return cb(Response{http::OK, json{
-        {"messages", std::move(messages)},
-        {"t", to_epoch_ms(now)},
-    }});
+    // Signatures are checked per request (above), but identical concurrent retrieves share one
+    // database query and response
+    auto run = [&]() noexcept -> Response {
+        try {
+            // Messages go straight from the database rows into the encoded response
+            retrieve_response_writer writer{req.b64,
+                std::min(req.max_size.value_or(retrieve_response_writer::DEFAULT_SIZE_HINT), MAX_RETRIEVE_SIZE_HINT)};
+            bool more = master_node_.retrieve(req.pubkey, req.last_hash.value_or(""), req.max_count,
+                    req.max_size, encoding,
+                    [&writer](const message_view& msg) { writer.append(msg); });
+
+            BELDEX_LOG(trace, "Retrieved {} messages for {}{}", writer.count(),
+                    obfuscate_pubkey(req.pubkey), more ? " (more remain)" : "");
+
+            Response res{http::OK, writer.finish(more, now)};
+            if (req.b64)
+                res.headers.emplace_back("Content-Type", JSON_CONTENT_TYPE);
+            return res;
+        } catch (const std::exception& e) {
+            auto msg = fmt::format("Internal Server Error. Could not retrieve messages for {}",
+                    obfuscate_pubkey(req.pubkey));
+            BELDEX_LOG(critical, msg);
+            return Response{http::INTERNAL_SERVER_ERROR, std::move(msg)};
+        }
+    };
+    if (retrieve_flights_(retrieve_flight_key(req), run, std::move(cb)))
+        master_node_.record_coalesced_retrieve();
 }
 
 void RequestHandler::process_client_req(
@@ -851,7 +871,7 @@ void RequestHandler::process_storage_test_req(
     /// TODO: we never actually test that `height` is within any reasonable
     /// time window (or that it is not repeated multiple times), we should do
     /// that! This is done implicitly to some degree using
-    /// `block_hashes_cache_`, which holds a limited number of recent blocks
+    /// `mnode_state::block_hashes`, which holds a limited number of recent blocks
     /// only and fails if an earlier block is requested
 
     auto started = steady_clock::now();
@@ -896,7 +916,10 @@ Response RequestHandler::wrap_proxy_response(Response res,
 
     int status = res.status.first;
     std::string body;
-    if (std::holds_alternative<std::string>(res.body))
+    if (embed_json && is_json_text(res))
+        // Splice pre-encoded json in as it is, just as dump() would write it if it were a json value
+        body = R"({"body":)" + std::get<std::string>(res.body) + R"(,"status":)" + std::to_string(status) + "}";
+    else if (std::holds_alternative<std::string>(res.body))
         body = json{{"status", status}, {"body", std::move(std::get<std::string>(res.body))}}.dump();
     else if (std::holds_alternative<std::string_view>(res.body))
         body = json{{"status", status}, {"body", std::get<std::string_view>(res.body)}}.dump();
@@ -7,6 +7,7 @@
 #include "beldex_common.h"
 #include "beldexd_key.h"
 #include "master_node.h"
+#include "single_flight.h"
 #include "string_utils.hpp"
 
 #include <chrono>
@@ -43,6 +44,10 @@ inline constexpr auto STORE_TOLERANCE = 10s;
 inline constexpr auto SIGNATURE_TOLERANCE = 60s;
 inline constexpr auto SIGNATURE_TOLERANCE_FORWARDED = 70s;
 
+// Upper bound on the response buffer allocated up front for a retrieve, however large the
+// requested `max_size`; bigger responses grow the buffer as they go.
+inline constexpr size_t MAX_RETRIEVE_SIZE_HINT = 1024 * 1024;
+
 
 // Simpler wrapper that works for most of our responses
 struct Response {
@@ -62,6 +67,20 @@ inline std::string_view view_body(const Response& r) {
     return "(internal error)"sv;
 }
 
+// Content-Type of responses with a string body holding json that has already been encoded
+inline constexpr auto JSON_CONTENT_TYPE = "application/json"sv;
+
+// Returns true if the response has a string body of already encoded json, as indicated by its
+// Content-Type header.
+inline bool is_json_text(const Response& r) {
+    if (!std::holds_alternative<std::string>(r.body))
+        return false;
+    for (auto& [h, v] : r.headers)
+        if (h == "Content-Type")
+            return v == JSON_CONTENT_TYPE;
+    return false;
+}
+
 std::string to_string(const Response& res);
 
 namespace detail {
@@ -132,6 +151,11 @@ class RequestHandler {
 
     std::forward_list<std::future<void>> pending_proxy_requests_;
 
+    // Identical retrieves (same pubkey, last hash, limits and encoding) arriving while one is
+    // being processed share its response rather than each querying the database.  Keyed by
+    // retrieve_flight_key().
+    single_flight<std::string, Response> retrieve_flights_;
+
     // Wrap response `res` to an intermediate node
     Response wrap_proxy_response(
             Response res,
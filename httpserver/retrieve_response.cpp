@@ -0,0 +1,127 @@
+#include "retrieve_response.h"
+
+#include "Database.hpp"
+#include "time.hpp"
+
+#include <bmq/base64.h>
+
+#include <algorithm>
+#include <charconv>
+#include <iterator>
+
+namespace beldex {
+
+using namespace std::literals;
+
+namespace {
+
+// Per-message overhead, beyond its hash and data: keys, punctuation and two timestamps
+constexpr size_t MESSAGE_OVERHEAD = 96;
+
+} // namespace
+
+retrieve_response_writer::retrieve_response_writer(bool json, size_t size_hint) : json_{json} {
+    buf_.reserve((json_ ? size_hint / 3 * 4 : size_hint) + 256);
+    write(json_ ? R"({"messages":[)"sv : "d8:messagesl"sv);
+}
+
+void retrieve_response_writer::reserve_more(size_t n) {
+    if (buf_.size() + n > buf_.capacity())
+        buf_.reserve(std::max(buf_.capacity() * 2, buf_.size() + n));
+}
+
+void retrieve_response_writer::write_int(int64_t i) {
+    char digits[20];
+    auto end = std::to_chars(std::begin(digits), std::end(digits), i).ptr;
+    if (!json_)
+        buf_ += 'i';
+    buf_.append(digits, end);
+    if (!json_)
+        buf_ += 'e';
+}
+
+void retrieve_response_writer::write_string(std::string_view s) {
+    if (!json_) {
+        char digits[20];
+        auto end = std::to_chars(std::begin(digits), std::end(digits), s.size()).ptr;
+        buf_.append(digits, end);
+        buf_ += ':';
+        buf_.append(s);
+        return;
+    }
+    // Hashes never need escaping in practice, but we escape just as nlohmann::json::dump() would
+    buf_ += '"';
+    for (char c : s) {
+        switch (c) {
+            case '"': buf_ += "\\\""; break;
+            case '\\': buf_ += "\\\\"; break;
+            case '\b': buf_ += "\\b"; break;
+            case '\f': buf_ += "\\f"; break;
+            case '\n': buf_ += "\\n"; break;
+            case '\r': buf_ += "\\r"; break;
+            case '\t': buf_ += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    constexpr auto hex = "0123456789abcdef";
+                    buf_ += "\\u00";
+                    buf_ += hex[c >> 4];
+                    buf_ += hex[c & 0xf];
+                } else {
+                    buf_ += c;
+                }
+        }
+    }
+    buf_ += '"';
+}
+
+void retrieve_response_writer::write_base64(std::string_view s) {
+    buf_ += '"';
+    auto pos = buf_.size();
+    buf_.resize(pos + (s.size() + 2) / 3 * 4);
+    bmq::to_base64(s.begin(), s.end(), buf_.begin() + pos);
+    buf_ += '"';
+}
+
+void retrieve_response_writer::append(const message_view& msg) {
+    reserve_more((json_ ? (msg.data.size() + 2) / 3 * 4 : msg.data.size()) + msg.hash.size() * 2 +
+            MESSAGE_OVERHEAD);
+    // Keys are in sorted order, as both bt-encoding and nlohmann::json require
+    if (json_) {
+        write(count_ ? R"(,{"data":)"sv : R"({"data":)"sv);
+        write_base64(msg.data);
+        write(R"(,"expiration":)"sv);
+        write_int(to_epoch_ms(msg.expiry));
+        write(R"(,"hash":)"sv);
+        write_string(msg.hash);
+        write(R"(,"timestamp":)"sv);
+        write_int(to_epoch_ms(msg.timestamp));
+        write("}"sv);
+    } else {
+        write("d4:data"sv);
+        write_string(msg.data);
+        write("10:expiration"sv);
+        write_int(to_epoch_ms(msg.expiry));
+        write("4:hash"sv);
+        write_string(msg.hash);
+        write("9:timestamp"sv);
+        write_int(to_epoch_ms(msg.timestamp));
+        write("e"sv);
+    }
+    count_++;
+}
+
+std::string retrieve_response_writer::finish(bool more, std::chrono::system_clock::time_point now) {
+    if (json_) {
+        write(more ? R"(],"more":true,"t":)"sv : R"(],"more":false,"t":)"sv);
+        write_int(to_epoch_ms(now));
+        write("}"sv);
+    } else {
+        // json_to_bt() turns bools into 0/1 integers, and so do we
+        write(more ? "e4:morei1e1:t"sv : "e4:morei0e1:t"sv);
+        write_int(to_epoch_ms(now));
+        write("e"sv);
+    }
+    return std::move(buf_);
+}
+
+} // namespace beldex
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+namespace beldex {
+
+struct message_view;
+
+// Writes the body of a `retrieve` response straight into one output buffer, as json (with base64
+// message data) or bt-encoded, so that message data goes from the database row to the response
+// with a single copy (or base64 encoding) rather than via message strings and a json DOM.  The
+// output is identical to dumping (or bt-serializing) the json object:
+//
+//     {"messages": [{"data": ..., "expiration": ..., "hash": ..., "timestamp": ...}, ...],
+//      "more": ..., "t": ...}
+class retrieve_response_writer {
+  public:
+    // Initial buffer size when no better estimate is given
+    inline static constexpr size_t DEFAULT_SIZE_HINT = 64 * 1024;
+
+    // `size_hint` is the expected total size of the message data (before any encoding), used to
+    // size the buffer up front.
+    explicit retrieve_response_writer(bool json, size_t size_hint = DEFAULT_SIZE_HINT);
+
+    void append(const message_view& msg);
+
+    // Number of messages appended
+    size_t count() const { return count_; }
+
+    // Completes the response and returns it; the writer must not be used afterwards.
+    std::string finish(bool more, std::chrono::system_clock::time_point now);
+
+  private:
+    // Makes sure that `n` more bytes fit without reallocating, growing the buffer geometrically.
+    void reserve_more(size_t n);
+    void write(std::string_view s) { buf_.append(s); }
+    void write_int(int64_t i);
+    void write_string(std::string_view s);
+    void write_base64(std::string_view s);
+
+    std::string buf_;
+    const bool json_;
+    size_t count_ = 0;
+};
+
+} // namespace beldex
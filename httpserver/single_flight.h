@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace beldex {
+
+// Coalesces concurrent identical operations: while the operation for a key is running, further
+// calls with the same key don't run it again but get a copy of its result instead.  Nothing is
+// cached: once an operation has completed, the next call with its key runs it afresh.  (Thus a
+// coalesced call can get a result that was being produced before the call was made.)
+//
+// Calls never block waiting for one another: the callbacks of coalesced calls are invoked on the
+// thread running the operation, once it completes.
+template <typename Key, typename Result, typename Hash = std::hash<Key>>
+class single_flight {
+  public:
+    using callback = std::function<void(Result)>;
+
+    // Runs `run()` and passes its result to `cb`, unless an operation for `key` is already running,
+    // in which case `cb` is called with (a copy of) that operation's result when it completes.
+    // `run` must not throw, as the coalesced calls would otherwise never get a result.  Returns
+    // true if the call was coalesced.
+    template <typename Run>
+    bool operator()(const Key& key, Run&& run, callback cb) {
+        static_assert(std::is_nothrow_invocable_r_v<Result, Run>);
+        {
+            std::lock_guard lock{mutex_};
+            auto [it, inserted] = flights_.try_emplace(key);
+            if (!inserted) {
+                it->second.push_back(std::move(cb));
+                coalesced_++;
+                return true;
+            }
+        }
+
+        Result result = run();
+
+        std::vector<callback> waiting;
+        {
+            std::lock_guard lock{mutex_};
+            auto it = flights_.find(key);
+            waiting = std::move(it->second);
+            flights_.erase(it);
+        }
+        for (auto& w : waiting)
+            w(result);
+        cb(std::move(result));
+        return false;
+    }
+
+    // Number of calls that were coalesced into another's operation
+    uint64_t coalesced() const { return coalesced_; }
+
+  private:
+    std::mutex mutex_;
+    // Callbacks waiting on each running operation
+    std::unordered_map<Key, std::vector<callback>, Hash> flights_;
+    std::atomic<uint64_t> coalesced_ = 0;
+};
+
+} // namespace beldex
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <utility>
+
+namespace beldex {
+
+// Holds a value that is read far more often than it changes, read-copy-update style: readers load
+// a shared pointer to the current (immutable) value without blocking, and keep a consistent view of
+// it for as long as they hold the pointer; writers publish a modified copy in its place with an
+// atomic pointer swap.  Readers are thus never held up by writers (nor by each other), however long
+// a writer takes to build the new value.
+template <typename T>
+class snapshot {
+  public:
+    explicit snapshot(T initial = {}) :
+        current_{std::make_shared<const T>(std::move(initial))} {}
+
+    // Returns the current value
+    std::shared_ptr<const T> load() const { return std::atomic_load(&current_); }
+
+    // Passes a copy of the current value to `f` to modify and then publishes it, returning the
+    // published value.  Updates are serialized, so that none are lost; `f` must not call update()
+    // itself (but can load()).  Nothing is published if `f` throws.
+    template <typename F>
+    std::shared_ptr<const T> update(F&& f) {
+        std::lock_guard lock{update_mutex_};
+        auto next = std::make_shared<T>(*load());
+        f(*next);
+        std::shared_ptr<const T> published = std::move(next);
+        std::atomic_store(&current_, published);
+        return published;
+    }
+
+  private:
+    std::shared_ptr<const T> current_;
+    std::mutex update_mutex_;
+};
+
+} // namespace beldex
@@ -70,6 +70,7 @@ class all_stats_t {
         current_client_store_requests{0},
         total_client_retrieve_requests{0},
         current_client_retrieve_requests{0},
+        total_coalesced_retrieve_requests{0},
         total_proxy_requests{0},
         current_proxy_requests{0},
         total_onion_requests{0},
@@ -132,11 +133,17 @@ class all_stats_t {
         total_client_retrieve_requests++;
         current_client_retrieve_requests++;
     }
+    // A retrieve answered with the response of an identical, concurrent one
+    void bump_coalesced_retrieve_requests() {
+        bump_retrieve_requests();
+        total_coalesced_retrieve_requests++;
+    }
 
     uint64_t get_total_proxy_requests() const { return total_proxy_requests; }
     uint64_t get_total_onion_requests() const { return total_onion_requests; }
     uint64_t get_total_store_requests() const { return total_client_store_requests; }
     uint64_t get_total_retrieve_requests() const { return total_client_retrieve_requests; }
+    uint64_t get_total_coalesced_retrieve_requests() const { return total_coalesced_retrieve_requests; }
 
     /// Retrieves recent request counts using current period + stored previous period counts.
     ///
@@ -3,14 +3,20 @@
 
 #include "master_node.h"
 
-#include <boost/endian/conversion.hpp>
+#include <algorithm>
 #include <cstdlib>
+#include <iterator>
+#include <map>
+#include <nlohmann/json.hpp>
 #include <ostream>
+#include <stdexcept>
 #include <unordered_map>
 
 #include "string_utils.hpp"
 #include "utils.hpp"
 
+using json = nlohmann::json;
+
 namespace beldex {
 
 static bool swarm_exists(const std::vector<SwarmInfo>& all_swarms,
@@ -41,14 +47,112 @@ void debug_print(std::ostream& os, const block_update& bu) {
     os << "}\n";
 }
 
+template <typename T>
+static T get_or(const json& j, std::string_view key, std::common_type_t<T> default_val) {
+    if (auto it = j.find(key); it != j.end())
+        return it->get<T>();
+    return default_val;
+}
+
+block_update parse_swarm_update(const std::string& response_body) {
+
+    if (response_body.empty()) {
+        BELDEX_LOG(critical, "Bad beldexd rpc response: no response body");
+        throw std::runtime_error("Failed to parse swarm update");
+    }
+
+    std::map<swarm_id_t, std::vector<mn_record>> swarm_map;
+    block_update bu;
+
+    BELDEX_LOG(trace, "swarm repsonse: <{}>", response_body);
+
+    try {
+        json result = json::parse(response_body, nullptr, true);
+
+        bu.height = result.at("height").get<uint64_t>();
+        bu.block_hash = result.at("block_hash").get<std::string>();
+        bu.hardfork = result.at("hardfork").get<int>();
+        bu.mnode_revision = get_or<int>(result, "mnode_revision", 0);
+        bu.unchanged = get_or<bool>(result, "unchanged", false);
+        if (bu.unchanged)
+            return bu;
+
+        const auto& master_node_states = result.at("master_node_states");
+
+        int missing_aux_pks = 0, total = 0;
+
+        for (const auto& mn_json : master_node_states) {
+            /// We want to include (test) decommissioned nodes, but not
+            /// partially funded ones.
+            if (!mn_json.at("funded").get<bool>()) {
+                continue;
+            }
+
+            total++;
+            const auto& pk_hex = mn_json.at("master_node_pubkey").get_ref<const std::string&>();
+            const auto& pk_x25519_hex =
+                mn_json.at("pubkey_x25519").get_ref<const std::string&>();
+            const auto& pk_ed25519_hex =
+                mn_json.at("pubkey_ed25519").get_ref<const std::string&>();
+
+            if (pk_x25519_hex.empty() || pk_ed25519_hex.empty()) {
+                // These will always either both be present or neither present.  If they are missing
+                // there isn't much we can do: it means the remote hasn't transmitted them yet (or
+                // our local beldexd hasn't received them yet).
+                missing_aux_pks++;
+                BELDEX_LOG(debug, "ed25519/x25519 pubkeys are missing from master node info {}", pk_hex);
+                continue;
+            }
+
+            auto mn = mn_record{
+                mn_json.at("public_ip").get_ref<const std::string&>(),
+                mn_json.at("storage_port").get<uint16_t>(),
+                mn_json.at("storage_lmq_port").get<uint16_t>(),
+                legacy_pubkey::from_hex(pk_hex),
+                ed25519_pubkey::from_hex(pk_ed25519_hex),
+                x25519_pubkey::from_hex(pk_x25519_hex)};
+
+            const swarm_id_t swarm_id =
+                mn_json.at("swarm_id").get<swarm_id_t>();
+
+            /// Storing decommissioned nodes (with dummy swarm id) in
+            /// a separate data structure as it seems less error prone
+            if (swarm_id == INVALID_SWARM_ID) {
+                bu.decommissioned_nodes.push_back(std::move(mn));
+            } else {
+                bu.active_x25519_pubkeys.emplace(mn.pubkey_x25519.view());
+
+                swarm_map[swarm_id].push_back(std::move(mn));
+            }
+        }
+
+        if (missing_aux_pks >
+                MISSING_PUBKEY_THRESHOLD::num*total/MISSING_PUBKEY_THRESHOLD::den) {
+            BELDEX_LOG(warn, "Missing ed25519/x25519 pubkeys for {}/{} master nodes; "
+                    "beldexd may be out of sync with the network", missing_aux_pks, total);
+        }
+
+    } catch (const std::exception& e) {
+        BELDEX_LOG(critical, "Bad beldexd rpc response: invalid json ({})", e.what());
+        throw std::runtime_error("Failed to parse swarm update");
+    }
+
+    bu.swarms.reserve(swarm_map.size());
+    for (auto& [swarm_id, mnodes] : swarm_map) {
+        bu.swarms.push_back(SwarmInfo{swarm_id, std::move(mnodes)});
+    }
+
+    return bu;
+}
+
 Swarm::~Swarm() = default;
 
 bool Swarm::is_existing_swarm(swarm_id_t sid) const {
 
-    return std::any_of(all_valid_swarms_.begin(), all_valid_swarms_.end(),
-                       [sid](const SwarmInfo& cur_swarm_info) {
-                           return cur_swarm_info.swarm_id == sid;
-                       });
+    const auto& ids = swarms_->sorted_ids;
+    auto it = std::lower_bound(ids.begin(), ids.end(), sid,
+            [](const auto& id, swarm_id_t val) { return id.first < val; });
+    return it != ids.end() && it->first == sid;
 }
 
 SwarmEvents Swarm::derive_swarm_events(const std::vector<SwarmInfo>& swarms) const {
@@ -132,10 +236,10 @@ void Swarm::set_swarm_id(swarm_id_t sid) {
 
 static auto get_mnode_map_from_swarms(const std::vector<SwarmInfo>& swarms) {
 
-    std::unordered_map<legacy_pubkey, mn_record> mnode_map;
+    std::unordered_map<legacy_pubkey, const mn_record*> mnode_map;
     for (const auto& swarm : swarms) {
         for (const auto& mnode : swarm.mnodes) {
-            mnode_map.emplace(mnode.pubkey_legacy, mnode);
+            mnode_map.emplace(mnode.pubkey_legacy, &mnode);
         }
     }
     return mnode_map;
@@ -163,7 +267,7 @@ std::vector<SwarmInfo> apply_ips(
             const auto other_mnode_it =
                 other_mnode_map.find(mnode.pubkey_legacy);
             if (other_mnode_it != other_mnode_map.end()) {
-                auto& mn = other_mnode_it->second;
+                auto& mn = *other_mnode_it->second;
                 // Keep swarms_to_keep but don't overwrite with default IPs/ports
                 bool updated = false;
                 if (update_if_changed(mnode.ip, mn.ip, "0.0.0.0")) updated = true;
@@ -183,7 +287,24 @@ void Swarm::apply_swarm_changes(const std::vector<SwarmInfo>& new_swarms) {
 
     BELDEX_LOG(trace, "Applying swarm changes");
 
-    all_valid_swarms_ = apply_ips(new_swarms, all_valid_swarms_);
+    auto list = std::make_shared<swarm_list>();
+    list->swarms = apply_ips(new_swarms, swarms_->swarms);
+
+    auto& ids = list->sorted_ids;
+    ids.reserve(list->swarms.size());
+    for (size_t i = 0; i < list->swarms.size(); i++)
+        if (list->swarms[i].swarm_id != INVALID_SWARM_ID)
+            ids.emplace_back(list->swarms[i].swarm_id, i);
+
+    // Sorting on the index as well keeps the first swarm of any duplicated id, which is the one
+    // get_swarm_by_pk() picks.
+    std::sort(ids.begin(), ids.end());
+    ids.erase(
+            std::unique(ids.begin(), ids.end(),
+                [](const auto& a, const auto& b) { return a.first == b.first; }),
+            ids.end());
+
+    swarms_ = std::move(list);
 }
 
 void Swarm::update_state(const std::vector<SwarmInfo>& swarms,
@@ -225,80 +346,156 @@ void Swarm::update_state(const std::vector<SwarmInfo>& swarms,
     }
 
     // Store a copy of every node in a separate data structure
-    all_funded_nodes_.clear();
-    all_funded_ed25519_.clear();
-    all_funded_x25519_.clear();
+    update_funded_nodes(swarms, decommissioned);
+}
 
-    for (const auto& si : swarms) {
-        for (const auto& mn : si.mnodes) {
-            all_funded_nodes_.emplace(mn.pubkey_legacy, mn);
-        }
-    }
+// Returns true if the records of a node differ in anything other than the legacy pubkey
+static bool record_changed(const mn_record& a, const mn_record& b) {
+    return a.ip != b.ip || a.port != b.port || a.bmq_port != b.bmq_port ||
+        a.pubkey_ed25519 != b.pubkey_ed25519 || a.pubkey_x25519 != b.pubkey_x25519;
+}
 
-    for (const auto& mn : decommissioned) {
-        all_funded_nodes_.emplace(mn.pubkey_legacy, mn);
-    }
+void Swarm::update_funded_nodes(
+        const std::vector<SwarmInfo>& swarms, const std::vector<mn_record>& decommissioned) {
 
-    for (const auto& [pk, mn] : all_funded_nodes_) {
-        all_funded_ed25519_.emplace(mn.pubkey_ed25519, pk);
-        all_funded_x25519_.emplace(mn.pubkey_x25519, pk);
+    // The (first) record of every node, and those of them that are new or changed
+    std::unordered_map<legacy_pubkey, const mn_record*> incoming;
+    incoming.reserve(funded_->nodes.size());
+    std::vector<const mn_record*> changed;
+    size_t added = 0;
+    auto add = [&](const mn_record& mn) {
+        if (!incoming.emplace(mn.pubkey_legacy, &mn).second)
+            return;
+        auto it = funded_->nodes.find(mn.pubkey_legacy);
+        if (it == funded_->nodes.end())
+            added++;
+        if (it == funded_->nodes.end() || record_changed(it->second, mn))
+            changed.push_back(&mn);
+    };
+    for (const auto& si : swarms)
+        for (const auto& mn : si.mnodes)
+            add(mn);
+    for (const auto& mn : decommissioned)
+        add(mn);
+
+    std::vector<legacy_pubkey> removed;
+    if (incoming.size() - added < funded_->nodes.size())
+        for (const auto& [pk, mn] : funded_->nodes)
+            if (!incoming.count(pk))
+                removed.push_back(pk);
+
+    if (changed.empty() && removed.empty())
+        return;
+
+    BELDEX_LOG(debug, "Updating funded nodes: {} new, {} changed, {} removed",
+            added, changed.size() - added, removed.size());
+
+    auto funded = std::make_shared<funded_nodes>(*funded_);
+    auto forget_keys = [&funded](const mn_record& mn) {
+        if (auto it = funded->ed25519.find(mn.pubkey_ed25519);
+                it != funded->ed25519.end() && it->second == mn.pubkey_legacy)
+            funded->ed25519.erase(it);
+        if (auto it = funded->x25519.find(mn.pubkey_x25519);
+                it != funded->x25519.end() && it->second == mn.pubkey_legacy)
+            funded->x25519.erase(it);
+    };
+    for (const auto& pk : removed) {
+        auto it = funded->nodes.find(pk);
+        forget_keys(it->second);
+        funded->nodes.erase(it);
+    }
+    for (const mn_record* mn : changed) {
+        auto [it, inserted] = funded->nodes.try_emplace(mn->pubkey_legacy, *mn);
+        if (!inserted) {
+            forget_keys(it->second);
+            it->second = *mn;
+        }
+        funded->ed25519.emplace(mn->pubkey_ed25519, mn->pubkey_legacy);
+        funded->x25519.emplace(mn->pubkey_x25519, mn->pubkey_legacy);
     }
+
+    funded_ = std::move(funded);
 }
 
 std::optional<mn_record>
 Swarm::find_node(const legacy_pubkey& pk) const {
-    if (auto it = all_funded_nodes_.find(pk); it != all_funded_nodes_.end())
+    if (auto it = funded_->nodes.find(pk); it != funded_->nodes.end())
         return it->second;
     return std::nullopt;
 }
 
 std::optional<mn_record>
 Swarm::find_node(const ed25519_pubkey& pk) const {
-    if (auto it = all_funded_ed25519_.find(pk); it != all_funded_ed25519_.end())
+    if (auto it = funded_->ed25519.find(pk); it != funded_->ed25519.end())
         return find_node(it->second);
     return std::nullopt;
 }
 
 std::optional<mn_record>
 Swarm::find_node(const x25519_pubkey& pk) const {
-    if (auto it = all_funded_x25519_.find(pk); it != all_funded_x25519_.end())
+    if (auto it = funded_->x25519.find(pk); it != funded_->x25519.end())
         return find_node(it->second);
     return std::nullopt;
 }
 
-uint64_t pubkey_to_swarm_space(const user_pubkey_t& pk) {
-
-    const auto bytes = pk.raw();
-    assert(bytes.size() == 32);
-
-    uint64_t res = 0;
-    for (size_t i = 0; i < 4; i++) {
-        uint64_t buf;
-        std::memcpy(&buf, bytes.data() + i*8, 8);
-        res ^= buf;
-    }
-    boost::endian::big_to_native_inplace(res);
-
-    return res;
-}
-
 bool Swarm::is_pubkey_for_us(const user_pubkey_t& pk) const {
 
     /// TODO: Make sure no exceptions bubble up from here!
-    return cur_swarm_id_ == get_swarm_by_pk(all_valid_swarms_, pk).swarm_id;
+    return cur_swarm_id_ == get_swarm(pk).swarm_id;
 }
 
 static const SwarmInfo null_swarm{INVALID_SWARM_ID, {}};
 
+/// We reserve UINT64_MAX as a sentinel swarm id for unassigned mnodes
+constexpr swarm_id_t MAX_ID = INVALID_SWARM_ID - 1;
+
+const SwarmInfo& Swarm::get_swarm(const user_pubkey_t& pk) const {
+
+    const auto& ids = swarms_->sorted_ids;
+    if (ids.empty())
+        return null_swarm;
+
+    const uint64_t res = pubkey_to_swarm_space(pk);
+
+    // The closest swarm is one of the two either side of `res`, with ties going to the one that
+    // comes first in all_valid_swarms() ...
+    auto it = std::lower_bound(ids.begin(), ids.end(), res,
+            [](const auto& id, uint64_t val) { return id.first < val; });
+
+    const std::pair<swarm_id_t, size_t>* best = nullptr;
+    uint64_t best_dist = 0;
+    if (it != ids.end()) {
+        best = &*it;
+        best_dist = it->first - res;
+    }
+    if (it != ids.begin()) {
+        const auto& below = *std::prev(it);
+        const uint64_t dist = res - below.first;
+        if (!best || dist < best_dist || (dist == best_dist && below.second < best->second)) {
+            best = &below;
+            best_dist = dist;
+        }
+    }
+
+    // ... unless `res` is outside of the swarm ids and closer to the one at the other end, going
+    // around.  (This uses the same distances as get_swarm_by_pk(), so that the two always agree.)
+    if (it == ids.end()) {
+        if ((MAX_ID - res) + ids.front().first < best_dist)
+            best = &ids.front();
+    } else if (it == ids.begin() && res < it->first) {
+        if (res + (MAX_ID - ids.back().first) < best_dist)
+            best = &ids.back();
+    }
+
+    return swarms_->swarms[best->second];
+}
+
 const SwarmInfo& get_swarm_by_pk(
         const std::vector<SwarmInfo>& all_swarms,
         const user_pubkey_t& pk) {
 
     const uint64_t res = pubkey_to_swarm_space(pk);
 
-    /// We reserve UINT64_MAX as a sentinel swarm id for unassigned mnodes
-    constexpr swarm_id_t MAX_ID = INVALID_SWARM_ID - 1;
-
     const SwarmInfo* cur_best = &null_swarm;
     uint64_t cur_min = INVALID_SWARM_ID;
 
@@ -354,6 +551,35 @@ const SwarmInfo& get_swarm_by_pk(
     return *cur_best;
 }
 
+std::optional<std::pair<uint64_t, uint64_t>> swarm_space_range(
+        const std::vector<SwarmInfo>& all_swarms, swarm_id_t swarm) {
+
+    std::vector<swarm_id_t> ids;
+    ids.reserve(all_swarms.size());
+    for (const auto& si : all_swarms)
+        if (si.swarm_id != INVALID_SWARM_ID)
+            ids.push_back(si.swarm_id);
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+    auto it = std::lower_bound(ids.begin(), ids.end(), swarm);
+    if (it == ids.end() || *it != swarm)
+        return std::nullopt;
+    if (ids.size() == 1)
+        return std::make_pair(uint64_t{0}, UINT64_MAX);
+
+    // Between two adjacent swarms the closer one wins, so the boundaries are at the midpoints (we
+    // include the midpoint itself on both sides since ties can go either way).  The first and last
+    // swarms also split the wrap-around gap between them; we just include the whole gap in both.
+    uint64_t first = it == ids.begin()
+        ? ids.back() + 1
+        : *std::prev(it) + (swarm - *std::prev(it)) / 2;
+    uint64_t last = std::next(it) == ids.end()
+        ? ids.front() - 1
+        : swarm + (*std::next(it) - swarm) / 2;
+    return std::make_pair(first, last);
+}
+
 std::pair<int, int> count_missing_data(const block_update& bu) {
     auto result = std::make_pair(0, 0);
     auto& [missing, total] = result;
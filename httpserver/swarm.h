@@ -1,9 +1,13 @@
 #pragma once
 
 #include <iostream>
+#include <memory>
+#include <optional>
+#include <ratio>
 #include <bmq/auth.h>
 #include <string>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "beldex_common.h"
@@ -31,13 +35,30 @@ struct block_update {
 
 void debug_print(std::ostream& os, const block_update& bu);
 
+// Threshold of missing data records at which we start warning and consult bootstrap nodes (mainly
+// so that we don't bother producing warning spam or going to the bootstrap just for a few new nodes
+// that will often have missing info for a few minutes).
+using MISSING_PUBKEY_THRESHOLD = std::ratio<3, 100>;
+
+// Parses the (json) response body of a get_master_nodes request into a block_update.  Throws on
+// failure.
+block_update parse_swarm_update(const std::string& response_body);
+
 // Returns a reference to the SwarmInfo member of `all_swarms` for the given user pub.  Returns a
 // reference to a null SwarmInfo with swarm_id set to INVALID_SWARM_ID on error (which will only
-// happen if there are no swarms at all).
+// happen if there are no swarms at all).  This scans all the swarms; Swarm::get_swarm() gives the
+// same result by binary search.
 const SwarmInfo& get_swarm_by_pk(
         const std::vector<SwarmInfo>& all_swarms,
         const user_pubkey_t& pk);
 
+// Returns an inclusive swarm space range (as used by `stream_options::swarm_space`, wrapping around
+// if first > second) containing every pubkey_to_swarm_space() value that get_swarm_by_pk() maps to
+// the given swarm.  The range can include a few extra values at its boundaries, so callers still
+// need to check the swarm of each pubkey.  Returns nullopt if `swarm` is not in `all_swarms`.
+std::optional<std::pair<uint64_t, uint64_t>> swarm_space_range(
+        const std::vector<SwarmInfo>& all_swarms, swarm_id_t swarm);
+
 // Takes a swarm update, returns the number of active MN entries with missing
 // IP/port/ed25519/x25519 data and the total number of entries.  (We don't include
 // decommissioned nodes in either count).
@@ -50,10 +71,6 @@ std::vector<SwarmInfo> apply_ips(
         const std::vector<SwarmInfo>& swarms_to_keep,
         const std::vector<SwarmInfo>& other_swarms);
 
-/// Maps a pubkey into a 64-bit "swarm space" value; the swarm you belong to is whichever one has a
-/// swarm id closest to this pubkey-derived value.
-uint64_t pubkey_to_swarm_space(const user_pubkey_t& pk);
-
 struct SwarmEvents {
 
     /// our (potentially new) swarm id
@@ -69,24 +86,44 @@ struct SwarmEvents {
     std::vector<mn_record> our_swarm_members;
 };
 
+// Swarm membership as of a block.  Copies are cheap: the lists of swarms and of funded nodes are
+// shared between copies until one of them changes (as MasterNode copies the Swarm for each block
+// update, which usually changes little or none of them).
 class Swarm {
 
+    struct swarm_list {
+        /// Note: this excludes the "dummy" swarm
+        std::vector<SwarmInfo> swarms;
+        /// The ids of `swarms` in ascending order, each with the index of its (first) swarm in
+        /// `swarms`
+        std::vector<std::pair<swarm_id_t, size_t>> sorted_ids;
+    };
+
+    /// This includes decommissioned nodes
+    struct funded_nodes {
+        std::unordered_map<legacy_pubkey, mn_record> nodes;
+        std::unordered_map<ed25519_pubkey, legacy_pubkey> ed25519;
+        std::unordered_map<x25519_pubkey, legacy_pubkey> x25519;
+    };
+
     swarm_id_t cur_swarm_id_ = INVALID_SWARM_ID;
-    /// Note: this excludes the "dummy" swarm
-    std::vector<SwarmInfo> all_valid_swarms_;
+    std::shared_ptr<const swarm_list> swarms_ = std::make_shared<const swarm_list>();
     mn_record our_address_;
     std::vector<mn_record> swarm_peers_;
-    /// This includes decommissioned nodes
-    std::unordered_map<legacy_pubkey, mn_record> all_funded_nodes_;
-    std::unordered_map<ed25519_pubkey, legacy_pubkey> all_funded_ed25519_;
-    std::unordered_map<x25519_pubkey, legacy_pubkey> all_funded_x25519_;
+    std::shared_ptr<const funded_nodes> funded_ = std::make_shared<const funded_nodes>();
 
     /// Check if `sid` is an existing (active) swarm
     bool is_existing_swarm(swarm_id_t sid) const;
 
+    /// Updates the funded nodes to the given ones, if any of them changed
+    void update_funded_nodes(
+            const std::vector<SwarmInfo>& swarms, const std::vector<mn_record>& decommissioned);
+
   public:
     Swarm(mn_record address) : our_address_(address) {}
 
+    Swarm(const Swarm&) = default;
+
     ~Swarm();
 
     /// Extract relevant information from incoming swarm composition
@@ -102,10 +139,14 @@ class Swarm {
 
     bool is_pubkey_for_us(const user_pubkey_t& pk) const;
 
+    // Returns the swarm the given user pubkey belongs to, like get_swarm_by_pk() on
+    // all_valid_swarms() but in O(log n).
+    const SwarmInfo& get_swarm(const user_pubkey_t& pk) const;
+
     const std::vector<mn_record>& other_nodes() const { return swarm_peers_; }
 
     const std::vector<SwarmInfo>& all_valid_swarms() const {
-        return all_valid_swarms_;
+        return swarms_->swarms;
     }
 
     const mn_record& our_address() const { return our_address_; }
@@ -117,7 +158,7 @@ class Swarm {
     void set_swarm_id(swarm_id_t sid);
 
     const std::unordered_map<legacy_pubkey, mn_record>& all_funded_nodes() const {
-        return all_funded_nodes_;
+        return funded_->nodes;
     }
 
     // Get the node with public key `pk` if exists; these search *all* fully-funded MNs (including
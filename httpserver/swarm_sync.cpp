@@ -0,0 +1,704 @@
+#include "swarm_sync.h"
+
+#include "Database.hpp"
+#include "beldex_logger.h"
+#include "serialization.h"
+#include "string_utils.hpp"
+
+#include <algorithm>
+#include <exception>
+#include <limits>
+#include <stdexcept>
+#include <unordered_set>
+
+namespace beldex {
+
+namespace swarm_sync {
+
+    uint64_t message_digest(const user_pubkey_t& owner, std::string_view hash) {
+        // FNV-1a over the owner's network id and pubkey and the message hash, with a final mix so
+        // that the xor of many digests doesn't favour any bits.
+        uint64_t h = 0xcbf29ce484222325ULL;
+        auto add = [&h](unsigned char c) {
+            h ^= c;
+            h *= 0x100000001b3ULL;
+        };
+        add(static_cast<unsigned char>(owner.type()));
+        for (char c : owner.raw())
+            add(static_cast<unsigned char>(c));
+        add(0);
+        for (char c : hash)
+            add(static_cast<unsigned char>(c));
+
+        h ^= h >> 30;
+        h *= 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 27;
+        h *= 0x94d049bb133111ebULL;
+        h ^= h >> 31;
+        return h;
+    }
+
+    std::vector<range> split(const range& r) {
+        std::vector<range> parts;
+        // Values per part; the last part takes whatever is left
+        const uint64_t size = (r.last - r.first) / FANOUT + 1;
+        for (uint64_t start = r.first;; start += size) {
+            if (r.last - start <= size - 1) {
+                parts.push_back({start, r.last});
+                break;
+            }
+            parts.push_back({start, start + size - 1});
+        }
+        return parts;
+    }
+
+    std::vector<range> to_ranges(std::pair<uint64_t, uint64_t> space) {
+        if (space.first <= space.second)
+            return {{space.first, space.second}};
+        return {{space.first, std::numeric_limits<uint64_t>::max()}, {0, space.second}};
+    }
+
+    const mn_record& relaying_member(const std::vector<mn_record>& members, const mn_record& new_member) {
+        auto distance = [&new_member](const mn_record& mn) {
+            legacy_pubkey d;
+            for (size_t i = 0; i < d.size(); i++)
+                d[i] = mn.pubkey_legacy[i] ^ new_member.pubkey_legacy[i];
+            return d;
+        };
+        return *std::min_element(members.begin(), members.end(),
+                [&distance](const mn_record& a, const mn_record& b) { return distance(a) < distance(b); });
+    }
+
+    static void put_u64(std::string& out, uint64_t x) {
+        for (int i = 0; i < 8; i++)
+            out += static_cast<char>((x >> (8 * i)) & 0xff);
+    }
+
+    static uint64_t get_u64(std::string_view in) {
+        uint64_t x = 0;
+        for (int i = 0; i < 8; i++)
+            x |= uint64_t{static_cast<unsigned char>(in[i])} << (8 * i);
+        return x;
+    }
+
+    // Decodes pairs of 64-bit integers
+    template <typename T>
+    static std::vector<T> decode_pairs(std::string_view data, const char* what) {
+        if (data.size() % 16)
+            throw std::invalid_argument{fmt::format("Invalid {}: {} bytes is not a multiple of 16", what, data.size())};
+        std::vector<T> result;
+        result.reserve(data.size() / 16);
+        for (; !data.empty(); data.remove_prefix(16))
+            result.push_back(T{get_u64(data), get_u64(data.substr(8))});
+        return result;
+    }
+
+    std::string encode_ranges(const std::vector<range>& ranges) {
+        std::string out;
+        out.reserve(16 * ranges.size());
+        for (auto& r : ranges) {
+            put_u64(out, r.first);
+            put_u64(out, r.last);
+        }
+        return out;
+    }
+
+    std::vector<range> decode_ranges(std::string_view data) {
+        auto ranges = decode_pairs<range>(data, "ranges");
+        if (ranges.size() > MAX_RANGES)
+            throw std::invalid_argument{fmt::format("Too many ranges ({} > {})", ranges.size(), MAX_RANGES)};
+        for (auto& r : ranges)
+            if (r.first > r.last)
+                throw std::invalid_argument{"Invalid range: first > last"};
+        return ranges;
+    }
+
+    std::string encode_summaries(const std::vector<summary>& summaries) {
+        std::string out;
+        out.reserve(16 * summaries.size());
+        for (auto& s : summaries) {
+            put_u64(out, s.count);
+            put_u64(out, s.digest);
+        }
+        return out;
+    }
+
+    std::vector<summary> decode_summaries(std::string_view data) {
+        return decode_pairs<summary>(data, "summaries");
+    }
+
+    std::string encode_hashes(const std::vector<std::string>& hashes) {
+        std::string out;
+        for (auto& h : hashes) {
+            if (h.size() > 255)
+                throw std::invalid_argument{"Invalid message hash: too long"};
+            out += static_cast<char>(h.size());
+            out += h;
+        }
+        return out;
+    }
+
+    std::vector<std::string> decode_hashes(std::string_view data) {
+        std::vector<std::string> hashes;
+        while (!data.empty()) {
+            size_t len = static_cast<unsigned char>(data[0]);
+            if (len == 0 || data.size() < 1 + len)
+                throw std::invalid_argument{"Invalid message hashes"};
+            hashes.emplace_back(data.substr(1, len));
+            data.remove_prefix(1 + len);
+        }
+        if (hashes.size() > MAX_FETCH_HASHES)
+            throw std::invalid_argument{fmt::format("Too many hashes ({} > {})", hashes.size(), MAX_FETCH_HASHES)};
+        return hashes;
+    }
+
+    index::index(Database& db, std::vector<range> ranges) : ranges_{std::move(ranges)} {
+        stream_options opts;
+        opts.keys_only = true;
+        for (auto& r : ranges_) {
+            opts.swarm_space = {r.first, r.last};
+            db.for_each([this](std::vector<message>& batch) {
+                for (auto& m : batch)
+                    entries_.emplace_back(pubkey_to_swarm_space(m.pubkey), message_digest(m.pubkey, m.hash));
+                return true;
+            }, opts);
+        }
+        std::sort(entries_.begin(), entries_.end());
+        xors_.reserve(entries_.size() + 1);
+        xors_.push_back(0);
+        for (auto& [ss, digest] : entries_)
+            xors_.push_back(xors_.back() ^ digest);
+    }
+
+    bool index::covers(const range& r) const {
+        return std::any_of(ranges_.begin(), ranges_.end(),
+                [&r](const range& c) { return r.first >= c.first && r.last <= c.last; });
+    }
+
+    summary index::summarize(const range& r) const {
+        auto begin = std::lower_bound(entries_.begin(), entries_.end(), std::make_pair(r.first, uint64_t{0}));
+        auto end = std::upper_bound(begin, entries_.end(),
+                std::make_pair(r.last, std::numeric_limits<uint64_t>::max()));
+        auto i = begin - entries_.begin(), j = end - entries_.begin();
+        return {static_cast<uint64_t>(j - i), xors_[j] ^ xors_[i]};
+    }
+
+} // namespace swarm_sync
+
+using namespace swarm_sync;
+
+// Returns the index of the (sorted, disjoint) range containing a swarm space value, if any
+static std::optional<size_t> find_range(const std::vector<range>& ranges, uint64_t ss) {
+    auto it = std::upper_bound(ranges.begin(), ranges.end(), ss,
+            [](uint64_t x, const range& r) { return x < r.first; });
+    if (it == ranges.begin() || std::prev(it)->last < ss)
+        return std::nullopt;
+    return std::prev(it) - ranges.begin();
+}
+
+// Merges adjacent ranges of a sorted list of disjoint ranges
+static std::vector<range> merge_adjacent(const std::vector<range>& ranges) {
+    std::vector<range> merged;
+    for (auto& r : ranges) {
+        if (!merged.empty() && merged.back().last + 1 == r.first)
+            merged.back().last = r.last;
+        else
+            merged.push_back(r);
+    }
+    return merged;
+}
+
+SwarmSync::SwarmSync(
+        Database& db, request_fn request, relay_fn relay, version_fn version, swarm_sync_options opts) :
+      db_{db},
+      request_{std::move(request)},
+      relay_{std::move(relay)},
+      version_{std::move(version)},
+      opts_{std::move(opts)} {
+    thread_ = std::thread{[this] { run(); }};
+    serve_thread_ = std::thread{[this] { run_serving(); }};
+}
+
+SwarmSync::~SwarmSync() { stop(); }
+
+void SwarmSync::stop() {
+    {
+        std::lock_guard lock{mutex_};
+        stop_ = true;
+        // The requesters time out waiting for these
+        requests_.clear();
+    }
+    cv_.notify_all();
+    serve_cv_.notify_all();
+    if (thread_.joinable())
+        thread_.join();
+    if (serve_thread_.joinable())
+        serve_thread_.join();
+}
+
+void SwarmSync::sync(
+        const std::vector<mn_record>& peers,
+        std::pair<uint64_t, uint64_t> space,
+        failure_fn on_failure) {
+    auto ranges = to_ranges(space);
+    {
+        std::lock_guard lock{mutex_};
+        space_ = ranges;
+        for (auto& mn : peers) {
+            auto it = std::find_if(jobs_.begin(), jobs_.end(),
+                    [&mn](const job& j) { return j.peer == mn; });
+            if (it == jobs_.end())
+                jobs_.push_back(job{mn, ranges, on_failure});
+            else {
+                // Sync the queued peer over the new range instead, keeping any fallback
+                it->ranges = ranges;
+                if (on_failure)
+                    it->on_failure = on_failure;
+            }
+        }
+        stats_.queued = jobs_.size();
+    }
+    cv_.notify_all();
+}
+
+SwarmSync::stats_t SwarmSync::get_stats() const {
+    std::lock_guard lock{mutex_};
+    return stats_;
+}
+
+std::shared_ptr<const index> SwarmSync::recent_index(const std::vector<range>& ranges) {
+    std::lock_guard lock{index_mutex_};
+    auto now = std::chrono::steady_clock::now();
+    if (!index_ || index_->ranges() != ranges || now - index_built_ > opts_.index_max_age) {
+        index_ = std::make_shared<const index>(db_, ranges);
+        index_built_ = now;
+        std::lock_guard slock{mutex_};
+        stats_.indexes++;
+    }
+    return index_;
+}
+
+void SwarmSync::drop_index() {
+    std::lock_guard lock{index_mutex_};
+    index_.reset();
+}
+
+void SwarmSync::serve(
+        std::string_view command, std::function<std::vector<std::string>()> answer, reply_fn reply) {
+    {
+        std::lock_guard lock{mutex_};
+        if (!stop_ && requests_.size() < opts_.max_queued_requests) {
+            requests_.push_back([this, command, answer = std::move(answer), reply = std::move(reply)] {
+                std::vector<std::string> parts;
+                try {
+                    parts = answer();
+                    parts.insert(parts.begin(), "OK");
+                } catch (const std::invalid_argument& e) {
+                    BELDEX_LOG(warn, "Invalid {} request: {}", command, e.what());
+                    parts = {"invalid parameters"};
+                } catch (const std::exception& e) {
+                    BELDEX_LOG(err, "Failed to answer {} request: {}", command, e.what());
+                    parts = {"error"};
+                }
+                {
+                    std::lock_guard lock{mutex_};
+                    stats_.served++;
+                }
+                reply(std::move(parts));
+            });
+            serve_cv_.notify_one();
+            return;
+        }
+        stats_.busy++;
+    }
+    BELDEX_LOG(debug, "Too many sync requests queued; turning away a {} request", command);
+    reply({"busy"});
+}
+
+void SwarmSync::digest(std::string ranges, reply_fn reply) {
+    serve("mn.sync_digest",
+            [this, ranges = std::move(ranges)] { return std::vector<std::string>{answer_digest(ranges)}; },
+            std::move(reply));
+}
+
+void SwarmSync::fetch(std::string ranges, std::string hashes, std::string after, reply_fn reply) {
+    serve("mn.sync_fetch",
+            [this, ranges = std::move(ranges), hashes = std::move(hashes), after = std::move(after)] {
+                auto r = answer_fetch(ranges, hashes, after);
+                return std::vector<std::string>{std::move(r.messages), std::move(r.wanted), r.more ? "1" : "0"};
+            },
+            std::move(reply));
+}
+
+std::string SwarmSync::answer_digest(std::string_view ranges) {
+    std::vector<range> space;
+    {
+        std::lock_guard lock{mutex_};
+        space = space_;
+    }
+    if (space.empty())
+        space.push_back({0, std::numeric_limits<uint64_t>::max()});
+
+    auto idx = recent_index(space);
+    std::vector<summary> summaries;
+    for (auto& r : decode_ranges(ranges)) {
+        if (!idx->covers(r))
+            throw std::invalid_argument{"Range is outside of our swarm's"};
+        for (auto& part : split(r))
+            summaries.push_back(idx->summarize(part));
+    }
+    return encode_summaries(summaries);
+}
+
+fetch_reply SwarmSync::answer_fetch(std::string_view ranges_data, std::string_view hashes, std::string_view after) {
+    auto ranges = decode_ranges(ranges_data);
+    std::sort(ranges.begin(), ranges.end(), [](const range& a, const range& b) { return a.first < b.first; });
+    for (size_t i = 1; i < ranges.size(); i++)
+        if (ranges[i].first <= ranges[i - 1].last)
+            throw std::invalid_argument{"Invalid ranges: ranges overlap"};
+    auto theirs_list = decode_hashes(hashes);
+    std::unordered_set<std::string> theirs{theirs_list.begin(), theirs_list.end()};
+
+    // The hashes of our messages in the ranges (and only those are read).  Further pages list them
+    // again, so we only answer for ranges small enough (as the leaves of a sync are) for that to
+    // stay cheap.
+    std::vector<std::string> ours;
+    stream_options opts;
+    opts.keys_only = true;
+    for (auto& r : merge_adjacent(ranges)) {
+        opts.swarm_space = {r.first, r.last};
+        db_.for_each([&](std::vector<message>& batch) {
+            for (auto& m : batch)
+                ours.push_back(std::move(m.hash));
+            return ours.size() <= MAX_FETCH_HASHES;
+        }, opts);
+        if (ours.size() > MAX_FETCH_HASHES)
+            throw std::invalid_argument{"Ranges hold too many messages"};
+    }
+
+    fetch_reply reply;
+    if (after.empty()) {
+        std::unordered_set<std::string_view> have{ours.begin(), ours.end()};
+        std::vector<std::string> wanted;
+        for (auto& h : theirs_list)
+            if (!have.count(h))
+                wanted.push_back(h);
+        reply.wanted = encode_hashes(wanted);
+    }
+
+    // The messages they lack, in hash order (so that a further page can carry on after the last
+    // hash of this one)
+    ours.erase(std::remove_if(ours.begin(), ours.end(),
+                [&theirs](const std::string& h) { return theirs.count(h) > 0; }),
+            ours.end());
+    std::sort(ours.begin(), ours.end());
+    std::vector<message> msgs;
+    size_t bytes = 0;
+    for (auto it = std::upper_bound(ours.begin(), ours.end(), after); it != ours.end(); ++it) {
+        if (bytes >= MAX_FETCH_BYTES) {
+            reply.more = true;
+            break;
+        }
+        // It could have expired since we listed it
+        if (auto m = db_.retrieve_by_hash(*it)) {
+            bytes += m->data.size();
+            msgs.push_back(std::move(*m));
+        }
+    }
+    if (!msgs.empty()) {
+        // MAX_FETCH_BYTES keeps this to one blob, but if not the rest go in the next page
+        auto blobs = serialize_messages(msgs.begin(), msgs.end(), version_());
+        reply.messages = std::move(blobs.front());
+        if (blobs.size() > 1)
+            reply.more = true;
+    }
+    return reply;
+}
+
+std::optional<std::vector<std::string>> SwarmSync::request(
+        const mn_record& mn, std::string command, std::vector<std::string> parts) {
+    struct pending {
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool done = false;
+        bool success = false;
+        std::vector<std::string> reply;
+    };
+    auto p = std::make_shared<pending>();
+
+    int64_t bytes = 0;
+    for (auto& part : parts)
+        bytes += part.size();
+
+    request_(mn, std::move(command), std::move(parts), [p](bool success, std::vector<std::string> reply) {
+        {
+            std::lock_guard lock{p->mutex};
+            p->done = true;
+            p->success = success;
+            p->reply = std::move(reply);
+        }
+        p->cv.notify_all();
+    });
+
+    std::unique_lock lock{p->mutex};
+    // The callback holds its own reference, so we can stop waiting for it at any time
+    while (!p->cv.wait_for(lock, 100ms, [&p] { return p->done; }))
+        if (stop_)
+            return std::nullopt;
+    for (auto& part : p->reply)
+        bytes += part.size();
+    {
+        std::lock_guard slock{mutex_};
+        stats_.bytes += bytes;
+    }
+    if (!p->success)
+        return std::nullopt;
+    return std::move(p->reply);
+}
+
+bool SwarmSync::push_to(const mn_record& peer, const std::vector<std::string>& hashes) {
+    std::vector<message> msgs;
+    size_t bytes = 0;
+    auto send = [&] {
+        if (msgs.empty())
+            return true;
+        for (auto& blob : serialize_messages(msgs.begin(), msgs.end(), version_())) {
+            auto size = blob.size();
+            if (!request(peer, "mn.data", {std::move(blob)}) || !pace(size))
+                return false;
+        }
+        {
+            std::lock_guard lock{mutex_};
+            stats_.pushed += msgs.size();
+        }
+        msgs.clear();
+        bytes = 0;
+        return true;
+    };
+    for (auto& hash : hashes) {
+        if (auto m = db_.retrieve_by_hash(hash)) {
+            bytes += m->data.size();
+            msgs.push_back(std::move(*m));
+        }
+        if (bytes >= MAX_FETCH_BYTES && !send())
+            return false;
+    }
+    return send();
+}
+
+bool SwarmSync::pace(size_t bytes) {
+    if (opts_.bytes_per_second <= 0)
+        return !stop_;
+    std::unique_lock lock{mutex_};
+    return !cv_.wait_for(lock,
+            std::chrono::duration<double>{static_cast<double>(bytes) / opts_.bytes_per_second},
+            [this] { return stop_.load(); });
+}
+
+bool SwarmSync::fetch_from(const mn_record& peer, const std::vector<range>& ranges, std::vector<std::string> have) {
+    const auto ranges_data = encode_ranges(ranges);
+    const auto have_data = encode_hashes(have);
+    std::vector<std::string> wanted;
+    std::string after;
+    bool more = true;
+    for (bool first = true; more; first = false) {
+        auto reply = request(peer, "mn.sync_fetch", {ranges_data, have_data, after});
+        if (!reply || reply->size() != 4 || (*reply)[0] != "OK")
+            return false;
+        if (first)
+            wanted = decode_hashes((*reply)[2]);
+        more = (*reply)[3] == "1";
+
+        auto msgs = deserialize_messages((*reply)[1]);
+        if (msgs.empty()) {
+            if (more)
+                throw std::runtime_error{"Peer sent an empty page of messages"};
+            break;
+        }
+        after = msgs.back().hash;
+        db_.bulk_store(msgs);
+        // Our index no longer matches what we have
+        drop_index();
+        {
+            std::lock_guard lock{mutex_};
+            stats_.fetched += msgs.size();
+        }
+        if (!pace((*reply)[1].size()))
+            return false;
+    }
+
+    // Only push what we listed: a peer can't ask for anything else
+    std::sort(have.begin(), have.end());
+    wanted.erase(std::remove_if(wanted.begin(), wanted.end(),
+                [&have](const std::string& h) { return !std::binary_search(have.begin(), have.end(), h); }),
+            wanted.end());
+    return push_to(peer, wanted);
+}
+
+bool SwarmSync::sync_with(const job& j) {
+    auto idx = recent_index(j.ranges);
+
+    // Descend from our ranges through the parts whose summaries differ, until the parts are small
+    // enough to compare by listing them (or one side has nothing there).
+    std::vector<range> frontier = j.ranges, leaves, push_only;
+    int64_t compared = 0, deferred = 0;
+    while (!frontier.empty() && !stop_) {
+        std::vector<range> next;
+        for (size_t i = 0; i < frontier.size(); i += MAX_RANGES) {
+            std::vector<range> chunk{frontier.begin() + i,
+                    frontier.begin() + std::min(frontier.size(), i + MAX_RANGES)};
+            auto reply = request(j.peer, "mn.sync_digest", {encode_ranges(chunk)});
+            if (!reply || reply->size() != 2 || (*reply)[0] != "OK")
+                return false;
+            auto theirs = decode_summaries((*reply)[1]);
+            size_t k = 0;
+            for (auto& r : chunk) {
+                for (auto& part : split(r)) {
+                    if (k >= theirs.size())
+                        throw std::runtime_error{"Peer sent too few summaries"};
+                    auto& t = theirs[k++];
+                    auto ours = idx->summarize(part);
+                    compared++;
+                    if (t == ours)
+                        continue;
+                    if (t.count == 0)
+                        push_only.push_back(part);
+                    else if (part.first == part.last || std::max(t.count, ours.count) <= LEAF_SIZE)
+                        leaves.push_back(part);
+                    else if (ours.count == 0)
+                        // A bulk transfer the other way: the peer relays these to us when it syncs
+                        // with us (as when we're new to its swarm), so we don't pull them too.
+                        deferred += t.count;
+                    else
+                        next.push_back(part);
+                }
+            }
+            if (k != theirs.size())
+                throw std::runtime_error{"Peer sent too many summaries"};
+        }
+        frontier = std::move(next);
+    }
+    if (stop_)
+        return false;
+
+    // The full dump we're saving: everything we have in the ranges, other than what we relay as a
+    // full dump anyway
+    int64_t synced = 0, relayed = 0;
+    for (auto& r : j.ranges)
+        synced += idx->summarize(r).count;
+    for (auto& part : push_only)
+        relayed += idx->summarize(part).count;
+    synced -= relayed;
+    auto count = db_.get_message_count();
+    int64_t full_dump = count > 0 ? synced * (db_.get_data_bytes() / count) : 0;
+    {
+        std::lock_guard lock{mutex_};
+        stats_.ranges += compared;
+        stats_.full_dump_bytes += full_dump;
+        stats_.deferred += deferred;
+        if (leaves.empty() && push_only.empty() && deferred == 0)
+            stats_.in_sync++;
+    }
+    if (leaves.empty() && push_only.empty())
+        return true;
+
+    auto by_first = [](const range& a, const range& b) { return a.first < b.first; };
+
+    // The parts where the peer has nothing at all (all of them, for a new swarm member) can be a
+    // large transfer, which we leave to the Rebalancer's pacing and retries.
+    if (!push_only.empty()) {
+        std::sort(push_only.begin(), push_only.end(), by_first);
+        std::vector<std::pair<uint64_t, uint64_t>> relay_ranges;
+        for (auto& r : merge_adjacent(push_only))
+            relay_ranges.emplace_back(r.first, r.last);
+        relay_(j.peer, std::move(relay_ranges));
+        std::lock_guard lock{mutex_};
+        stats_.relayed += relayed;
+    }
+    if (leaves.empty())
+        return true;
+
+    // List our messages in the differing ranges, reading only those of our swarm's range
+    std::sort(leaves.begin(), leaves.end(), by_first);
+    std::vector<std::vector<std::string>> have(leaves.size());
+    stream_options opts;
+    opts.keys_only = true;
+    for (auto& r : j.ranges) {
+        opts.swarm_space = {r.first, r.last};
+        db_.for_each([&](std::vector<message>& batch) {
+            for (auto& m : batch)
+                if (auto i = find_range(leaves, pubkey_to_swarm_space(m.pubkey)))
+                    have[*i].push_back(std::move(m.hash));
+            return true;
+        }, opts);
+    }
+
+    // Compare the leaves in as few requests as their ranges and our hashes allow
+    std::vector<range> ranges;
+    std::vector<std::string> hashes;
+    for (size_t i = 0; i < leaves.size(); i++) {
+        if (!ranges.empty() && (ranges.size() >= MAX_RANGES || hashes.size() + have[i].size() > MAX_FETCH_HASHES)) {
+            if (!fetch_from(j.peer, ranges, std::move(hashes)))
+                return false;
+            ranges.clear();
+            hashes.clear();
+        }
+        ranges.push_back(leaves[i]);
+        hashes.insert(hashes.end(),
+                std::make_move_iterator(have[i].begin()), std::make_move_iterator(have[i].end()));
+    }
+    return ranges.empty() || fetch_from(j.peer, ranges, std::move(hashes));
+}
+
+void SwarmSync::run_serving() {
+    std::unique_lock lock{mutex_};
+    while (true) {
+        serve_cv_.wait(lock, [this] { return stop_ || !requests_.empty(); });
+        if (stop_)
+            break;
+
+        auto answer = std::move(requests_.front());
+        requests_.pop_front();
+        lock.unlock();
+        answer();
+        lock.lock();
+    }
+}
+
+void SwarmSync::run() {
+    std::unique_lock lock{mutex_};
+    while (true) {
+        cv_.wait(lock, [this] { return stop_ || !jobs_.empty(); });
+        if (stop_)
+            break;
+
+        auto j = std::move(jobs_.front());
+        jobs_.pop_front();
+        stats_.queued = jobs_.size();
+        lock.unlock();
+
+        auto started = std::chrono::steady_clock::now();
+        bool ok = false;
+        try {
+            ok = sync_with(j);
+        } catch (const std::exception& e) {
+            BELDEX_LOG(warn, "Failed to sync messages with {}: {}", j.peer.pubkey_legacy, e.what());
+        }
+        if (ok)
+            BELDEX_LOG(debug, "Synced messages with {} in {}", j.peer.pubkey_legacy,
+                    util::short_duration(std::chrono::steady_clock::now() - started));
+        else if (!stop_) {
+            BELDEX_LOG(info, "Could not sync messages with {}", j.peer.pubkey_legacy);
+            if (j.on_failure)
+                j.on_failure(j.peer);
+        }
+
+        lock.lock();
+        if (ok)
+            stats_.synced++;
+        else if (!stop_)
+            stats_.failed++;
+    }
+}
+
+} // namespace beldex
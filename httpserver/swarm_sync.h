@@ -0,0 +1,310 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "beldex_common.h"
+#include "mn_record.h"
+
+namespace beldex {
+
+using namespace std::literals;
+
+class Database;
+
+// Range-hash anti-entropy between swarm members, over the mn.sync_digest and mn.sync_fetch
+// requests.
+//
+// Messages are placed by their owner's swarm space value (see pubkey_to_swarm_space()), and a range
+// of the swarm space is summarized by the number of messages in it and the xor of their digests
+// (see message_digest()).  To sync with a peer we ask it for the summaries of the parts of our
+// swarm's range (see split()), compare them with our own and ask again for the parts of those that
+// differ, until the differing parts are small (LEAF_SIZE).  We then send the peer the hashes of our
+// messages in those parts, and it replies with its messages there that we lack and the hashes of
+// ours that it lacks, which we then push to it (as mn.data).  Bulk transfers are only ever made by
+// the side that has the messages: parts in which the peer has nothing at all are handed to the
+// Rebalancer (see SwarmSync::relay_fn), which paces them, while large parts in which we have nothing
+// are left for the peer to relay to us in the same way (see relaying_member()).  Peers that are in
+// sync thus take a single round trip, and only the messages that differ get sent, once.
+namespace swarm_sync {
+
+    // Number of parts a range is split into
+    inline constexpr size_t FANOUT = 16;
+
+    // Ranges in which neither side has more than this many messages are compared by listing them;
+    // larger ones are split further (or, if we have nothing there, left for the peer to relay).
+    inline constexpr uint64_t LEAF_SIZE = 64;
+
+    // Maximum number of ranges in one request
+    inline constexpr size_t MAX_RANGES = 256;
+
+    // Maximum number of message hashes in one mn.sync_fetch request, and of our messages in its
+    // ranges
+    inline constexpr size_t MAX_FETCH_HASHES = 20'000;
+
+    // A mn.sync_fetch reply (or a push of messages to a peer) stops adding messages once their data
+    // reaches this size; the rest follow in further requests.  (This keeps a serialized batch well
+    // under SERIALIZATION_BATCH_SIZE.)
+    inline constexpr size_t MAX_FETCH_BYTES = 4'000'000;
+
+    // An inclusive range of the swarm space (first <= last)
+    struct range {
+        uint64_t first;
+        uint64_t last;
+    };
+    inline bool operator==(const range& a, const range& b) {
+        return a.first == b.first && a.last == b.last;
+    }
+
+    // The number of messages in a range and the xor of their digests
+    struct summary {
+        uint64_t count = 0;
+        uint64_t digest = 0;
+    };
+    inline bool operator==(const summary& a, const summary& b) {
+        return a.count == b.count && a.digest == b.digest;
+    }
+    inline bool operator!=(const summary& a, const summary& b) { return !(a == b); }
+
+    // Returns the digest of a message.  This is part of the protocol: every node must compute the
+    // same value.
+    uint64_t message_digest(const user_pubkey_t& owner, std::string_view hash);
+
+    // Splits a range into FANOUT parts of (nearly) equal size, or fewer when the range has fewer
+    // values than that.  Both sides of a sync split ranges the same way.
+    std::vector<range> split(const range& r);
+
+    // Returns the (one or two, if it wraps around) ranges making up a swarm space range as given by
+    // swarm_space_range().
+    std::vector<range> to_ranges(std::pair<uint64_t, uint64_t> space);
+
+    // Returns which of a swarm's existing members (which must not be empty) brings a new member up
+    // to date: the one whose pubkey is nearest to the new member's by xor distance.  Every member
+    // picks the same one, and new members are spread over the existing ones.
+    const mn_record& relaying_member(const std::vector<mn_record>& members, const mn_record& new_member);
+
+    // Encodings of the requests' and replies' parts: ranges and summaries as pairs of 64-bit
+    // little-endian integers, and hashes each preceded by its length (in one byte).  The decoders
+    // throw std::invalid_argument on invalid input.
+    std::string encode_ranges(const std::vector<range>& ranges);
+    std::vector<range> decode_ranges(std::string_view data);
+    std::string encode_summaries(const std::vector<summary>& summaries);
+    std::vector<summary> decode_summaries(std::string_view data);
+    std::string encode_hashes(const std::vector<std::string>& hashes);
+    std::vector<std::string> decode_hashes(std::string_view data);
+
+    // The swarm space values and digests of a database's messages in some ranges of the swarm
+    // space (normally our swarm's), for summarizing ranges.  Takes 16 bytes per message.
+    class index {
+        std::vector<range> ranges_;
+        // Sorted (swarm space value, digest) pairs
+        std::vector<std::pair<uint64_t, uint64_t>> entries_;
+        // xors_[i] is the xor of the digests of the first i entries
+        std::vector<uint64_t> xors_;
+
+      public:
+        // Builds the index of the messages in the given ranges of the database
+        index(Database& db, std::vector<range> ranges);
+
+        // The ranges that the index covers
+        const std::vector<range>& ranges() const { return ranges_; }
+
+        // Returns true if the range lies within the ranges that the index covers
+        bool covers(const range& r) const;
+
+        // Summarizes a range, which must lie within those that the index covers
+        summary summarize(const range& r) const;
+
+        size_t size() const { return entries_.size(); }
+    };
+
+    // A reply to mn.sync_fetch
+    struct fetch_reply {
+        // Serialized messages that the requester lacks
+        std::string messages;
+        // The (encoded) hashes of the requester's messages that we lack
+        std::string wanted;
+        // True if there are more messages than fit in this reply
+        bool more = false;
+    };
+
+} // namespace swarm_sync
+
+struct swarm_sync_options {
+    // How long an index of our messages (see swarm_sync::index) is reused for, to answer peers'
+    // requests and to run our syncs; messages stored or removed in the meantime show up as
+    // differences until the next index.
+    std::chrono::milliseconds index_max_age = 30s;
+
+    // Bandwidth budget for the messages we push to peers and fetch from them, in bytes per second;
+    // 0 for no limit.  (Whole ranges that a peer lacks go through the Rebalancer's budget instead.)
+    int64_t bytes_per_second = 4 * 1024 * 1024;
+
+    // Maximum number of peers' requests waiting to be answered; further requests are answered with
+    // "busy".
+    size_t max_queued_requests = 64;
+};
+
+// Runs syncs with peers (one at a time, on its own thread) and answers peers' sync requests (one at
+// a time, on another thread, so that neither the syncs nor the request handlers' threads get held
+// up).
+class SwarmSync {
+  public:
+    // Sends a request to a node, calling `cb` (from any thread) with whether the request succeeded
+    // and the parts of the reply.
+    using request_fn = std::function<void(
+            const mn_record& mn,
+            std::string command,
+            std::vector<std::string> parts,
+            std::function<void(bool success, std::vector<std::string> reply)> cb)>;
+
+    // Queues sending all of our messages in the given swarm space ranges to a node, in the
+    // background (see Rebalancer::relay_all())
+    using relay_fn = std::function<void(
+            const mn_record& mn, std::vector<std::pair<uint64_t, uint64_t>> ranges)>;
+
+    // Returns the serialization version to send messages with
+    using version_fn = std::function<uint8_t()>;
+
+    // Called (on the sync thread) with a peer that we couldn't sync with
+    using failure_fn = std::function<void(const mn_record& mn)>;
+
+    // Called (from the serving thread) with the parts of the reply to a peer's request
+    using reply_fn = std::function<void(std::vector<std::string> reply)>;
+
+    struct stats_t {
+        int64_t queued = 0;          // Syncs waiting to run
+        int64_t synced = 0;          // Syncs completed
+        int64_t in_sync = 0;         // Completed syncs that found no differences
+        int64_t failed = 0;          // Syncs that failed (e.g. the peer didn't answer)
+        int64_t ranges = 0;          // Ranges compared
+        int64_t fetched = 0;         // Messages received from peers
+        int64_t pushed = 0;          // Messages sent to peers
+        int64_t relayed = 0;         // Messages handed to the Rebalancer for peers that lacked them
+        int64_t deferred = 0;        // Peers' messages in large ranges where we had none, left for them to relay
+        int64_t bytes = 0;           // Total size of our sync requests (and pushes) and replies
+        int64_t full_dump_bytes = 0; // Estimated size of sending all of the synced messages instead
+        int64_t served = 0;          // Sync requests answered for peers
+        int64_t busy = 0;            // Sync requests turned away because too many were queued
+        int64_t indexes = 0;         // Indexes of our messages built
+    };
+
+    // Starts the sync and serving threads.  The database must outlive the SwarmSync.
+    SwarmSync(
+            Database& db,
+            request_fn request,
+            relay_fn relay,
+            version_fn version,
+            swarm_sync_options opts = {});
+
+    // Stops syncing; see stop().
+    ~SwarmSync();
+
+    SwarmSync(const SwarmSync&) = delete;
+    SwarmSync& operator=(const SwarmSync&) = delete;
+
+    // Queues syncing the messages of the given swarm space range (as given by swarm_space_range())
+    // with each of the peers (other than those already queued).  `on_failure`, if given, is called
+    // for each peer that we fail to sync with.  The range also becomes the one we answer peers'
+    // requests about (until then, we answer about the whole swarm space).
+    void sync(
+            const std::vector<mn_record>& peers,
+            std::pair<uint64_t, uint64_t> space,
+            failure_fn on_failure = nullptr);
+
+    // Abandons the running and queued syncs and the queued requests, and waits for the threads to
+    // finish.
+    void stop();
+
+    // Queues answering a peer's mn.sync_digest request (its ranges part).  The reply is "OK" and
+    // the encoded summaries of the parts of each range, "invalid parameters" if the request is
+    // invalid, or "busy" if too many requests are queued.
+    void digest(std::string ranges, reply_fn reply);
+
+    // Queues answering a peer's mn.sync_fetch request: its ranges, the hashes of its messages in
+    // them, and (for the further pages of a reply with `more` set) the last hash of the previous
+    // page.  The reply is "OK" and the parts of a swarm_sync::fetch_reply (with `more` as "1" or
+    // "0"), or an error as for digest().
+    void fetch(std::string ranges, std::string hashes, std::string after, reply_fn reply);
+
+    stats_t get_stats() const;
+
+  private:
+    struct job {
+        mn_record peer;
+        std::vector<swarm_sync::range> ranges;
+        failure_fn on_failure;
+    };
+
+    void run();
+    void run_serving();
+
+    // Queues answering a request with `answer`, which returns the reply parts following "OK" and
+    // throws std::invalid_argument if the request is invalid
+    void serve(std::string_view command, std::function<std::vector<std::string>()> answer, reply_fn reply);
+
+    // Answer peers' requests; see digest() and fetch()
+    std::string answer_digest(std::string_view ranges);
+    swarm_sync::fetch_reply answer_fetch(std::string_view ranges, std::string_view hashes, std::string_view after);
+
+    // Syncs with a peer; returns false (or throws) on failure
+    bool sync_with(const job& j);
+
+    // Fetches the peer's messages in the given ranges that we lack (given the hashes of ours there)
+    // and pushes it those of ours that it lacks.
+    bool fetch_from(const mn_record& peer, const std::vector<swarm_sync::range>& ranges, std::vector<std::string> have);
+
+    // Pushes the messages with the given hashes to the peer, within the bandwidth budget
+    bool push_to(const mn_record& peer, const std::vector<std::string>& hashes);
+
+    // Waits for as long as transferring `bytes` takes at the bandwidth budget; returns false if we
+    // are stopping.
+    bool pace(size_t bytes);
+
+    // Makes a request and waits for its reply, adding the size of both to `bytes_`.  Returns
+    // nullopt if it fails, or if we are stopping.
+    std::optional<std::vector<std::string>> request(
+            const mn_record& mn, std::string command, std::vector<std::string> parts);
+
+    // Returns a recent index of our messages in the given ranges, building a new one if the last
+    // one is too old or is of other ranges
+    std::shared_ptr<const swarm_sync::index> recent_index(const std::vector<swarm_sync::range>& ranges);
+
+    // Drops the index of our messages, so that the next use builds a new one
+    void drop_index();
+
+    Database& db_;
+    const request_fn request_;
+    const relay_fn relay_;
+    const version_fn version_;
+    const swarm_sync_options opts_;
+
+    std::mutex index_mutex_; // Protects the index_ fields, and is held while building
+    std::shared_ptr<const swarm_sync::index> index_;
+    std::chrono::steady_clock::time_point index_built_;
+
+    mutable std::mutex mutex_; // Protects the fields below, and is used to wait on cv_ and serve_cv_
+    std::condition_variable cv_;
+    std::condition_variable serve_cv_;
+    std::atomic<bool> stop_ = false;
+    std::deque<job> jobs_;
+    std::deque<std::function<void()>> requests_;
+    std::vector<swarm_sync::range> space_; // The ranges we answer about; empty for all of them
+    stats_t stats_;
+    std::thread thread_;
+    std::thread serve_thread_;
+};
+
+} // namespace beldex
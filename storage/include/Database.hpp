@@ -5,43 +5,274 @@
 #include <chrono>
 #include <cstdint>
 #include <filesystem>
+#include <functional>
+#include <limits>
+#include <map>
 #include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 
 namespace beldex {
 
-class DatabaseImpl;
+class StorageEngine;
 
-// Storage database class.
+// The available implementations of the storage behind a Database.
+enum class storage_engine {
+    // A SQLite database file; the default, and the only one that persists anything.
+    sqlite,
+    // A pure in-memory store (see MemoryEngine) whose contents are lost when the Database is
+    // destroyed: for tests and benchmarks.  Of the options below only the store and capacity
+    // limits (owner quotas, eviction) and `shards` apply to it.
+    memory,
+};
+
+// Tunables for a Database instance; the defaults are intended for production use.
+struct database_options {
+    // The storage engine to use.
+    storage_engine engine = storage_engine::sqlite;
+
+    // Concurrent store() calls are committed together in a single transaction: the first store to
+    // arrive waits up to this long for others to join it before committing.  Stores that arrive
+    // while a batch is being committed are always grouped into the next batch, even if this is 0.
+    std::chrono::microseconds store_batch_window = 2ms;
+
+    // A store batch is committed immediately (without waiting out the window) once it has this
+    // many messages.
+    size_t store_batch_size = 256;
+
+    // Maximum number of pubkey -> owner id mappings kept in memory so that lookups and deletions
+    // can bind owner ids directly rather than looking the owner up in the database each time.  The
+    // cache is emptied if it fills up; 0 disables it.
+    size_t owner_cache_size = 100'000;
+
+    // If true then new message bodies are stored in append-only, memory-mapped segment files (in a
+    // `blobs` directory next to the database) rather than inline in the messages table, keeping
+    // the table and its indices small.  Bodies already stored either way remain readable whatever
+    // this is set to.  The space of removed bodies is reclaimed by compact_blob_segments().
+    bool blob_segments = false;
+
+    // If true then messages are kept in a set of tables partitioned by expiry (one per
+    // `partition_width` of expiry times) so that cleaning up expired messages mostly just drops
+    // whole tables rather than deleting rows.  An existing database is migrated to the partitioned
+    // layout when it is first opened with this set (in chunks, resuming if interrupted); there is
+    // no migration back, and a partitioned database stays partitioned
+    // even if opened with this unset.  Expired messages are hidden from lookups until their
+    // partition gets dropped.
+    bool partitioned = false;
+
+    // Span of expiry times covered by each partition table.
+    std::chrono::milliseconds partition_width = 24h;
+
+    // If true then an in-memory filter of stored message hashes (about 2-4 bytes per message) is
+    // kept so that most attempts to store a message we already have are answered by a read-only
+    // lookup instead of a write transaction.  The filter is built in the background at startup.
+    bool hash_filter = true;
+
+    // Per-owner limits on the number of (unexpired) messages and on their total data size; a
+    // store that would take its owner over either limit is rejected as if the database were full.
+    // 0 means no limit.
+    int64_t owner_max_messages = 0;
+    int64_t owner_max_bytes = 0;
+
+    // Once the database is this full (as a fraction of Database::SIZE_LIMIT) evict_chunk() starts
+    // removing the messages that expire soonest, and carries on until it is below `evict_target`,
+    // so that room is made before stores start failing.  A value above 1 disables eviction.
+    double evict_watermark = 0.9;
+    double evict_target = 0.85;
+
+    // If the database is this full when a store batch is committed (i.e. background eviction is
+    // not keeping up) then up to `store_evict_max` messages per store are evicted in the same
+    // transaction first.  0 disables this.
+    double store_evict_watermark = 0.97;
+    int store_evict_max = 4;
+
+    // Memory budget for caching the newest few messages of recently polled owners, so that
+    // repeated retrieves of "anything new?" can be answered without querying the database.  0
+    // disables the cache.
+    size_t retrieve_cache_size = 64 * 1024 * 1024;
+
+    // If greater than 1 then messages are spread over this many database files (`storage-00.db`,
+    // `storage-01.db`, ...), each owner's messages all going to the one chosen by
+    // Database::shard_of(), so that stores to different shards don't wait on each other's write
+    // locks.  Each shard gets an equal part of Database::SIZE_LIMIT and of the memory budgets
+    // above.  A single-file database is migrated to the shards when first opened with this set;
+    // opening a sharded database with a different number of shards (including 1) fails.
+    size_t shards = 1;
+};
+
+// Occupancy and eviction statistics; see `database_options::evict_watermark`.
+struct capacity_stats {
+    double fill_level = 0;         // Fraction of Database::SIZE_LIMIT in use
+    bool evicting = false;         // True between reaching the watermark and getting below target
+    int64_t evicted = 0;           // Unexpired messages evicted to make room
+    int64_t store_evicted = 0;     // ... of which were evicted by stores rather than evict_chunk()
+    int64_t quota_rejections = 0;  // Stores rejected for taking their owner over quota
+    int64_t full_rejections = 0;   // Stores rejected because the database was full
+};
+
+// Statistics of the filter used to detect duplicate stores; see `database_options::hash_filter`.
+struct hash_filter_stats {
+    bool ready = false;        // False if disabled, or not yet built
+    int64_t entries = 0;       // Message hashes in the filter
+    int64_t memory_bytes = 0;  // Memory used by the filter
+    int64_t lookups = 0;       // Messages to be stored that were checked against the filter
+    int64_t hits = 0;          // Lookups that found the hash in the filter
+    int64_t duplicates = 0;    // Hits confirmed as already stored, and so not written
+};
+
+// Statistics of the cache of owners' recent messages; see `database_options::retrieve_cache_size`.
+struct retrieve_cache_stats {
+    bool enabled = false;
+    int64_t entries = 0;       // Owners with cached messages
+    int64_t memory_bytes = 0;  // Approximate memory used by the cached messages
+    int64_t hits = 0;          // Retrieves answered from the cache
+    int64_t empty = 0;         // ... of which had no new messages
+    int64_t misses = 0;        // Retrieves that had to query the database
+    int64_t evictions = 0;     // Entries evicted to stay within the memory budget
+};
+
+// Checkpoint modes of Database::checkpoint(), as for sqlite3_wal_checkpoint_v2: `passive` copies
+// what it can without waiting for anything; `restart` also waits (briefly) for readers so that the
+// next write starts the WAL over from the beginning; `truncate` additionally truncates the WAL
+// file to zero bytes.
+enum class checkpoint_mode { passive, restart, truncate };
+
+struct checkpoint_result {
+    bool busy = false;               // True if a restart/truncate checkpoint couldn't complete
+    int64_t log_bytes = 0;           // Size of the content of the WAL
+    int64_t checkpointed_bytes = 0;  // How much of that is now copied into the database
+};
+
+// A page of messages returned by Database::retrieve_page().
+struct retrieve_result {
+    std::vector<message> messages;
+    // True if there are more messages after the last one returned, i.e. if the page was cut short
+    // by its count or size limit.  The hash of the last message continues from there.
+    bool more = false;
+};
+
+// How a retrieve's size limit counts each message's data: as raw bytes, or as the base64 encoding
+// (with padding) that json responses carry it in.
+enum class size_encoding { raw, base64 };
+
+// Returns the size that `data_size` bytes of message data count as against a retrieve's size limit
+inline size_t counted_size(size_t data_size, size_encoding encoding) {
+    return encoding == size_encoding::base64 ? (data_size + 2) / 3 * 4 : data_size;
+}
+
+// A stored message as passed to the callback of Database::retrieve_each(): the hash and data view
+// the database row (or blob segment) directly, and are only valid during the callback.
+struct message_view {
+    std::string_view hash;
+    std::chrono::system_clock::time_point timestamp;
+    std::chrono::system_clock::time_point expiry;
+    std::string_view data;
+};
+
+// Selects and bounds the messages visited by Database::for_each().
+struct stream_options {
+    // If set, only visit messages owned by this pubkey.
+    std::optional<user_pubkey_t> owner;
+
+    // If set, only visit messages of owners whose pubkey_to_swarm_space() value lies in the
+    // inclusive range [first, second]; if first > second the range wraps around, i.e. it contains
+    // values >= first *or* <= second.  Only the messages of the owners in the range are read, so
+    // streaming a small range is cheap however large the database.
+    std::optional<std::pair<uint64_t, uint64_t>> swarm_space;
+
+    // Maximum number of messages in a single batch.
+    size_t batch_count = 1000;
+
+    // A batch is ended once the total data size of its messages reaches this many bytes.
+    size_t batch_bytes = 8'000'000;
+
+    // If true then the messages' data is left empty (and so doesn't count towards batch_bytes), for
+    // callers that only need the owners and hashes (and expiries and timestamps).
+    bool keys_only = false;
+};
+
+// Storage database class: optionally sharded, with each shard (or the whole database) stored by a
+// StorageEngine chosen by `database_options::engine`.
 class Database {
-    std::unique_ptr<DatabaseImpl> impl;
-    friend class DatabaseImpl;
+    // The storage (see StorageEngine) that everything other than the sharding is forwarded to.
+    std::unique_ptr<StorageEngine> engine;
+
+    // The shards of a sharded database (see `database_options::shards`), each a Database of its own
+    // on one of the files, which this dispatches to; `engine` is unset.  Empty if not sharded.
+    std::vector<std::unique_ptr<Database>> shard_dbs;
+
+    // Opens a single database file (and blob segment directory): the whole database or a shard.
+    Database(
+            const std::filesystem::path& db_file,
+            const std::filesystem::path& blobs_dir,
+            const database_options& opts,
+            int64_t size_limit);
+    static std::unique_ptr<StorageEngine> make_engine(
+            const std::filesystem::path& db_file,
+            const std::filesystem::path& blobs_dir,
+            const database_options& opts,
+            int64_t size_limit);
+
+    // Moves the messages of a single-file database in `db_path`, if there is one, into our shards.
+    // The old database is only moved out of the way once all of its messages are stored.
+    void migrate_to_shards(const std::filesystem::path& db_path);
+
+    // Stores messages regardless of the per-owner quotas (for migrate_to_shards()); returns how
+    // many of them are stored afterwards, newly or already.
+    size_t bulk_import(const std::vector<message>& items);
+
+    Database& shard_for(const user_pubkey_t& pubkey) {
+        return *shard_dbs[shard_of(pubkey, shard_dbs.size())];
+    }
 
   public:
-    // Recommended period for calling clean_expired()
+    // Recommended period for calling clean_expired(); ExpirySweeper also uses this as the maximum
+    // time between sweeps even when the expiry estimate says there is nothing to remove.
     inline static constexpr auto CLEANUP_PERIOD = 10s;
 
     inline static constexpr int64_t SIZE_LIMIT = int64_t(3584) * 1024 * 1024; // 3.5 GB
 
-    // Constructor.  Note that you *must* also set up a timer that runs periodically (every
-    // CLEANUP_PERIOD is recommended) and calls clean_expired().
-    explicit Database(const std::filesystem::path& db_path);
+    // Lookups (retrieve, retrieve_by_hash, counts, etc.) run on a pool of read-only connections so
+    // that they can proceed concurrently with each other and with writes; we open one per hardware
+    // thread, but at least 2 and at most this many.
+    inline static constexpr unsigned MAX_READERS = 16;
+
+    // Constructor.  Note that you *must* also periodically remove expired messages, either via an
+    // ExpirySweeper or a timer that calls clean_expired() (every CLEANUP_PERIOD is recommended).
+    explicit Database(const std::filesystem::path& db_path, const database_options& opts = {});
 
     ~Database();
 
+    // Returns the shard (in [0, shards)) holding the messages of `pubkey`.  This depends only on
+    // the pubkey, so it must never change.
+    static size_t shard_of(const user_pubkey_t& pubkey, size_t shards);
+
+    // Number of shards: 1 if not sharded
+    size_t shard_count() const { return shard_dbs.empty() ? 1 : shard_dbs.size(); }
+
+    // Returns the given shard (for running maintenance, such as an ExpirySweeper, on each shard);
+    // for an unsharded database the only shard, 0, is the database itself.
+    Database& shard(size_t i) { return shard_dbs.empty() ? *this : *shard_dbs.at(i); }
+
     // if the database is full then print an error only once ever N errors
     inline static constexpr int DB_FULL_FREQUENCY = 100;
 
     // Attempts to store a message in the database.  Returns true if inserted, false on failure due
     // to the message already existing, and nullopt if the insertion failed because the database
-    // is full.  For other query failures, throws.
+    // is full or the owner is over quota.  For other query failures, throws.
+    //
+    // Concurrent calls are group-committed (see `database_options::store_batch_window`), so this
+    // can block for up to the batch window before returning.
     // 
     // This means `if (db.store(...))` will be true if inserted *or* already present; to check only
     // for insertion use `ins && *ins`.
     std::optional<bool> store(const message& msg);
 
+    // Stores messages that aren't already stored, in a single transaction.  Messages that would
+    // take their owner over quota are skipped.
     void bulk_store(const std::vector<message>& items);
 
     // Retrieves messages owned by pubkey received since `last_hash` (which must also be owned by
@@ -55,19 +286,75 @@ class Database {
             const std::string& last_hash,
             std::optional<int> num_results = std::nullopt);
 
-    // Retrieves all messages.
+    // Like retrieve(), but returns at most `max_count` messages (if non-negative) whose data adds up
+    // to at most `max_size` bytes (as counted by counted_size()), along with whether more messages
+    // follow.  The first message is
+    // always returned even if it alone exceeds `max_size`, so that paging always progresses.
+    // Reading stops as soon as a limit is reached, so a page never loads more than one message
+    // beyond what it returns.
+    retrieve_result retrieve_page(
+            const user_pubkey_t& pubkey,
+            const std::string& last_hash,
+            int max_count,
+            size_t max_size = std::numeric_limits<size_t>::max(),
+            size_encoding encoding = size_encoding::raw);
+
+    // Zero-copy version of retrieve_page(): calls `f` with each message of the page, as a view of
+    // the database row, rather than copying the messages out.  Returns true if more messages
+    // follow the page.  `f` runs while a read connection is held, so it must not use the Database.
+    bool retrieve_each(
+            const user_pubkey_t& pubkey,
+            const std::string& last_hash,
+            int max_count,
+            size_t max_size,
+            size_encoding encoding,
+            const std::function<void(const message_view& msg)>& f);
+
+    // Retrieves all messages.  This loads everything (including message data) into memory at
+    // once: for anything other than small databases use for_each() instead.
     std::vector<message> retrieve_all();
 
-    // Return the total number of messages stored
+    // Streams stored messages (with pubkeys set) in storage order (per partition, if partitioned,
+    // and owner by owner when filtering by swarm space), in batches bounded by `opts.batch_count` and `opts.batch_bytes`, optionally filtered by owner
+    // or swarm space.  `f` is called with each batch and may consume (e.g. move from) its messages;
+    // it returns false to stop early.  No database connection or transaction is held while `f` runs, so messages
+    // stored or removed between batches may or may not be visited.  Returns the number of
+    // messages passed to `f`.
+    size_t for_each(
+            const std::function<bool(std::vector<message>& batch)>& f,
+            const stream_options& opts = {});
+
+    // Return the total number of messages stored.  This, get_owner_count() and get_data_bytes()
+    // come from counts maintained as messages are stored and removed rather than from scanning the
+    // database; the counts of what was stored before startup are added in by a background scan,
+    // which these wait for if it hasn't finished yet.
     int64_t get_message_count();
 
     // Returns the number of distinct owner pubkeys with stored messages
     int64_t get_owner_count();
 
-    // Returns the number of used bytes (i.e. used pages * page size) of the database
+    // Returns the total size of the data of the stored messages
+    int64_t get_data_bytes();
+
+    hash_filter_stats get_hash_filter_stats();
+
+    retrieve_cache_stats get_retrieve_cache_stats();
+
+    // Returns the query plans (the EXPLAIN QUERY PLAN steps, one per line) of the statements run
+    // for each client request or stored message, by statement name.  For diagnostics, and for
+    // tests that check that these keep using the intended indices.
+    std::map<std::string, std::string> query_plans();
+
+    // Returns the number of used bytes (i.e. used pages * page size) of the database, plus the size
+    // of any blob segments.
     int64_t get_used_bytes();
 
-    // Get random message. Returns nullopt if there are no messages.
+    // Number of random ids retrieve_random() tries before falling back to seeking to the next
+    // existing message.
+    inline static constexpr int RANDOM_SAMPLE_ATTEMPTS = 5;
+
+    // Get random unexpired message. Returns nullopt if there are no (unexpired) messages.  This
+    // picks a random id and so does not scan the table; it also does not remove expired messages.
     std::optional<message> retrieve_random();
 
     // Get message by `msg_hash`, return true if found.  Note that this does *not* filter by pubkey!
@@ -77,6 +364,58 @@ class Database {
     // periodically.
     void clean_expired();
 
+    // Removes up to `limit` expired messages (earliest expiries first) and returns the number
+    // removed.  Unlike clean_expired() this keeps the write transaction short, so that a large
+    // backlog of expired messages can be removed in chunks without stalling other writes.
+    int clean_expired_chunk(int limit);
+
+    // If the database has reached `database_options::evict_watermark` (and until it is back below
+    // `evict_target`), removes up to `limit` of the unexpired messages that expire soonest, in one
+    // write transaction.  Returns the number removed.
+    int evict_chunk(int limit);
+
+    // Returns the fraction of SIZE_LIMIT in use, i.e. the used (not free) pages of the database or,
+    // if larger, the data stored in blob segments.
+    double get_fill_level();
+
+    capacity_stats get_capacity_stats();
+
+    // Returns an estimate of the number of messages that have expired but have not yet been
+    // removed.  This comes from an in-memory histogram of expiries and does not query the database.
+    int64_t get_expired_estimate();
+
+    // Blob segments with no more than this fraction of their space still in use get compacted.
+    inline static constexpr double COMPACT_THRESHOLD = 0.5;
+
+    // Reclaims the space of removed message bodies in blob segments (see
+    // `database_options::blob_segments`) by moving the remaining bodies of mostly-unused segments
+    // into the current segment and deleting the old segment files.  Each segment is compacted in
+    // its own write transaction.  Returns the number of bytes reclaimed.
+    int64_t compact_blob_segments();
+
+    // Runs a WAL checkpoint, on a connection of its own so that it does not hold up stores unless
+    // `mode` requires it.  Throws on errors other than being unable to complete a restart or
+    // truncate checkpoint (see checkpoint_result::busy).
+    checkpoint_result checkpoint(checkpoint_mode mode);
+
+    // Turns sqlite's automatic checkpoints (run by whichever commit takes the WAL over its
+    // threshold) on or off; they are on by default.  If they are turned off then checkpoint() has
+    // to be called regularly instead, e.g. by a DbMaintainer.
+    void set_auto_checkpoint(bool enabled);
+
+    // Returns the size of the WAL file, which stays at its high water mark until a truncate
+    // checkpoint.
+    int64_t get_wal_bytes();
+
+    // Returns the number of unused pages in the database file
+    int64_t get_freelist_pages();
+
+    // Releases up to `max_pages` unused pages (such as those freed by removing expired messages)
+    // to the filesystem, in one write transaction, and returns the number released.  This does
+    // nothing in databases created without incremental auto-vacuum, which would need a full VACUUM
+    // to convert.
+    int64_t incremental_vacuum(int64_t max_pages);
+
     // Deletes all messages owned by the given pubkey.  Returns the hashes of any deleted messages
     // on success (including the case where no messages are deleted), nullopt on query failure.
     std::vector<std::string> delete_all(const user_pubkey_t& pubkey);
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+namespace beldex {
+
+using namespace std::literals;
+
+class Database;
+
+// Background thread that looks after a Database's write-ahead log and free space.  It takes over
+// checkpointing from sqlite's automatic checkpoints (which make whichever store happens to cross
+// the WAL threshold pay for the checkpoint), running a PASSIVE checkpoint every
+// CHECKPOINT_INTERVAL.  Passive checkpoints never wait, but under sustained reads and writes they
+// can't get the WAL started over, so it only escalates when the WAL has grown: to RESTART once its
+// content reaches RESTART_LOG_BYTES, and to TRUNCATE once the file reaches TRUNCATE_WAL_BYTES.  It
+// also returns free pages (which mostly come from removing expired messages) to the filesystem in
+// bounded incremental vacuum steps once enough of them have accumulated.
+class DbMaintainer {
+  public:
+    inline static constexpr auto CHECKPOINT_INTERVAL = 1s;
+
+    // WAL content size at which we use a RESTART checkpoint
+    inline static constexpr int64_t RESTART_LOG_BYTES = 64 * 1024 * 1024;
+
+    // WAL file size at which we use a TRUNCATE checkpoint
+    inline static constexpr int64_t TRUNCATE_WAL_BYTES = 256 * 1024 * 1024;
+
+    // How often we check the database's free pages
+    inline static constexpr auto VACUUM_INTERVAL = 10s;
+
+    // Free pages at which we start releasing them
+    inline static constexpr int64_t VACUUM_THRESHOLD_PAGES = 4096;
+
+    // Maximum number of pages released by one incremental vacuum (i.e. one write transaction)
+    inline static constexpr int64_t VACUUM_STEP_PAGES = 512;
+
+    // Maximum time spent on incremental vacuum steps in one go
+    inline static constexpr auto VACUUM_BUDGET = 100ms;
+
+    struct stats_t {
+        int64_t wal_bytes = 0;       // Size of the WAL file as of the last checkpoint
+        int64_t log_bytes = 0;       // Size of the WAL content as of the last checkpoint
+        int64_t checkpoints = 0;     // Total checkpoints run (of any mode)
+        int64_t restarts = 0;        // ... of which RESTART checkpoints
+        int64_t truncates = 0;       // ... of which TRUNCATE checkpoints
+        int64_t busy = 0;            // RESTART/TRUNCATE checkpoints that couldn't complete
+        std::chrono::microseconds last_checkpoint{0};  // Duration of the most recent checkpoint
+        std::chrono::microseconds max_checkpoint{0};   // Longest checkpoint duration
+        std::chrono::microseconds total_checkpoint{0}; // Sum of all checkpoint durations
+        int64_t freelist_pages = 0;  // Free pages in the database as of the last check
+        int64_t vacuumed_pages = 0;  // Total pages released by incremental vacuum
+    };
+
+    // Starts the maintenance thread, turning off the database's automatic checkpoints.  The
+    // database must outlive the maintainer.
+    explicit DbMaintainer(Database& db);
+
+    // Stops the thread and turns automatic checkpoints back on.
+    ~DbMaintainer();
+
+    DbMaintainer(const DbMaintainer&) = delete;
+    DbMaintainer& operator=(const DbMaintainer&) = delete;
+
+    stats_t get_stats() const;
+
+  private:
+    void run();
+
+    void checkpoint();
+
+    void vacuum();
+
+    Database& db_;
+    mutable std::mutex mutex_; // Protects stats_ and is used to wait on cv_
+    std::condition_variable cv_;
+    std::atomic<bool> stop_ = false;
+    stats_t stats_;
+    std::thread thread_;
+};
+
+} // namespace beldex
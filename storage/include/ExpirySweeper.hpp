@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+namespace beldex {
+
+using namespace std::literals;
+
+class Database;
+
+// Background thread that removes expired messages from a Database.  Rather than one unbounded
+// DELETE it removes messages in small chunks, each in its own short write transaction, and limits
+// the time spent in each sweep step so that stores (and the owner cleanup trigger) never stall
+// behind a large cohort of messages expiring at once.  The pause between steps is driven by the
+// database's in-memory estimate of expired messages: it sweeps continuously (with short pauses)
+// when a backlog builds up and goes back to idle checks once the backlog is cleared.  When the
+// database nears capacity it also evicts the soonest-to-expire messages (see
+// Database::evict_chunk()), in the same chunks, and it periodically compacts the database's blob
+// segments, if any.
+class ExpirySweeper {
+  public:
+    // Maximum number of messages removed in one chunk (i.e. one write transaction)
+    inline static constexpr int CHUNK_SIZE = 500;
+
+    // Maximum time spent removing chunks in one sweep step before pausing to let other writers in
+    inline static constexpr auto STEP_BUDGET = 50ms;
+
+    // How often we check the expiry estimate when there is nothing (known) to remove
+    inline static constexpr auto CHECK_INTERVAL = 1s;
+
+    // Shortest pause between sweep steps, used when the backlog is large
+    inline static constexpr auto MIN_PAUSE = 5ms;
+
+    // How often we compact the database's blob segments to reclaim space of removed messages
+    inline static constexpr auto COMPACT_INTERVAL = 1min;
+
+    struct stats_t {
+        int64_t backlog = 0;  // Estimated number of expired messages not yet removed
+        int64_t removed = 0;  // Total messages removed by the sweeper
+        int64_t chunks = 0;   // Total chunks (delete transactions) executed
+        std::chrono::microseconds last_chunk{0};  // Duration of the most recent chunk
+        std::chrono::microseconds max_chunk{0};   // Longest chunk duration
+        std::chrono::microseconds total_chunk{0}; // Sum of all chunk durations
+        int64_t blob_bytes_reclaimed = 0; // Blob segment space reclaimed by compaction
+        int64_t evicted = 0;  // Total unexpired messages evicted to make room
+    };
+
+    // Starts the sweeper thread.  The database must outlive the sweeper.
+    explicit ExpirySweeper(Database& db);
+
+    // Signals the sweeper thread to stop and waits for it to finish its current chunk.
+    ~ExpirySweeper();
+
+    ExpirySweeper(const ExpirySweeper&) = delete;
+    ExpirySweeper& operator=(const ExpirySweeper&) = delete;
+
+    stats_t get_stats() const;
+
+  private:
+    void run();
+
+    // Removes chunks until the step budget is used up or nothing more has expired.  Returns the
+    // number of messages removed.
+    int64_t sweep_step();
+
+    // Like sweep_step(), but evicting unexpired messages while the database is over its eviction
+    // watermark.
+    int64_t evict_step();
+
+    Database& db_;
+    mutable std::mutex mutex_; // Protects stats_ and is used to wait on cv_
+    std::condition_variable cv_;
+    std::atomic<bool> stop_ = false;
+    stats_t stats_;
+    std::thread thread_;
+};
+
+} // namespace beldex
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+namespace beldex {
+
+// Approximate set of message hashes (a cuckoo filter) that supports removal.  contains() can give
+// false positives (with 16-bit fingerprints in buckets of 4, roughly 0.01% per table) but not
+// false negatives for inserted keys, with two exceptions: erasing a key that was never inserted
+// can remove another key's matching fingerprint, and an insertion into a table that can't make
+// room (which the growth policy makes very unlikely) drops a fingerprint.  Callers must therefore
+// treat a negative as "almost certainly absent".
+//
+// The filter grows by adding a table twice the size of the previous one once the newest table is
+// MAX_LOAD full, rather than by rehashing, so that it never needs the original keys again.  Not
+// thread-safe.
+class HashFilter {
+  public:
+    inline static constexpr size_t BUCKET_SIZE = 4;
+    inline static constexpr double MAX_LOAD = 0.9;
+    inline static constexpr int MAX_KICKS = 500;
+    inline static constexpr size_t MIN_BUCKETS = 1024;
+
+    // Creates a filter with initial room for (at least) `capacity` keys.
+    explicit HashFilter(size_t capacity = 0);
+
+    void insert(std::string_view key);
+
+    // Removes (a fingerprint matching) the key; returns false if there was none.
+    bool erase(std::string_view key);
+
+    bool contains(std::string_view key) const;
+
+    // Number of keys in the filter
+    size_t size() const { return size_; }
+
+    // Memory used by the filter's tables, in bytes
+    size_t memory_usage() const;
+
+  private:
+    struct table {
+        std::vector<uint16_t> slots;  // BUCKET_SIZE slots per bucket; 0 is an empty slot
+        size_t mask;                  // Number of buckets - 1
+        size_t size = 0;
+
+        explicit table(size_t buckets) : slots(buckets * BUCKET_SIZE), mask{buckets - 1} {}
+
+        bool add(size_t bucket, uint16_t fp);
+        bool has(size_t bucket, uint16_t fp) const;
+        bool remove(size_t bucket, uint16_t fp);
+        size_t alt_bucket(size_t bucket, uint16_t fp) const;
+    };
+
+    // Tables from oldest (smallest) to newest; new keys go into the last one.
+    std::vector<table> tables_;
+    size_t size_ = 0;
+    uint64_t rng_ = 0x9e3779b97f4a7c15;
+};
+
+} // namespace beldex
@@ -0,0 +1,116 @@
+#pragma once
+
+#include "Database.hpp"
+#include "StorageEngine.hpp"
+#include "beldex_common.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <optional>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace beldex {
+
+// Storage engine that keeps everything in memory (see `storage_engine::memory`), as a reference
+// implementation of the Database semantics and for benchmarking the server without the SQL layer.
+//
+// Messages are kept by id, ids being assigned in storage order (like the rowids of the sqlite
+// engine), with indices by hash and by owner and an expiry-ordered set for removing expired
+// messages and evicting.  It behaves like an unpartitioned sqlite database: expired messages stay
+// visible until they are removed.  The fill level is the size of the stored hashes and data
+// relative to the size limit.
+//
+// Everything is protected by a single reader/writer lock; stores are not batched.
+class MemoryEngine final : public StorageEngine {
+  public:
+    MemoryEngine(const database_options& opts, int64_t size_limit);
+
+    std::optional<bool> store(const message& msg) override;
+    void bulk_store(const std::vector<message>& items) override;
+    size_t bulk_import(const std::vector<message>& items) override;
+
+    bool retrieve_each(
+            const user_pubkey_t& pubkey,
+            const std::string& last_hash,
+            int max_count,
+            size_t max_size,
+            size_encoding encoding,
+            const std::function<void(const message_view& msg)>& f) override;
+    size_t for_each(
+            const std::function<bool(std::vector<message>& batch)>& f,
+            const stream_options& opts) override;
+    std::optional<message> retrieve_random() override;
+    std::optional<message> retrieve_by_hash(const std::string& msg_hash) override;
+
+    int64_t get_message_count() override;
+    int64_t get_owner_count() override;
+    int64_t get_data_bytes() override;
+    int64_t get_used_bytes() override;
+
+    void clean_expired() override;
+    int clean_expired_chunk(int limit) override;
+    int evict_chunk(int limit) override;
+    double get_fill_level() override;
+    capacity_stats get_capacity_stats() override;
+    int64_t get_expired_estimate() override;
+
+    std::vector<std::string> delete_all(const user_pubkey_t& pubkey) override;
+    std::vector<std::string> delete_by_hash(
+            const user_pubkey_t& pubkey, const std::vector<std::string>& msg_hashes) override;
+    std::vector<std::string> delete_by_timestamp(
+            const user_pubkey_t& pubkey, std::chrono::system_clock::time_point timestamp) override;
+    std::vector<std::string> update_expiry(
+            const user_pubkey_t& pubkey,
+            const std::vector<std::string>& msg_hashes,
+            std::chrono::system_clock::time_point new_exp) override;
+    std::vector<std::string> update_all_expiries(
+            const user_pubkey_t& pubkey, std::chrono::system_clock::time_point new_exp) override;
+
+  private:
+    using messages_t = std::map<int64_t, message>;
+
+    // The methods below must be called with `mutex_` held (exclusively, for those that modify).
+
+    // Inserts a message unless it is already stored (returning false) or would take its owner over
+    // quota (if `quotas` is set) or the engine over its size limit (returning nullopt).
+    std::optional<bool> insert(const message& msg, bool quotas = true);
+    bool within_quota(const message& msg) const;
+    void remove(messages_t::iterator it);
+    // Removes up to `limit` messages in expiry order, stopping at those expiring after `until` (if
+    // given).  Returns the number removed.
+    int remove_by_expiry(std::optional<int> limit, std::optional<std::chrono::system_clock::time_point> until);
+    // Removes the owner's messages for which `pred` is true, returning their hashes.
+    std::vector<std::string> remove_owned(
+            const user_pubkey_t& pubkey, const std::function<bool(const message&)>& pred);
+    // Brings the expiry of a message forward to `new_exp`; returns false if it already expires by
+    // then.
+    bool shorten_expiry(messages_t::iterator it, std::chrono::system_clock::time_point new_exp);
+    double fill_level() const;
+
+    const database_options options_;
+    const int64_t size_limit_;
+
+    std::shared_mutex mutex_;
+    int64_t next_id_ = 1;
+    messages_t messages_;
+    std::unordered_map<std::string, int64_t> by_hash_;
+    std::unordered_map<user_pubkey_t, std::set<int64_t>> by_owner_;
+    std::set<std::pair<std::chrono::system_clock::time_point, int64_t>> by_expiry_;
+    int64_t data_bytes_ = 0;
+    // Hash and data bytes of the stored messages
+    int64_t used_bytes_ = 0;
+
+    std::atomic<bool> evicting_ = false;
+    std::atomic<int64_t> evicted_ = 0, store_evicted_ = 0, quota_rejections_ = 0, full_rejections_ = 0;
+};
+
+} // namespace beldex
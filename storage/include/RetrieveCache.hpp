@@ -0,0 +1,130 @@
+#pragma once
+
+#include "Database.hpp"
+#include "beldex_common.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace beldex {
+
+// In-memory summary of the most recent messages of recently polled owners, so that the common
+// `retrieve` polls ("anything new since last_hash?", usually with nothing new) can be answered
+// without touching the database.  Each entry holds an owner's newest (up to) MAX_MESSAGES messages
+// in id order, and whether those are all of the owner's messages.
+//
+// Entries are filled after a database read that started after the entry was reserved (see
+// begin_fill()), and not while any of the owner's stores are in progress (see store_guard); stores
+// append to existing entries, and anything else that changes an owner's
+// messages (deletions, expiry updates) drops the entry.  Removing expired messages needs neither:
+// expired messages are never returned from the cache, and a poll from an expired message is a
+// miss.  (Thus, unlike the database without partitioning, the cache never returns expired messages
+// that haven't been removed yet.)  Entries are evicted least recently used first to stay within the memory budget.
+//
+// Thread-safe.
+class RetrieveCache {
+  public:
+    // Maximum number of messages cached per owner
+    inline static constexpr size_t MAX_MESSAGES = 8;
+
+    // Approximate memory used by an entry beyond the sizes of its message hashes and data
+    inline static constexpr size_t ENTRY_OVERHEAD = 256;
+    inline static constexpr size_t MESSAGE_OVERHEAD = 96;
+
+    explicit RetrieveCache(size_t budget) : budget_{budget} {}
+
+    // Holds off filling the entries of the owners of messages being stored, from before the
+    // store's transaction until after its stored() calls (i.e. for the guard's lifetime): a fill
+    // reading the database in between would already see the committed messages, which stored()
+    // would then add to the entry a second time.  Entries being filled when the guard is created
+    // are dropped once filled.
+    class store_guard {
+        RetrieveCache* cache_;
+        std::vector<user_pubkey_t> owners_;
+
+      public:
+        // `cache` may be null, for no cache.  `owners` may repeat.
+        store_guard(RetrieveCache* cache, std::vector<user_pubkey_t> owners);
+        ~store_guard();
+
+        store_guard(const store_guard&) = delete;
+        store_guard& operator=(const store_guard&) = delete;
+    };
+
+    // Answers a retrieve (as for Database::retrieve_each(), but never returning messages expired as
+    // of `now`) if it can.  Returns nullopt on a miss, otherwise whether more messages follow.
+    // `f` is called without any lock held.
+    std::optional<bool> retrieve(
+            const user_pubkey_t& pubkey,
+            std::string_view last_hash,
+            int max_count,
+            size_t max_size,
+            size_encoding encoding,
+            std::chrono::system_clock::time_point now,
+            const std::function<void(const message_view& msg)>& f);
+
+    // Reserves an entry for an owner that has none.  Returns 0 if the owner already has one (or one
+    // is being filled), or if some of its messages are being stored.  Otherwise the caller must then read the owner's newest messages from the
+    // database and pass them, with the returned reservation, to fill(), which fills the entry
+    // unless there were changes to the owner's messages in between.
+    uint64_t begin_fill(const user_pubkey_t& pubkey);
+
+    // Fills a reserved entry with the owner's newest messages (newest first, as read from the
+    // database: up to MAX_MESSAGES, plus one more if there are any more).
+    void fill(const user_pubkey_t& pubkey, uint64_t reservation, std::vector<message> newest);
+
+    // Releases a reservation without filling it, e.g. if reading the messages failed.
+    void cancel_fill(const user_pubkey_t& pubkey, uint64_t reservation);
+
+    // Adds a newly stored message to its owner's entry, if any (and if not already there).
+    void stored(const message& msg);
+
+    // Drops an owner's entry, after a change to its messages other than a store.
+    void invalidate(const user_pubkey_t& pubkey);
+
+    // Drops all entries, e.g. after removing unexpired messages of unknown owners.
+    void clear();
+
+    retrieve_cache_stats get_stats() const;
+
+  private:
+    struct entry {
+        enum class state_t { filling, stale, ready } state = state_t::filling;
+        uint64_t reservation = 0;
+        std::deque<std::shared_ptr<const message>> messages;  // Oldest first
+        bool complete = false;  // True if `messages` holds all of the owner's messages
+        size_t bytes = ENTRY_OVERHEAD;
+        std::list<user_pubkey_t>::iterator lru;
+    };
+
+    static size_t message_bytes(const message& m) {
+        return m.hash.size() + m.data.size() + MESSAGE_OVERHEAD;
+    }
+
+    void begin_stores(const std::vector<user_pubkey_t>& owners);
+    void end_stores(const std::vector<user_pubkey_t>& owners);
+
+    void erase(std::unordered_map<user_pubkey_t, entry>::iterator it);
+    void evict();
+
+    const size_t budget_;
+    mutable std::mutex mutex_;
+    std::unordered_map<user_pubkey_t, entry> entries_;
+    std::list<user_pubkey_t> lru_;  // Most recently used first
+    std::unordered_map<user_pubkey_t, int> storing_;  // Stores in progress, by owner
+    size_t bytes_ = 0;
+    uint64_t next_reservation_ = 1;
+    std::atomic<int64_t> hits_ = 0, empty_ = 0, misses_ = 0, evictions_ = 0;
+};
+
+} // namespace beldex
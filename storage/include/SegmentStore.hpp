@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string_view>
+#include <vector>
+
+namespace beldex {
+
+// Append-only store for message bodies kept outside of the sqlite database, in memory-mapped
+// segment files ("00000001.seg", ...) in a directory.  Each stored body is identified by a
+// locator: the segment number in the upper 32 bits and the record's offset within the segment in
+// the lower 32 bits; the database keeps the locator in place of the body.  Space used by deleted
+// bodies is only reclaimed by copying a segment's remaining bodies elsewhere and then removing the
+// segment.
+//
+// Writes (append, discard, sync, remove) must be serialized by the caller.  Readers must hold a
+// read_lock() for as long as they use views returned by read(); remove() waits for these locks so
+// that a reader holding one can still read any segment it found a locator for.
+class SegmentStore {
+  public:
+    // Size limit of a segment file; once the current segment is full a new one is started.
+    inline static constexpr uint32_t SEGMENT_SIZE = 32 * 1024 * 1024;
+
+    // Opens the store in the given directory, which is created when the first body is stored.
+    // Existing segments are opened read-only: appends always go to a new segment.
+    explicit SegmentStore(std::filesystem::path dir);
+
+    ~SegmentStore();
+
+    SegmentStore(const SegmentStore&) = delete;
+    SegmentStore& operator=(const SegmentStore&) = delete;
+
+    // Appends a body to the current segment and returns its locator.  Throws on I/O failure.
+    int64_t append(std::string_view data);
+
+    // Discards the most recently appended body, which must be the one at `locator` (e.g. because
+    // the message it was appended for turned out to be a duplicate).
+    void discard(int64_t locator);
+
+    // Flushes appended bodies to disk.  Must be called before locators of appended bodies are
+    // committed to the database so that a committed locator never refers to lost data.
+    void sync();
+
+    std::shared_lock<std::shared_mutex> read_lock() { return std::shared_lock{remove_mutex_}; }
+
+    // Returns a view of the body at `locator`, which remains valid while the caller holds a read
+    // lock.  Throws if the locator does not refer to a stored body.
+    std::string_view read(int64_t locator) const;
+
+    struct segment_info {
+        uint32_t id;
+        uint64_t size;  // Bytes of the segment used by records, including deleted ones
+    };
+
+    // Returns the segments that are no longer appended to, i.e. all but the current one.
+    std::vector<segment_info> sealed_segments() const;
+
+    // Removes a sealed segment, waiting until no reader holds a read lock.
+    void remove(uint32_t id);
+
+    // Total size of all segment records
+    uint64_t size() const { return total_size_; }
+
+    static constexpr uint32_t segment_of(int64_t locator) { return static_cast<uint64_t>(locator) >> 32; }
+    static constexpr int64_t segment_begin(uint32_t id) { return static_cast<int64_t>(uint64_t{id} << 32); }
+
+  private:
+    struct segment;
+
+    std::filesystem::path file_path(uint32_t id) const;
+
+    // Seals the current segment (if any) and starts a new one.
+    void start_segment();
+
+    const std::filesystem::path dir_;
+    std::map<uint32_t, std::unique_ptr<segment>> segments_;
+    mutable std::shared_mutex segments_mutex_;  // Protects segments_ (but not segment contents)
+    std::shared_mutex remove_mutex_;            // Held shared by readers, exclusively by remove()
+    segment* current_ = nullptr;
+    uint32_t next_id_ = 1;
+    bool dirty_ = false;
+    std::atomic<uint64_t> total_size_ = 0;
+};
+
+} // namespace beldex
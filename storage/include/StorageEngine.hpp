@@ -0,0 +1,86 @@
+#pragma once
+
+#include "Database.hpp"
+#include "beldex_common.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace beldex {
+
+// The storage behind a Database (or behind each shard of a sharded one): Database does the
+// sharding and derives its convenience methods (retrieve(), retrieve_page(), retrieve_all()), and
+// forwards everything else to its engine.  Each method has the semantics documented for the
+// Database method of the same name, which engines must follow (the storage unit tests run against
+// every engine).
+//
+// The methods after the first group are for the maintenance of on-disk databases; engines without
+// files, WAL or blob segments can leave them as the no-op defaults.
+//
+// Implementations must be thread-safe.
+class StorageEngine {
+  public:
+    virtual ~StorageEngine() = default;
+
+    virtual std::optional<bool> store(const message& msg) = 0;
+    virtual void bulk_store(const std::vector<message>& items) = 0;
+    // Like bulk_store(), but ignoring the per-owner quotas (for moving messages from another
+    // database).  Returns how many of the items are stored afterwards, whether inserted now or
+    // already present.
+    virtual size_t bulk_import(const std::vector<message>& items) = 0;
+
+    virtual bool retrieve_each(
+            const user_pubkey_t& pubkey,
+            const std::string& last_hash,
+            int max_count,
+            size_t max_size,
+            size_encoding encoding,
+            const std::function<void(const message_view& msg)>& f) = 0;
+    virtual size_t for_each(
+            const std::function<bool(std::vector<message>& batch)>& f,
+            const stream_options& opts) = 0;
+    virtual std::optional<message> retrieve_random() = 0;
+    virtual std::optional<message> retrieve_by_hash(const std::string& msg_hash) = 0;
+
+    virtual int64_t get_message_count() = 0;
+    virtual int64_t get_owner_count() = 0;
+    virtual int64_t get_data_bytes() = 0;
+    virtual int64_t get_used_bytes() = 0;
+
+    virtual void clean_expired() = 0;
+    virtual int clean_expired_chunk(int limit) = 0;
+    virtual int evict_chunk(int limit) = 0;
+    virtual double get_fill_level() = 0;
+    virtual capacity_stats get_capacity_stats() = 0;
+    virtual int64_t get_expired_estimate() = 0;
+
+    virtual std::vector<std::string> delete_all(const user_pubkey_t& pubkey) = 0;
+    virtual std::vector<std::string> delete_by_hash(
+            const user_pubkey_t& pubkey, const std::vector<std::string>& msg_hashes) = 0;
+    virtual std::vector<std::string> delete_by_timestamp(
+            const user_pubkey_t& pubkey, std::chrono::system_clock::time_point timestamp) = 0;
+    virtual std::vector<std::string> update_expiry(
+            const user_pubkey_t& pubkey,
+            const std::vector<std::string>& msg_hashes,
+            std::chrono::system_clock::time_point new_exp) = 0;
+    virtual std::vector<std::string> update_all_expiries(
+            const user_pubkey_t& pubkey, std::chrono::system_clock::time_point new_exp) = 0;
+
+    virtual hash_filter_stats get_hash_filter_stats() { return {}; }
+    virtual retrieve_cache_stats get_retrieve_cache_stats() { return {}; }
+    virtual std::map<std::string, std::string> query_plans() { return {}; }
+    virtual int64_t compact_blob_segments() { return 0; }
+    virtual checkpoint_result checkpoint(checkpoint_mode) { return {}; }
+    virtual void set_auto_checkpoint(bool) {}
+    virtual int64_t get_wal_bytes() { return 0; }
+    virtual int64_t get_freelist_pages() { return 0; }
+    virtual int64_t incremental_vacuum(int64_t) { return 0; }
+};
+
+} // namespace beldex
@@ -1,19 +1,36 @@
 #include "Database.hpp"
+#include "HashFilter.hpp"
+#include "MemoryEngine.hpp"
+#include "RetrieveCache.hpp"
+#include "SegmentStore.hpp"
 #include "SQLiteCpp/Statement.h"
 #include "SQLiteCpp/Transaction.h"
+#include "StorageEngine.hpp"
 #include "beldex_logger.h"
 #include "string_utils.hpp"
 #include "time.hpp"
 #include "utils.hpp"
 
+#include <algorithm>
+#include <array>
 #include <chrono>
+#include <condition_variable>
+#include <cstdio>
 #include <cstdlib>
 #include <exception>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <shared_mutex>
 #include <thread>
+#include <unordered_map>
 #include <unordered_set>
 
 #include <SQLiteCpp/SQLiteCpp.h>
+#include <bmq/base64.h>
+#include <bmq/hex.h>
 #include <sqlite3.h>
 
 namespace beldex {
@@ -36,6 +53,14 @@ struct blob_binder {
     explicit blob_binder(std::string_view d) : data{d} {}
 };
 
+// Binds the values of an `IN (?,?,...)` list with `slots` parameters (see IN_LIST_BUCKETS): the
+// values go into the first slots (using no-copy binding) and any remaining slots are set to NULL,
+// which never matches anything.
+struct in_list_binder {
+    const std::vector<std::string>& values;
+    size_t slots;
+};
+
 // Binds a string_view as a no-copy blob at parameter index i.
 void bind_blob_ref(SQLite::Statement& st, int i, std::string_view blob) {
     st.bindNoCopy(i, static_cast<const void*>(blob.data()), blob.size());
@@ -43,14 +68,27 @@ void bind_blob_ref(SQLite::Statement& st, int i, std::string_view blob) {
 
 // Called from exec_query and similar to bind statement parameters for immediate execution.  strings
 // (and c strings) use no-copy binding; user_pubkey_t values use *two* sequential binding slots for
-// pubkey (first) and type (second); integer values are bound by value.  You can bind a blob (by
-// reference, like strings) by passing `blob_binder{data}`.
+// pubkey (first) and type (second); integer values are bound by value, and optional<int64_t> as
+// the value or NULL.  You can bind a blob (by reference, like strings) by passing
+// `blob_binder{data}`, and the values of an IN list via `in_list_binder`.
 template <typename T>
 void bind_oneshot(SQLite::Statement& st, int& i, const T& val) {
     if constexpr (std::is_same_v<T, std::string> || is_cstr<T>)
         st.bindNoCopy(i++, val);
     else if constexpr (std::is_same_v<T, blob_binder>)
         bind_blob_ref(st, i++, val.data);
+    else if constexpr (std::is_same_v<T, std::optional<int64_t>>) {
+        if (val)
+            st.bind(i++, *val);
+        else
+            st.bind(i++);
+    }
+    else if constexpr (std::is_same_v<T, in_list_binder>) {
+        for (auto& s : val.values)
+            st.bindNoCopy(i++, s);
+        for (size_t n = val.values.size(); n < val.slots; n++)
+            st.bind(i++);
+    }
     else if constexpr (std::is_same_v<T, user_pubkey_t>) {
         bind_blob_ref(st, i++, val.raw());
         st.bind(i++, val.type());
@@ -59,13 +97,6 @@ void bind_oneshot(SQLite::Statement& st, int& i, const T& val) {
         st.bind(i++, val);
 }
 
-// Binds pubkey in a query such as `... WHERE pubkey = ? AND type = ?` into positions i (pubkey) and
-// j (type).  The user_pubkey_t reference must stay valid for the duration of the statement.
-void bind_pubkey(SQLite::Statement& st, int i, int j, const user_pubkey_t& pk) {
-    bind_blob_ref(st, i, pk.raw());
-    st.bind(j, pk.type());
-}
-
 // Executes a query that does not expect results.  Optionally binds parameters, if provided.
 // Returns the number of affected rows; throws on error or if results are returned.
 template <typename... T>
@@ -102,6 +133,14 @@ std::tuple<T1, T2, Tn...> get(SQLite::Statement& st) {
     return st.getColumns<std::tuple<T1, T2, Tn...>, 2 + sizeof...(Tn)>();
 }
 
+// Returns a view of a text or blob column value, without copying it.  The view is only valid until
+// the statement is stepped or reset.
+std::string_view column_view(const SQLite::Column& col) {
+    // getBlob() first: getBytes() is only correct after the value has been converted
+    auto* data = static_cast<const char*>(col.getBlob());
+    return {data, static_cast<size_t>(col.getBytes())};
+}
+
 // Steps a statement to completion that is expected to return at most one row, optionally binding
 // values into it (if provided).  Returns a filled out optional<T> (or optional<std::tuple<T...>>)
 // if a row was retrieved, otherwise a nullopt.  Throws if more than one row is retrieved.
@@ -146,31 +185,654 @@ std::vector<type_or_tuple<T...>> get_all(SQLite::Statement& st, const Bind&... b
     return results;
 }
 
+// Message hashes are stored in the `hash` columns as the bytes they encode: 32 bytes for the
+// (unpadded) base64 blake2b hashes, 64 for the hex sha512 hashes of older messages.  This halves
+// the size of the hash indices.  A hash not in exactly one of those forms (which would not survive
+// the round trip) is stored as given, as text.  The hash_key() and hash_text() SQL functions (see
+// DatabaseImpl::register_functions) convert hashes to and from the stored form.
+constexpr size_t HASH_KEY_SIZE = 32;
+constexpr size_t LEGACY_HASH_KEY_SIZE = 64;
+
+std::optional<std::string> hash_key(std::string_view hash) {
+    std::string key;
+    if (hash.size() == 43 && bmq::is_base64(hash)) {
+        key = bmq::from_base64(hash);
+        auto back = bmq::to_base64(key);
+        if (key.size() != HASH_KEY_SIZE || std::string_view{back}.substr(0, 43) != hash)
+            return std::nullopt;
+    } else if (hash.size() == 2 * LEGACY_HASH_KEY_SIZE && bmq::is_hex(hash)) {
+        key = bmq::from_hex(hash);
+        if (bmq::to_hex(key) != hash)
+            return std::nullopt;
+    } else
+        return std::nullopt;
+    return key;
+}
+
+std::string hash_text(std::string_view key) {
+    if (key.size() == HASH_KEY_SIZE) {
+        auto hash = bmq::to_base64(key);
+        hash.resize(43);  // Trim the padding
+        return hash;
+    }
+    if (key.size() == LEGACY_HASH_KEY_SIZE)
+        return bmq::to_hex(key);
+    return std::string{key};
+}
+
+// Statements used by DatabaseImpl, each prepared on a connection the first time it is needed and
+// then kept for reuse.  Statements are identified by their index in STATEMENTS, so that getting
+// one is just an array lookup (no hashing of the query text, locking, or allocation).  `{0}` in a
+// query stands for a message table: `messages` (the table, or in the partitioned layout the view
+// over all partitions), or one particular partition.
+enum class Stmt : unsigned {
+    expiry_histogram,
+    delete_expired,
+    delete_expired_limit,
+    evict,
+    migrate_select,
+    migrate_insert,
+    migrate_delete,
+    find_owner,
+    insert_owner,
+    all_owners,
+    hash_exists,
+    insert_message,
+    segment_blobs,
+    move_blob,
+    count_messages,
+    count_expired_messages,
+    count_owners,
+    owner_usage,
+    all_hashes,
+    page_count,
+    freelist_count,
+    all_blobs,
+    id_range,
+    partitioned_id_range,
+    message_by_id,
+    message_from_id,
+    message_by_hash,
+    owner_message_id,
+    owner_messages,
+    owner_messages_after,
+    owner_recent_messages,
+    stream_messages,
+    stream_owner_messages,
+    delete_all,
+    delete_by_hash,
+    delete_by_timestamp,
+    update_expiry,
+    update_all_expiries,
+
+    count_
+};
+
+struct statement_def {
+    Stmt id;
+    std::string_view query;
+};
+
+constexpr statement_def STATEMENTS[] = {
+    {Stmt::expiry_histogram, "SELECT expiry / ?, COUNT(*) FROM messages GROUP BY 1"},
+    // Deletions return the data size of each deleted message (see DatabaseImpl::blob_size) for
+    // the maintained data byte count.
+    {Stmt::delete_expired,
+        "DELETE FROM {0} WHERE expiry <= ?"
+        " RETURNING expiry, IFNULL(blob_size(blob), length(data)), hash_text(hash)"},
+    {Stmt::delete_expired_limit,
+        "DELETE FROM {0} WHERE id IN (SELECT id FROM {0} WHERE expiry <= ? ORDER BY expiry LIMIT ?)"
+        " RETURNING expiry, IFNULL(blob_size(blob), length(data)), hash_text(hash)"},
+    {Stmt::evict,
+        "DELETE FROM {0} WHERE id IN (SELECT id FROM {0} ORDER BY expiry LIMIT ?)"
+        " RETURNING expiry, IFNULL(blob_size(blob), length(data)), hash_text(hash)"},
+    {Stmt::migrate_select, "SELECT id, expiry FROM messages_unpartitioned ORDER BY id LIMIT ?"},
+    {Stmt::migrate_insert,
+        "INSERT INTO {0} SELECT id, hash, owner, timestamp, expiry, data, blob"
+        " FROM messages_unpartitioned WHERE id = ?"},
+    {Stmt::migrate_delete, "DELETE FROM messages_unpartitioned WHERE id <= ?"},
+    {Stmt::find_owner, "SELECT id FROM owners WHERE pubkey = ? AND type = ?"},
+    {Stmt::insert_owner, "INSERT INTO owners (pubkey, type) VALUES (?, ?) RETURNING id"},
+    {Stmt::all_owners, "SELECT id, type, pubkey FROM owners"},
+    {Stmt::hash_exists, "SELECT 1 FROM messages WHERE hash = hash_key(?)"},
+    {Stmt::insert_message,
+        "INSERT INTO {0} (id, owner, hash, timestamp, expiry, data, blob) VALUES (?, ?, hash_key(?), ?, ?, ?, ?)"
+        " ON CONFLICT DO NOTHING"},
+    {Stmt::segment_blobs, "SELECT id, blob FROM {0} WHERE blob >= ? AND blob < ?"},
+    {Stmt::move_blob, "UPDATE {0} SET blob = ? WHERE id = ?"},
+    {Stmt::count_messages,
+        "SELECT COUNT(*), IFNULL(SUM(IFNULL(blob_size(blob), length(data))), 0) FROM {0}"},
+    {Stmt::count_expired_messages, "SELECT COUNT(*) FROM messages WHERE expiry <= ?"},
+    {Stmt::count_owners, "SELECT COUNT(*) FROM owners"},
+    {Stmt::owner_usage,
+        "SELECT COUNT(*), IFNULL(SUM(IFNULL(blob_size(blob), length(data))), 0) FROM messages"
+        " WHERE owner = ? AND +expiry > ?"},
+    {Stmt::all_hashes, "SELECT hash_text(hash) FROM {0}"},
+    {Stmt::page_count, "PRAGMA page_count"},
+    {Stmt::freelist_count, "PRAGMA freelist_count"},
+    {Stmt::all_blobs, "SELECT blob FROM messages WHERE blob IS NOT NULL"},
+    // Separate subqueries so that sqlite can answer each from the rowid b-tree without a scan
+    {Stmt::id_range, "SELECT (SELECT MIN(id) FROM messages), (SELECT MAX(id) FROM messages)"},
+    {Stmt::partitioned_id_range, "SELECT IFNULL(lo, 0), IFNULL(hi, 0) FROM message_id_range"},
+    {Stmt::message_by_id,
+        "SELECT hash_text(hash), type, pubkey, timestamp, expiry, data, blob"
+        " FROM owned_messages WHERE mid = ? AND expiry > ?"},
+    {Stmt::message_from_id,
+        "SELECT hash_text(hash), type, pubkey, timestamp, expiry, data, blob"
+        " FROM owned_messages WHERE mid >= ? AND expiry > ? ORDER BY mid LIMIT 1"},
+    {Stmt::message_by_hash,
+        "SELECT hash_text(hash), type, pubkey, timestamp, expiry, data, blob"
+        " FROM owned_messages WHERE hash = hash_key(?) AND +expiry > ?"},
+    {Stmt::owner_message_id, "SELECT id FROM messages WHERE owner = ? AND hash = hash_key(?)"},
+    // (+expiry keeps sqlite from considering the expiry index for these)
+    {Stmt::owner_messages,
+        "SELECT hash_text(hash), timestamp, expiry, data, blob FROM messages"
+        " WHERE owner = ? AND +expiry > ? ORDER BY id LIMIT ?"},
+    {Stmt::owner_messages_after,
+        "SELECT hash_text(hash), timestamp, expiry, data, blob FROM messages"
+        " WHERE owner = ? AND id > ? AND +expiry > ? ORDER BY id LIMIT ?"},
+    {Stmt::owner_recent_messages,
+        "SELECT hash_text(hash), timestamp, expiry, data, blob FROM messages"
+        " WHERE owner = ? ORDER BY id DESC LIMIT ?"},
+    {Stmt::stream_messages,
+        "SELECT m.id, owners.id, type, pubkey, hash_text(hash), timestamp, expiry, data, blob"
+        " FROM {0} m JOIN owners ON m.owner = owners.id"
+        " WHERE m.id > ? AND +expiry > ? ORDER BY m.id LIMIT ?"},
+    {Stmt::stream_owner_messages,
+        "SELECT m.id, owners.id, type, pubkey, hash_text(hash), timestamp, expiry, data, blob"
+        " FROM {0} m JOIN owners ON m.owner = owners.id"
+        " WHERE m.owner = ? AND m.id > ? AND +expiry > ? ORDER BY m.id LIMIT ?"},
+    {Stmt::delete_all,
+        "DELETE FROM {0} WHERE owner = ? RETURNING hash_text(hash), IFNULL(blob_size(blob), length(data))"},
+    {Stmt::delete_by_hash,
+        "DELETE FROM {0} WHERE owner = ? AND hash = hash_key(?)"
+        " RETURNING hash_text(hash), IFNULL(blob_size(blob), length(data))"},
+    {Stmt::delete_by_timestamp,
+        "DELETE FROM {0} WHERE owner = ? AND timestamp <= ?"
+        " RETURNING hash_text(hash), IFNULL(blob_size(blob), length(data))"},
+    {Stmt::update_expiry,
+        "UPDATE {0} SET expiry = ? WHERE expiry > ? AND hash = hash_key(?) AND owner = ? RETURNING hash_text(hash)"},
+    {Stmt::update_all_expiries,
+        "UPDATE {0} SET expiry = ? WHERE expiry > ? AND owner = ? RETURNING hash_text(hash)"},
+};
+
+// Statements with a variable-length `IN (...)` list of `item`s (each with one `?`), which is
+// inserted between the prefix and the suffix.  Each is prepared with the IN_LIST_BUCKETS sizes; a list is bound into the smallest
+// bucket that fits it (see in_list_binder).
+enum class InStmt : unsigned {
+    delete_by_hashes,
+    update_expiries,
+
+    count_
+};
+
+struct in_statement_def {
+    InStmt id;
+    std::string_view prefix;
+    std::string_view item;
+    std::string_view suffix;
+};
+
+constexpr in_statement_def IN_STATEMENTS[] = {
+    {InStmt::delete_by_hashes,
+        "DELETE FROM {0} WHERE owner = ? AND hash IN (", "hash_key(?)",
+        ") RETURNING hash_text(hash), IFNULL(blob_size(blob), length(data))"},
+    {InStmt::update_expiries,
+        "UPDATE {0} SET expiry = ? WHERE expiry > ? AND owner = ? AND hash IN (", "hash_key(?)",
+        ") RETURNING hash_text(hash)"},
+};
+
+// The statements run for each client request or stored message, whose query plans
+// Database::query_plans() reports.
+constexpr std::pair<std::string_view, Stmt> HOT_STATEMENTS[] = {
+    {"find_owner", Stmt::find_owner},
+    {"hash_exists", Stmt::hash_exists},
+    {"message_by_id", Stmt::message_by_id},
+    {"message_from_id", Stmt::message_from_id},
+    {"message_by_hash", Stmt::message_by_hash},
+    {"owner_message_id", Stmt::owner_message_id},
+    {"owner_messages", Stmt::owner_messages},
+    {"owner_messages_after", Stmt::owner_messages_after},
+    {"owner_recent_messages", Stmt::owner_recent_messages},
+    {"stream_messages", Stmt::stream_messages},
+    {"stream_owner_messages", Stmt::stream_owner_messages},
+    {"delete_all", Stmt::delete_all},
+    {"delete_by_hash", Stmt::delete_by_hash},
+    {"delete_by_timestamp", Stmt::delete_by_timestamp},
+    {"update_expiry", Stmt::update_expiry},
+    {"update_all_expiries", Stmt::update_all_expiries},
+    {"delete_expired", Stmt::delete_expired},
+    {"delete_expired_limit", Stmt::delete_expired_limit},
+    {"count_expired_messages", Stmt::count_expired_messages},
+};
+constexpr std::pair<std::string_view, InStmt> HOT_IN_STATEMENTS[] = {
+    {"delete_by_hashes", InStmt::delete_by_hashes},
+    {"update_expiries", InStmt::update_expiries},
+};
+
+// IN list sizes that we prepare statements for.  Longer lists than the last bucket get a one-off
+// statement of their exact size.
+constexpr size_t IN_LIST_BUCKETS[] = {2, 4, 8, 16, 32, 64, 128, 256};
+constexpr size_t NUM_IN_LIST_BUCKETS = std::size(IN_LIST_BUCKETS);
+
+template <typename Def, size_t N>
+constexpr bool in_id_order(const Def (&defs)[N]) {
+    for (size_t i = 0; i < N; i++)
+        if (static_cast<size_t>(defs[i].id) != i)
+            return false;
+    return true;
+}
+static_assert(std::size(STATEMENTS) == static_cast<size_t>(Stmt::count_) && in_id_order(STATEMENTS),
+        "STATEMENTS must have one entry per Stmt value, in order");
+static_assert(std::size(IN_STATEMENTS) == static_cast<size_t>(InStmt::count_) && in_id_order(IN_STATEMENTS),
+        "IN_STATEMENTS must have one entry per InStmt value, in order");
+
+// Returns the index of the smallest IN list bucket with room for `count` values, or
+// NUM_IN_LIST_BUCKETS if there isn't one.
+constexpr size_t in_list_bucket(size_t count) {
+    size_t b = 0;
+    while (b < NUM_IN_LIST_BUCKETS && IN_LIST_BUCKETS[b] < count)
+        b++;
+    return b;
+}
+
+std::string in_list_query(InStmt id, size_t count) {
+    auto& def = IN_STATEMENTS[static_cast<size_t>(id)];
+    std::string query;
+    query.reserve(def.prefix.size() + (def.item.size() + 1) * count + def.suffix.size());
+    query += def.prefix;
+    for (size_t i = 0; i < count; i++) {
+        if (i > 0) query += ',';
+        query += def.item;
+    }
+    query += def.suffix;
+    return query;
+}
+
+// Statements are cached per connection in slots: the STATEMENTS first, then each IN_STATEMENTS
+// entry's buckets.
+constexpr size_t NUM_STATEMENT_SLOTS =
+    static_cast<size_t>(Stmt::count_) + static_cast<size_t>(InStmt::count_) * NUM_IN_LIST_BUCKETS;
+
+constexpr size_t statement_slot(Stmt id) { return static_cast<size_t>(id); }
+constexpr size_t statement_slot(InStmt id, size_t bucket) {
+    return static_cast<size_t>(Stmt::count_) + static_cast<size_t>(id) * NUM_IN_LIST_BUCKETS + bucket;
+}
+
+// Replaces each `{0}` in a query with the given table name.
+std::string on_table(std::string query, std::string_view table) {
+    for (auto pos = query.find("{0}"); pos != std::string::npos; pos = query.find("{0}", pos + table.size()))
+        query.replace(pos, 3, table);
+    return query;
+}
+
+// Returns the query text of a statement slot, for the given message table.
+std::string slot_query(size_t slot, std::string_view table) {
+    if (slot < static_cast<size_t>(Stmt::count_))
+        return on_table(std::string{STATEMENTS[slot].query}, table);
+    slot -= static_cast<size_t>(Stmt::count_);
+    return on_table(in_list_query(static_cast<InStmt>(slot / NUM_IN_LIST_BUCKETS),
+                IN_LIST_BUCKETS[slot % NUM_IN_LIST_BUCKETS]), table);
+}
+
+std::string partition_table(int64_t start) {
+    return "messages_" + std::to_string(start);
+}
+
+// A table holding messages: the `messages` table (or view, if partitioned) if nullopt, otherwise
+// the partition with the given start.
+using message_table = std::optional<int64_t>;
+
 } // anon. namespace
 
-class DatabaseImpl {
+/** Wrapper around a SQLite::Statement that calls `tryReset()` on destruction of the wrapper. */
+class StatementWrapper {
+    SQLite::Statement& st;
 public:
+    /// Whether we should reset on destruction; can be set to false if needed.
+    bool reset_on_destruction = true;
+
+    explicit StatementWrapper(SQLite::Statement& st) noexcept : st{st} {}
+    ~StatementWrapper() noexcept { if (reset_on_destruction) st.tryReset(); }
+    SQLite::Statement& operator*() noexcept { return st; }
+    SQLite::Statement* operator->() noexcept { return &st; }
+    operator SQLite::Statement&() noexcept { return st; }
+};
 
-    beldex::Database& parent;
+// A single sqlite connection along with the statements we have prepared on it.  Connections are
+// opened without sqlite's internal mutex: each one is only ever used by the single thread that
+// currently holds a ConnectionLease on it, and so its prepared statements are effectively
+// thread-local for the duration of the lease.
+struct Connection {
     SQLite::Database db;
+    // Prepared statements on `messages`, by statement slot
+    std::array<std::unique_ptr<SQLite::Statement>, NUM_STATEMENT_SLOTS> statements;
+    // Prepared statements on individual partitions, by statement slot and partition start
+    std::map<std::pair<size_t, int64_t>, SQLite::Statement> partition_statements;
+    // DatabaseImpl::partitions_version as of when `partition_statements` was last cleared
+    uint64_t partitions_version = 0;
+
+    Connection(const std::filesystem::path& path, int flags) :
+        db{path, flags | SQLite::OPEN_NOMUTEX, static_cast<int>(SQLite_busy_timeout.count())}
+    {}
+
+    StatementWrapper prepared_st(size_t slot, message_table table) {
+        if (!table) {
+            auto& st = statements[slot];
+            if (!st)
+                st = std::make_unique<SQLite::Statement>(db, slot_query(slot, "messages"));
+            return StatementWrapper{*st};
+        }
+        auto it = partition_statements.find({slot, *table});
+        if (it == partition_statements.end())
+            it = partition_statements.try_emplace(
+                    {slot, *table}, db, slot_query(slot, partition_table(*table))).first;
+        return StatementWrapper{it->second};
+    }
+};
+
+class DatabaseImpl {
+public:
+
+    const database_options options;
+    std::filesystem::path db_file;
+    // Database::SIZE_LIMIT, or this shard's part of it
+    const int64_t size_limit;
+
+    // The single read-write connection; all modifications go through this connection, serialized
+    // by `write_mutex`.
+    Connection writer_conn;
+    std::mutex write_mutex;
+
+    // Pool of read-only connections used for lookups.  With WAL enabled these do not block on (or
+    // get blocked by) the writer, so retrieves can proceed while a store or cleanup is running.
+    std::vector<std::unique_ptr<Connection>> readers;
+    std::vector<Connection*> idle_readers;
+    std::mutex readers_mutex;
+    std::condition_variable readers_cv;
 
     // keep track of db full errorss so we don't print them on every store
     std::atomic<int> db_full_counter = 0;
 
-    // SQLiteCpp's statements are not thread-safe, so we prepare them thread-locally when needed
-    std::unordered_map<std::thread::id, std::unordered_map<std::string, SQLite::Statement>> prepared_sts;
-    std::shared_mutex prepared_sts_mutex;
+    // Capacity management (see `database_options::evict_watermark` and the owner quotas).
+    // `evicting` is set once the fill level reaches the watermark and cleared once it is back
+    // below the target.
+    std::atomic<bool> evicting = false;
+    std::atomic<int64_t> evicted_count = 0;
+    std::atomic<int64_t> store_evicted_count = 0;
+    std::atomic<int64_t> quota_rejections = 0;
+    std::atomic<int64_t> full_rejections = 0;
+
+    // Rough in-memory histogram of message expiries, in EXPIRY_BUCKET-sized buckets keyed by
+    // bucket start (in epoch ms), used to estimate how many messages have expired without querying
+    // the database.  Stores add to it and expiry cleanups remove from it; other deletions and
+    // expiry updates aren't tracked, so it can overestimate, but it gets corrected each time a
+    // cleanup runs out of expired messages to remove.
+    static constexpr int64_t EXPIRY_BUCKET = 60'000;
+    std::map<int64_t, int64_t> expiry_buckets;
+    std::mutex expiry_buckets_mutex;
+
+    // Group commit for store(): each store() call queues itself here, and the first one to find
+    // no batch in progress becomes the batch "leader": it waits (up to the configured window) for
+    // other stores to join, then commits the whole queue in one transaction while later arrivals
+    // queue up for the next batch.
+    struct pending_store {
+        const message& msg;
+        std::optional<bool> result;
+        std::exception_ptr error;
+        bool done = false;
+    };
+    std::mutex store_mutex;
+    std::condition_variable store_joined;    // Signalled when a store is queued
+    std::condition_variable store_committed; // Signalled when a batch has been committed
+    std::vector<pending_store*> store_queue;
+    bool store_leader = false;
+
+    // Cache of owner ids by pubkey.  Entries are only ever added for owners known to be committed,
+    // and are removed when the owner row is deleted (typically by the owner_autoclean trigger once
+    // the owner's last message goes away).  The generation is bumped on each such removal so that a
+    // lookup that raced with the deletion doesn't put the stale id back.
+    std::unordered_map<user_pubkey_t, int64_t> owner_cache;
+    std::unordered_map<int64_t, const user_pubkey_t*> owner_cache_ids; // points into owner_cache
+    uint64_t owner_cache_generation = 0;
+    std::shared_mutex owner_cache_mutex;
+
+    // Owner rows deleted and inserted by the current writer, applied to the owner cache when the
+    // writer lease is released (or, for inserts, discarded if the transaction is rolled back).
+    // Only accessed while holding `write_mutex`.
+    std::vector<int64_t> deleted_owners;
+    std::vector<std::pair<user_pubkey_t, int64_t>> inserted_owners;
+
+    // Maintained counts of stored messages, owners, and message data bytes, so that reading them
+    // doesn't need a scan.  Writers accumulate their changes in `pending_counts` (only accessed
+    // while holding `write_mutex`), which get added to the counts when the writer lease is
+    // released, or dropped if the transaction is rolled back.  The counts start out as just the
+    // changes made since startup: reconcile() (running in `reconciler`) adds in what was already
+    // stored, after which `counts_reconciled` is set.
+    struct counts {
+        int64_t messages = 0;
+        int64_t owners = 0;
+        int64_t bytes = 0;
+    };
+    std::atomic<int64_t> message_count = 0;
+    std::atomic<int64_t> owner_count = 0;
+    std::atomic<int64_t> data_bytes = 0;
+    counts pending_counts;
+    std::atomic<bool> counts_reconciled = false;
+    std::mutex counts_mutex;
+    std::condition_variable counts_cv;
+    std::thread reconciler;
+
+    // Approximate set of the stored message hashes (if `options.hash_filter` is set), so that
+    // storing a message we already have can usually be detected with a read-only lookup rather
+    // than a write.  It gets built from the database by reconcile() in the background; until it
+    // is ready the filter is not used, and the changes made after reconcile()'s snapshot are
+    // logged in `hash_filter_log` to be applied once it is built.
+    HashFilter hash_filter;
+    std::optional<std::vector<std::pair<bool, std::string>>> hash_filter_log; // (added?, hash)
+    std::atomic<bool> hash_filter_ready = false;
+    std::shared_mutex hash_filter_mutex;
+    std::atomic<int64_t> filter_lookups = 0;
+    std::atomic<int64_t> filter_hits = 0;
+    std::atomic<int64_t> filter_duplicates = 0;
+    // Hash filter changes (added?, hash) of the current write, applied or dropped like
+    // `pending_counts`.
+    std::vector<std::pair<bool, std::string>> pending_hashes;
+
+    // Recent messages of recently polled owners, for answering retrieves without the database (see
+    // `database_options::retrieve_cache_size`); null if disabled.
+    std::unique_ptr<RetrieveCache> retrieve_cache = options.retrieve_cache_size > 0
+        ? std::make_unique<RetrieveCache>(options.retrieve_cache_size) : nullptr;
 
     int page_size;
 
-    DatabaseImpl(Database& parent, const std::filesystem::path& db_path) :
-        parent{parent},
-        db{
-            db_path / std::filesystem::u8path("storage.db"),
-            SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE | SQLite::OPEN_FULLMUTEX,
-            SQLite_busy_timeout.count()
+    // Connection used only for WAL checkpoints (see Database::checkpoint()), so that they neither
+    // hold up nor wait for the writer lease.  It waits only briefly for other connections:
+    // checkpoints that can't complete are just retried later.
+    static constexpr auto CHECKPOINT_BUSY_TIMEOUT = 100ms;
+    std::unique_ptr<SQLite::Database> checkpoint_conn;
+    std::mutex checkpoint_mutex;
+
+    // True if the database has incremental auto-vacuum (which databases created since it was
+    // introduced have), i.e. if incremental_vacuum() can return free pages to the filesystem.
+    bool incremental_vacuum = false;
+
+    // Out-of-line message bodies, for messages whose `blob` column is set; new messages are only
+    // stored here if `options.blob_segments` is enabled.
+    SegmentStore blobs;
+
+    // Time-partitioned layout (see `database_options::partitioned`): messages are stored in one
+    // table per expiry range, "messages_<start>", holding messages whose expiry when stored was in
+    // [start, end).  The ranges are listed in the `partitions` table, and `messages` is a view over
+    // all of them.  Since expiries can only ever be shortened, everything in a partition has
+    // expired once its end has passed, and it can be dropped as a whole; until then its expired
+    // messages remain, so reads filter them out.
+    bool partitioned = false;
+    // The writer's view of the partitions ([start, end) ranges, sorted); only accessed while
+    // holding `write_mutex`.  Reloaded from the database if a transaction that changed it is
+    // rolled back.
+    std::vector<std::pair<int64_t, int64_t>> partitions;
+    bool partitions_changed = false;
+    bool partitions_stale = false;
+    // The partitions as of the last committed change, for readers.  The version is bumped when
+    // partitions are dropped so that connections drop their statements for removed tables.
+    std::vector<std::pair<int64_t, int64_t>> committed_partitions;
+    std::shared_mutex partitions_mutex;
+    std::atomic<uint64_t> partitions_version = 0;
+    // Message ids are allocated by us (rather than sqlite) in the partitioned layout so that they
+    // are unique across partitions.
+    int64_t next_message_id = 1;
+
+    /** Scoped, exclusive use of one of our connections: either the writer (in which case the
+     * lease holds `write_mutex` for its lifetime) or one of the pooled read-only connections (which
+     * is returned to the pool when the lease is destroyed).  A thread must not hold more than one
+     * reader lease at a time, and statements obtained from a lease must not outlive it.
+     */
+    class ConnectionLease {
+        DatabaseImpl& impl;
+        Connection& conn;
+        std::unique_lock<std::mutex> write_lock;
+        // Held by readers so that a blob segment can't be removed while we might still read it
+        std::shared_lock<std::shared_mutex> blobs_lock;
+    public:
+        ConnectionLease(DatabaseImpl& impl, Connection& conn, std::unique_lock<std::mutex> write_lock = {}) :
+            impl{impl}, conn{conn}, write_lock{std::move(write_lock)} {
+            if (!this->write_lock)
+                blobs_lock = impl.blobs.read_lock();
+        }
+        ConnectionLease(const ConnectionLease&) = delete;
+        ConnectionLease& operator=(const ConnectionLease&) = delete;
+        ~ConnectionLease() {
+            if (write_lock)
+                impl.release_writer();
+            else
+                impl.release_reader(conn);
+        }
+
+        SQLite::Database& db() { return conn.db; }
+
+        bool is_writer() const { return static_cast<bool>(write_lock); }
+
+        // Returns one of the STATEMENTS, on the given message table if it has a `{0}` table.
+        StatementWrapper prepared_st(Stmt id, message_table table = std::nullopt) {
+            return conn.prepared_st(statement_slot(id), table);
+        }
+
+        // Returns an IN_STATEMENTS statement prepared with the given IN_LIST_BUCKETS bucket.
+        StatementWrapper prepared_st(InStmt id, size_t bucket, message_table table = std::nullopt) {
+            return conn.prepared_st(statement_slot(id, bucket), table);
+        }
+
+        template <typename... T>
+        int prepared_exec(Stmt id, const T&... bind) {
+            return exec_query(prepared_st(id), bind...);
+        }
+
+        template <typename... T, typename... Bind>
+        auto prepared_get(Stmt id, const Bind&... bind) {
+            return exec_and_get<T...>(prepared_st(id), bind...);
+        }
+    };
+
+    // Obtains exclusive use of the writer connection, blocking until any other writer is done.
+    ConnectionLease writer() {
+        return ConnectionLease{*this, writer_conn, std::unique_lock{write_mutex}};
+    }
+
+    // Obtains a read-only connection from the pool, blocking until one is available.  Reads made
+    // through it see the last committed state of the database.
+    ConnectionLease reader() {
+        std::unique_lock lock{readers_mutex};
+        readers_cv.wait(lock, [this] { return !idle_readers.empty(); });
+        auto* conn = idle_readers.back();
+        idle_readers.pop_back();
+        if (auto version = partitions_version.load(); conn->partitions_version != version) {
+            conn->partition_statements.clear();
+            conn->partitions_version = version;
+        }
+        return ConnectionLease{*this, *conn};
+    }
+
+    // Called (with `write_mutex` still held) when a writer lease ends to update the owner cache for
+    // owners that the writer added or removed, and to publish partition changes.
+    void release_writer() {
+        if (partitions_changed) {
+            try {
+                if (partitions_stale)
+                    load_partitions();
+                publish_partitions();
+            } catch (const std::exception& e) {
+                BELDEX_LOG(critical, "Failed to reload message partitions: {}", e.what());
+            }
+        }
+        if (pending_counts.messages || pending_counts.owners || pending_counts.bytes) {
+            message_count += pending_counts.messages;
+            owner_count += pending_counts.owners;
+            data_bytes += pending_counts.bytes;
+            pending_counts = {};
+        }
+        if (!pending_hashes.empty())
+            apply_pending_hashes();
+        if (deleted_owners.empty() && inserted_owners.empty())
+            return;
+        if (options.owner_cache_size > 0) {
+            std::unique_lock lock{owner_cache_mutex};
+            for (auto id : deleted_owners) {
+                if (auto it = owner_cache_ids.find(id); it != owner_cache_ids.end()) {
+                    owner_cache.erase(*it->second);
+                    owner_cache_ids.erase(it);
+                }
+            }
+            if (!deleted_owners.empty())
+                owner_cache_generation++;
+            for (auto& [pubkey, id] : inserted_owners)
+                cache_owner(pubkey, id);
+        }
+        deleted_owners.clear();
+        inserted_owners.clear();
+    }
+
+    // Must be called with a unique lock on `owner_cache_mutex`.
+    void cache_owner(const user_pubkey_t& pubkey, int64_t id) {
+        if (owner_cache.size() >= options.owner_cache_size) {
+            owner_cache.clear();
+            owner_cache_ids.clear();
         }
+        auto [it, inserted] = owner_cache.try_emplace(pubkey, id);
+        if (!inserted) {
+            if (it->second == id)
+                return;
+            owner_cache_ids.erase(it->second);
+            it->second = id;
+        }
+        owner_cache_ids.insert_or_assign(id, &it->first);
+    }
+
+    void release_reader(Connection& conn) {
+        {
+            std::lock_guard lock{readers_mutex};
+            idle_readers.push_back(&conn);
+        }
+        readers_cv.notify_one();
+    }
+
+    DatabaseImpl(
+            const std::filesystem::path& db_file,
+            const std::filesystem::path& blobs_dir,
+            const database_options& opts,
+            int64_t size_limit) :
+        options{opts},
+        db_file{db_file},
+        size_limit{size_limit},
+        writer_conn{db_file, SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE},
+        blobs{blobs_dir}
     {
+        auto& db = writer_conn.db;
+
+        // This only takes effect in a new database (and must come before anything, including the
+        // journal mode, is written to it): converting an existing one would need a full VACUUM.
+        db.exec("PRAGMA auto_vacuum = INCREMENTAL");
+
         // Don't fail on these because we can still work even if they fail
         if (int rc = db.tryExec("PRAGMA journal_mode = WAL");
                 rc != SQLITE_OK)
@@ -182,422 +844,2325 @@ public:
 
         page_size = db.execAndGet("PRAGMA page_size").getInt();
         // Would use a placeholder here, but sqlite3 apparently doesn't support them for PRAGMAs.
-        if (int rc = db.tryExec("PRAGMA max_page_count = " + std::to_string(Database::SIZE_LIMIT / page_size));
+        if (int rc = db.tryExec("PRAGMA max_page_count = " + std::to_string(size_limit / page_size));
                 rc != SQLITE_OK) {
             auto m = fmt::format("Failed to set max page count: {}", sqlite3_errstr(rc));
             BELDEX_LOG(critical, m);
             throw std::runtime_error{m};
         }
 
-        if (!db.tableExists("owners")) {
+        // Track owner rows deleted (including by triggers) and owners inserted in transactions that
+        // then get rolled back, for the owner cache and the owner count.
+        sqlite3_update_hook(db.getHandle(),
+                [](void* self, int op, const char*, const char* table, sqlite3_int64 rowid) {
+                    if (std::string_view{table} != "owners")
+                        return;
+                    auto& impl = *static_cast<DatabaseImpl*>(self);
+                    if (op == SQLITE_DELETE) {
+                        impl.deleted_owners.push_back(rowid);
+                        impl.pending_counts.owners--;
+                    } else if (op == SQLITE_INSERT)
+                        impl.pending_counts.owners++;
+                }, this);
+        sqlite3_rollback_hook(db.getHandle(),
+                [](void* self) {
+                    auto& impl = *static_cast<DatabaseImpl*>(self);
+                    impl.inserted_owners.clear();
+                    impl.pending_counts = {};
+                    impl.pending_hashes.clear();
+                    if (impl.partitions_changed)
+                        impl.partitions_stale = true;
+                }, this);
+        register_functions(db);
+
+        if (!db.tableExists("owners"))
             create_schema();
+        else
+            migrate_schema();
+
+        partitioned = db.tableExists("partitions");
+        if (!partitioned && options.partitioned)
+            start_partitioning();
+        else if (partitioned && !options.partitioned)
+            BELDEX_LOG(warn, "Database uses the partitioned layout; it cannot be changed back");
+        if (partitioned) {
+            load_partitions();
+            publish_partitions();
+            if (db.tableExists("messages_unpartitioned"))
+                migrate_to_partitions();
+            next_message_id = 1 + db.execAndGet("SELECT IFNULL(MAX(hi), 0) FROM message_id_range").getInt64();
+        }
+
+        // Open the readers only once the schema exists: a read-only connection can't create it.
+        auto reader_count = std::clamp(std::thread::hardware_concurrency(), 2u, Database::MAX_READERS);
+        for (unsigned i = 0; i < reader_count; i++) {
+            auto& conn = readers.emplace_back(std::make_unique<Connection>(db_file, SQLite::OPEN_READONLY));
+            register_functions(conn->db);
+            idle_readers.push_back(conn.get());
         }
+        BELDEX_LOG(debug, "Opened {} read-only database connections", reader_count);
+
+        checkpoint_conn = std::make_unique<SQLite::Database>(db_file, SQLite::OPEN_READWRITE | SQLite::OPEN_NOMUTEX,
+                static_cast<int>(CHECKPOINT_BUSY_TIMEOUT.count()));
+        // Checkpoints do nothing until the connection has read the database and found it in WAL mode
+        checkpoint_conn->execAndGet("SELECT COUNT(*) FROM sqlite_master");
+        incremental_vacuum = db.execAndGet("PRAGMA auto_vacuum").getInt() == 2;
+        if (!incremental_vacuum)
+            BELDEX_LOG(info, "Database does not have incremental auto-vacuum; free pages will be reused but not released");
     }
 
-    void create_schema() {
+    ~DatabaseImpl() {
+        if (reconciler.joinable())
+            reconciler.join();
+    }
 
-        SQLite::Transaction transaction{db};
+    // Registers our SQL functions on a connection: blob_size(locator) returns the size of the
+    // message body at `locator` in the blob segments, or NULL if given NULL.
+    void register_functions(SQLite::Database& db) {
+        int rc = sqlite3_create_function_v2(db.getHandle(), "blob_size", 1, SQLITE_UTF8, this,
+                [](sqlite3_context* ctx, int, sqlite3_value** args) {
+                    if (sqlite3_value_type(args[0]) == SQLITE_NULL)
+                        return sqlite3_result_null(ctx);
+                    auto& impl = *static_cast<DatabaseImpl*>(sqlite3_user_data(ctx));
+                    int64_t size = 0;
+                    try {
+                        size = impl.blobs.read(sqlite3_value_int64(args[0])).size();
+                    } catch (const std::exception& e) {
+                        // Don't fail (e.g. the deletion of) the message over this: it just doesn't
+                        // count towards the data size.
+                        BELDEX_LOG(warn, "Failed to get message data size: {}", e.what());
+                    }
+                    sqlite3_result_int64(ctx, size);
+                }, nullptr, nullptr, nullptr);
+        // hash_key(hash) and hash_text(key) convert a message hash to and from the form stored in
+        // the hash columns (see ::hash_key).
+        if (rc == SQLITE_OK)
+            rc = sqlite3_create_function_v2(db.getHandle(), "hash_key", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                    nullptr, [](sqlite3_context* ctx, int, sqlite3_value** args) {
+                        if (sqlite3_value_type(args[0]) == SQLITE_TEXT) {
+                            std::string_view hash{
+                                reinterpret_cast<const char*>(sqlite3_value_text(args[0])),
+                                static_cast<size_t>(sqlite3_value_bytes(args[0]))};
+                            if (auto key = beldex::hash_key(hash))
+                                return sqlite3_result_blob(ctx, key->data(), key->size(), SQLITE_TRANSIENT);
+                        }
+                        sqlite3_result_value(ctx, args[0]);
+                    }, nullptr, nullptr, nullptr);
+        if (rc == SQLITE_OK)
+            rc = sqlite3_create_function_v2(db.getHandle(), "hash_text", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                    nullptr, [](sqlite3_context* ctx, int, sqlite3_value** args) {
+                        if (sqlite3_value_type(args[0]) != SQLITE_BLOB)
+                            return sqlite3_result_value(ctx, args[0]);
+                        auto hash = beldex::hash_text({
+                                static_cast<const char*>(sqlite3_value_blob(args[0])),
+                                static_cast<size_t>(sqlite3_value_bytes(args[0]))});
+                        sqlite3_result_text(ctx, hash.data(), hash.size(), SQLITE_TRANSIENT);
+                    }, nullptr, nullptr, nullptr);
+        if (rc != SQLITE_OK)
+            throw std::runtime_error{fmt::format("Failed to register sql functions: {}", sqlite3_errstr(rc))};
+    }
 
-        db.exec(R"(
-CREATE TABLE owners (
-    id INTEGER PRIMARY KEY,
-    type INTEGER NOT NULL,
-    pubkey BLOB NOT NULL,
+    // Adds the messages, owners and data bytes that were stored before startup to the maintained
+    // counts (then setting `counts_reconciled`), and builds the hash filter.  This has to go
+    // through the whole database, so Database starts it in the background.
+    void reconcile() {
+        try {
+            auto conn = reader();
+            SQLite::Transaction t{conn.db()};
+            counts base;
+            {
+                // Start our read transaction while no write is in progress, so that the changes
+                // already in the counts (or pending to be) are exactly those our snapshot sees,
+                // and the hash filter changes logged from here on are exactly those it doesn't.
+                auto writer_lock = writer();
+                conn.db().exec("SELECT COUNT(*) FROM sqlite_master");
+                base.messages = message_count + pending_counts.messages;
+                base.owners = owner_count + pending_counts.owners;
+                base.bytes = data_bytes + pending_counts.bytes;
+                if (options.hash_filter) {
+                    std::unique_lock lock{hash_filter_mutex};
+                    hash_filter_log.emplace();
+                }
+            }
+            auto [messages, bytes] = conn.prepared_get<int64_t, int64_t>(Stmt::count_messages);
+            auto owners = conn.prepared_get<int64_t>(Stmt::count_owners);
+            message_count += messages - base.messages;
+            owner_count += owners - base.owners;
+            data_bytes += bytes - base.bytes;
+            BELDEX_LOG(debug, "Counted {} stored messages ({} bytes) for {} owners", messages, bytes, owners);
+            {
+                std::lock_guard lock{counts_mutex};
+                counts_reconciled = true;
+            }
+            counts_cv.notify_all();
+
+            if (options.hash_filter) {
+                HashFilter filter{static_cast<size_t>(messages)};
+                auto st = conn.prepared_st(Stmt::all_hashes);
+                while (st->executeStep())
+                    filter.insert(st->getColumn(0).getText());
+                std::unique_lock lock{hash_filter_mutex};
+                for (auto& [added, hash] : *hash_filter_log) {
+                    if (added)
+                        filter.insert(hash);
+                    else
+                        filter.erase(hash);
+                }
+                hash_filter_log.reset();
+                hash_filter = std::move(filter);
+                hash_filter_ready = true;
+                BELDEX_LOG(debug, "Built message hash filter ({} bytes)", hash_filter.memory_usage());
+            }
+            t.commit();
+        } catch (const std::exception& e) {
+            BELDEX_LOG(err, "Failed to scan stored messages: {}", e.what());
+            std::unique_lock lock{hash_filter_mutex};
+            hash_filter_log.reset();
+        }
+        if (!counts_reconciled) {
+            {
+                std::lock_guard lock{counts_mutex};
+                counts_reconciled = true;
+            }
+            counts_cv.notify_all();
+        }
+    }
 
-    UNIQUE(pubkey, type)
-);
+    // Applies the writer's `pending_hashes` to the hash filter (or its log, while it is being
+    // built).  Called when the writer is released.
+    void apply_pending_hashes() {
+        std::unique_lock lock{hash_filter_mutex};
+        if (hash_filter_log) {
+            std::move(pending_hashes.begin(), pending_hashes.end(), std::back_inserter(*hash_filter_log));
+        } else if (hash_filter_ready) {
+            for (auto& [added, hash] : pending_hashes) {
+                if (added)
+                    hash_filter.insert(hash);
+                else
+                    hash_filter.erase(hash);
+            }
+        }
+        pending_hashes.clear();
+    }
 
-CREATE TABLE messages (
-    id INTEGER PRIMARY KEY,
-    hash TEXT NOT NULL,
-    owner INTEGER NOT NULL REFERENCES owners(id),
-    timestamp INTEGER NOT NULL,
-    expiry INTEGER NOT NULL,
-    data BLOB NOT NULL,
+    // Records a hash filter change to make once the current write is released (if the filter is
+    // enabled).  Must be called with the writer.
+    void pending_hash(bool added, std::string hash) {
+        if (options.hash_filter)
+            pending_hashes.emplace_back(added, std::move(hash));
+    }
 
-    UNIQUE(hash)
-);
+    // Returns true if a message with the given hash might already be stored according to the hash
+    // filter, i.e. if it is worth checking for with is_stored() before storing it.
+    bool maybe_stored(const std::string& hash) {
+        if (!hash_filter_ready)
+            return false;
+        filter_lookups++;
+        std::shared_lock lock{hash_filter_mutex};
+        if (!hash_filter.contains(hash))
+            return false;
+        filter_hits++;
+        return true;
+    }
 
-CREATE INDEX messages_expiry ON messages(expiry);
-CREATE INDEX messages_owner ON messages(owner, timestamp);
+    // Looks up whether a message with the given hash is stored (for a hash filter hit).
+    bool is_stored(ConnectionLease& conn, const std::string& hash) {
+        auto st = conn.prepared_st(Stmt::hash_exists);
+        if (!exec_and_maybe_get<int>(st, hash))
+            return false;
+        filter_duplicates++;
+        return true;
+    }
 
-CREATE TRIGGER owner_autoclean
-    AFTER DELETE ON messages FOR EACH ROW WHEN NOT EXISTS (SELECT * FROM messages WHERE owner = old.owner)
-    BEGIN
-        DELETE FROM owners WHERE id = old.owner;
-    END;
+    // Returns which of the given messages are already stored, as far as maybe_stored() and
+    // is_stored() can tell (i.e. a false may still turn out to be a duplicate).
+    std::vector<bool> find_stored(const std::vector<message>& msgs) {
+        std::vector<bool> stored(msgs.size(), false);
+        std::vector<size_t> check;
+        for (size_t i = 0; i < msgs.size(); i++)
+            if (maybe_stored(msgs[i].hash))
+                check.push_back(i);
+        if (!check.empty()) {
+            auto conn = reader();
+            for (auto i : check)
+                stored[i] = is_stored(conn, msgs[i].hash);
+        }
+        return stored;
+    }
 
-CREATE VIEW owned_messages AS
-    SELECT owners.id AS oid, type, pubkey, messages.id AS mid, hash, timestamp, expiry, data
-    FROM messages JOIN owners ON messages.owner = owners.id;
+    // Waits (if needed) for reconcile() to update the counts, after which they are up to date.
+    void wait_for_counts() {
+        if (counts_reconciled)
+            return;
+        std::unique_lock lock{counts_mutex};
+        counts_cv.wait(lock, [this] { return counts_reconciled.load(); });
+    }
 
-CREATE TRIGGER owned_messages_insert
-    INSTEAD OF INSERT ON owned_messages FOR EACH ROW WHEN NEW.oid IS NULL
-    BEGIN
-        INSERT INTO owners (type, pubkey) VALUES (NEW.type, NEW.pubkey) ON CONFLICT DO NOTHING;
-        INSERT INTO messages values (
-            NEW.mid,
-            NEW.hash,
-            (SELECT id FROM owners WHERE type = NEW.type AND pubkey = NEW.pubkey),
-            NEW.timestamp,
-            NEW.expiry,
-            NEW.data);
-    END;
+    void load_expiry_estimate() {
+        auto conn = reader();
+        auto st = conn.prepared_st(Stmt::expiry_histogram);
+        auto buckets = get_all<int64_t, int64_t>(st, EXPIRY_BUCKET);
+        std::lock_guard lock{expiry_buckets_mutex};
+        expiry_buckets.clear();
+        for (auto& [bucket, count] : buckets)
+            expiry_buckets.emplace_hint(expiry_buckets.end(), bucket * EXPIRY_BUCKET, count);
+    }
 
-        )");
+    void add_expiries(const std::vector<int64_t>& expiries) {
+        std::lock_guard lock{expiry_buckets_mutex};
+        for (auto e : expiries)
+            expiry_buckets[e - e % EXPIRY_BUCKET]++;
+    }
 
-        if (db.tableExists("Data")) {
-            BELDEX_LOG(warn, "Old database schema detected; performing migration...");
+    // Updates the expiry estimate after an expiry cleanup at `now` removed messages with the given
+    // expiries.  If `exhausted` is true then the cleanup removed everything that had expired, so
+    // any counts left in buckets that ended before `now` are stale and get dropped.
+    void remove_expiries(const std::vector<int64_t>& expiries, int64_t now, bool exhausted) {
+        std::lock_guard lock{expiry_buckets_mutex};
+        for (auto e : expiries)
+            if (auto it = expiry_buckets.find(e - e % EXPIRY_BUCKET); it != expiry_buckets.end())
+                if (--it->second <= 0)
+                    expiry_buckets.erase(it);
+        if (exhausted)
+            expiry_buckets.erase(expiry_buckets.begin(),
+                    expiry_buckets.upper_bound(now - EXPIRY_BUCKET));
+    }
 
-            // Migratation from old table structure:
-            //
-            // CREATE TABLE Data(
-            //    Hash VARCHAR(128) NOT NULL,
-            //    Owner VARCHAR(256) NOT NULL,
-            //    TTL INTEGER NOT NULL,
-            //    Timestamp INTEGER NOT NULL,
-            //    TimeExpires INTEGER NOT NULL,
-            //    Nonce VARCHAR(128) NOT NULL,
-            //    Data BLOB
-            // );
+    int64_t expired_estimate(int64_t now) {
+        std::lock_guard lock{expiry_buckets_mutex};
+        int64_t expired = 0;
+        for (auto& [start, count] : expiry_buckets) {
+            if (start > now)
+                break;
+            if (start + EXPIRY_BUCKET <= now)
+                expired += count;
+            else // Partially expired bucket: assume its expiries are evenly spread
+                expired += count * (now - start) / EXPIRY_BUCKET;
+        }
+        return expired;
+    }
 
-            SQLite::Statement ins_owner{db, "INSERT INTO owners (type, pubkey) VALUES (?, ?) RETURNING id"};
+    // Deletes expired messages (up to `limit`, if given) and updates the expiry estimate.  Returns
+    // the number of messages deleted.
+    int delete_expired(std::optional<int> limit) {
+        if (partitioned)
+            return delete_expired_partitions(limit);
+        auto now = to_epoch_ms(std::chrono::system_clock::now());
+        std::vector<int64_t> expiries;
+        {
+            auto conn = writer();
+            auto st = conn.prepared_st(limit ? Stmt::delete_expired_limit : Stmt::delete_expired);
+            expiries = count_deleted(limit ? get_all<int64_t, int64_t, std::string>(st, now, *limit)
+                                           : get_all<int64_t, int64_t, std::string>(st, now));
+        }
+        int deleted = expiries.size();
+        remove_expiries(expiries, now, !limit || deleted < *limit);
+        return deleted;
+    }
 
-            std::unordered_map<std::string, int> owner_ids;
-            SQLite::Statement old_owners{db, "SELECT DISTINCT Owner FROM Data"};
-            while (old_owners.executeStep()) {
-                int type;
-                std::array<char, 32> pubkey;
-                std::string old_owner = old_owners.getColumn(0);
-                if (old_owner.size() == 66 && util::starts_with(old_owner, "05") && bmq::is_hex(old_owner)) {
-                    type = 5;
-                    bmq::from_hex(old_owner.begin() + 2, old_owner.end(), pubkey.begin());
-                } else if (old_owner.size() == 64 && bmq::is_hex(old_owner)) {
-                    type = 0;
-                    bmq::from_hex(old_owner.begin(), old_owner.end(), pubkey.begin());
-                } else {
-                    BELDEX_LOG(warn, "Found invalid owner pubkey '{}' during migration; ignoring");
-                    continue;
-                }
+    // Takes the rows returned by a message deletion, i.e. some value (such as the hash), the data
+    // size and (unless the value is the hash) the hash of each deleted message, and returns just
+    // the values after subtracting the messages from the pending counts and hash filter.
+    template <typename T, typename... Hash>
+    std::vector<T> count_deleted(std::vector<std::tuple<T, int64_t, Hash...>> rows) {
+        std::vector<T> values;
+        values.reserve(rows.size());
+        for (auto& row : rows) {
+            pending_hash(false, std::get<std::string>(row));
+            pending_counts.bytes -= std::get<1>(row);
+            values.push_back(std::move(std::get<0>(row)));
+        }
+        pending_counts.messages -= rows.size();
+        return values;
+    }
 
-                int id = exec_and_get<int>(ins_owner, type, old_owner);
-                ins_owner.reset();
-                owner_ids.emplace(std::move(old_owner), id);
+    // Partitioned layout version of delete_expired(): drops partitions that have entirely expired,
+    // then deletes any expired messages in partitions that haven't started yet (which can only be
+    // messages that had their expiry shortened).  Expired messages in the current partition are
+    // left for when it gets dropped.  `limit` only applies to the latter deletions.
+    int delete_expired_partitions(std::optional<int> limit) {
+        auto now = to_epoch_ms(std::chrono::system_clock::now());
+        int deleted = 0;
+        std::vector<int64_t> expiries;
+        bool exhausted = true;
+        {
+            auto conn = writer();
+            auto& db = conn.db();
+            SQLite::Transaction t{db};
+            bool dropped = false;
+            while (!partitions.empty() && partitions.front().second <= now) {
+                auto start = partitions.front().first;
+                auto st = conn.prepared_st(Stmt::count_messages, start);
+                auto [count, bytes] = exec_and_get<int64_t, int64_t>(st);
+                deleted += count;
+                pending_counts.messages -= count;
+                pending_counts.bytes -= bytes;
+                if (options.hash_filter) {
+                    auto hashes = conn.prepared_st(Stmt::all_hashes, start);
+                    while (hashes->executeStep())
+                        pending_hash(false, hashes->getColumn(0).getString());
+                }
+                db.exec("DROP TABLE " + partition_table(start));
+                exec_query(db, "DELETE FROM partitions WHERE start = ?", start);
+                partitions.erase(partitions.begin());
+                partitions_changed = dropped = true;
+            }
+            if (dropped) {
+                create_partition_views();
+                // Without the owner_autoclean trigger owners have to be cleaned up separately
+                db.exec("DELETE FROM owners WHERE NOT EXISTS (SELECT * FROM messages WHERE owner = owners.id)");
             }
 
-            BELDEX_LOG(warn, "Migrated {} owner pubkeys.  Migrating messages...", owner_ids.size());
-
-            SQLite::Statement ins_msg{db,
-                "INSERT INTO messages (hash, owner, timestamp, expiry, data) VALUES (?, ?, ?, ?, ?)"};
-
-            SQLite::Statement sel_msgs{db,
-                "SELECT Hash, Owner, Timestamp, TimeExpires, Data FROM Data ORDER BY rowid"};
-            int msgs = 0, bad_owners = 0;
-            while (sel_msgs.executeStep()) {
-                auto [hash, owner, ts, exp, data] = get<const char*, const char*, int64_t, int64_t, std::string>(sel_msgs);
-                auto it = owner_ids.find(owner);
-                if (it == owner_ids.end()) {
-                    bad_owners++;
+            for (auto& [start, end] : partitions) {
+                if (start <= now)
                     continue;
+                if (limit && static_cast<int>(expiries.size()) >= *limit) {
+                    exhausted = false;
+                    break;
                 }
-                exec_query(ins_msg, hash, it->second, ts, exp, data);
-                ins_msg.reset();
-                msgs++;
+                auto st = conn.prepared_st(limit ? Stmt::delete_expired_limit : Stmt::delete_expired, start);
+                auto removed = count_deleted(limit
+                    ? get_all<int64_t, int64_t, std::string>(st, now, *limit - static_cast<int>(expiries.size()))
+                    : get_all<int64_t, int64_t, std::string>(st, now));
+                expiries.insert(expiries.end(), removed.begin(), removed.end());
             }
+            t.commit();
+        }
+        deleted += expiries.size();
+        remove_expiries(expiries, expiry_horizon(now), exhausted);
+        return deleted;
+    }
 
-            BELDEX_LOG(warn, "Migrated {} messages ({} invalid owner ids); dropping old Data table",
-                    msgs, bad_owners);
+    // Returns the time up to which expired messages can be removed: in the partitioned layout
+    // expired messages in the current partition stay until the whole partition has expired.
+    int64_t expiry_horizon(int64_t now) {
+        if (!partitioned)
+            return now;
+        std::shared_lock lock{partitions_mutex};
+        for (auto& [start, end] : committed_partitions)
+            if (end > now)
+                return std::min(start, now);
+        return now;
+    }
 
-            db.exec("DROP TABLE Data");
+    // Messages that expired at or before this time are hidden from reads.  Only the partitioned
+    // layout hides them: otherwise expired messages are visible until they are cleaned up.
+    int64_t visible_expiry() {
+        return partitioned
+            ? to_epoch_ms(std::chrono::system_clock::now())
+            : std::numeric_limits<int64_t>::min();
+    }
 
-            BELDEX_LOG(warn, "Data migration complete!");
+    // Returns the tables holding messages.  For the writer these are the current partitions; for
+    // readers, the partitions as of the last committed change, which may include a partition that
+    // has been dropped since.
+    std::vector<message_table> message_tables(const ConnectionLease& conn) {
+        if (!partitioned)
+            return {std::nullopt};
+        std::vector<message_table> tables;
+        std::shared_lock lock{partitions_mutex, std::defer_lock};
+        if (!conn.is_writer())
+            lock.lock();
+        for (auto& [start, end] : conn.is_writer() ? partitions : committed_partitions)
+            tables.push_back(start);
+        return tables;
+    }
+
+    // Calls `modify(table)`, which returns modified message hashes, on each table holding
+    // messages, and returns all the hashes.
+    template <typename Modify>
+    std::vector<std::string> modify_each_table(ConnectionLease& conn, Modify&& modify) {
+        std::vector<std::string> hashes;
+        for (auto& table : message_tables(conn)) {
+            auto modified = modify(table);
+            if (hashes.empty())
+                hashes = std::move(modified);
+            else
+                hashes.insert(hashes.end(),
+                        std::make_move_iterator(modified.begin()), std::make_move_iterator(modified.end()));
         }
+        return hashes;
+    }
 
-        transaction.commit();
+    // Runs a statement that modifies messages and returns their hashes (`... RETURNING hash`) on
+    // each table holding messages, returning all the hashes.  Must be called with the writer
+    // connection.
+    template <typename... Bind>
+    std::vector<std::string> modify_messages(ConnectionLease& conn, Stmt id, const Bind&... bind) {
+        return modify_each_table(conn, [&](message_table table) {
+            auto st = conn.prepared_st(id, table);
+            return get_all<std::string>(st, bind...);
+        });
+    }
 
-        BELDEX_LOG(info, "Database setup complete");
+    // Same as above, for a statement with an IN list of `values` (bound after `bind`).
+    template <typename... Bind>
+    std::vector<std::string> modify_messages(
+            ConnectionLease& conn, InStmt id, const std::vector<std::string>& values, const Bind&... bind) {
+        return modify_each_table(conn, [&](message_table table) {
+            return get_all_in<std::string>(conn, id, table, values, bind...);
+        });
     }
 
-    /** Wrapper around a SQLite::Statement that calls `tryReset()` on destruction of the wrapper. */
-    class StatementWrapper {
-        SQLite::Statement& st;
-    public:
-        /// Whether we should reset on destruction; can be set to false if needed.
-        bool reset_on_destruction = true;
-
-        explicit StatementWrapper(SQLite::Statement& st) noexcept : st{st} {}
-        ~StatementWrapper() noexcept { if (reset_on_destruction) st.tryReset(); }
-        SQLite::Statement& operator*() noexcept { return st; }
-        SQLite::Statement* operator->() noexcept { return &st; }
-        operator SQLite::Statement&() noexcept { return st; }
-    };
+    // Same as modify_messages(), for deletions that also return each message's data size
+    // (`... RETURNING hash, <size>`); the deleted messages are subtracted from the pending counts.
+    template <typename... Bind>
+    std::vector<std::string> delete_messages(ConnectionLease& conn, Stmt id, const Bind&... bind) {
+        return modify_each_table(conn, [&](message_table table) {
+            auto st = conn.prepared_st(id, table);
+            return count_deleted(get_all<std::string, int64_t>(st, bind...));
+        });
+    }
 
+    template <typename... Bind>
+    std::vector<std::string> delete_messages(
+            ConnectionLease& conn, InStmt id, const std::vector<std::string>& values, const Bind&... bind) {
+        return modify_each_table(conn, [&](message_table table) {
+            return count_deleted(get_all_in<std::string, int64_t>(conn, id, table, values, bind...));
+        });
+    }
 
-    StatementWrapper prepared_st(const std::string& query) {
-        std::unordered_map<std::string, SQLite::Statement>* sts;
-        {
-            std::shared_lock rlock{prepared_sts_mutex};
-            if (auto it = prepared_sts.find(std::this_thread::get_id());
-                    it != prepared_sts.end())
-                sts = &it->second;
-            else {
-                rlock.unlock();
-                std::unique_lock wlock{prepared_sts_mutex};
-                sts = &prepared_sts.try_emplace(std::this_thread::get_id()).first->second;
-            }
+    // get_all() for an IN_STATEMENTS statement on the given table, with an IN list of `values`
+    // (bound after `bind`).
+    template <typename... T, typename... Bind>
+    std::vector<type_or_tuple<T...>> get_all_in(
+            ConnectionLease& conn,
+            InStmt id,
+            message_table table,
+            const std::vector<std::string>& values,
+            const Bind&... bind) {
+        if (auto bucket = in_list_bucket(values.size()); bucket < NUM_IN_LIST_BUCKETS) {
+            auto st = conn.prepared_st(id, bucket, table);
+            return get_all<T...>(st, bind..., in_list_binder{values, IN_LIST_BUCKETS[bucket]});
         }
-        if (auto qit = sts->find(query); qit != sts->end())
-            return StatementWrapper{qit->second};
-        return StatementWrapper{sts->try_emplace(query, db, query).first->second};
+        SQLite::Statement st{conn.db(), on_table(in_list_query(id, values.size()),
+                table ? partition_table(*table) : "messages")};
+        return get_all<T...>(st, bind..., in_list_binder{values, values.size()});
     }
 
-    template <typename... T>
-    int prepared_exec(const std::string& query, const T&... bind) {
-        return exec_query(prepared_st(query), bind...);
+    // Returns the partition (i.e. its start) to store a message with the given expiry in, creating
+    // the partition if needed.  Must be called with the writer connection, inside a transaction.
+    int64_t partition_for(int64_t expiry) {
+        // The first partition ending after the expiry, if it also starts at or before it
+        auto it = std::upper_bound(partitions.begin(), partitions.end(), expiry,
+                [](int64_t e, const auto& p) { return e < p.second; });
+        if (it != partitions.end() && it->first <= expiry)
+            return it->first;
+
+        int64_t width = options.partition_width.count();
+        int64_t start = expiry - expiry % width, end = start + width;
+        // Don't overlap existing partitions (which could have been created with another width)
+        if (it != partitions.begin())
+            start = std::max(start, std::prev(it)->second);
+        if (it != partitions.end())
+            end = std::min(end, it->first);
+
+        auto table = partition_table(start);
+        writer_conn.db.exec(on_table(MESSAGES_TABLE, table));
+        exec_query(writer_conn.db, "INSERT INTO partitions (start, end) VALUES (?, ?)", start, end);
+        partitions.emplace(it, start, end);
+        partitions_changed = true;
+        create_partition_views();
+        BELDEX_LOG(debug, "Created message partition {} for expiries up to {}", table, end);
+        return start;
     }
 
-    template <typename... T, typename... Bind>
-    auto prepared_get(const std::string& query, const Bind&... bind) {
-        return exec_and_get<T...>(prepared_st(query), bind...);
+    // (Re)creates the views over the partitions: `messages` (the union of all partitions),
+    // `owned_messages` (as in the single table layout) and `message_id_range` (the lowest and
+    // highest message ids, computed so that each partition's min/max come from its rowid b-tree).
+    void create_partition_views() {
+        auto& db = writer_conn.db;
+        db.exec("DROP VIEW IF EXISTS owned_messages;"
+                "DROP VIEW IF EXISTS messages;"
+                "DROP VIEW IF EXISTS message_id_range;");
+        std::string messages = "CREATE VIEW messages AS ";
+        std::string id_range = "CREATE VIEW message_id_range AS SELECT MIN(lo) AS lo, MAX(hi) AS hi FROM (";
+        if (partitions.empty()) {
+            messages += "SELECT 0 AS id, '' AS hash, 0 AS owner, 0 AS timestamp, 0 AS expiry,"
+                " X'' AS data, NULL AS blob WHERE 0";
+            id_range += "SELECT NULL AS lo, NULL AS hi";
+        }
+        for (size_t i = 0; i < partitions.size(); i++) {
+            auto table = partition_table(partitions[i].first);
+            if (i > 0) {
+                messages += " UNION ALL ";
+                id_range += " UNION ALL ";
+            }
+            messages += "SELECT id, hash, owner, timestamp, expiry, data, blob FROM " + table;
+            id_range += "SELECT (SELECT MIN(id) FROM " + table + ") AS lo, (SELECT MAX(id) FROM " + table + ") AS hi";
+        }
+        id_range += ")";
+        db.exec(messages);
+        db.exec(id_range);
+        db.exec(OWNED_MESSAGES_VIEW);
     }
 
-    user_pubkey_t load_pubkey(uint8_t type, std::string pk) {
-        return {type, std::move(pk)};
+    void load_partitions() {
+        SQLite::Statement st{writer_conn.db, "SELECT start, end FROM partitions ORDER BY start"};
+        partitions.clear();
+        while (st.executeStep())
+            partitions.emplace_back(st.getColumn(0).getInt64(), st.getColumn(1).getInt64());
+        partitions_stale = false;
     }
-};
-
-Database::Database(const std::filesystem::path& db_path)
-    : impl{std::make_unique<DatabaseImpl>(*this, db_path)}
-{
-    clean_expired();
-}
 
-Database::~Database() = default;
+    // Makes the writer's partitions visible to readers once committed.  The changed partitions
+    // invalidate statements cached on any connection (which could refer to dropped tables).
+    void publish_partitions() {
+        {
+            std::unique_lock lock{partitions_mutex};
+            committed_partitions = partitions;
+        }
+        partitions_version++;
+        writer_conn.partition_statements.clear();
+        writer_conn.partitions_version = partitions_version;
+        partitions_changed = false;
+    }
 
-void Database::clean_expired() {
-    impl->prepared_exec("DELETE FROM messages WHERE expiry <= ?",
-            to_epoch_ms(std::chrono::system_clock::now()));
+    // Switches a database from the single messages table to the partitioned layout.  The existing
+    // messages are then moved into partitions by migrate_to_partitions().
+    void start_partitioning() {
+        BELDEX_LOG(warn, "Switching database to the partitioned layout...");
+        auto& db = writer_conn.db;
+        SQLite::Transaction transaction{db};
+        db.exec(R"(
+DROP VIEW owned_messages;
+DROP TRIGGER owner_autoclean;
+ALTER TABLE messages RENAME TO messages_unpartitioned;
+
+CREATE TABLE partitions (
+    start INTEGER PRIMARY KEY,
+    end INTEGER NOT NULL
+);
+        )");
+        create_partition_views();
+        transaction.commit();
+        partitioned = true;
+    }
+
+    // Moves messages from the table used before switching to the partitioned layout into
+    // partitions, then drops it.  This goes in chunks, each in its own transaction, so that it
+    // resumes where it left off if interrupted.  Already expired messages are dropped.
+    void migrate_to_partitions() {
+        constexpr int64_t CHUNK_SIZE = 10'000;
+        auto now = to_epoch_ms(std::chrono::system_clock::now());
+        int64_t moved = 0, dropped = 0;
+        for (bool more = true; more; ) {
+            auto conn = writer();
+            SQLite::Transaction t{conn.db()};
+            auto rows = [&] {
+                auto st = conn.prepared_st(Stmt::migrate_select);
+                return get_all<int64_t, int64_t>(st, CHUNK_SIZE);
+            }();
+            for (auto& [id, expiry] : rows) {
+                if (expiry <= now) {
+                    dropped++;
+                    continue;
+                }
+                auto st = conn.prepared_st(Stmt::migrate_insert, partition_for(expiry));
+                exec_query(st, id);
+                moved++;
+            }
+            if (!rows.empty()) {
+                auto st = conn.prepared_st(Stmt::migrate_delete);
+                exec_query(st, std::get<0>(rows.back()));
+            }
+            t.commit();
+            more = static_cast<int64_t>(rows.size()) == CHUNK_SIZE;
+            if (more)
+                BELDEX_LOG(info, "Moved {} messages into partitions so far...", moved);
+        }
+
+        auto conn = writer();
+        auto& db = conn.db();
+        SQLite::Transaction t{db};
+        db.exec("DROP TABLE messages_unpartitioned");
+        db.exec("DELETE FROM owners WHERE NOT EXISTS (SELECT * FROM messages WHERE owner = owners.id)");
+        t.commit();
+        BELDEX_LOG(warn, "Moved {} messages into {} partitions ({} expired messages dropped)",
+                moved, partitions.size(), dropped);
+    }
+
+    // Looks up the id of the given owner, from the owner cache if possible, otherwise from the
+    // database (adding it to the cache).  Returns nullopt if the owner does not exist.
+    std::optional<int64_t> find_owner(ConnectionLease& conn, const user_pubkey_t& pubkey) {
+        uint64_t generation = 0;
+        if (options.owner_cache_size > 0) {
+            std::shared_lock lock{owner_cache_mutex};
+            if (auto it = owner_cache.find(pubkey); it != owner_cache.end())
+                return it->second;
+            generation = owner_cache_generation;
+        }
+        auto st = conn.prepared_st(Stmt::find_owner);
+        auto id = exec_and_maybe_get<int64_t>(st, pubkey);
+        if (id && options.owner_cache_size > 0) {
+            std::unique_lock lock{owner_cache_mutex};
+            // If an owner was deleted since we started looking then our id might be that owner's
+            if (generation == owner_cache_generation)
+                cache_owner(pubkey, *id);
+        }
+        return id;
+    }
+
+    // Looks up the id of the given owner, inserting the owner if not already present.  Must be
+    // called with the writer connection.
+    int64_t get_or_insert_owner(ConnectionLease& conn, const user_pubkey_t& pubkey) {
+        if (auto id = find_owner(conn, pubkey))
+            return *id;
+        auto insert_owner = conn.prepared_st(Stmt::insert_owner);
+        auto id = exec_and_get<int64_t>(insert_owner, pubkey);
+        inserted_owners.emplace_back(pubkey, id);
+        return id;
+    }
+
+    // Inserts a message for the given owner id; returns true if inserted, false if a message with
+    // the same hash already exists.  Must be called with the writer connection, and blobs.sync()
+    // must be called before committing.
+    bool insert_message(ConnectionLease& conn, int64_t owner, const message& msg) {
+        std::optional<int64_t> id;
+        message_table table;
+        if (partitioned) {
+            // Hashes are only unique within each partition, so we have to check them all first
+            auto exists = conn.prepared_st(Stmt::hash_exists);
+            if (exec_and_maybe_get<int>(exists, msg.hash))
+                return false;
+            id = next_message_id;
+            table = partition_for(to_epoch_ms(msg.expiry));
+        }
+
+        std::optional<int64_t> blob;
+        if (options.blob_segments) {
+            // The segments aren't covered by sqlite's max_page_count, so enforce the limit here
+            if (static_cast<int64_t>(blobs.size() + msg.data.size()) > size_limit)
+                throw SQLite::Exception{"message data segments are full", SQLITE_FULL};
+            blob = blobs.append(msg.data);
+        }
+        auto st = conn.prepared_st(Stmt::insert_message, table);
+        bool inserted = false;
+        try {
+            inserted = exec_query(st,
+                    id,
+                    owner,
+                    msg.hash,
+                    to_epoch_ms(msg.timestamp),
+                    to_epoch_ms(msg.expiry),
+                    blob_binder{blob ? ""sv : msg.data},
+                    blob);
+        } catch (...) {
+            if (blob)
+                blobs.discard(*blob);
+            throw;
+        }
+        if (blob && !inserted)
+            blobs.discard(*blob);
+        if (inserted) {
+            pending_counts.messages++;
+            pending_counts.bytes += msg.data.size();
+            pending_hash(true, msg.hash);
+            if (id)
+                next_message_id++;
+        }
+        return inserted;
+    }
+
+    // Returns a message's data from a row with the data and blob columns at the given indices.
+    // Must be called with a reader connection.
+    std::string load_data(SQLite::Statement& st, int data_col, int blob_col) {
+        return std::string{view_data(st, data_col, blob_col)};
+    }
+
+    // Like load_data(), but returns a view of the row's column or of the blob segment, valid until
+    // the statement moves on (or the reader lease is released, for blobs).
+    std::string_view view_data(SQLite::Statement& st, int data_col, int blob_col) {
+        if (auto blob = st.getColumn(blob_col); !blob.isNull())
+            return blobs.read(blob.getInt64());
+        return column_view(st.getColumn(data_col));
+    }
+
+    // Fills the retrieve cache entry for an owner, if it has none, with its newest messages.  Must
+    // be called with a reader connection that has no statement in progress (so that the read
+    // starts after the entry is reserved).
+    void fill_retrieve_cache(ConnectionLease& conn, const user_pubkey_t& pubkey, std::optional<int64_t> owner) {
+        auto reservation = retrieve_cache->begin_fill(pubkey);
+        if (!reservation)
+            return;
+        try {
+            std::vector<message> newest;
+            if (owner) {
+                auto st = conn.prepared_st(Stmt::owner_recent_messages);
+                st->bind(1, *owner);
+                st->bind(2, static_cast<int64_t>(RetrieveCache::MAX_MESSAGES + 1));
+                while (st->executeStep())
+                    newest.emplace_back(
+                            pubkey,
+                            st->getColumn(0).getString(),
+                            from_epoch_ms(st->getColumn(1).getInt64()),
+                            from_epoch_ms(st->getColumn(2).getInt64()),
+                            load_data(st, 3, 4));
+            }
+            retrieve_cache->fill(pubkey, reservation, std::move(newest));
+        } catch (...) {
+            retrieve_cache->cancel_fill(pubkey, reservation);
+            throw;
+        }
+    }
+
+    // Drops an owner's retrieve cache entry once `changed` (the hashes of deleted or updated
+    // messages) has been committed, and returns `changed`.
+    std::vector<std::string> changed_messages(const user_pubkey_t& pubkey, std::vector<std::string> changed) {
+        if (retrieve_cache && !changed.empty())
+            retrieve_cache->invalidate(pubkey);
+        return changed;
+    }
+
+    // Moves the bodies still stored in the given (sealed) segment into the current segment and
+    // then removes it.  Returns the number of bodies moved.
+    int64_t compact_segment(uint32_t segment) {
+        int64_t moved = 0;
+        {
+            auto conn = writer();
+            SQLite::Transaction t{conn.db()};
+            for (auto& table : message_tables(conn)) {
+                auto st = conn.prepared_st(Stmt::segment_blobs, table);
+                auto rows = get_all<int64_t, int64_t>(st,
+                        SegmentStore::segment_begin(segment), SegmentStore::segment_begin(segment + 1));
+                for (auto& [id, blob] : rows) {
+                    auto upd = conn.prepared_st(Stmt::move_blob, table);
+                    exec_query(upd, blobs.append(blobs.read(blob)), id);
+                }
+                moved += rows.size();
+            }
+            blobs.sync();
+            t.commit();
+        }
+        // Readers that already looked up a locator in this segment hold the blobs read lock, so
+        // this waits for them to finish.
+        blobs.remove(segment);
+        return moved;
+    }
+
+    void log_db_full() {
+        full_rejections++;
+        if (db_full_counter++ % Database::DB_FULL_FREQUENCY == 0)
+            BELDEX_LOG(err, "Failed to store message: database is full");
+    }
+
+    // Returns the fraction of `size_limit` in use: the database pages in use (i.e. not on
+    // the freelist) or, if larger, the data of the stored messages when there are blob segments.
+    // (Segment sizes include removed bodies until they get compacted, so counting them would make
+    // eviction overshoot.)
+    double fill_level(ConnectionLease& conn) {
+        auto pages = conn.prepared_get<int64_t>(Stmt::page_count) - conn.prepared_get<int64_t>(Stmt::freelist_count);
+        auto used = pages * page_size;
+        if (blobs.size() > 0)
+            used = std::max<int64_t>(used, data_bytes);
+        return static_cast<double>(used) / size_limit;
+    }
+
+    // Removes up to `limit` of the messages that expire soonest (whether or not they have expired
+    // already) to make room, appending their expiries to `expiries` (for remove_expiries() once
+    // committed).  Returns the number removed.  Must be called with the writer.
+    int evict(ConnectionLease& conn, int limit, std::vector<int64_t>& expiries) {
+        int evicted = 0;
+        // Partitions are in expiry order, so the soonest expiries are in the first ones
+        for (auto& table : message_tables(conn)) {
+            if (evicted >= limit)
+                break;
+            auto st = conn.prepared_st(Stmt::evict, table);
+            auto removed = count_deleted(get_all<int64_t, int64_t, std::string>(st, limit - evicted));
+            evicted += removed.size();
+            expiries.insert(expiries.end(), removed.begin(), removed.end());
+        }
+        evicted_count += evicted;
+        return evicted;
+    }
+
+    // Message count and data bytes of owners (by id), loaded as needed by within_quota() and
+    // updated by count_quota() for the messages stored by a write.
+    using owner_usage = std::unordered_map<int64_t, std::pair<int64_t, int64_t>>;
+
+    bool quotas() const { return options.owner_max_messages > 0 || options.owner_max_bytes > 0; }
+
+    // Returns true if storing `msg` keeps its owner within the per-owner quotas.  Must be called
+    // with the writer.
+    bool within_quota(ConnectionLease& conn, int64_t owner, const message& msg, owner_usage& usage) {
+        auto it = usage.find(owner);
+        if (it == usage.end()) {
+            auto st = conn.prepared_st(Stmt::owner_usage);
+            auto [count, bytes] = exec_and_get<int64_t, int64_t>(
+                    st, owner, to_epoch_ms(std::chrono::system_clock::now()));
+            it = usage.emplace(owner, std::make_pair(count, bytes)).first;
+        }
+        auto& [count, bytes] = it->second;
+        return (options.owner_max_messages <= 0 || count + 1 <= options.owner_max_messages) &&
+               (options.owner_max_bytes <= 0 ||
+                    bytes + static_cast<int64_t>(msg.data.size()) <= options.owner_max_bytes);
+    }
+
+    void count_quota(int64_t owner, const message& msg, owner_usage& usage) {
+        if (auto it = usage.find(owner); it != usage.end()) {
+            it->second.first++;
+            it->second.second += msg.data.size();
+        }
+    }
+
+    // Inserts a message like insert_message() but subject to the per-owner quotas (if any): a
+    // message that would take its owner over quota is not stored, and nullopt is returned (unless
+    // it is already stored).
+    std::optional<bool> insert_within_quota(
+            ConnectionLease& conn, int64_t owner, const message& msg, owner_usage& usage) {
+        if (quotas() && !within_quota(conn, owner, msg, usage)) {
+            auto exists = conn.prepared_st(Stmt::hash_exists);
+            if (exec_and_maybe_get<int>(exists, msg.hash))
+                return false;
+            if (quota_rejections++ % Database::DB_FULL_FREQUENCY == 0)
+                BELDEX_LOG(warn, "Rejected message for owner {}: over the per-owner quota", owner);
+            return std::nullopt;
+        }
+        bool inserted = insert_message(conn, owner, msg);
+        if (inserted && quotas())
+            count_quota(owner, msg, usage);
+        return inserted;
+    }
+
+    // Called by the store() caller that becomes the leader of the next batch, with `lock` holding
+    // `store_mutex`.  Waits for the batch to fill (or the window to elapse), commits it, and then
+    // wakes up the batch's other callers.
+    void lead_store_batch(std::unique_lock<std::mutex>& lock) {
+        store_leader = true;
+        if (options.store_batch_window > 0s)
+            store_joined.wait_for(lock, options.store_batch_window,
+                    [this] { return store_queue.size() >= options.store_batch_size; });
+        auto batch = std::move(store_queue);
+        store_queue.clear();
+
+        lock.unlock();
+        commit_stores(batch);
+        lock.lock();
+
+        for (auto* s : batch)
+            s->done = true;
+        store_leader = false;
+        store_committed.notify_all();
+    }
+
+    // Inserts a batch of queued stores in a single transaction, setting each one's result (or
+    // error).  If the transaction fails as a whole then every store in it gets the failure.
+    void commit_stores(const std::vector<pending_store*>& batch) {
+        auto conn = writer();
+        auto& db = conn.db();
+        std::unordered_map<user_pubkey_t, int64_t> owner_ids;
+        std::vector<int64_t> expiries;
+        std::vector<int64_t> evicted;
+        owner_usage usage;
+        std::vector<user_pubkey_t> owners;
+        if (retrieve_cache)
+            for (auto* s : batch)
+                owners.push_back(s->msg.pubkey);
+        RetrieveCache::store_guard guard{retrieve_cache.get(), std::move(owners)};
+        try {
+            SQLite::Transaction t{db};
+            // If background eviction isn't keeping up then make some room for these stores first
+            if (options.store_evict_max > 0 && fill_level(conn) >= options.store_evict_watermark)
+                store_evicted_count += evict(conn, options.store_evict_max * batch.size(), evicted);
+            for (auto* s : batch) {
+                try {
+                    auto it = owner_ids.find(s->msg.pubkey);
+                    if (it == owner_ids.end())
+                        it = owner_ids.emplace(s->msg.pubkey, get_or_insert_owner(conn, s->msg.pubkey)).first;
+                    s->result = insert_within_quota(conn, it->second, s->msg, usage);
+                    if (s->result.value_or(false))
+                        expiries.push_back(to_epoch_ms(s->msg.expiry));
+                } catch (const SQLite::Exception& e) {
+                    // Some errors (e.g. SQLITE_FULL) make sqlite roll back the whole transaction
+                    // rather than just the failed statement, which fails the whole batch:
+                    if (sqlite3_get_autocommit(db.getHandle()))
+                        throw;
+                    if (int rc = e.getErrorCode(); rc == SQLITE_CONSTRAINT)
+                        s->result = false;
+                    else if (rc == SQLITE_FULL) {
+                        s->result = std::nullopt;
+                        log_db_full();
+                    } else {
+                        BELDEX_LOG(err, "Failed to store message: {}", e.getErrorStr());
+                        s->error = std::current_exception();
+                    }
+                }
+            }
+            blobs.sync();
+            t.commit();
+            if (retrieve_cache) {
+                if (!evicted.empty())
+                    retrieve_cache->clear();
+                for (auto* s : batch)
+                    if (s->result.value_or(false))
+                        retrieve_cache->stored(s->msg);
+            }
+        } catch (const SQLite::Exception& e) {
+            // Nothing in the batch got committed
+            bool full = e.getErrorCode() == SQLITE_FULL;
+            if (full)
+                log_db_full();
+            else
+                BELDEX_LOG(err, "Failed to commit {} stored message(s): {}", batch.size(), e.getErrorStr());
+            for (auto* s : batch) {
+                s->result = std::nullopt;
+                s->error = full ? nullptr : std::current_exception();
+            }
+            return;
+        }
+        add_expiries(expiries);
+        if (!evicted.empty())
+            remove_expiries(evicted, 0, false);
+    }
+
+    // Creates the schema (at SCHEMA_VERSION) in a new database, migrating the messages of the
+    // pre-`owners` schema if there are any.
+    void create_schema() {
+        auto& db = writer_conn.db;
+
+        SQLite::Transaction transaction{db};
+
+        db.exec(R"(
+CREATE TABLE owners (
+    id INTEGER PRIMARY KEY,
+    type INTEGER NOT NULL,
+    pubkey BLOB NOT NULL,
+
+    UNIQUE(pubkey, type)
+);
+        )");
+        db.exec(on_table(MESSAGES_TABLE, "messages"));
+        db.exec(R"(
+CREATE TRIGGER owner_autoclean
+    AFTER DELETE ON messages FOR EACH ROW WHEN NOT EXISTS (SELECT * FROM messages WHERE owner = old.owner)
+    BEGIN
+        DELETE FROM owners WHERE id = old.owner;
+    END;
+        )");
+        db.exec(OWNED_MESSAGES_VIEW);
+        db.exec(OWNED_MESSAGES_INSERT_TRIGGER);
+        db.exec("PRAGMA user_version = " + std::to_string(SCHEMA_VERSION));
+
+        if (db.tableExists("Data")) {
+            BELDEX_LOG(warn, "Old database schema detected; performing migration...");
+
+            // Migratation from old table structure:
+            //
+            // CREATE TABLE Data(
+            //    Hash VARCHAR(128) NOT NULL,
+            //    Owner VARCHAR(256) NOT NULL,
+            //    TTL INTEGER NOT NULL,
+            //    Timestamp INTEGER NOT NULL,
+            //    TimeExpires INTEGER NOT NULL,
+            //    Nonce VARCHAR(128) NOT NULL,
+            //    Data BLOB
+            // );
+
+            SQLite::Statement ins_owner{db, "INSERT INTO owners (type, pubkey) VALUES (?, ?) RETURNING id"};
+
+            std::unordered_map<std::string, int> owner_ids;
+            SQLite::Statement old_owners{db, "SELECT DISTINCT Owner FROM Data"};
+            while (old_owners.executeStep()) {
+                int type;
+                std::array<char, 32> pubkey;
+                std::string old_owner = old_owners.getColumn(0);
+                if (old_owner.size() == 66 && util::starts_with(old_owner, "05") && bmq::is_hex(old_owner)) {
+                    type = 5;
+                    bmq::from_hex(old_owner.begin() + 2, old_owner.end(), pubkey.begin());
+                } else if (old_owner.size() == 64 && bmq::is_hex(old_owner)) {
+                    type = 0;
+                    bmq::from_hex(old_owner.begin(), old_owner.end(), pubkey.begin());
+                } else {
+                    BELDEX_LOG(warn, "Found invalid owner pubkey '{}' during migration; ignoring");
+                    continue;
+                }
+
+                int id = exec_and_get<int>(ins_owner, type, old_owner);
+                ins_owner.reset();
+                owner_ids.emplace(std::move(old_owner), id);
+            }
+
+            BELDEX_LOG(warn, "Migrated {} owner pubkeys.  Migrating messages...", owner_ids.size());
+
+            SQLite::Statement ins_msg{db,
+                "INSERT INTO messages (hash, owner, timestamp, expiry, data) VALUES (hash_key(?), ?, ?, ?, ?)"};
+
+            SQLite::Statement sel_msgs{db,
+                "SELECT Hash, Owner, Timestamp, TimeExpires, Data FROM Data ORDER BY rowid"};
+            int msgs = 0, bad_owners = 0;
+            while (sel_msgs.executeStep()) {
+                auto [hash, owner, ts, exp, data] = get<const char*, const char*, int64_t, int64_t, std::string>(sel_msgs);
+                auto it = owner_ids.find(owner);
+                if (it == owner_ids.end()) {
+                    bad_owners++;
+                    continue;
+                }
+                exec_query(ins_msg, hash, it->second, ts, exp, data);
+                ins_msg.reset();
+                msgs++;
+            }
+
+            BELDEX_LOG(warn, "Migrated {} messages ({} invalid owner ids); dropping old Data table",
+                    msgs, bad_owners);
+
+            db.exec("DROP TABLE Data");
+
+            BELDEX_LOG(warn, "Data migration complete!");
+        }
+
+        transaction.commit();
+
+        BELDEX_LOG(info, "Database setup complete");
+    }
+
+    // A table of messages (`{0}`: `messages` or a partition) and its indices, as of SCHEMA_VERSION.
+    // `(owner, id, expiry)` lets the retrieve queries find an owner's unexpired messages in id
+    // order without a sort and without visiting the rows of expired messages.
+    static constexpr auto MESSAGES_TABLE = R"(
+CREATE TABLE {0} (
+    id INTEGER PRIMARY KEY,
+    hash BLOB NOT NULL,
+    owner INTEGER NOT NULL REFERENCES owners(id),
+    timestamp INTEGER NOT NULL,
+    expiry INTEGER NOT NULL,
+    data BLOB NOT NULL,
+    blob INTEGER,
+
+    UNIQUE(hash)
+);
+
+CREATE INDEX {0}_expiry ON {0}(expiry);
+CREATE INDEX {0}_owner ON {0}(owner, timestamp);
+CREATE INDEX {0}_owner_id ON {0}(owner, id, expiry);
+CREATE INDEX {0}_blob ON {0}(blob) WHERE blob IS NOT NULL;
+    )";
+
+    static constexpr auto OWNED_MESSAGES_VIEW = R"(
+CREATE VIEW owned_messages AS
+    SELECT owners.id AS oid, type, pubkey, messages.id AS mid, hash, timestamp, expiry, data, blob
+    FROM messages JOIN owners ON messages.owner = owners.id;
+    )";
+
+    static constexpr auto OWNED_MESSAGES_INSERT_TRIGGER = R"(
+CREATE TRIGGER owned_messages_insert
+    INSTEAD OF INSERT ON owned_messages FOR EACH ROW WHEN NEW.oid IS NULL
+    BEGIN
+        INSERT INTO owners (type, pubkey) VALUES (NEW.type, NEW.pubkey) ON CONFLICT DO NOTHING;
+        INSERT INTO messages (id, hash, owner, timestamp, expiry, data, blob) VALUES (
+            NEW.mid,
+            hash_key(NEW.hash),
+            (SELECT id FROM owners WHERE type = NEW.type AND pubkey = NEW.pubkey),
+            NEW.timestamp,
+            NEW.expiry,
+            NEW.data,
+            NEW.blob);
+    END;
+    )";
+
+    // Version of the schema that create_schema() creates, kept in the database's user_version.
+    // Databases created before versioning are version 0.
+    static constexpr int SCHEMA_VERSION = 3;
+
+    // Brings the schema of an existing database up to SCHEMA_VERSION.  Migration `i` takes the
+    // database from version i to i + 1, and the version is only bumped once it has finished, so
+    // a migration has to cope with being run again after an interruption; this lets migrations of
+    // all the messages work in chunks, each in its own transaction.
+    void migrate_schema() {
+        void (DatabaseImpl::*migrations[])() = {
+            &DatabaseImpl::add_blob_column,
+            &DatabaseImpl::add_owner_id_index,
+            &DatabaseImpl::convert_hashes,
+        };
+        static_assert(std::size(migrations) == SCHEMA_VERSION);
+
+        auto& db = writer_conn.db;
+        int version = db.execAndGet("PRAGMA user_version").getInt();
+        if (version > SCHEMA_VERSION) {
+            auto m = fmt::format("Database schema version {} is newer than this version of "
+                    "the storage server supports ({})", version, SCHEMA_VERSION);
+            BELDEX_LOG(critical, m);
+            throw std::runtime_error{m};
+        }
+        for (; version < SCHEMA_VERSION; version++) {
+            BELDEX_LOG(warn, "Migrating database schema from version {} to {}...", version, version + 1);
+            (this->*migrations[version])();
+            db.exec("PRAGMA user_version = " + std::to_string(version + 1));
+        }
+    }
+
+    // Returns the names of the tables holding messages: `messages`, or in the partitioned layout
+    // the partitions and the table being migrated into them (if any).
+    std::vector<std::string> message_table_names() {
+        SQLite::Statement st{writer_conn.db,
+            "SELECT name FROM sqlite_master WHERE type = 'table' AND"
+            " (name = 'messages' OR name = 'messages_unpartitioned' OR name GLOB 'messages_[0-9]*')"};
+        std::vector<std::string> tables;
+        while (st.executeStep())
+            tables.push_back(st.getColumn(0).getString());
+        return tables;
+    }
+
+    // Migration 0 -> 1: adds the `blob` column (the SegmentStore locator of a message's data,
+    // stored there instead of in `data`).  Unversioned databases may already have it.
+    void add_blob_column() {
+        auto& db = writer_conn.db;
+        if (db.execAndGet("SELECT COUNT(*) FROM pragma_table_info('messages') WHERE name = 'blob'").getInt() > 0)
+            return;
+
+        SQLite::Transaction transaction{db};
+
+        db.exec(R"(
+ALTER TABLE messages ADD COLUMN blob INTEGER;
+
+CREATE INDEX messages_blob ON messages(blob) WHERE blob IS NOT NULL;
+
+DROP VIEW owned_messages;
+        )");
+        db.exec(OWNED_MESSAGES_VIEW);
+        db.exec(OWNED_MESSAGES_INSERT_TRIGGER);
+
+        transaction.commit();
+    }
+
+    // Migration 1 -> 2: adds the `(owner, id, expiry)` index (see MESSAGES_TABLE).
+    void add_owner_id_index() {
+        auto& db = writer_conn.db;
+        for (auto& table : message_table_names()) {
+            db.exec(on_table("CREATE INDEX IF NOT EXISTS {0}_owner_id ON {0}(owner, id, expiry)", table));
+            BELDEX_LOG(info, "Indexed {}", table);
+        }
+    }
+
+    // Migration 2 -> 3: converts the stored message hashes from text to their binary form (see
+    // ::hash_key), in chunks of message ids.
+    void convert_hashes() {
+        constexpr int64_t CHUNK_SIZE = 10'000;
+        auto& db = writer_conn.db;
+        int64_t converted = 0;
+        for (auto& table : message_table_names()) {
+            SQLite::Statement range{db, on_table(
+                    "SELECT IFNULL((SELECT MIN(id) FROM {0}), 0), IFNULL((SELECT MAX(id) FROM {0}), -1)", table)};
+            auto [lo, hi] = exec_and_get<int64_t, int64_t>(range);
+            SQLite::Statement convert{db, on_table(
+                    "UPDATE {0} SET hash = hash_key(hash) WHERE id >= ? AND id < ? AND typeof(hash) = 'text'", table)};
+            for (int64_t start = lo; start <= hi; start += CHUNK_SIZE) {
+                SQLite::Transaction t{db};
+                converted += exec_query(convert, start, start + CHUNK_SIZE);
+                convert.reset();
+                t.commit();
+            }
+        }
+        if (!db.tableExists("partitions")) {
+            SQLite::Transaction t{db};
+            db.exec("DROP TRIGGER IF EXISTS owned_messages_insert");
+            db.exec(OWNED_MESSAGES_INSERT_TRIGGER);
+            t.commit();
+        }
+        BELDEX_LOG(warn, "Converted {} message hashes", converted);
+    }
+
+    user_pubkey_t load_pubkey(uint8_t type, std::string pk) {
+        return {type, std::move(pk)};
+    }
+};
+
+// The default engine: a SQLite database file (and its blob segments directory).
+class SqliteEngine final : public StorageEngine {
+    std::unique_ptr<DatabaseImpl> impl;
+
+  public:
+    SqliteEngine(
+            const std::filesystem::path& db_file,
+            const std::filesystem::path& blobs_dir,
+            const database_options& opts,
+            int64_t size_limit);
+
+    void clean_expired() override;
+    int clean_expired_chunk(int limit) override;
+    int evict_chunk(int limit) override;
+    double get_fill_level() override;
+    capacity_stats get_capacity_stats() override;
+    int64_t get_expired_estimate() override;
+    int64_t get_message_count() override;
+    int64_t get_owner_count() override;
+    int64_t get_data_bytes() override;
+    std::map<std::string, std::string> query_plans() override;
+    retrieve_cache_stats get_retrieve_cache_stats() override;
+    hash_filter_stats get_hash_filter_stats() override;
+    int64_t get_used_bytes() override;
+    checkpoint_result checkpoint(checkpoint_mode mode) override;
+    void set_auto_checkpoint(bool enabled) override;
+    int64_t get_wal_bytes() override;
+    int64_t get_freelist_pages() override;
+    int64_t incremental_vacuum(int64_t max_pages) override;
+    int64_t compact_blob_segments() override;
+    std::optional<message> retrieve_random() override;
+    std::optional<message> retrieve_by_hash(const std::string& msg_hash) override;
+    std::optional<bool> store(const message& msg) override;
+    void bulk_store(const std::vector<message>& items) override;
+    size_t bulk_import(const std::vector<message>& items) override;
+    bool retrieve_each(
+            const user_pubkey_t& pubkey,
+            const std::string& last_hash,
+            int max_count,
+            size_t max_size,
+            size_encoding encoding,
+            const std::function<void(const message_view& msg)>& f) override;
+    size_t for_each(
+            const std::function<bool(std::vector<message>& batch)>& f,
+            const stream_options& opts) override;
+    std::vector<std::string> delete_all(const user_pubkey_t& pubkey) override;
+    std::vector<std::string> delete_by_hash(
+            const user_pubkey_t& pubkey, const std::vector<std::string>& msg_hashes) override;
+    std::vector<std::string> delete_by_timestamp(
+            const user_pubkey_t& pubkey, std::chrono::system_clock::time_point timestamp) override;
+    std::vector<std::string> update_expiry(
+            const user_pubkey_t& pubkey,
+            const std::vector<std::string>& msg_hashes,
+            std::chrono::system_clock::time_point new_exp) override;
+    std::vector<std::string> update_all_expiries(
+            const user_pubkey_t& pubkey,
+            std::chrono::system_clock::time_point new_exp) override;
+};
+
+SqliteEngine::SqliteEngine(
+        const std::filesystem::path& db_file,
+        const std::filesystem::path& blobs_dir,
+        const database_options& opts,
+        int64_t size_limit) :
+    impl{std::make_unique<DatabaseImpl>(db_file, blobs_dir, opts, size_limit)}
+{
+    clean_expired();
+    impl->load_expiry_estimate();
+    impl->reconciler = std::thread{[impl = impl.get()] { impl->reconcile(); }};
 }
 
-int64_t Database::get_message_count() {
-    return impl->prepared_get<int64_t>("SELECT COUNT(*) FROM messages");
+void SqliteEngine::clean_expired() {
+    impl->delete_expired(std::nullopt);
 }
 
-int64_t Database::get_owner_count() {
-    return impl->prepared_get<int64_t>("SELECT COUNT(*) FROM owners");
+int SqliteEngine::clean_expired_chunk(int limit) {
+    return impl->delete_expired(limit);
 }
 
-int64_t Database::get_used_bytes() {
-    return impl->prepared_get<int64_t>("PRAGMA page_count") * impl->page_size;
+int SqliteEngine::evict_chunk(int limit) {
+    std::vector<int64_t> evicted;
+    {
+        auto conn = impl->writer();
+        auto fill = impl->fill_level(conn);
+        if (fill >= impl->options.evict_watermark)
+            impl->evicting = true;
+        else if (fill < impl->options.evict_target)
+            impl->evicting = false;
+        if (!impl->evicting)
+            return 0;
+        SQLite::Transaction t{conn.db()};
+        impl->evict(conn, limit, evicted);
+        t.commit();
+        if (impl->retrieve_cache && !evicted.empty())
+            impl->retrieve_cache->clear();
+    }
+    impl->remove_expiries(evicted, 0, false);
+    return evicted.size();
+}
+
+double SqliteEngine::get_fill_level() {
+    auto conn = impl->reader();
+    return impl->fill_level(conn);
+}
+
+capacity_stats SqliteEngine::get_capacity_stats() {
+    capacity_stats stats;
+    stats.fill_level = get_fill_level();
+    stats.evicting = impl->evicting;
+    stats.evicted = impl->evicted_count;
+    stats.store_evicted = impl->store_evicted_count;
+    stats.quota_rejections = impl->quota_rejections;
+    stats.full_rejections = impl->full_rejections;
+    return stats;
+}
+
+int64_t SqliteEngine::get_expired_estimate() {
+    return impl->expired_estimate(impl->expiry_horizon(to_epoch_ms(std::chrono::system_clock::now())));
+}
+
+int64_t SqliteEngine::get_message_count() {
+    impl->wait_for_counts();
+    int64_t count = impl->message_count;
+    // Expired messages waiting for their partition to be dropped aren't visible, so don't count
+    // them; this only has to look at those messages (via the expiry index).
+    if (impl->partitioned)
+        count -= impl->reader().prepared_get<int64_t>(Stmt::count_expired_messages, impl->visible_expiry());
+    return std::max<int64_t>(count, 0);
+}
+
+int64_t SqliteEngine::get_owner_count() {
+    impl->wait_for_counts();
+    return impl->owner_count;
+}
+
+int64_t SqliteEngine::get_data_bytes() {
+    impl->wait_for_counts();
+    return impl->data_bytes;
+}
+
+std::map<std::string, std::string> SqliteEngine::query_plans() {
+    auto conn = impl->reader();
+    auto explain = [&](const std::string& query) {
+        SQLite::Statement st{conn.db(), "EXPLAIN QUERY PLAN " + query};
+        std::string plan;
+        while (st.executeStep()) {
+            if (!plan.empty())
+                plan += '\n';
+            plan += st.getColumn(3).getString();
+        }
+        return plan;
+    };
+    std::map<std::string, std::string> plans;
+    for (auto& [name, id] : HOT_STATEMENTS)
+        plans.emplace(name, explain(slot_query(statement_slot(id), "messages")));
+    for (auto& [name, id] : HOT_IN_STATEMENTS)
+        plans.emplace(name, explain(slot_query(statement_slot(id, 0), "messages")));
+    return plans;
+}
+
+retrieve_cache_stats SqliteEngine::get_retrieve_cache_stats() {
+    return impl->retrieve_cache ? impl->retrieve_cache->get_stats() : retrieve_cache_stats{};
+}
+
+hash_filter_stats SqliteEngine::get_hash_filter_stats() {
+    hash_filter_stats stats;
+    stats.ready = impl->hash_filter_ready;
+    if (stats.ready) {
+        std::shared_lock lock{impl->hash_filter_mutex};
+        stats.entries = impl->hash_filter.size();
+        stats.memory_bytes = impl->hash_filter.memory_usage();
+    }
+    stats.lookups = impl->filter_lookups;
+    stats.hits = impl->filter_hits;
+    stats.duplicates = impl->filter_duplicates;
+    return stats;
+}
+
+int64_t SqliteEngine::get_used_bytes() {
+    return impl->reader().prepared_get<int64_t>(Stmt::page_count) * impl->page_size
+        + impl->blobs.size();
+}
+
+checkpoint_result SqliteEngine::checkpoint(checkpoint_mode mode) {
+    int sqlite_mode = mode == checkpoint_mode::truncate ? SQLITE_CHECKPOINT_TRUNCATE
+                    : mode == checkpoint_mode::restart ? SQLITE_CHECKPOINT_RESTART
+                    : SQLITE_CHECKPOINT_PASSIVE;
+    std::lock_guard lock{impl->checkpoint_mutex};
+    int log = 0, checkpointed = 0;
+    int rc = sqlite3_wal_checkpoint_v2(
+            impl->checkpoint_conn->getHandle(), nullptr, sqlite_mode, &log, &checkpointed);
+    if (rc != SQLITE_OK && rc != SQLITE_BUSY)
+        throw SQLite::Exception{impl->checkpoint_conn->getHandle(), rc};
+    checkpoint_result result;
+    result.busy = rc == SQLITE_BUSY;
+    // (-1 if not in WAL mode)
+    result.log_bytes = std::max(log, 0) * int64_t{impl->page_size};
+    result.checkpointed_bytes = std::max(checkpointed, 0) * int64_t{impl->page_size};
+    return result;
+}
+
+void SqliteEngine::set_auto_checkpoint(bool enabled) {
+    auto conn = impl->writer();
+    // 1000 pages is sqlite's default
+    conn.db().exec(enabled ? "PRAGMA wal_autocheckpoint = 1000" : "PRAGMA wal_autocheckpoint = 0");
+}
+
+int64_t SqliteEngine::get_wal_bytes() {
+    std::error_code ec;
+    auto size = std::filesystem::file_size(impl->db_file.u8string() + "-wal", ec);
+    return ec ? 0 : static_cast<int64_t>(size);
+}
+
+int64_t SqliteEngine::get_freelist_pages() {
+    return impl->reader().prepared_get<int64_t>(Stmt::freelist_count);
+}
+
+int64_t SqliteEngine::incremental_vacuum(int64_t max_pages) {
+    if (!impl->incremental_vacuum || max_pages <= 0)
+        return 0;
+    auto conn = impl->writer();
+    auto before = conn.prepared_get<int64_t>(Stmt::freelist_count);
+    if (before == 0)
+        return 0;
+    conn.db().exec("PRAGMA incremental_vacuum(" + std::to_string(max_pages) + ")");
+    return before - conn.prepared_get<int64_t>(Stmt::freelist_count);
+}
+
+int64_t SqliteEngine::compact_blob_segments() {
+    auto sealed = impl->blobs.sealed_segments();
+    if (sealed.empty())
+        return 0;
+
+    // Add up the still-referenced bytes of each segment (the partial index makes this a scan of
+    // the locators only; the record sizes come from the mapped segments).
+    std::unordered_map<uint32_t, uint64_t> live;
+    {
+        auto conn = impl->reader();
+        auto st = conn.prepared_st(Stmt::all_blobs);
+        while (st->executeStep()) {
+            auto blob = st->getColumn(0).getInt64();
+            live[SegmentStore::segment_of(blob)] += sizeof(uint32_t) + impl->blobs.read(blob).size();
+        }
+    }
+
+    int64_t reclaimed = 0;
+    for (auto& [segment, size] : sealed) {
+        auto used = live[segment];
+        if (used > size * Database::COMPACT_THRESHOLD)
+            continue;
+        auto moved = impl->compact_segment(segment);
+        BELDEX_LOG(debug, "Compacted message data segment {}: moved {} messages ({} of {} bytes)",
+                segment, moved, used, size);
+        reclaimed += size - used;
+    }
+    return reclaimed;
 }
 
 static std::optional<message> get_message(DatabaseImpl& impl, SQLite::Statement& st) {
     std::optional<message> msg;
     while (st.executeStep()) {
         assert(!msg);
-        auto [hash, otype, opubkey, ts, exp, data] = get<std::string, uint8_t, std::string, int64_t, int64_t, std::string>(st);
+        auto [hash, otype, opubkey, ts, exp] = get<std::string, uint8_t, std::string, int64_t, int64_t>(st);
         msg.emplace(
             impl.load_pubkey(otype, std::move(opubkey)),
             std::move(hash),
             from_epoch_ms(ts),
             from_epoch_ms(exp),
-            std::move(data));
+            impl.load_data(st, 5, 6));
     }
     return msg;
 }
 
-std::optional<message> Database::retrieve_random() {
-    clean_expired();
-    auto st = impl->prepared_st("SELECT hash, type, pubkey, timestamp, expiry, data"
-        " FROM owned_messages "
-        " WHERE mid = (SELECT id FROM messages ORDER BY RANDOM() LIMIT 1)");
-    return get_message(*impl, st);
+std::optional<message> SqliteEngine::retrieve_random() {
+    auto conn = impl->reader();
+
+    auto [min_id, max_id] = conn.prepared_get<int64_t, int64_t>(
+            impl->partitioned ? Stmt::partitioned_id_range : Stmt::id_range);
+    if (max_id < min_id || max_id <= 0)
+        return std::nullopt;
+
+    // We don't clean up here, so we have to skip over expired messages that haven't been removed
+    // yet (a tester shouldn't ask for a message that the testee is allowed to have dropped).
+    auto now = to_epoch_ms(std::chrono::system_clock::now());
+
+    // Pick uniformly among the ids in the range and take the message if it exists.  Ids have gaps
+    // (from deletions), so we retry a few times; only if all attempts land in gaps do we fall back
+    // to seeking to the next existing id, which slightly favours messages following a gap.
+    auto& rng = util::rng();
+    auto random_id = [&] {
+        return min_id + static_cast<int64_t>(util::uniform_distribution_portable(rng, max_id - min_id + 1));
+    };
+    {
+        auto st = conn.prepared_st(Stmt::message_by_id);
+        for (int i = 0; i < Database::RANDOM_SAMPLE_ATTEMPTS; i++) {
+            st->bind(1, random_id());
+            st->bind(2, now);
+            if (auto msg = get_message(*impl, st))
+                return msg;
+            st->reset();
+        }
+    }
+
+    auto st = conn.prepared_st(Stmt::message_from_id);
+    for (auto from : {random_id(), min_id}) { // If nothing after a random id then wrap around
+        st->bind(1, from);
+        st->bind(2, now);
+        if (auto msg = get_message(*impl, st))
+            return msg;
+        st->reset();
+    }
+    return std::nullopt;
 }
 
-std::optional<message> Database::retrieve_by_hash(const std::string& msg_hash) {
-    auto st = impl->prepared_st("SELECT hash, type, pubkey, timestamp, expiry, data"
-            " FROM owned_messages WHERE hash = ?");
+std::optional<message> SqliteEngine::retrieve_by_hash(const std::string& msg_hash) {
+    auto conn = impl->reader();
+    auto st = conn.prepared_st(Stmt::message_by_hash);
     st->bindNoCopy(1, msg_hash);
+    st->bind(2, impl->visible_expiry());
     return get_message(*impl, st);
 }
 
-std::optional<bool> Database::store(const message& msg) {
-    auto st = impl->prepared_st("INSERT INTO owned_messages"
-           " (pubkey, type, hash, timestamp, expiry, data) VALUES (?, ?, ?, ?, ?, ?)");
-
-    try {
-        exec_query(st,
-            msg.pubkey,
-            msg.hash,
-            to_epoch_ms(msg.timestamp),
-            to_epoch_ms(msg.expiry),
-            blob_binder{msg.data});
-    } catch (const SQLite::Exception& e) {
-        if (int rc = e.getErrorCode(); rc == SQLITE_CONSTRAINT)
+std::optional<bool> SqliteEngine::store(const message& msg) {
+    // Most duplicates (e.g. the same message pushed to us by several swarm members) can be found
+    // without joining a write batch:
+    if (impl->maybe_stored(msg.hash)) {
+        auto conn = impl->reader();
+        if (impl->is_stored(conn, msg.hash))
             return false;
-        else if (rc == SQLITE_FULL) {
-            if (impl->db_full_counter++ % DB_FULL_FREQUENCY == 0)
-                BELDEX_LOG(err, "Failed to store message: database is full");
-            return std::nullopt;
-        } else {
-            BELDEX_LOG(err, "Failed to store message: {}", e.getErrorStr());
-            throw;
-        }
     }
-    return true;
-}
 
+    DatabaseImpl::pending_store store{msg};
 
-void Database::bulk_store(const std::vector<message>& items) {
-    SQLite::Transaction t{impl->db};
-    auto get_owner = impl->prepared_st(
-            "SELECT id FROM owners WHERE pubkey = ? AND type = ?");
-    auto insert_owner = impl->prepared_st(
-            "INSERT INTO owners (pubkey, type) VALUES (?, ?) ON CONFLICT DO NOTHING RETURNING id");
+    std::unique_lock lock{impl->store_mutex};
+    impl->store_queue.push_back(&store);
+    impl->store_joined.notify_one();
+    // Wait until a leader has committed our store, or until there is no leader (in which case we
+    // become the leader for the next batch, which includes our store).
+    impl->store_committed.wait(lock, [&] { return store.done || !impl->store_leader; });
+    if (!store.done)
+        impl->lead_store_batch(lock);
+
+    if (store.error)
+        std::rethrow_exception(store.error);
+    return store.result;
+}
+
+// Stores messages that aren't already stored, in a single transaction, skipping those that would
+// take their owner over quota if `quotas` is set.  Returns how many of the items are stored
+// afterwards (inserted now or already present).
+static size_t bulk_insert(DatabaseImpl& impl, const std::vector<message>& items, bool quotas) {
+    auto stored = impl.find_stored(items);
+    size_t count = std::count(stored.begin(), stored.end(), true);
+    if (count == items.size())
+        return count;
+
+    std::vector<user_pubkey_t> owners;
+    if (impl.retrieve_cache)
+        for (size_t i = 0; i < items.size(); i++)
+            if (items[i].pubkey && !stored[i])
+                owners.push_back(items[i].pubkey);
+    RetrieveCache::store_guard guard{impl.retrieve_cache.get(), std::move(owners)};
+
+    auto conn = impl.writer();
+    SQLite::Transaction t{conn.db()};
     std::unordered_map<user_pubkey_t, int64_t> seen;
-    for (auto& m : items) {
-        if (!m.pubkey)
+    std::vector<int64_t> expiries;
+    std::vector<bool> inserted(items.size());
+    DatabaseImpl::owner_usage usage;
+    for (size_t i = 0; i < items.size(); i++) {
+        auto& m = items[i];
+        if (!m.pubkey || stored[i])
             continue;
-        if (auto [it, ins] = seen.emplace(m.pubkey, 0); ins) {
-            auto ownerid = exec_and_maybe_get<int64_t>(get_owner, m.pubkey);
-            get_owner->reset();
-            if (!ownerid) {
-                ownerid = exec_and_maybe_get<int64_t>(insert_owner, m.pubkey);
-                insert_owner->reset();
+        auto [it, ins] = seen.try_emplace(m.pubkey);
+        if (ins)
+            it->second = impl.get_or_insert_owner(conn, m.pubkey);
+
+        auto added = quotas ? impl.insert_within_quota(conn, it->second, m, usage)
+                            : std::optional<bool>{impl.insert_message(conn, it->second, m)};
+        if (added)
+            count++;
+        if (added.value_or(false)) {
+            expiries.push_back(to_epoch_ms(m.expiry));
+            inserted[i] = true;
+        }
+    }
+
+    impl.blobs.sync();
+    t.commit();
+    if (impl.retrieve_cache)
+        for (size_t i = 0; i < items.size(); i++)
+            if (inserted[i])
+                impl.retrieve_cache->stored(items[i]);
+    impl.add_expiries(expiries);
+    return count;
+}
+
+void SqliteEngine::bulk_store(const std::vector<message>& items) {
+    bulk_insert(*impl, items, true);
+}
+
+size_t SqliteEngine::bulk_import(const std::vector<message>& items) {
+    return bulk_insert(*impl, items, false);
+}
+
+// Streams an owner's messages from the database, as for Database::retrieve_each().
+static bool retrieve_rows(
+        DatabaseImpl& impl,
+        DatabaseImpl::ConnectionLease& conn,
+        int64_t owner,
+        const std::string& last_hash,
+        int max_count,
+        size_t max_size,
+        size_encoding encoding,
+        const std::function<void(const message_view& msg)>& f) {
+    std::optional<int64_t> last_id;
+    if (!last_hash.empty()) {
+        auto st = conn.prepared_st(Stmt::owner_message_id);
+        last_id = exec_and_maybe_get<int64_t>(st, owner, last_hash);
+    }
+
+    auto st = conn.prepared_st(last_id ? Stmt::owner_messages_after : Stmt::owner_messages);
+    int i = 1;
+    st->bind(i++, owner);
+    if (last_id) st->bind(i++, *last_id);
+    st->bind(i++, impl.visible_expiry());
+    // One extra row tells us whether there are more
+    st->bind(i++, max_count >= 0 ? max_count + 1 : -1);
+
+    size_t count = 0, size = 0;
+    message_view msg;
+    while (st->executeStep()) {
+        if (max_count >= 0 && count >= static_cast<size_t>(max_count))
+            return true;
+        msg.data = impl.view_data(st, 3, 4);
+        auto msg_size = counted_size(msg.data.size(), encoding);
+        if (count > 0 && msg_size > max_size - size)
+            return true;
+        msg.hash = column_view(st->getColumn(0));
+        msg.timestamp = from_epoch_ms(st->getColumn(1).getInt64());
+        msg.expiry = from_epoch_ms(st->getColumn(2).getInt64());
+        f(msg);
+        count++;
+        size += std::min(msg_size, max_size);
+    }
+    return false;
+}
+
+bool SqliteEngine::retrieve_each(
+        const user_pubkey_t& pubkey,
+        const std::string& last_hash,
+        int max_count,
+        size_t max_size,
+        size_encoding encoding,
+        const std::function<void(const message_view& msg)>& f) {
+    auto& cache = impl->retrieve_cache;
+    if (cache)
+        if (auto more = cache->retrieve(pubkey, last_hash, max_count, max_size, encoding,
+                    std::chrono::system_clock::now(), f))
+            return *more;
+
+    auto conn = impl->reader();
+    auto ownerid = impl->find_owner(conn, pubkey);
+    bool more = ownerid && retrieve_rows(*impl, conn, *ownerid, last_hash, max_count, max_size, encoding, f);
+    if (cache)
+        impl->fill_retrieve_cache(conn, pubkey, ownerid);
+    return more;
+}
+
+static bool in_swarm_space(uint64_t val, const std::pair<uint64_t, uint64_t>& range) {
+    auto& [first, last] = range;
+    return first <= last
+        ? val >= first && val <= last
+        : val >= first || val <= last;
+}
+
+size_t SqliteEngine::for_each(
+        const std::function<bool(std::vector<message>& batch)>& f,
+        const stream_options& opts) {
+    // Owner pubkeys (by owner id) that we have loaded so far
+    std::unordered_map<int64_t, user_pubkey_t> owners;
+
+    // The owners whose messages we go through one at a time (using the owner index), when filtering
+    // by owner or swarm space; nullopt to go through all messages.  The swarm space filter is
+    // applied to the (far smaller) owners table, so that we only touch the messages in the range.
+    std::vector<std::optional<int64_t>> scans;
+    std::vector<message_table> tables;
+    {
+        auto conn = impl->reader();
+        if (opts.owner) {
+            auto owner_id = impl->find_owner(conn, *opts.owner);
+            if (!owner_id)
+                return 0;
+            scans.push_back(*owner_id);
+        } else if (opts.swarm_space) {
+            auto st = conn.prepared_st(Stmt::all_owners);
+            while (st->executeStep()) {
+                auto pubkey = impl->load_pubkey(
+                        static_cast<uint8_t>(st->getColumn(1).getInt()), st->getColumn(2).getString());
+                if (!in_swarm_space(pubkey_to_swarm_space(pubkey), *opts.swarm_space))
+                    continue;
+                auto id = st->getColumn(0).getInt64();
+                scans.push_back(id);
+                owners.emplace(id, std::move(pubkey));
             }
-            if (ownerid)
-                it->second = *ownerid;
-            else {
-                BELDEX_LOG(err, "Failed to insert owner {} for bulk store", m.pubkey.prefixed_hex());
-                seen.erase(it);
+            if (scans.empty())
+                return 0;
+        } else
+            scans.push_back(std::nullopt);
+        tables = impl->message_tables(conn);
+    }
+
+    const auto limit = std::max<size_t>(opts.batch_count, 1);
+    size_t visited = 0;
+    size_t bytes = 0;
+    std::vector<message> batch;
+    // Passes the batch to `f` once it is full (or whatever is left, if `last`); returns false to
+    // stop.  Batches carry over from one owner (or partition) to the next.
+    auto flush = [&](bool last) {
+        if (batch.empty() || (!last && batch.size() < limit && bytes < opts.batch_bytes))
+            return true;
+        visited += batch.size();
+        bool go_on = f(batch);
+        batch.clear();
+        bytes = 0;
+        return go_on;
+    };
+    for (auto& table : tables) {
+    for (auto& owner_id : scans) {
+    int64_t last_id = 0;
+    for (bool more = true; more; ) {
+        try {
+            auto conn = impl->reader();
+            auto st = conn.prepared_st(owner_id ? Stmt::stream_owner_messages : Stmt::stream_messages, table);
+            const auto room = static_cast<int64_t>(limit - batch.size());
+            int i = 1;
+            if (owner_id)
+                st->bind(i++, *owner_id);
+            st->bind(i++, last_id);
+            st->bind(i++, impl->visible_expiry());
+            st->bind(i++, room);
+
+            int64_t rows = 0;
+            more = false;
+            while (st->executeStep()) {
+                rows++;
+                last_id = st->getColumn(0).getInt64();
+                auto oid = st->getColumn(1).getInt64();
+                auto it = owners.find(oid);
+                if (it == owners.end())
+                    it = owners.emplace(oid, impl->load_pubkey(
+                            static_cast<uint8_t>(st->getColumn(2).getInt()), st->getColumn(3).getString())).first;
+
+                auto& msg = batch.emplace_back(
+                        it->second,
+                        st->getColumn(4).getString(),
+                        from_epoch_ms(st->getColumn(5).getInt64()),
+                        from_epoch_ms(st->getColumn(6).getInt64()),
+                        opts.keys_only ? std::string{} : impl->load_data(st, 7, 8));
+                bytes += msg.data.size();
+                if (bytes >= opts.batch_bytes) {
+                    more = true;
+                    break;
+                }
             }
+            if (rows == room)
+                more = true;
+        } catch (const SQLite::Exception& e) {
+            // A partition can get dropped while we are going through them, which just means that
+            // all of its messages expired.
+            if (!impl->partitioned || std::string_view{e.what()}.find("no such table") == std::string_view::npos)
+                throw;
+            break;
         }
+
+        if (!flush(false))
+            return visited;
+    }
+    }
     }
+    flush(true);
+    return visited;
+}
 
-    auto insert_message = impl->prepared_st(
-            "INSERT INTO messages (owner, hash, timestamp, expiry, data) VALUES (?, ?, ?, ?, ?)"
-            " ON CONFLICT DO NOTHING");
+std::vector<std::string> SqliteEngine::delete_all(const user_pubkey_t& pubkey) {
+    auto conn = impl->writer();
+    auto owner = impl->find_owner(conn, pubkey);
+    if (!owner)
+        return {};
+    return impl->changed_messages(pubkey, impl->delete_messages(conn, Stmt::delete_all, *owner));
+}
 
-    for (auto& m : items) {
-        if (!m.pubkey)
-            continue;
-        auto owner_it = seen.find(m.pubkey);
-        if (owner_it == seen.end())
-            continue;
+std::vector<std::string> SqliteEngine::delete_by_hash(
+        const user_pubkey_t& pubkey, const std::vector<std::string>& msg_hashes) {
+    auto conn = impl->writer();
+    auto owner = impl->find_owner(conn, pubkey);
+    if (!owner)
+        return {};
+    if (msg_hashes.size() == 1) {
+        // Use an optimized prepared statement for very common single-hash deletions
+        return impl->changed_messages(pubkey,
+                impl->delete_messages(conn, Stmt::delete_by_hash, *owner, msg_hashes[0]));
+    }
+
+    return impl->changed_messages(pubkey,
+            impl->delete_messages(conn, InStmt::delete_by_hashes, msg_hashes, *owner));
+}
+
+std::vector<std::string> SqliteEngine::delete_by_timestamp(
+        const user_pubkey_t& pubkey, std::chrono::system_clock::time_point timestamp) {
+    auto conn = impl->writer();
+    auto owner = impl->find_owner(conn, pubkey);
+    if (!owner)
+        return {};
+    return impl->changed_messages(pubkey,
+            impl->delete_messages(conn, Stmt::delete_by_timestamp, *owner, to_epoch_ms(timestamp)));
+}
+
+std::vector<std::string>
+SqliteEngine::update_expiry(
+        const user_pubkey_t& pubkey,
+        const std::vector<std::string>& msg_hashes,
+        std::chrono::system_clock::time_point new_exp) {
+    auto new_exp_ms = to_epoch_ms(new_exp);
 
-        int foo =
-        exec_query(insert_message,
-                owner_it->second,
-                m.hash,
-                to_epoch_ms(m.timestamp),
-                to_epoch_ms(m.expiry),
-                blob_binder{m.data});
-        insert_message->reset();
+    auto conn = impl->writer();
+    auto owner = impl->find_owner(conn, pubkey);
+    if (!owner)
+        return {};
+    if (msg_hashes.size() == 1) {
+        // Pre-prepared version for the common single hash case
+        return impl->changed_messages(pubkey, impl->modify_messages(conn, Stmt::update_expiry,
+                new_exp_ms, new_exp_ms, msg_hashes[0], *owner));
     }
 
-    t.commit();
+    return impl->changed_messages(pubkey, impl->modify_messages(conn, InStmt::update_expiries, msg_hashes,
+            new_exp_ms, new_exp_ms, *owner));
 }
 
-std::vector<message> Database::retrieve(
+std::vector<std::string>
+SqliteEngine::update_all_expiries(
         const user_pubkey_t& pubkey,
-        const std::string& last_hash,
-        std::optional<int> num_results) {
+        std::chrono::system_clock::time_point new_exp
+        ) {
+    auto new_exp_ms = to_epoch_ms(new_exp);
+    auto conn = impl->writer();
+    auto owner = impl->find_owner(conn, pubkey);
+    if (!owner)
+        return {};
+    return impl->changed_messages(pubkey,
+            impl->modify_messages(conn, Stmt::update_all_expiries, new_exp_ms, new_exp_ms, *owner));
+}
 
-    std::vector<message> results;
+static std::filesystem::path shard_file(const std::filesystem::path& db_path, size_t shard) {
+    return db_path / std::filesystem::u8path(fmt::format("storage-{:02d}.db", shard));
+}
 
-    auto owner_st = impl->prepared_st("SELECT id FROM owners WHERE pubkey = ? AND type = ?");
-    auto ownerid = exec_and_maybe_get<int64_t>(owner_st, pubkey);
-    if (!ownerid)
-        return results;
+static std::filesystem::path shard_blobs(const std::filesystem::path& db_path, size_t shard) {
+    return db_path / std::filesystem::u8path(fmt::format("blobs-{:02d}", shard));
+}
 
-    std::optional<int64_t> last_id;
-    if (!last_hash.empty()) {
-        auto st = impl->prepared_st("SELECT id FROM messages WHERE owner = ? AND hash = ?");
-        last_id = exec_and_maybe_get<int64_t>(st, *ownerid, last_hash);
+// Returns the number of shard files in `db_path` (i.e. the number of shards it was created with),
+// checking that they are numbered consecutively from 0.
+static size_t existing_shards(const std::filesystem::path& db_path) {
+    size_t count = 0, max = 0;
+    std::error_code ec;
+    for (auto& entry : std::filesystem::directory_iterator{db_path, ec}) {
+        auto name = entry.path().filename().u8string();
+        unsigned shard;
+        int len = 0;
+        if (std::sscanf(name.c_str(), "storage-%u.db%n", &shard, &len) == 1 &&
+                static_cast<size_t>(len) == name.size()) {
+            count++;
+            max = std::max<size_t>(max, shard + 1);
+        }
+    }
+    if (count != max)
+        throw std::runtime_error{fmt::format(
+                "Database shards in {} are incomplete: found {} of {}", db_path.u8string(), count, max)};
+    return count;
+}
+
+size_t Database::shard_of(const user_pubkey_t& pubkey, size_t shards) {
+    // Xor of the pubkey's big-endian 64-bit words, so that every byte counts
+    uint64_t h = 0;
+    auto& raw = pubkey.raw();
+    for (size_t i = 0; i < raw.size(); i++)
+        h ^= uint64_t{static_cast<unsigned char>(raw[i])} << (8 * (7 - i % 8));
+    return shards > 1 ? h % shards : 0;
+}
+
+Database::Database(const std::filesystem::path& db_path, const database_options& opts) {
+    // Only the sqlite engine has files in `db_path` to worry about
+    bool files = opts.engine == storage_engine::sqlite;
+    auto existing = files ? existing_shards(db_path) : 0;
+    if (opts.shards <= 1) {
+        if (existing > 0)
+            throw std::runtime_error{fmt::format(
+                    "Database in {} is sharded ({} shards) but sharding is not enabled",
+                    db_path.u8string(), existing)};
+        engine = make_engine(db_path / std::filesystem::u8path("storage.db"),
+                db_path / std::filesystem::u8path("blobs"), opts, SIZE_LIMIT);
+        return;
     }
+    if (existing > 0 && existing != opts.shards)
+        throw std::runtime_error{fmt::format(
+                "Database in {} has {} shards, not the {} configured",
+                db_path.u8string(), existing, opts.shards)};
+
+    auto shard_opts = opts;
+    shard_opts.shards = 1;
+    shard_opts.owner_cache_size /= opts.shards;
+    shard_opts.retrieve_cache_size /= opts.shards;
+    for (size_t i = 0; i < opts.shards; i++)
+        shard_dbs.push_back(std::unique_ptr<Database>{new Database{
+                shard_file(db_path, i), shard_blobs(db_path, i), shard_opts,
+                SIZE_LIMIT / static_cast<int64_t>(opts.shards)}});
+
+    if (files)
+        migrate_to_shards(db_path);
+}
 
-    auto st = impl->prepared_st(last_id
-            ? "SELECT hash, timestamp, expiry, data FROM messages WHERE owner = ? AND id > ? ORDER BY id LIMIT ?"
-            : "SELECT hash, timestamp, expiry, data FROM messages WHERE owner = ? ORDER BY id LIMIT ?");
-    st->bind(1, *ownerid);
-    if (last_id) st->bind(2, *last_id);
-    st->bind(last_id ? 3 : 2, num_results.value_or(-1));
+Database::Database(
+        const std::filesystem::path& db_file,
+        const std::filesystem::path& blobs_dir,
+        const database_options& opts,
+        int64_t size_limit) :
+    engine{make_engine(db_file, blobs_dir, opts, size_limit)}
+{}
+
+std::unique_ptr<StorageEngine> Database::make_engine(
+        const std::filesystem::path& db_file,
+        const std::filesystem::path& blobs_dir,
+        const database_options& opts,
+        int64_t size_limit) {
+    if (opts.engine == storage_engine::memory)
+        return std::make_unique<MemoryEngine>(opts, size_limit);
+    return std::make_unique<SqliteEngine>(db_file, blobs_dir, opts, size_limit);
+}
 
-    while (st->executeStep()) {
-        auto [hash, ts, exp, data] = get<std::string, int64_t, int64_t, std::string>(st);
-        results.emplace_back(
-                std::move(hash), from_epoch_ms(ts), from_epoch_ms(exp), std::move(data));
+size_t Database::bulk_import(const std::vector<message>& items) {
+    return engine->bulk_import(items);
+}
+
+void Database::migrate_to_shards(const std::filesystem::path& db_path) {
+    auto old_file = db_path / std::filesystem::u8path("storage.db");
+    if (!std::filesystem::exists(old_file))
+        return;
+    BELDEX_LOG(warn, "Migrating {} to {} shards; this may take some time...",
+            old_file.u8string(), shard_dbs.size());
+
+    // Moving the messages is idempotent (already stored messages are skipped), so an interrupted
+    // migration just starts over.  The quotas don't apply: the messages were already accepted.
+    size_t migrated = 0, stored = 0;
+    {
+        database_options old_opts;
+        old_opts.hash_filter = false;
+        old_opts.retrieve_cache_size = 0;
+        auto blobs = db_path / std::filesystem::u8path("blobs");
+        Database old{old_file, blobs, old_opts, SIZE_LIMIT};
+        std::vector<std::vector<message>> by_shard(shard_dbs.size());
+        migrated = old.for_each([&](std::vector<message>& batch) {
+            for (auto& msg : batch)
+                by_shard[shard_of(msg.pubkey, shard_dbs.size())].push_back(std::move(msg));
+            for (size_t i = 0; i < shard_dbs.size(); i++) {
+                stored += shard_dbs[i]->bulk_import(by_shard[i]);
+                by_shard[i].clear();
+            }
+            return true;
+        });
     }
 
-    return results;
+    if (stored != migrated) {
+        BELDEX_LOG(err, "Only {} of the {} messages in {} could be stored in the shards; leaving it in "
+                "place (the migration will be retried on the next startup)",
+                stored, migrated, old_file.u8string());
+        return;
+    }
+
+    // Keep the old database, in case, but out of the way
+    for (auto suffix : {"", "-wal", "-shm"}) {
+        std::filesystem::path f = old_file.u8string() + suffix;
+        if (std::filesystem::exists(f))
+            std::filesystem::rename(f, f.u8string() + ".unsharded");
+    }
+    if (auto blobs = db_path / std::filesystem::u8path("blobs"); std::filesystem::exists(blobs))
+        std::filesystem::rename(blobs, blobs.u8string() + ".unsharded");
+    BELDEX_LOG(warn, "Migrated {} messages to {} shards; the old database was renamed to {}.unsharded",
+            migrated, shard_dbs.size(), old_file.u8string());
 }
 
-std::vector<message> Database::retrieve_all() {
-    std::vector<message> results;
-    auto st = impl->prepared_st("SELECT type, pubkey, hash, timestamp, expiry, data"
-            " FROM owned_messages ORDER BY mid");
+Database::~Database() = default;
 
-    while (st->executeStep()) {
-        auto [type, pubkey, hash, ts, exp, data] =
-            get<uint8_t, std::string, std::string, int64_t, int64_t, std::string>(st);
-        results.emplace_back(
-                impl->load_pubkey(type, pubkey),
-                std::move(hash),
-                from_epoch_ms(ts),
-                from_epoch_ms(exp),
-                std::move(data));
+// Returns the sum of `f(shard)` over the shards of a sharded database.
+template <typename F>
+static auto sum_shards(const std::vector<std::unique_ptr<Database>>& shards, F&& f) {
+    decltype(f(*shards.front())) sum{};
+    for (auto& shard : shards)
+        sum += f(*shard);
+    return sum;
+}
+
+void Database::clean_expired() {
+    if (!shard_dbs.empty()) {
+        for (auto& shard : shard_dbs)
+            shard->clean_expired();
+        return;
     }
+    engine->clean_expired();
+}
 
-    return results;
+int Database::clean_expired_chunk(int limit) {
+    if (!shard_dbs.empty())
+        return sum_shards(shard_dbs, [&](Database& s) { return s.clean_expired_chunk(limit); });
+    return engine->clean_expired_chunk(limit);
 }
 
-std::vector<std::string> Database::delete_all(const user_pubkey_t& pubkey) {
-    auto st = impl->prepared_st(
-            "DELETE FROM messages WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-            " RETURNING hash");
-    return get_all<std::string>(st, pubkey);
+int Database::evict_chunk(int limit) {
+    if (!shard_dbs.empty())
+        return sum_shards(shard_dbs, [&](Database& s) { return s.evict_chunk(limit); });
+    return engine->evict_chunk(limit);
 }
 
-static std::string multi_in_query(std::string_view prefix, size_t count, std::string_view suffix) {
-    std::string query;
-    query.reserve(prefix.size() + (count == 0 ? 0 : 2*count-1) + suffix.size());
-    query += prefix;
-    for (size_t i = 0; i < count; i++) {
-        if (i > 0) query += ',';
-        query += '?';
+double Database::get_fill_level() {
+    // Each shard has its own part of the size limit, so the fullest one is what matters
+    if (!shard_dbs.empty()) {
+        double fill = 0;
+        for (auto& shard : shard_dbs)
+            fill = std::max(fill, shard->get_fill_level());
+        return fill;
     }
-    query += suffix;
-    return query;
+    return engine->get_fill_level();
 }
 
-std::vector<std::string> Database::delete_by_hash(
-        const user_pubkey_t& pubkey, const std::vector<std::string>& msg_hashes) {
-    if (msg_hashes.size() == 1) {
-        // Use an optimized prepared statement for very common single-hash deletions
-        auto st = impl->prepared_st("DELETE FROM messages"
-                " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?) AND hash = ?"
-                " RETURNING hash");
-        return get_all<std::string>(st, pubkey, msg_hashes[0]);
+capacity_stats Database::get_capacity_stats() {
+    capacity_stats stats;
+    if (!shard_dbs.empty()) {
+        for (auto& shard : shard_dbs) {
+            auto s = shard->get_capacity_stats();
+            stats.fill_level = std::max(stats.fill_level, s.fill_level);
+            stats.evicting = stats.evicting || s.evicting;
+            stats.evicted += s.evicted;
+            stats.store_evicted += s.store_evicted;
+            stats.quota_rejections += s.quota_rejections;
+            stats.full_rejections += s.full_rejections;
+        }
+        return stats;
+    }
+    return engine->get_capacity_stats();
+}
+
+int64_t Database::get_expired_estimate() {
+    if (!shard_dbs.empty())
+        return sum_shards(shard_dbs, [](Database& s) { return s.get_expired_estimate(); });
+    return engine->get_expired_estimate();
+}
+
+int64_t Database::get_message_count() {
+    if (!shard_dbs.empty())
+        return sum_shards(shard_dbs, [](Database& s) { return s.get_message_count(); });
+    return engine->get_message_count();
+}
+
+int64_t Database::get_owner_count() {
+    if (!shard_dbs.empty())
+        return sum_shards(shard_dbs, [](Database& s) { return s.get_owner_count(); });
+    return engine->get_owner_count();
+}
+
+int64_t Database::get_data_bytes() {
+    if (!shard_dbs.empty())
+        return sum_shards(shard_dbs, [](Database& s) { return s.get_data_bytes(); });
+    return engine->get_data_bytes();
+}
+
+std::map<std::string, std::string> Database::query_plans() {
+    // The shards all have the same schema
+    if (!shard_dbs.empty())
+        return shard_dbs.front()->query_plans();
+    return engine->query_plans();
+}
+
+retrieve_cache_stats Database::get_retrieve_cache_stats() {
+    if (!shard_dbs.empty()) {
+        retrieve_cache_stats stats;
+        for (auto& shard : shard_dbs) {
+            auto s = shard->get_retrieve_cache_stats();
+            stats.enabled = s.enabled;
+            stats.entries += s.entries;
+            stats.memory_bytes += s.memory_bytes;
+            stats.hits += s.hits;
+            stats.empty += s.empty;
+            stats.misses += s.misses;
+            stats.evictions += s.evictions;
+        }
+        return stats;
+    }
+    return engine->get_retrieve_cache_stats();
+}
+
+hash_filter_stats Database::get_hash_filter_stats() {
+    hash_filter_stats stats;
+    if (!shard_dbs.empty()) {
+        stats.ready = true;
+        for (auto& shard : shard_dbs) {
+            auto s = shard->get_hash_filter_stats();
+            stats.ready = stats.ready && s.ready;
+            stats.entries += s.entries;
+            stats.memory_bytes += s.memory_bytes;
+            stats.lookups += s.lookups;
+            stats.hits += s.hits;
+            stats.duplicates += s.duplicates;
+        }
+        return stats;
+    }
+    return engine->get_hash_filter_stats();
+}
+
+int64_t Database::get_used_bytes() {
+    if (!shard_dbs.empty())
+        return sum_shards(shard_dbs, [](Database& s) { return s.get_used_bytes(); });
+    return engine->get_used_bytes();
+}
+
+checkpoint_result Database::checkpoint(checkpoint_mode mode) {
+    if (!shard_dbs.empty()) {
+        checkpoint_result result;
+        for (auto& shard : shard_dbs) {
+            auto r = shard->checkpoint(mode);
+            result.busy = result.busy || r.busy;
+            result.log_bytes += r.log_bytes;
+            result.checkpointed_bytes += r.checkpointed_bytes;
+        }
+        return result;
+    }
+    return engine->checkpoint(mode);
+}
+
+void Database::set_auto_checkpoint(bool enabled) {
+    if (!shard_dbs.empty()) {
+        for (auto& shard : shard_dbs)
+            shard->set_auto_checkpoint(enabled);
+        return;
+    }
+    engine->set_auto_checkpoint(enabled);
+}
+
+int64_t Database::get_wal_bytes() {
+    if (!shard_dbs.empty())
+        return sum_shards(shard_dbs, [](Database& s) { return s.get_wal_bytes(); });
+    return engine->get_wal_bytes();
+}
+
+int64_t Database::get_freelist_pages() {
+    if (!shard_dbs.empty())
+        return sum_shards(shard_dbs, [](Database& s) { return s.get_freelist_pages(); });
+    return engine->get_freelist_pages();
+}
+
+int64_t Database::incremental_vacuum(int64_t max_pages) {
+    if (!shard_dbs.empty())
+        return sum_shards(shard_dbs, [&](Database& s) { return s.incremental_vacuum(max_pages); });
+    return engine->incremental_vacuum(max_pages);
+}
+
+int64_t Database::compact_blob_segments() {
+    if (!shard_dbs.empty())
+        return sum_shards(shard_dbs, [](Database& s) { return s.compact_blob_segments(); });
+    return engine->compact_blob_segments();
+}
+
+std::optional<message> Database::retrieve_random() {
+    // Owners are spread evenly over the shards, so starting from a random shard is close enough to
+    // uniform
+    if (!shard_dbs.empty()) {
+        auto first = util::uniform_distribution_portable(util::rng(), shard_dbs.size());
+        for (size_t i = 0; i < shard_dbs.size(); i++)
+            if (auto msg = shard_dbs[(first + i) % shard_dbs.size()]->retrieve_random())
+                return msg;
+        return std::nullopt;
+    }
+    return engine->retrieve_random();
+}
+
+std::optional<message> Database::retrieve_by_hash(const std::string& msg_hash) {
+    if (!shard_dbs.empty()) {
+        for (auto& shard : shard_dbs)
+            if (auto msg = shard->retrieve_by_hash(msg_hash))
+                return msg;
+        return std::nullopt;
+    }
+    return engine->retrieve_by_hash(msg_hash);
+}
+
+std::optional<bool> Database::store(const message& msg) {
+    if (!shard_dbs.empty())
+        return shard_for(msg.pubkey).store(msg);
+    return engine->store(msg);
+}
+
+void Database::bulk_store(const std::vector<message>& items) {
+    if (!shard_dbs.empty()) {
+        std::vector<std::vector<message>> by_shard(shard_dbs.size());
+        for (auto& m : items)
+            if (m.pubkey)
+                by_shard[shard_of(m.pubkey, shard_dbs.size())].push_back(m);
+        for (size_t i = 0; i < shard_dbs.size(); i++)
+            if (!by_shard[i].empty())
+                shard_dbs[i]->bulk_store(by_shard[i]);
+        return;
+    }
+    engine->bulk_store(items);
+}
+
+std::vector<message> Database::retrieve(
+        const user_pubkey_t& pubkey,
+        const std::string& last_hash,
+        std::optional<int> num_results) {
+    return retrieve_page(pubkey, last_hash, num_results.value_or(-1)).messages;
+}
+
+retrieve_result Database::retrieve_page(
+        const user_pubkey_t& pubkey,
+        const std::string& last_hash,
+        int max_count,
+        size_t max_size,
+        size_encoding encoding) {
+    retrieve_result result;
+    result.more = retrieve_each(pubkey, last_hash, max_count, max_size, encoding, [&](const message_view& m) {
+        result.messages.emplace_back(std::string{m.hash}, m.timestamp, m.expiry, std::string{m.data});
+    });
+    return result;
+}
+
+bool Database::retrieve_each(
+        const user_pubkey_t& pubkey,
+        const std::string& last_hash,
+        int max_count,
+        size_t max_size,
+        size_encoding encoding,
+        const std::function<void(const message_view& msg)>& f) {
+
+    if (!shard_dbs.empty())
+        return shard_for(pubkey).retrieve_each(pubkey, last_hash, max_count, max_size, encoding, f);
+    return engine->retrieve_each(pubkey, last_hash, max_count, max_size, encoding, f);
+}
+
+std::vector<message> Database::retrieve_all() {
+    std::vector<message> results;
+    for_each([&results](std::vector<message>& batch) {
+        results.insert(results.end(),
+                std::make_move_iterator(batch.begin()), std::make_move_iterator(batch.end()));
+        return true;
+    });
+    return results;
+}
+
+size_t Database::for_each(
+        const std::function<bool(std::vector<message>& batch)>& f,
+        const stream_options& opts) {
+
+    if (!shard_dbs.empty()) {
+        if (opts.owner)
+            return shard_for(*opts.owner).for_each(f, opts);
+        size_t visited = 0;
+        bool stopped = false;
+        for (auto& shard : shard_dbs) {
+            visited += shard->for_each([&](std::vector<message>& batch) {
+                stopped = !f(batch);
+                return !stopped;
+            }, opts);
+            if (stopped)
+                break;
+        }
+        return visited;
     }
+    return engine->for_each(f, opts);
+}
 
-    SQLite::Statement st{impl->db, multi_in_query("DELETE FROM messages "
-        "WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?) AND "
-        "hash IN ("sv, // ?,?,?,...,?
-        msg_hashes.size(),
-        ") RETURNING hash"sv)};
+std::vector<std::string> Database::delete_all(const user_pubkey_t& pubkey) {
+    if (!shard_dbs.empty())
+        return shard_for(pubkey).delete_all(pubkey);
+    return engine->delete_all(pubkey);
+}
 
-    bind_pubkey(st, 1, 2, pubkey);
-    for (size_t i = 0; i < msg_hashes.size(); i++)
-        st.bindNoCopy(3 + i, msg_hashes[i]);
-    return get_all<std::string>(st);
+std::vector<std::string> Database::delete_by_hash(
+        const user_pubkey_t& pubkey, const std::vector<std::string>& msg_hashes) {
+    if (!shard_dbs.empty())
+        return shard_for(pubkey).delete_by_hash(pubkey, msg_hashes);
+    return engine->delete_by_hash(pubkey, msg_hashes);
 }
 
 std::vector<std::string> Database::delete_by_timestamp(
         const user_pubkey_t& pubkey, std::chrono::system_clock::time_point timestamp) {
-    auto st = impl->prepared_st("DELETE FROM messages"
-            " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-            " AND timestamp <= ? RETURNING hash");
-    return get_all<std::string>(st, pubkey, to_epoch_ms(timestamp));
+    if (!shard_dbs.empty())
+        return shard_for(pubkey).delete_by_timestamp(pubkey, timestamp);
+    return engine->delete_by_timestamp(pubkey, timestamp);
 }
 
 std::vector<std::string>
@@ -606,29 +3171,9 @@ Database::update_expiry(
         const std::vector<std::string>& msg_hashes,
         std::chrono::system_clock::time_point new_exp) {
 
-    auto new_exp_ms = to_epoch_ms(new_exp);
-
-    if (msg_hashes.size() == 1) {
-        // Pre-prepared version for the common single hash case
-        auto st = impl->prepared_st("UPDATE messages SET expiry = ? "
-                "WHERE expiry > ? AND hash = ?"
-                " AND owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-                " RETURNING hash");
-        return get_all<std::string>(st, new_exp_ms, new_exp_ms, msg_hashes[0], pubkey);
-    }
-
-    SQLite::Statement st{impl->db, multi_in_query("UPDATE messages SET expiry = ? "
-        "WHERE expiry > ? AND owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?) "
-        "AND hash IN ("sv, // ?,?,?,...,?
-        msg_hashes.size(),
-        ") RETURNING hash"sv)};
-    st.bind(1, new_exp_ms);
-    st.bind(2, new_exp_ms);
-    bind_pubkey(st, 3, 4, pubkey);
-    for (size_t i = 0; i < msg_hashes.size(); i++)
-        st.bindNoCopy(5 + i, msg_hashes[i]);
-
-    return get_all<std::string>(st);
+    if (!shard_dbs.empty())
+        return shard_for(pubkey).update_expiry(pubkey, msg_hashes, new_exp);
+    return engine->update_expiry(pubkey, msg_hashes, new_exp);
 }
 
 std::vector<std::string>
@@ -636,11 +3181,9 @@ Database::update_all_expiries(
         const user_pubkey_t& pubkey,
         std::chrono::system_clock::time_point new_exp
         ) {
-    auto new_exp_ms = to_epoch_ms(new_exp);
-    auto st = impl->prepared_st("UPDATE messages SET expiry = ? "
-            "WHERE expiry > ? AND owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?) "
-            "RETURNING hash");
-    return get_all<std::string>(st, new_exp_ms, new_exp_ms, pubkey);
+    if (!shard_dbs.empty())
+        return shard_for(pubkey).update_all_expiries(pubkey, new_exp);
+    return engine->update_all_expiries(pubkey, new_exp);
 }
 
 } // namespace beldex
@@ -0,0 +1,117 @@
+#include "DbMaintainer.hpp"
+#include "Database.hpp"
+#include "beldex_logger.h"
+#include "string_utils.hpp"
+
+#include <algorithm>
+#include <exception>
+
+namespace beldex {
+
+DbMaintainer::DbMaintainer(Database& db) : db_{db} {
+    db_.set_auto_checkpoint(false);
+    thread_ = std::thread{[this] { run(); }};
+}
+
+DbMaintainer::~DbMaintainer() {
+    {
+        std::lock_guard lock{mutex_};
+        stop_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+    try {
+        db_.set_auto_checkpoint(true);
+    } catch (const std::exception& e) {
+        BELDEX_LOG(warn, "Failed to re-enable automatic checkpoints: {}", e.what());
+    }
+}
+
+DbMaintainer::stats_t DbMaintainer::get_stats() const {
+    std::lock_guard lock{mutex_};
+    return stats_;
+}
+
+void DbMaintainer::checkpoint() {
+    auto wal_bytes = db_.get_wal_bytes();
+    int64_t log_bytes;
+    {
+        std::lock_guard lock{mutex_};
+        log_bytes = stats_.log_bytes;
+    }
+    auto mode = wal_bytes >= TRUNCATE_WAL_BYTES ? checkpoint_mode::truncate
+              : log_bytes >= RESTART_LOG_BYTES ? checkpoint_mode::restart
+              : checkpoint_mode::passive;
+
+    auto start = std::chrono::steady_clock::now();
+    checkpoint_result result;
+    try {
+        result = db_.checkpoint(mode);
+    } catch (const std::exception& e) {
+        BELDEX_LOG(err, "WAL checkpoint failed: {}", e.what());
+        return;
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start);
+    if (mode != checkpoint_mode::passive)
+        BELDEX_LOG(debug, "{} checkpoint of {} byte WAL took {}{}",
+                mode == checkpoint_mode::truncate ? "Truncate" : "Restart", wal_bytes,
+                util::short_duration(elapsed), result.busy ? " (busy; will retry)" : "");
+
+    std::lock_guard lock{mutex_};
+    stats_.wal_bytes = db_.get_wal_bytes();
+    // After a completed restart/truncate the next write starts the WAL over
+    stats_.log_bytes = mode != checkpoint_mode::passive && !result.busy ? 0 : result.log_bytes;
+    stats_.checkpoints++;
+    if (mode == checkpoint_mode::restart)
+        stats_.restarts++;
+    else if (mode == checkpoint_mode::truncate)
+        stats_.truncates++;
+    if (result.busy)
+        stats_.busy++;
+    stats_.last_checkpoint = elapsed;
+    stats_.max_checkpoint = std::max(stats_.max_checkpoint, elapsed);
+    stats_.total_checkpoint += elapsed;
+}
+
+void DbMaintainer::vacuum() {
+    try {
+        auto free_pages = db_.get_freelist_pages();
+        if (free_pages >= VACUUM_THRESHOLD_PAGES) {
+            const auto start = std::chrono::steady_clock::now();
+            int64_t released = 0;
+            while (!stop_ && free_pages > 0 && std::chrono::steady_clock::now() - start < VACUUM_BUDGET) {
+                auto n = db_.incremental_vacuum(VACUUM_STEP_PAGES);
+                if (n == 0)
+                    break;
+                released += n;
+                free_pages -= n;
+            }
+            if (released > 0)
+                BELDEX_LOG(debug, "Released {} free database pages in {}", released,
+                        util::short_duration(std::chrono::steady_clock::now() - start));
+            std::lock_guard lock{mutex_};
+            stats_.vacuumed_pages += released;
+        }
+        std::lock_guard lock{mutex_};
+        stats_.freelist_pages = free_pages;
+    } catch (const std::exception& e) {
+        BELDEX_LOG(err, "Failed to vacuum database: {}", e.what());
+    }
+}
+
+void DbMaintainer::run() {
+    auto last_vacuum = std::chrono::steady_clock::now() - VACUUM_INTERVAL;
+    while (!stop_) {
+        checkpoint();
+        if (std::chrono::steady_clock::now() - last_vacuum >= VACUUM_INTERVAL) {
+            vacuum();
+            last_vacuum = std::chrono::steady_clock::now();
+        }
+
+        std::unique_lock lock{mutex_};
+        cv_.wait_for(lock, CHECKPOINT_INTERVAL, [this] { return stop_.load(); });
+    }
+}
+
+} // namespace beldex
@@ -0,0 +1,128 @@
+#include "ExpirySweeper.hpp"
+#include "Database.hpp"
+#include "beldex_logger.h"
+#include "string_utils.hpp"
+
+#include <algorithm>
+#include <exception>
+
+namespace beldex {
+
+ExpirySweeper::ExpirySweeper(Database& db) : db_{db} {
+    thread_ = std::thread{[this] { run(); }};
+}
+
+ExpirySweeper::~ExpirySweeper() {
+    {
+        std::lock_guard lock{mutex_};
+        stop_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+}
+
+ExpirySweeper::stats_t ExpirySweeper::get_stats() const {
+    std::lock_guard lock{mutex_};
+    return stats_;
+}
+
+int64_t ExpirySweeper::sweep_step() {
+    const auto step_start = std::chrono::steady_clock::now();
+    int64_t removed = 0;
+    while (!stop_) {
+        auto chunk_start = std::chrono::steady_clock::now();
+        int n;
+        try {
+            n = db_.clean_expired_chunk(CHUNK_SIZE);
+        } catch (const std::exception& e) {
+            BELDEX_LOG(err, "Failed to remove expired messages: {}", e.what());
+            break;
+        }
+        auto now = std::chrono::steady_clock::now();
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - chunk_start);
+        removed += n;
+        {
+            std::lock_guard lock{mutex_};
+            stats_.removed += n;
+            stats_.chunks++;
+            stats_.last_chunk = elapsed;
+            stats_.max_chunk = std::max(stats_.max_chunk, elapsed);
+            stats_.total_chunk += elapsed;
+        }
+        if (n < CHUNK_SIZE || now - step_start >= STEP_BUDGET)
+            break;
+    }
+    if (removed > 0)
+        BELDEX_LOG(debug, "Removed {} expired messages in {}", removed,
+                util::short_duration(std::chrono::steady_clock::now() - step_start));
+    return removed;
+}
+
+int64_t ExpirySweeper::evict_step() {
+    const auto step_start = std::chrono::steady_clock::now();
+    int64_t evicted = 0;
+    while (!stop_) {
+        int n;
+        try {
+            n = db_.evict_chunk(CHUNK_SIZE);
+        } catch (const std::exception& e) {
+            BELDEX_LOG(err, "Failed to evict messages: {}", e.what());
+            break;
+        }
+        evicted += n;
+        if (n < CHUNK_SIZE || std::chrono::steady_clock::now() - step_start >= STEP_BUDGET)
+            break;
+    }
+    if (evicted > 0) {
+        BELDEX_LOG(warn, "Database near capacity: evicted {} unexpired messages in {}", evicted,
+                util::short_duration(std::chrono::steady_clock::now() - step_start));
+        std::lock_guard lock{mutex_};
+        stats_.evicted += evicted;
+    }
+    return evicted;
+}
+
+void ExpirySweeper::run() {
+    auto last_sweep = std::chrono::steady_clock::now();
+    auto last_compact = last_sweep;
+    while (!stop_) {
+        auto backlog = db_.get_expired_estimate();
+        // The estimate doesn't see expiries that were shortened after storing, so we also sweep
+        // every CLEANUP_PERIOD regardless of what it says.
+        if (backlog > 0 || std::chrono::steady_clock::now() - last_sweep >= Database::CLEANUP_PERIOD) {
+            sweep_step();
+            last_sweep = std::chrono::steady_clock::now();
+            backlog = db_.get_expired_estimate();
+        }
+
+        // Expired messages go first; if that hasn't made enough room then we keep evicting (with
+        // the shortest pause) until the database is back below its eviction target.
+        bool evicting = evict_step() > 0;
+
+        if (backlog == 0 && std::chrono::steady_clock::now() - last_compact >= COMPACT_INTERVAL) {
+            try {
+                auto reclaimed = db_.compact_blob_segments();
+                std::lock_guard lock{mutex_};
+                stats_.blob_bytes_reclaimed += reclaimed;
+            } catch (const std::exception& e) {
+                BELDEX_LOG(err, "Failed to compact message data segments: {}", e.what());
+            }
+            last_compact = std::chrono::steady_clock::now();
+        }
+
+        // The bigger the backlog the shorter we pause between steps: a handful of expired messages
+        // can wait for the next check, while a large cohort gets swept nearly continuously.
+        std::chrono::milliseconds pause = CHECK_INTERVAL;
+        if (evicting)
+            pause = MIN_PAUSE;
+        else if (backlog > 0)
+            pause = std::clamp<std::chrono::milliseconds>(
+                    pause * CHUNK_SIZE / backlog, MIN_PAUSE, CHECK_INTERVAL);
+
+        std::unique_lock lock{mutex_};
+        stats_.backlog = backlog;
+        cv_.wait_for(lock, pause, [this] { return stop_.load(); });
+    }
+}
+
+} // namespace beldex
@@ -0,0 +1,129 @@
+#include "HashFilter.hpp"
+
+#include <functional>
+
+namespace beldex {
+
+namespace {
+
+struct key_hash {
+    size_t bucket;
+    uint16_t fp;
+};
+
+key_hash hash_key(std::string_view key) {
+    uint64_t h = std::hash<std::string_view>{}(key);
+    // Fingerprint from the high bits, buckets from the low bits; 0 marks an empty slot
+    auto fp = static_cast<uint16_t>(h >> 48);
+    return {static_cast<size_t>(h), fp ? fp : uint16_t{1}};
+}
+
+size_t buckets_for(size_t capacity) {
+    size_t buckets = HashFilter::MIN_BUCKETS;
+    while (buckets * HashFilter::BUCKET_SIZE * HashFilter::MAX_LOAD < capacity)
+        buckets *= 2;
+    return buckets;
+}
+
+} // namespace
+
+bool HashFilter::table::add(size_t bucket, uint16_t fp) {
+    auto* b = &slots[bucket * BUCKET_SIZE];
+    for (size_t i = 0; i < BUCKET_SIZE; i++) {
+        if (!b[i]) {
+            b[i] = fp;
+            size++;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool HashFilter::table::has(size_t bucket, uint16_t fp) const {
+    auto* b = &slots[bucket * BUCKET_SIZE];
+    for (size_t i = 0; i < BUCKET_SIZE; i++)
+        if (b[i] == fp)
+            return true;
+    return false;
+}
+
+bool HashFilter::table::remove(size_t bucket, uint16_t fp) {
+    auto* b = &slots[bucket * BUCKET_SIZE];
+    for (size_t i = 0; i < BUCKET_SIZE; i++) {
+        if (b[i] == fp) {
+            b[i] = 0;
+            size--;
+            return true;
+        }
+    }
+    return false;
+}
+
+// The alternate bucket depends only on the current bucket and the fingerprint (and maps back),
+// so that a fingerprint can be moved without knowing its key.
+size_t HashFilter::table::alt_bucket(size_t bucket, uint16_t fp) const {
+    return (bucket ^ (fp * uint64_t{0xc6a4a7935bd1e995})) & mask;
+}
+
+HashFilter::HashFilter(size_t capacity) {
+    tables_.emplace_back(buckets_for(capacity));
+}
+
+void HashFilter::insert(std::string_view key) {
+    auto* t = &tables_.back();
+    if (t->size + 1 > t->slots.size() * MAX_LOAD)
+        t = &tables_.emplace_back((t->mask + 1) * 2);
+
+    auto [h, fp] = hash_key(key);
+    size_t bucket = h & t->mask;
+    size_++;
+    if (t->add(bucket, fp))
+        return;
+    bucket = t->alt_bucket(bucket, fp);
+    if (t->add(bucket, fp))
+        return;
+
+    // Both buckets are full: move fingerprints to their alternate buckets to make room
+    for (int kick = 0; kick < MAX_KICKS; kick++) {
+        rng_ ^= rng_ << 13;
+        rng_ ^= rng_ >> 7;
+        rng_ ^= rng_ << 17;
+        std::swap(fp, t->slots[bucket * BUCKET_SIZE + rng_ % BUCKET_SIZE]);
+        bucket = t->alt_bucket(bucket, fp);
+        if (t->add(bucket, fp))
+            return;
+    }
+    // Give up on whichever fingerprint we are left holding
+    size_--;
+}
+
+bool HashFilter::erase(std::string_view key) {
+    auto [h, fp] = hash_key(key);
+    for (auto it = tables_.rbegin(); it != tables_.rend(); ++it) {
+        size_t bucket = h & it->mask;
+        if (it->remove(bucket, fp) || it->remove(it->alt_bucket(bucket, fp), fp)) {
+            size_--;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool HashFilter::contains(std::string_view key) const {
+    auto [h, fp] = hash_key(key);
+    for (auto& t : tables_) {
+        size_t bucket = h & t.mask;
+        if (t.has(bucket, fp) || t.has(t.alt_bucket(bucket, fp), fp))
+            return true;
+    }
+    return false;
+}
+
+size_t HashFilter::memory_usage() const {
+    size_t bytes = 0;
+    for (auto& t : tables_)
+        bytes += t.slots.size() * sizeof(uint16_t);
+    return bytes;
+}
+
+} // namespace beldex
@@ -0,0 +1,391 @@
+#include "MemoryEngine.hpp"
+#include "beldex_logger.h"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <mutex>
+
+namespace beldex {
+
+MemoryEngine::MemoryEngine(const database_options& opts, int64_t size_limit) :
+    options_{opts}, size_limit_{size_limit} {}
+
+std::optional<bool> MemoryEngine::insert(const message& msg, bool quotas) {
+    if (by_hash_.count(msg.hash))
+        return false;
+    if (quotas && (options_.owner_max_messages > 0 || options_.owner_max_bytes > 0) && !within_quota(msg)) {
+        if (quota_rejections_++ % Database::DB_FULL_FREQUENCY == 0)
+            BELDEX_LOG(warn, "Rejected message for {}: over the per-owner quota", msg.pubkey.hex());
+        return std::nullopt;
+    }
+    auto bytes = static_cast<int64_t>(msg.hash.size() + msg.data.size());
+    if (used_bytes_ + bytes > size_limit_) {
+        if (full_rejections_++ % Database::DB_FULL_FREQUENCY == 0)
+            BELDEX_LOG(err, "Failed to store message: database is full");
+        return std::nullopt;
+    }
+
+    auto id = next_id_++;
+    auto& m = messages_.emplace_hint(messages_.end(), id, msg)->second;
+    by_hash_.emplace(m.hash, id);
+    by_owner_[m.pubkey].insert(id);
+    by_expiry_.emplace(m.expiry, id);
+    data_bytes_ += m.data.size();
+    used_bytes_ += bytes;
+    return true;
+}
+
+bool MemoryEngine::within_quota(const message& msg) const {
+    int64_t count = 1, bytes = msg.data.size();
+    if (auto it = by_owner_.find(msg.pubkey); it != by_owner_.end()) {
+        // As with the sqlite engine, expired messages that haven't been removed yet don't count
+        auto now = std::chrono::system_clock::now();
+        for (auto id : it->second) {
+            auto& m = messages_.find(id)->second;
+            if (m.expiry > now) {
+                count++;
+                bytes += m.data.size();
+            }
+        }
+    }
+    return (options_.owner_max_messages <= 0 || count <= options_.owner_max_messages) &&
+           (options_.owner_max_bytes <= 0 || bytes <= options_.owner_max_bytes);
+}
+
+void MemoryEngine::remove(messages_t::iterator it) {
+    auto& [id, m] = *it;
+    by_hash_.erase(m.hash);
+    if (auto owner = by_owner_.find(m.pubkey); owner != by_owner_.end()) {
+        owner->second.erase(id);
+        if (owner->second.empty())
+            by_owner_.erase(owner);
+    }
+    by_expiry_.erase({m.expiry, id});
+    data_bytes_ -= m.data.size();
+    used_bytes_ -= m.hash.size() + m.data.size();
+    messages_.erase(it);
+}
+
+int MemoryEngine::remove_by_expiry(
+        std::optional<int> limit, std::optional<std::chrono::system_clock::time_point> until) {
+    int removed = 0;
+    while (!by_expiry_.empty() && (!limit || removed < *limit)) {
+        auto [expiry, id] = *by_expiry_.begin();
+        if (until && expiry > *until)
+            break;
+        remove(messages_.find(id));
+        removed++;
+    }
+    return removed;
+}
+
+std::vector<std::string> MemoryEngine::remove_owned(
+        const user_pubkey_t& pubkey, const std::function<bool(const message&)>& pred) {
+    std::vector<std::string> hashes;
+    auto owner = by_owner_.find(pubkey);
+    if (owner == by_owner_.end())
+        return hashes;
+    // Copied, as removing the last message removes the owner
+    auto ids = owner->second;
+    for (auto id : ids) {
+        auto it = messages_.find(id);
+        if (!pred(it->second))
+            continue;
+        hashes.push_back(it->second.hash);
+        remove(it);
+    }
+    return hashes;
+}
+
+bool MemoryEngine::shorten_expiry(messages_t::iterator it, std::chrono::system_clock::time_point new_exp) {
+    auto& [id, m] = *it;
+    if (m.expiry <= new_exp)
+        return false;
+    by_expiry_.erase({m.expiry, id});
+    m.expiry = new_exp;
+    by_expiry_.emplace(m.expiry, id);
+    return true;
+}
+
+double MemoryEngine::fill_level() const {
+    return static_cast<double>(used_bytes_) / size_limit_;
+}
+
+std::optional<bool> MemoryEngine::store(const message& msg) {
+    std::unique_lock lock{mutex_};
+    if (by_hash_.count(msg.hash))
+        return false;
+    if (options_.store_evict_max > 0 && fill_level() >= options_.store_evict_watermark) {
+        auto evicted = remove_by_expiry(options_.store_evict_max, std::nullopt);
+        evicted_ += evicted;
+        store_evicted_ += evicted;
+    }
+    return insert(msg);
+}
+
+void MemoryEngine::bulk_store(const std::vector<message>& items) {
+    std::unique_lock lock{mutex_};
+    for (auto& m : items)
+        if (m.pubkey)
+            insert(m);
+}
+
+size_t MemoryEngine::bulk_import(const std::vector<message>& items) {
+    std::unique_lock lock{mutex_};
+    size_t stored = 0;
+    for (auto& m : items)
+        if (m.pubkey && insert(m, false))
+            stored++;
+    return stored;
+}
+
+bool MemoryEngine::retrieve_each(
+        const user_pubkey_t& pubkey,
+        const std::string& last_hash,
+        int max_count,
+        size_t max_size,
+        size_encoding encoding,
+        const std::function<void(const message_view& msg)>& f) {
+    std::shared_lock lock{mutex_};
+    auto owner = by_owner_.find(pubkey);
+    if (owner == by_owner_.end())
+        return false;
+    auto& ids = owner->second;
+    auto it = ids.begin();
+    if (!last_hash.empty())
+        if (auto last = by_hash_.find(last_hash); last != by_hash_.end() && ids.count(last->second))
+            it = ids.upper_bound(last->second);
+
+    size_t count = 0, size = 0;
+    for (; it != ids.end(); ++it) {
+        auto& m = messages_.find(*it)->second;
+        if (max_count >= 0 && count >= static_cast<size_t>(max_count))
+            return true;
+        auto msg_size = counted_size(m.data.size(), encoding);
+        if (count > 0 && msg_size > max_size - size)
+            return true;
+        f(message_view{m.hash, m.timestamp, m.expiry, m.data});
+        count++;
+        size += std::min(msg_size, max_size);
+    }
+    return false;
+}
+
+static bool in_swarm_space(uint64_t val, const std::pair<uint64_t, uint64_t>& range) {
+    auto& [first, last] = range;
+    return first <= last
+        ? val >= first && val <= last
+        : val >= first || val <= last;
+}
+
+size_t MemoryEngine::for_each(
+        const std::function<bool(std::vector<message>& batch)>& f,
+        const stream_options& opts) {
+    const auto limit = std::max<size_t>(opts.batch_count, 1);
+    size_t visited = 0;
+    int64_t last_id = 0;
+    std::vector<message> batch;
+    for (bool more = true; more; ) {
+        batch.clear();
+        more = false;
+        {
+            std::shared_lock lock{mutex_};
+            size_t bytes = 0;
+            // Adds a message to the batch; returns false once the batch is full
+            auto add = [&](int64_t id, const message& m) {
+                last_id = id;
+                if (opts.swarm_space && !in_swarm_space(pubkey_to_swarm_space(m.pubkey), *opts.swarm_space))
+                    return true;
+                if (opts.keys_only)
+                    batch.emplace_back(m.pubkey, m.hash, m.timestamp, m.expiry, std::string{});
+                else
+                    batch.push_back(m);
+                bytes += batch.back().data.size();
+                more = batch.size() >= limit || bytes >= opts.batch_bytes;
+                return !more;
+            };
+            if (opts.owner) {
+                auto owner = by_owner_.find(*opts.owner);
+                if (owner == by_owner_.end())
+                    return visited;
+                for (auto it = owner->second.upper_bound(last_id); it != owner->second.end(); ++it)
+                    if (!add(*it, messages_.find(*it)->second))
+                        break;
+            } else {
+                for (auto it = messages_.upper_bound(last_id); it != messages_.end(); ++it)
+                    if (!add(it->first, it->second))
+                        break;
+            }
+        }
+
+        if (!batch.empty()) {
+            visited += batch.size();
+            if (!f(batch))
+                return visited;
+        }
+    }
+    return visited;
+}
+
+std::optional<message> MemoryEngine::retrieve_random() {
+    std::shared_lock lock{mutex_};
+    if (messages_.empty())
+        return std::nullopt;
+    auto now = std::chrono::system_clock::now();
+
+    // As in the sqlite engine: try a few random ids, then fall back to the first unexpired message
+    // after a random id (wrapping around).
+    auto min_id = messages_.begin()->first, max_id = messages_.rbegin()->first;
+    auto& rng = util::rng();
+    auto random_id = [&] {
+        return min_id + static_cast<int64_t>(util::uniform_distribution_portable(rng, max_id - min_id + 1));
+    };
+    for (int i = 0; i < Database::RANDOM_SAMPLE_ATTEMPTS; i++)
+        if (auto it = messages_.find(random_id()); it != messages_.end() && it->second.expiry > now)
+            return it->second;
+    for (auto from : {random_id(), min_id})
+        for (auto it = messages_.lower_bound(from); it != messages_.end(); ++it)
+            if (it->second.expiry > now)
+                return it->second;
+    return std::nullopt;
+}
+
+std::optional<message> MemoryEngine::retrieve_by_hash(const std::string& msg_hash) {
+    std::shared_lock lock{mutex_};
+    auto it = by_hash_.find(msg_hash);
+    if (it == by_hash_.end())
+        return std::nullopt;
+    return messages_.find(it->second)->second;
+}
+
+int64_t MemoryEngine::get_message_count() {
+    std::shared_lock lock{mutex_};
+    return messages_.size();
+}
+
+int64_t MemoryEngine::get_owner_count() {
+    std::shared_lock lock{mutex_};
+    return by_owner_.size();
+}
+
+int64_t MemoryEngine::get_data_bytes() {
+    std::shared_lock lock{mutex_};
+    return data_bytes_;
+}
+
+int64_t MemoryEngine::get_used_bytes() {
+    std::shared_lock lock{mutex_};
+    return used_bytes_;
+}
+
+void MemoryEngine::clean_expired() {
+    std::unique_lock lock{mutex_};
+    remove_by_expiry(std::nullopt, std::chrono::system_clock::now());
+}
+
+int MemoryEngine::clean_expired_chunk(int limit) {
+    std::unique_lock lock{mutex_};
+    return remove_by_expiry(limit, std::chrono::system_clock::now());
+}
+
+int MemoryEngine::evict_chunk(int limit) {
+    std::unique_lock lock{mutex_};
+    auto fill = fill_level();
+    if (fill >= options_.evict_watermark)
+        evicting_ = true;
+    else if (fill < options_.evict_target)
+        evicting_ = false;
+    if (!evicting_)
+        return 0;
+    auto evicted = remove_by_expiry(limit, std::nullopt);
+    evicted_ += evicted;
+    return evicted;
+}
+
+double MemoryEngine::get_fill_level() {
+    std::shared_lock lock{mutex_};
+    return fill_level();
+}
+
+capacity_stats MemoryEngine::get_capacity_stats() {
+    capacity_stats stats;
+    stats.fill_level = get_fill_level();
+    stats.evicting = evicting_;
+    stats.evicted = evicted_;
+    stats.store_evicted = store_evicted_;
+    stats.quota_rejections = quota_rejections_;
+    stats.full_rejections = full_rejections_;
+    return stats;
+}
+
+int64_t MemoryEngine::get_expired_estimate() {
+    // Not an estimate at all: we can just count them
+    std::shared_lock lock{mutex_};
+    auto now = std::chrono::system_clock::now();
+    int64_t expired = 0;
+    for (auto it = by_expiry_.begin(); it != by_expiry_.end() && it->first <= now; ++it)
+        expired++;
+    return expired;
+}
+
+std::vector<std::string> MemoryEngine::delete_all(const user_pubkey_t& pubkey) {
+    std::unique_lock lock{mutex_};
+    return remove_owned(pubkey, [](const message&) { return true; });
+}
+
+std::vector<std::string> MemoryEngine::delete_by_hash(
+        const user_pubkey_t& pubkey, const std::vector<std::string>& msg_hashes) {
+    std::unique_lock lock{mutex_};
+    std::vector<std::string> deleted;
+    for (auto& hash : msg_hashes) {
+        auto h = by_hash_.find(hash);
+        if (h == by_hash_.end())
+            continue;
+        auto it = messages_.find(h->second);
+        if (!(it->second.pubkey == pubkey))
+            continue;
+        deleted.push_back(hash);
+        remove(it);
+    }
+    return deleted;
+}
+
+std::vector<std::string> MemoryEngine::delete_by_timestamp(
+        const user_pubkey_t& pubkey, std::chrono::system_clock::time_point timestamp) {
+    std::unique_lock lock{mutex_};
+    return remove_owned(pubkey, [&](const message& m) { return m.timestamp <= timestamp; });
+}
+
+std::vector<std::string> MemoryEngine::update_expiry(
+        const user_pubkey_t& pubkey,
+        const std::vector<std::string>& msg_hashes,
+        std::chrono::system_clock::time_point new_exp) {
+    std::unique_lock lock{mutex_};
+    std::vector<std::string> updated;
+    for (auto& hash : msg_hashes) {
+        auto h = by_hash_.find(hash);
+        if (h == by_hash_.end())
+            continue;
+        auto it = messages_.find(h->second);
+        if (it->second.pubkey == pubkey && shorten_expiry(it, new_exp))
+            updated.push_back(hash);
+    }
+    return updated;
+}
+
+std::vector<std::string> MemoryEngine::update_all_expiries(
+        const user_pubkey_t& pubkey, std::chrono::system_clock::time_point new_exp) {
+    std::unique_lock lock{mutex_};
+    std::vector<std::string> updated;
+    auto owner = by_owner_.find(pubkey);
+    if (owner == by_owner_.end())
+        return updated;
+    for (auto id : owner->second) {
+        auto it = messages_.find(id);
+        if (shorten_expiry(it, new_exp))
+            updated.push_back(it->second.hash);
+    }
+    return updated;
+}
+
+} // namespace beldex
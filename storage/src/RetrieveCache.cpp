@@ -0,0 +1,228 @@
+#include "RetrieveCache.hpp"
+
+#include <algorithm>
+
+namespace beldex {
+
+std::optional<bool> RetrieveCache::retrieve(
+        const user_pubkey_t& pubkey,
+        std::string_view last_hash,
+        int max_count,
+        size_t max_size,
+        size_encoding encoding,
+        std::chrono::system_clock::time_point now,
+        const std::function<void(const message_view& msg)>& f) {
+    std::vector<std::shared_ptr<const message>> found;
+    bool more = false;
+    {
+        std::lock_guard lock{mutex_};
+        auto it = entries_.find(pubkey);
+        if (it == entries_.end() || it->second.state != entry::state_t::ready) {
+            misses_++;
+            return std::nullopt;
+        }
+        auto& e = it->second;
+        auto begin = e.messages.begin();
+        if (!last_hash.empty()) {
+            begin = std::find_if(e.messages.begin(), e.messages.end(),
+                    [&](const auto& m) { return m->hash == last_hash; });
+            if (begin != e.messages.end()) {
+                // Whether the database still has an expired message depends on when it gets
+                // removed, so we can't tell what it would return
+                if ((*begin)->expiry <= now) {
+                    misses_++;
+                    return std::nullopt;
+                }
+                ++begin;
+            } else if (e.complete) {
+                // Not one of the owner's messages, so the database would return all of them
+                begin = e.messages.begin();
+            } else {
+                misses_++;
+                return std::nullopt;
+            }
+        } else if (!e.complete) {
+            misses_++;
+            return std::nullopt;
+        }
+
+        size_t size = 0;
+        for (auto m = begin; m != e.messages.end(); ++m) {
+            if ((*m)->expiry <= now)
+                continue;
+            auto msg_size = counted_size((*m)->data.size(), encoding);
+            if ((max_count >= 0 && found.size() >= static_cast<size_t>(max_count)) ||
+                    (!found.empty() && msg_size > max_size - size)) {
+                more = true;
+                break;
+            }
+            size += std::min(msg_size, max_size);
+            found.push_back(*m);
+        }
+        lru_.splice(lru_.begin(), lru_, e.lru);
+    }
+
+    hits_++;
+    if (found.empty())
+        empty_++;
+    for (auto& m : found)
+        f(message_view{m->hash, m->timestamp, m->expiry, m->data});
+    return more;
+}
+
+RetrieveCache::store_guard::store_guard(RetrieveCache* cache, std::vector<user_pubkey_t> owners) :
+      cache_{cache}, owners_{std::move(owners)} {
+    if (cache_)
+        cache_->begin_stores(owners_);
+}
+
+RetrieveCache::store_guard::~store_guard() {
+    if (cache_)
+        cache_->end_stores(owners_);
+}
+
+void RetrieveCache::begin_stores(const std::vector<user_pubkey_t>& owners) {
+    std::lock_guard lock{mutex_};
+    for (auto& pubkey : owners) {
+        storing_[pubkey]++;
+        // A fill in progress may or may not read the new messages
+        if (auto it = entries_.find(pubkey);
+                it != entries_.end() && it->second.state == entry::state_t::filling)
+            it->second.state = entry::state_t::stale;
+    }
+}
+
+void RetrieveCache::end_stores(const std::vector<user_pubkey_t>& owners) {
+    std::lock_guard lock{mutex_};
+    for (auto& pubkey : owners)
+        if (auto it = storing_.find(pubkey); it != storing_.end() && --it->second <= 0)
+            storing_.erase(it);
+}
+
+uint64_t RetrieveCache::begin_fill(const user_pubkey_t& pubkey) {
+    std::lock_guard lock{mutex_};
+    if (storing_.count(pubkey))
+        return 0;
+    auto [it, inserted] = entries_.try_emplace(pubkey);
+    if (!inserted)
+        return 0;
+    auto reservation = it->second.reservation = next_reservation_++;
+    lru_.push_front(pubkey);
+    it->second.lru = lru_.begin();
+    bytes_ += it->second.bytes;
+    evict();
+    return reservation;
+}
+
+void RetrieveCache::fill(const user_pubkey_t& pubkey, uint64_t reservation, std::vector<message> newest) {
+    std::lock_guard lock{mutex_};
+    auto it = entries_.find(pubkey);
+    // The entry may have been evicted (and even reserved again) meanwhile
+    if (it == entries_.end() || it->second.reservation != reservation)
+        return;
+    auto& e = it->second;
+    if (e.state == entry::state_t::stale) {
+        erase(it);
+        return;
+    }
+    if (e.state != entry::state_t::filling)
+        return;
+    e.complete = newest.size() <= MAX_MESSAGES;
+    if (!e.complete)
+        newest.resize(MAX_MESSAGES);
+    for (auto& m : newest) {
+        auto bytes = message_bytes(m);
+        e.bytes += bytes;
+        bytes_ += bytes;
+        e.messages.push_front(std::make_shared<const message>(std::move(m)));
+    }
+    e.state = entry::state_t::ready;
+    evict();
+}
+
+void RetrieveCache::cancel_fill(const user_pubkey_t& pubkey, uint64_t reservation) {
+    std::lock_guard lock{mutex_};
+    auto it = entries_.find(pubkey);
+    if (it != entries_.end() && it->second.reservation == reservation && it->second.state != entry::state_t::ready)
+        erase(it);
+}
+
+void RetrieveCache::stored(const message& msg) {
+    std::lock_guard lock{mutex_};
+    auto it = entries_.find(msg.pubkey);
+    if (it == entries_.end())
+        return;
+    auto& e = it->second;
+    if (e.state == entry::state_t::filling)
+        e.state = entry::state_t::stale;
+    if (e.state != entry::state_t::ready)
+        return;
+    // Already there, if the entry was filled after the message was committed
+    if (std::any_of(e.messages.begin(), e.messages.end(), [&msg](const auto& m) { return m->hash == msg.hash; }))
+        return;
+    auto bytes = message_bytes(msg);
+    e.bytes += bytes;
+    bytes_ += bytes;
+    e.messages.push_back(std::make_shared<const message>(msg));
+    if (e.messages.size() > MAX_MESSAGES) {
+        bytes = message_bytes(*e.messages.front());
+        e.bytes -= bytes;
+        bytes_ -= bytes;
+        e.messages.pop_front();
+        e.complete = false;
+    }
+    evict();
+}
+
+void RetrieveCache::invalidate(const user_pubkey_t& pubkey) {
+    std::lock_guard lock{mutex_};
+    auto it = entries_.find(pubkey);
+    if (it == entries_.end())
+        return;
+    if (it->second.state == entry::state_t::ready)
+        erase(it);
+    else
+        it->second.state = entry::state_t::stale;
+}
+
+void RetrieveCache::clear() {
+    std::lock_guard lock{mutex_};
+    for (auto it = entries_.begin(); it != entries_.end(); ) {
+        if (it->second.state == entry::state_t::ready) {
+            erase(it++);
+        } else {
+            it->second.state = entry::state_t::stale;
+            ++it;
+        }
+    }
+}
+
+retrieve_cache_stats RetrieveCache::get_stats() const {
+    retrieve_cache_stats stats;
+    stats.enabled = true;
+    {
+        std::lock_guard lock{mutex_};
+        stats.entries = entries_.size();
+        stats.memory_bytes = bytes_;
+    }
+    stats.hits = hits_;
+    stats.empty = empty_;
+    stats.misses = misses_;
+    stats.evictions = evictions_;
+    return stats;
+}
+
+void RetrieveCache::erase(std::unordered_map<user_pubkey_t, entry>::iterator it) {
+    bytes_ -= it->second.bytes;
+    lru_.erase(it->second.lru);
+    entries_.erase(it);
+}
+
+void RetrieveCache::evict() {
+    while (bytes_ > budget_ && !lru_.empty()) {
+        erase(entries_.find(lru_.back()));
+        evictions_++;
+    }
+}
+
+} // namespace beldex
@@ -0,0 +1,220 @@
+#include "SegmentStore.hpp"
+#include "beldex_logger.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace beldex {
+
+namespace {
+
+// Each record is the body length (in native byte order) followed by the body.
+using record_len_t = uint32_t;
+constexpr size_t HEADER_SIZE = sizeof(record_len_t);
+
+[[noreturn]] void throw_errno(const std::string& what) {
+    throw std::system_error{errno, std::system_category(), what};
+}
+
+void sync_fd(int fd, const std::filesystem::path& path) {
+#ifdef __APPLE__
+    if (fsync(fd) != 0)
+#else
+    if (fdatasync(fd) != 0)
+#endif
+        throw_errno("Failed to sync " + path.u8string());
+}
+
+} // namespace
+
+struct SegmentStore::segment {
+    int fd = -1;
+    char* map = nullptr;
+    size_t map_size = 0;
+    std::atomic<uint64_t> size = 0;
+
+    ~segment() {
+        if (map)
+            munmap(map, map_size);
+        if (fd != -1)
+            close(fd);
+    }
+};
+
+SegmentStore::SegmentStore(std::filesystem::path dir) : dir_{std::move(dir)} {
+    std::error_code ec;
+    for (auto& entry : std::filesystem::directory_iterator{dir_, ec}) {
+        auto& path = entry.path();
+        auto name = path.filename().u8string();
+        if (name.size() != 12 || name.find_first_not_of("0123456789abcdef") != 8 ||
+                path.extension() != ".seg")
+            continue;
+        uint32_t id = std::stoul(name.substr(0, 8), nullptr, 16);
+        next_id_ = std::max(next_id_, id + 1);
+
+        auto seg = std::make_unique<segment>();
+        seg->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (seg->fd == -1)
+            throw_errno("Failed to open " + path.u8string());
+        seg->map_size = std::filesystem::file_size(path);
+        if (seg->map_size == 0) {
+            std::filesystem::remove(path);
+            continue;
+        }
+        void* map = mmap(nullptr, seg->map_size, PROT_READ, MAP_SHARED, seg->fd, 0);
+        if (map == MAP_FAILED)
+            throw_errno("Failed to map " + path.u8string());
+        seg->map = static_cast<char*>(map);
+        seg->size = seg->map_size;
+        total_size_ += seg->map_size;
+        segments_.emplace(id, std::move(seg));
+    }
+    if (!segments_.empty())
+        BELDEX_LOG(info, "Opened {} message data segments ({} bytes)", segments_.size(), total_size_.load());
+}
+
+SegmentStore::~SegmentStore() {
+    // Trim the unused (sparse) tail of the current segment
+    if (current_ && ftruncate(current_->fd, current_->size) != 0)
+        BELDEX_LOG(warn, "Failed to truncate {}: {}", file_path(next_id_ - 1).u8string(), strerror(errno));
+}
+
+std::filesystem::path SegmentStore::file_path(uint32_t id) const {
+    char name[13];
+    snprintf(name, sizeof(name), "%08x.seg", id);
+    return dir_ / name;
+}
+
+void SegmentStore::start_segment() {
+    if (current_) {
+        sync();
+        if (ftruncate(current_->fd, current_->size) != 0)
+            BELDEX_LOG(warn, "Failed to truncate {}: {}", file_path(next_id_ - 1).u8string(), strerror(errno));
+    }
+
+    if (next_id_ == 1)
+        std::filesystem::create_directories(dir_);
+    auto id = next_id_++;
+    auto path = file_path(id);
+    auto seg = std::make_unique<segment>();
+    seg->fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (seg->fd == -1)
+        throw_errno("Failed to create " + path.u8string());
+    // Size the file up front (sparsely) so that we can map it once and never remap it as it fills.
+    seg->map_size = SEGMENT_SIZE;
+    if (ftruncate(seg->fd, seg->map_size) != 0)
+        throw_errno("Failed to size " + path.u8string());
+    void* map = mmap(nullptr, seg->map_size, PROT_READ, MAP_SHARED, seg->fd, 0);
+    if (map == MAP_FAILED)
+        throw_errno("Failed to map " + path.u8string());
+    seg->map = static_cast<char*>(map);
+
+    // Make sure the new file itself survives a crash
+    if (int dirfd = open(dir_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC); dirfd != -1) {
+        fsync(dirfd);
+        close(dirfd);
+    }
+
+    std::unique_lock lock{segments_mutex_};
+    current_ = segments_.emplace(id, std::move(seg)).first->second.get();
+    BELDEX_LOG(debug, "Started message data segment {}", path.u8string());
+}
+
+int64_t SegmentStore::append(std::string_view data) {
+    if (data.size() > SEGMENT_SIZE - HEADER_SIZE)
+        throw std::invalid_argument{"Message data too large for a segment"};
+    if (!current_ || current_->size + HEADER_SIZE + data.size() > SEGMENT_SIZE)
+        start_segment();
+
+    uint64_t offset = current_->size;
+    record_len_t len = data.size();
+    char header[HEADER_SIZE];
+    std::memcpy(header, &len, HEADER_SIZE);
+    struct iovec iov[2] = {
+        {header, HEADER_SIZE},
+        {const_cast<char*>(data.data()), data.size()}};
+    size_t expected = HEADER_SIZE + data.size();
+    ssize_t written = pwritev(current_->fd, iov, 2, offset);
+    if (written < 0 || static_cast<size_t>(written) != expected) {
+        if (written >= 0)
+            errno = EIO;
+        throw_errno("Failed to write message data to " + file_path(next_id_ - 1).u8string());
+    }
+
+    current_->size = offset + expected;
+    total_size_ += expected;
+    dirty_ = true;
+    return segment_begin(next_id_ - 1) | static_cast<int64_t>(offset);
+}
+
+void SegmentStore::discard(int64_t locator) {
+    uint64_t offset = static_cast<uint32_t>(locator);
+    if (!current_ || segment_of(locator) != next_id_ - 1 || offset >= current_->size)
+        throw std::logic_error{"Can only discard the last appended message data"};
+    total_size_ -= current_->size - offset;
+    current_->size = offset;
+}
+
+void SegmentStore::sync() {
+    if (!dirty_)
+        return;
+    sync_fd(current_->fd, file_path(next_id_ - 1));
+    dirty_ = false;
+}
+
+std::string_view SegmentStore::read(int64_t locator) const {
+    const segment* seg = nullptr;
+    {
+        std::shared_lock lock{segments_mutex_};
+        if (auto it = segments_.find(segment_of(locator)); it != segments_.end())
+            seg = it->second.get();
+    }
+    uint64_t offset = static_cast<uint32_t>(locator);
+    uint64_t size = seg ? seg->size.load() : 0;
+    if (offset + HEADER_SIZE > size)
+        throw std::out_of_range{"Invalid message data locator " + std::to_string(locator)};
+    record_len_t len;
+    std::memcpy(&len, seg->map + offset, HEADER_SIZE);
+    if (offset + HEADER_SIZE + len > size)
+        throw std::out_of_range{"Corrupt message data record at " + std::to_string(locator)};
+    return {seg->map + offset + HEADER_SIZE, len};
+}
+
+std::vector<SegmentStore::segment_info> SegmentStore::sealed_segments() const {
+    std::vector<segment_info> sealed;
+    std::shared_lock lock{segments_mutex_};
+    for (auto& [id, seg] : segments_)
+        if (seg.get() != current_)
+            sealed.push_back({id, seg->size});
+    return sealed;
+}
+
+void SegmentStore::remove(uint32_t id) {
+    std::unique_ptr<segment> seg;
+    {
+        std::unique_lock remove_lock{remove_mutex_};
+        std::unique_lock lock{segments_mutex_};
+        auto it = segments_.find(id);
+        if (it == segments_.end() || it->second.get() == current_)
+            throw std::logic_error{"Can only remove a sealed segment"};
+        seg = std::move(it->second);
+        segments_.erase(it);
+    }
+    total_size_ -= seg->size;
+    seg.reset();
+    std::error_code ec;
+    if (!std::filesystem::remove(file_path(id), ec))
+        BELDEX_LOG(warn, "Failed to remove message data segment {}: {}", file_path(id).u8string(), ec.message());
+}
+
+} // namespace beldex
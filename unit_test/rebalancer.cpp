@@ -0,0 +1,303 @@
+#include "Database.hpp"
+#include "rebalancer.h"
+#include "serialization.h"
+#include "swarm.h"
+
+#include <catch2/catch.hpp>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fmt/format.h>
+
+using namespace beldex;
+using namespace std::literals;
+
+namespace {
+
+mn_record test_node(int i) {
+    mn_record mn;
+    mn.ip = "10.0.0." + std::to_string(i);
+    mn.pubkey_legacy = legacy_pubkey::from_hex(fmt::format("{:064x}", 0x1000 + i));
+    return mn;
+}
+
+// Stands in for the network of a Rebalancer: records the blobs each node accepts, and answers each
+// send (after a moment, from its own thread) with a failure if `fail` says so for the node.
+struct fake_network {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::function<bool(const mn_record& mn)> fail = [](const mn_record&) { return false; };
+    std::map<legacy_pubkey, std::vector<std::string>> received;
+    std::map<legacy_pubkey, int> outstanding, max_outstanding;
+    std::deque<std::tuple<legacy_pubkey, bool, std::function<void(bool)>>> replies;
+    bool stop = false;
+    std::thread thread{[this] { run(); }};
+
+    ~fake_network() {
+        {
+            std::lock_guard lock{mutex};
+            stop = true;
+        }
+        cv.notify_all();
+        thread.join();
+    }
+
+    Rebalancer::send_fn sender() {
+        return [this](const mn_record& mn, const std::string& blob, std::function<void(bool)> done) {
+            std::lock_guard lock{mutex};
+            bool ok = !fail(mn);
+            if (ok)
+                received[mn.pubkey_legacy].push_back(blob);
+            auto& n = ++outstanding[mn.pubkey_legacy];
+            max_outstanding[mn.pubkey_legacy] = std::max(max_outstanding[mn.pubkey_legacy], n);
+            replies.emplace_back(mn.pubkey_legacy, ok, std::move(done));
+            cv.notify_all();
+        };
+    }
+
+    void run() {
+        std::unique_lock lock{mutex};
+        while (true) {
+            cv.wait(lock, [this] { return stop || !replies.empty(); });
+            if (stop)
+                return;
+            auto [pk, ok, done] = std::move(replies.front());
+            replies.pop_front();
+            outstanding[pk]--;
+            lock.unlock();
+            std::this_thread::sleep_for(100us);
+            done(ok);
+            lock.lock();
+        }
+    }
+
+    // Returns the hashes of the messages a node received
+    std::multiset<std::string> hashes(const mn_record& mn) {
+        std::lock_guard lock{mutex};
+        std::multiset<std::string> result;
+        for (auto& blob : received[mn.pubkey_legacy])
+            for (auto& msg : deserialize_messages(blob))
+                result.insert(msg.hash);
+        return result;
+    }
+};
+
+Rebalancer::stats_t wait_for_jobs(const Rebalancer& rebalancer, int64_t jobs) {
+    auto until = std::chrono::steady_clock::now() + 20s;
+    auto stats = rebalancer.get_stats();
+    while (stats.jobs_done < jobs && std::chrono::steady_clock::now() < until) {
+        std::this_thread::sleep_for(5ms);
+        stats = rebalancer.get_stats();
+    }
+    REQUIRE(stats.jobs_done == jobs);
+    return stats;
+}
+
+// Stores `count` messages (of `size` bytes each) of random pubkeys; returns their hashes by swarm
+// space value
+std::multimap<uint64_t, std::string> store_messages(Database& db, int count, size_t size) {
+    std::mt19937_64 rng{42};
+    auto now = std::chrono::system_clock::now();
+    std::vector<message> msgs;
+    std::multimap<uint64_t, std::string> hashes;
+    for (int i = 0; i < count; i++) {
+        user_pubkey_t pk;
+        pk.load(fmt::format("05{:016x}{:048x}", rng(), 0));
+        hashes.emplace(pubkey_to_swarm_space(pk), "hash" + std::to_string(i));
+        msgs.emplace_back(pk, "hash" + std::to_string(i), now, now + 1h, std::string(size, 'x'));
+    }
+    db.bulk_store(msgs);
+    return hashes;
+}
+
+std::multiset<std::string> all_hashes(const std::multimap<uint64_t, std::string>& hashes) {
+    std::multiset<std::string> result;
+    for (auto& [ss, hash] : hashes)
+        result.insert(hash);
+    return result;
+}
+
+database_options memory_db() {
+    database_options opts;
+    opts.engine = storage_engine::memory;
+    return opts;
+}
+
+} // namespace
+
+TEST_CASE("rebalancer - relays everything with bounded sends", "[rebalancer]") {
+    Database db{".", memory_db()};
+    auto hashes = store_messages(db, 500, 1000);
+
+    fake_network net;
+    rebalance_options opts;
+    opts.batch_bytes = 20'000;
+    opts.max_in_flight = 2;
+    opts.bytes_per_second = 0;
+    Rebalancer rebalancer{db, net.sender(), [] { return SERIALIZATION_VERSION_OLD; }, opts};
+
+    std::vector<mn_record> nodes{test_node(1), test_node(2), test_node(3)};
+    rebalancer.relay_all(nodes);
+    auto stats = wait_for_jobs(rebalancer, 1);
+
+    for (auto& mn : nodes) {
+        CHECK(net.hashes(mn) == all_hashes(hashes));
+        CHECK(net.max_outstanding[mn.pubkey_legacy] <= 2);
+    }
+    CHECK_FALSE(stats.running);
+    CHECK(stats.messages == 500);
+    // Each database batch of 20 messages goes out as a single blob
+    CHECK(stats.batches_sent == 3 * 25);
+    CHECK(stats.retries == 0);
+    CHECK(stats.dropped == 0);
+    CHECK(stats.in_flight == 0);
+    CHECK(stats.pending_bytes == 0);
+}
+
+TEST_CASE("rebalancer - relays swarm space ranges", "[rebalancer]") {
+    Database db{".", memory_db()};
+    auto hashes = store_messages(db, 400, 100);
+
+    fake_network net;
+    rebalance_options opts;
+    opts.batch_bytes = 5'000;
+    opts.bytes_per_second = 0;
+    Rebalancer rebalancer{db, net.sender(), [] { return SERIALIZATION_VERSION_OLD; }, opts};
+
+    // The top quarter of the swarm space, and (wrapping around) the bottom quarter
+    std::vector<std::pair<uint64_t, uint64_t>> ranges{
+            {uint64_t{1} << 62, (uint64_t{1} << 63) - 1}, {uint64_t{3} << 62, (uint64_t{1} << 62) - 1}};
+    rebalancer.relay_all({test_node(1)}, ranges);
+    auto stats = wait_for_jobs(rebalancer, 1);
+
+    std::multiset<std::string> expected;
+    for (auto& [ss, hash] : hashes)
+        if (ss >> 62 != 2)
+            expected.insert(hash);
+    CHECK(expected.size() < 400);
+    CHECK(net.hashes(test_node(1)) == expected);
+    CHECK(stats.messages == static_cast<int64_t>(expected.size()));
+}
+
+TEST_CASE("rebalancer - bootstraps swarms", "[rebalancer]") {
+    Database db{".", memory_db()};
+    auto hashes = store_messages(db, 400, 100);
+
+    std::vector<SwarmInfo> swarms;
+    for (int i = 0; i < 4; i++)
+        swarms.push_back({uint64_t(i) << 62, {test_node(2 * i), test_node(2 * i + 1)}});
+    auto swarm = std::make_shared<Swarm>(test_node(100));
+    swarm->apply_swarm_changes(swarms);
+
+    fake_network net;
+    rebalance_options opts;
+    opts.batch_bytes = 5'000;
+    Rebalancer rebalancer{db, net.sender(), [] { return SERIALIZATION_VERSION_OLD; }, opts};
+
+    // Returns the hashes of the messages belonging to the given swarms
+    auto belonging = [&](std::set<swarm_id_t> ids) {
+        std::multiset<std::string> result;
+        for (auto& [ss, hash] : hashes) {
+            user_pubkey_t pk;
+            pk.load(fmt::format("05{:016x}{:048x}", ss, 0));
+            if (ids.count(swarm->get_swarm(pk).swarm_id))
+                result.insert(hash);
+        }
+        return result;
+    };
+
+    SECTION("new swarms") {
+        rebalancer.bootstrap(swarm, {swarms[1].swarm_id, swarms[3].swarm_id});
+        auto stats = wait_for_jobs(rebalancer, 1);
+        CHECK(stats.messages < 400);
+
+        for (int i : {1, 3})
+            for (auto& mn : swarms[i].mnodes)
+                CHECK(net.hashes(mn) == belonging({swarms[i].swarm_id}));
+        for (int i : {0, 2})
+            for (auto& mn : swarms[i].mnodes)
+                CHECK(net.hashes(mn).empty());
+    }
+
+    SECTION("all swarms") {
+        rebalancer.bootstrap(swarm);
+        wait_for_jobs(rebalancer, 1);
+        for (auto& s : swarms)
+            for (auto& mn : s.mnodes)
+                CHECK(net.hashes(mn) == belonging({s.swarm_id}));
+    }
+}
+
+TEST_CASE("rebalancer - retries and gives up on failing nodes", "[rebalancer]") {
+    Database db{".", memory_db()};
+    auto hashes = store_messages(db, 200, 1000);
+
+    auto flaky = test_node(1), down = test_node(2), up = test_node(3);
+    fake_network net;
+    int flaky_failures = 0;
+    net.fail = [&](const mn_record& mn) {
+        if (mn == flaky)
+            return flaky_failures++ < 2;
+        return mn == down;
+    };
+
+    rebalance_options opts;
+    opts.batch_bytes = 20'000;
+    opts.max_attempts = 3;
+    opts.retry_delay = 1ms;
+    Rebalancer rebalancer{db, net.sender(), [] { return SERIALIZATION_VERSION_OLD; }, opts};
+
+    rebalancer.relay_all({flaky, down, up});
+    auto stats = wait_for_jobs(rebalancer, 1);
+
+    CHECK(net.hashes(flaky) == all_hashes(hashes));
+    CHECK(net.hashes(up) == all_hashes(hashes));
+    CHECK(net.hashes(down).empty());
+    // Two of the flaky node's sends and two of the down node's get retried before we give up on the
+    // down node, dropping the rest of its batches.
+    CHECK(stats.retries == 4);
+    CHECK(stats.dropped == 10);
+    CHECK(stats.batches_sent == 20);
+    CHECK(stats.pending_bytes == 0);
+}
+
+TEST_CASE("rebalancer - bandwidth budget and progress", "[rebalancer]") {
+    Database db{".", memory_db()};
+    store_messages(db, 300, 1000);
+
+    fake_network net;
+    rebalance_options opts;
+    opts.batch_bytes = 10'000;
+    opts.bytes_per_second = 100'000;
+    Rebalancer rebalancer{db, net.sender(), [] { return SERIALIZATION_VERSION_OLD; }, opts};
+
+    // A second's worth (100kB) goes out at once, and the rest of the ~420kB of serialized messages
+    // at 100kB/s.
+    auto started = std::chrono::steady_clock::now();
+    rebalancer.relay_all({test_node(1)});
+
+    std::this_thread::sleep_for(1s);
+    auto stats = rebalancer.get_stats();
+    CHECK(stats.running);
+    CHECK(stats.job_estimate == 300);
+    CHECK(stats.job_messages > 0);
+    CHECK(stats.job_messages < 300);
+    REQUIRE(stats.job_eta);
+    CHECK(*stats.job_eta <= 3s);
+
+    stats = wait_for_jobs(rebalancer, 1);
+    CHECK(std::chrono::steady_clock::now() - started >= 2s);
+    CHECK(stats.messages == 300);
+    CHECK_FALSE(stats.job_eta);
+}
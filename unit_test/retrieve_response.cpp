@@ -0,0 +1,154 @@
+#include "Database.hpp"
+#include "retrieve_response.h"
+#include "beldex_logger.h"
+#include "time.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <bmq/base64.h>
+#include <catch2/catch.hpp>
+#include <nlohmann/json.hpp>
+
+using namespace beldex;
+using namespace std::literals;
+
+// Counts heap allocations (of the whole test binary) so that the benchmark below can report
+// allocations per retrieved message.
+static std::atomic<size_t> allocations = 0;
+
+// gcc flags free() of memory from operator new, not realizing that it is *our* operator new
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc{};
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+namespace {
+
+const std::filesystem::path DB_DIR{"retrieve_test"};
+
+struct RetrieveDeleter {
+    RetrieveDeleter() {
+        std::filesystem::remove_all(DB_DIR);
+        std::filesystem::create_directory(DB_DIR);
+    }
+    ~RetrieveDeleter() { std::filesystem::remove_all(DB_DIR); }
+};
+
+// The retrieve response as it used to be built: messages copied out of the database, base64
+// encoded into new strings, inserted into a json DOM and then dumped.
+std::string retrieve_via_json(Database& db, const user_pubkey_t& pk, std::chrono::system_clock::time_point now) {
+    auto page = db.retrieve_page(pk, "", 100);
+    auto messages = nlohmann::json::array();
+    for (auto& msg : page.messages) {
+        messages.push_back(nlohmann::json{
+            {"hash", msg.hash},
+            {"timestamp", to_epoch_ms(msg.timestamp)},
+            {"expiration", to_epoch_ms(msg.expiry)},
+            {"data", bmq::to_base64(msg.data)},
+        });
+    }
+    return nlohmann::json{
+        {"messages", std::move(messages)},
+        {"more", page.more},
+        {"t", to_epoch_ms(now)},
+    }.dump();
+}
+
+std::string retrieve_via_writer(Database& db, const user_pubkey_t& pk, std::chrono::system_clock::time_point now, bool json = true) {
+    retrieve_response_writer writer{json};
+    bool more = db.retrieve_each(pk, "", 100, std::numeric_limits<size_t>::max(), size_encoding::raw,
+            [&writer](const message_view& msg) { writer.append(msg); });
+    return writer.finish(more, now);
+}
+
+} // namespace
+
+TEST_CASE("retrieve response - matches json encoding", "[retrieve]") {
+    RetrieveDeleter fixture;
+    Database db{DB_DIR};
+
+    user_pubkey_t pk;
+    REQUIRE(pk.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+
+    auto now = from_epoch_ms(1'650'000'000'000);
+    CHECK(retrieve_via_writer(db, pk, now) == R"({"messages":[],"more":false,"t":1650000000000})");
+    CHECK(retrieve_via_writer(db, pk, now, false) == "d8:messagesle4:morei0e1:ti1650000000000ee");
+
+    // Data sizes covering each base64 padding length, and binary data
+    std::vector<message> msgs;
+    msgs.emplace_back(pk, "weird\"hash\n", now, now + 1h, "\0\xff"s);
+    for (int i = 1; i < 105; i++)
+        msgs.emplace_back(pk, "hash" + std::to_string(i), now, now + 1h + 1ms * i,
+                std::string(i, static_cast<char>(i * 7)));
+    db.bulk_store(msgs);
+
+    auto json = retrieve_via_writer(db, pk, now);
+    CHECK(json == retrieve_via_json(db, pk, now));
+    auto parsed = nlohmann::json::parse(json);
+    CHECK(parsed["messages"].size() == 100);
+    CHECK(parsed["more"] == true);
+    CHECK(bmq::from_base64(parsed["messages"][99]["data"].get<std::string>()) == msgs[99].data);
+
+    retrieve_response_writer writer{false};
+    writer.append({"h", from_epoch_ms(12), from_epoch_ms(345), "a\0b"sv});
+    writer.append({"hh", from_epoch_ms(0), from_epoch_ms(-1), ""sv});
+    CHECK(writer.count() == 2);
+    CHECK(writer.finish(true, from_epoch_ms(6)) ==
+            "d8:messagesl"
+            "d4:data3:a\0b10:expirationi345e4:hash1:h9:timestampi12ee"
+            "d4:data0:10:expirationi-1e4:hash2:hh9:timestampi0ee"
+            "e4:morei1e1:ti6ee"sv);
+}
+
+TEST_CASE("retrieve response - throughput and allocations", "[retrieve][!benchmark]") {
+    RetrieveDeleter fixture;
+    Database db{DB_DIR};
+
+    user_pubkey_t pk;
+    REQUIRE(pk.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    auto now = std::chrono::system_clock::now();
+
+    for (size_t size : {100, 4'000, 76'800}) {
+        std::vector<message> msgs;
+        for (int i = 0; i < 100; i++)
+            msgs.emplace_back(pk, fmt::format("hash-{}-{}", size, i), now, now + 1h, std::string(size, 'x'));
+        db.delete_all(pk);
+        db.bulk_store(msgs);
+
+        for (auto [name, f] : {
+                std::pair{"json DOM", &retrieve_via_json},
+                std::pair{"writer", +[](Database& db, const user_pubkey_t& pk, std::chrono::system_clock::time_point now) {
+                    return retrieve_via_writer(db, pk, now);
+                }}}) {
+            constexpr int runs = 50;
+            auto allocs_before = allocations.load();
+            auto start = std::chrono::steady_clock::now();
+            size_t bytes = 0;
+            for (int i = 0; i < runs; i++)
+                bytes += f(db, pk, now).size();
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            std::cout << fmt::format("{}-byte messages via {}: {:.1f} MB/s, {:.1f} allocations/message\n",
+                    size, name, bytes / elapsed.count() / 1e6,
+                    double(allocations.load() - allocs_before) / (runs * msgs.size()));
+
+            BENCHMARK(fmt::format("retrieve 100 x {} bytes via {}", size, name)) {
+                return f(db, pk, now).size();
+            };
+        }
+    }
+}
@@ -1,12 +1,15 @@
 #include <catch2/catch.hpp>
 #include <iostream>
+#include <random>
 
+#include "beldex_logger.h"
 #include "beldexd_key.h"
 #include "request_handler.h"
 #include "swarm.h"
 #include "time.hpp"
 
 #include <bmq/base64.h>
+#include <nlohmann/json.hpp>
 
 using namespace std::literals;
 
@@ -115,3 +118,236 @@ TEST_CASE("master nodes - pubkey to swarm id") {
     REQUIRE(pk.load("050000000000000000000000000000000000000000000000000123456789abcdef"));
     CHECK(pubkey_to_swarm_space(pk) == 0x0123456789abcdefULL);
 }
+
+TEST_CASE("master nodes - swarm space ranges") {
+    using beldex::SwarmInfo;
+    std::vector<SwarmInfo> swarms{{1000, {}}, {5000, {}}, {20000, {}}, {beldex::INVALID_SWARM_ID, {}}};
+
+    using range = std::pair<uint64_t, uint64_t>;
+    // Midpoints between neighbours; the outer swarms share the wrap-around gap
+    CHECK(beldex::swarm_space_range(swarms, 1000) == range{20001, 3000});
+    CHECK(beldex::swarm_space_range(swarms, 5000) == range{3000, 12500});
+    CHECK(beldex::swarm_space_range(swarms, 20000) == range{12500, 999});
+    CHECK_FALSE(beldex::swarm_space_range(swarms, 1234));
+
+    swarms.resize(1);
+    CHECK(beldex::swarm_space_range(swarms, 1000) == range{0, UINT64_MAX});
+
+    // Every pubkey must fall within the range of the swarm it gets assigned to
+    swarms = {{0x1000000000000000, {}}, {0x8000000000000000, {}}, {0xf000000000000000, {}}};
+    beldex::user_pubkey_t pk;
+    for (auto hex : {
+            "050000000000000000000000000000000000000000000000000000000000000000",
+            "05ffffffffffffffff000000000000000000000000000000000000000000000000",
+            "054800000000000000000000000000000000000000000000000000000000000000",
+            "04b800000000000000000000000000000000000000000000000000000000000001",
+            "050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"}) {
+        REQUIRE(pk.load(hex));
+        auto swarm = beldex::get_swarm_by_pk(swarms, pk).swarm_id;
+        auto r = beldex::swarm_space_range(swarms, swarm);
+        REQUIRE(r);
+        auto val = beldex::pubkey_to_swarm_space(pk);
+        CHECK((r->first <= r->second ? val >= r->first && val <= r->second
+                                     : val >= r->first || val <= r->second));
+    }
+}
+
+// Returns a pubkey that maps to the given swarm space value
+static beldex::user_pubkey_t pubkey_in_swarm_space(uint64_t val) {
+    beldex::user_pubkey_t pk;
+    pk.load(fmt::format("05{:016x}{}", val, std::string(48, '0')));
+    return pk;
+}
+
+TEST_CASE("master nodes - indexed swarm lookups", "[master-nodes][swarms]") {
+    using beldex::SwarmInfo;
+    using beldex::INVALID_SWARM_ID;
+
+    std::mt19937_64 rng{1234};
+    auto random_id = [&]() -> beldex::swarm_id_t {
+        switch (rng() % 5) {
+            case 0: return rng() % 20;
+            case 1: return INVALID_SWARM_ID - 1 - rng() % 20;
+            case 2: return (rng() % 8) * (INVALID_SWARM_ID / 8);
+            case 3: return INVALID_SWARM_ID;
+            default: return rng();
+        }
+    };
+
+    for (int round = 0; round < 500; round++) {
+        std::vector<SwarmInfo> swarms;
+        auto count = round < 10 ? round : rng() % 40;
+        for (size_t i = 0; i < count; i++)
+            swarms.push_back({random_id(), {}});
+        // Some duplicated swarm ids
+        if (count > 1 && round % 3 == 0)
+            swarms.push_back({swarms[rng() % count].swarm_id, {}});
+
+        beldex::Swarm swarm{create_dummy_mn_record()};
+        swarm.apply_swarm_changes(swarms);
+        const auto& all = swarm.all_valid_swarms();
+
+        // Swarm ids, their neighbours and the midpoints between them, the ends of the swarm space,
+        // and random values
+        std::vector<uint64_t> vals{0, 1, INVALID_SWARM_ID - 1, INVALID_SWARM_ID};
+        for (const auto& a : all) {
+            for (const auto& b : all)
+                vals.push_back(a.swarm_id / 2 + b.swarm_id / 2 + (a.swarm_id & b.swarm_id & 1));
+            vals.push_back(a.swarm_id - 1);
+            vals.push_back(a.swarm_id);
+            vals.push_back(a.swarm_id + 1);
+        }
+        for (int i = 0; i < 50; i++)
+            vals.push_back(random_id());
+
+        for (auto val : vals) {
+            auto pk = pubkey_in_swarm_space(val);
+            REQUIRE(beldex::pubkey_to_swarm_space(pk) == val);
+            // The very same swarm, including for duplicated ids and when there are no swarms
+            const SwarmInfo& expected = beldex::get_swarm_by_pk(all, pk);
+            const SwarmInfo& found = swarm.get_swarm(pk);
+            INFO("round " << round << ", swarm space value " << val);
+            REQUIRE(&found == &expected);
+        }
+    }
+}
+
+TEST_CASE("master nodes - swarm lookup speed", "[master-nodes][swarms][!benchmark]") {
+    std::mt19937_64 rng{1234};
+    std::vector<beldex::SwarmInfo> swarms;
+    for (int i = 0; i < 500; i++)
+        swarms.push_back({rng(), {}});
+    beldex::Swarm swarm{create_dummy_mn_record()};
+    swarm.apply_swarm_changes(swarms);
+
+    std::vector<beldex::user_pubkey_t> pks;
+    for (int i = 0; i < 1000; i++)
+        pks.push_back(pubkey_in_swarm_space(rng()));
+
+    BENCHMARK("linear scan, 500 swarms x 1000 pubkeys") {
+        uint64_t sum = 0;
+        for (const auto& pk : pks)
+            sum += beldex::get_swarm_by_pk(swarm.all_valid_swarms(), pk).swarm_id;
+        return sum;
+    };
+    BENCHMARK("sorted index, 500 swarms x 1000 pubkeys") {
+        uint64_t sum = 0;
+        for (const auto& pk : pks)
+            sum += swarm.get_swarm(pk).swarm_id;
+        return sum;
+    };
+}
+
+// Returns a distinct, random-looking (as pubkeys hash on their first bytes) hex key for each `i`
+static std::string test_key(uint64_t i) {
+    return fmt::format("{:016x}{:048x}", i * 0x9e3779b97f4a7c15ULL, i);
+}
+
+// Returns a get_master_nodes response (as beldexd gives it) listing `count` nodes in swarms of 5,
+// except for every 50th which is decommissioned.
+static std::string master_nodes_response(int count, uint64_t height) {
+    auto nodes = nlohmann::json::array();
+    for (int i = 0; i < count; i++)
+        nodes.push_back({
+            {"master_node_pubkey", test_key(i + 1)},
+            {"pubkey_ed25519", test_key(100000 + i)},
+            {"pubkey_x25519", test_key(200000 + i)},
+            {"public_ip", fmt::format("10.0.{}.{}", i / 256, i % 256)},
+            {"storage_port", 22021},
+            {"storage_lmq_port", 22020},
+            {"swarm_id", i % 50 == 49 ? beldex::INVALID_SWARM_ID : uint64_t(i / 5) << 48},
+            {"funded", true},
+        });
+    return nlohmann::json{
+        {"height", height},
+        {"block_hash", fmt::format("{:064x}", height)},
+        {"hardfork", 18},
+        {"mnode_revision", 1},
+        {"master_node_states", std::move(nodes)},
+    }.dump();
+}
+
+TEST_CASE("master nodes - swarm updates", "[master-nodes][swarms]") {
+    auto bu = beldex::parse_swarm_update(master_nodes_response(20, 1234));
+    CHECK(bu.height == 1234);
+    CHECK(bu.hardfork == 18);
+    CHECK(bu.mnode_revision == 1);
+    CHECK_FALSE(bu.unchanged);
+    REQUIRE(bu.swarms.size() == 4);
+    CHECK(bu.swarms[1].swarm_id == uint64_t{1} << 48);
+    CHECK(bu.swarms[1].mnodes.size() == 5);
+    CHECK(bu.swarms[3].mnodes.size() == 5);
+    CHECK(bu.decommissioned_nodes.empty());
+    CHECK(bu.active_x25519_pubkeys.size() == 20);
+    CHECK_THROWS(beldex::parse_swarm_update(""));
+    CHECK_THROWS(beldex::parse_swarm_update("{\"height\": 1}"));
+
+    // Only the changes get applied to the funded nodes, and copies of the swarm made before an
+    // update don't see it.
+    beldex::Swarm swarm{bu.swarms[0].mnodes[0]};
+    auto apply = [&swarm](const beldex::block_update& bu) {
+        swarm.update_state(bu.swarms, bu.decommissioned_nodes,
+                swarm.derive_swarm_events(bu.swarms), true);
+    };
+    apply(bu);
+    CHECK(swarm.all_funded_nodes().size() == 20);
+    CHECK(swarm.all_valid_swarms().size() == 4);
+
+    auto& changed = bu.swarms[1].mnodes[2];
+    auto old_x25519 = changed.pubkey_x25519;
+    changed.ip = "1.2.3.4";
+    changed.pubkey_x25519 = beldex::x25519_pubkey::from_hex(test_key(999));
+    auto removed = bu.swarms[3].mnodes.back();
+    bu.swarms[3].mnodes.pop_back();
+    auto added = removed;
+    added.pubkey_legacy = beldex::legacy_pubkey::from_hex(test_key(5555));
+    added.pubkey_ed25519 = beldex::ed25519_pubkey::from_hex(test_key(6666));
+    added.pubkey_x25519 = beldex::x25519_pubkey::from_hex(test_key(7777));
+    bu.decommissioned_nodes.push_back(added);
+
+    const beldex::Swarm before = swarm;
+    apply(bu);
+
+    CHECK(swarm.all_funded_nodes().size() == 20);
+    CHECK(swarm.find_node(changed.pubkey_legacy)->ip == "1.2.3.4");
+    CHECK(swarm.find_node(changed.pubkey_x25519)->pubkey_legacy == changed.pubkey_legacy);
+    CHECK_FALSE(swarm.find_node(old_x25519));
+    CHECK(swarm.find_node(changed.pubkey_ed25519)->ip == "1.2.3.4");
+    CHECK_FALSE(swarm.find_node(removed.pubkey_legacy));
+    CHECK_FALSE(swarm.find_node(removed.pubkey_ed25519));
+    CHECK_FALSE(swarm.find_node(removed.pubkey_x25519));
+    CHECK(swarm.find_node(added.pubkey_ed25519)->pubkey_legacy == added.pubkey_legacy);
+    CHECK(swarm.find_node(added.pubkey_x25519)->pubkey_legacy == added.pubkey_legacy);
+
+    CHECK(before.all_funded_nodes().size() == 20);
+    CHECK(before.find_node(changed.pubkey_legacy)->ip != "1.2.3.4");
+    CHECK(before.find_node(old_x25519));
+    CHECK(before.find_node(removed.pubkey_legacy));
+    CHECK_FALSE(before.find_node(added.pubkey_legacy));
+    CHECK(before.all_valid_swarms()[3].mnodes.size() == 5);
+    CHECK(swarm.all_valid_swarms()[3].mnodes.size() == 4);
+}
+
+TEST_CASE("master nodes - swarm update latency", "[master-nodes][swarms][!benchmark]") {
+    auto bu = beldex::parse_swarm_update(master_nodes_response(1500, 1000));
+    beldex::Swarm swarm{bu.swarms[0].mnodes[0]};
+    swarm.update_state(bu.swarms, bu.decommissioned_nodes, swarm.derive_swarm_events(bu.swarms), true);
+
+    // The next block, on which one node changed its IP
+    const auto next = master_nodes_response(1500, 1001);
+    auto next_bu = beldex::parse_swarm_update(next);
+    next_bu.swarms[10].mnodes[1].ip = "1.2.3.4";
+
+    BENCHMARK("parse 1500-node update") {
+        return beldex::parse_swarm_update(next);
+    };
+    BENCHMARK("apply 1500-node update") {
+        beldex::Swarm s = swarm;
+        s.update_state(next_bu.swarms, next_bu.decommissioned_nodes,
+                s.derive_swarm_events(next_bu.swarms), true);
+        return s;
+    };
+    BENCHMARK("copy 1500-node swarm") {
+        return beldex::Swarm{swarm};
+    };
+}
@@ -0,0 +1,63 @@
+#include "single_flight.h"
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+using namespace beldex;
+using namespace std::literals;
+
+TEST_CASE("single flight - coalesces concurrent identical calls", "[single_flight]") {
+    single_flight<std::string, std::string> flight;
+
+    std::atomic<int> runs = 0;
+    std::promise<void> release;
+    auto released = release.get_future().share();
+
+    std::mutex results_mutex;
+    std::vector<std::string> results;
+    auto record = [&](std::string r) {
+        std::lock_guard lock{results_mutex};
+        results.push_back(std::move(r));
+    };
+    auto get_results = [&] {
+        std::lock_guard lock{results_mutex};
+        return results;
+    };
+
+    bool leader_coalesced = true;
+    std::thread leader{[&] {
+        leader_coalesced = flight("k", [&]() noexcept {
+            runs++;
+            released.wait();
+            return "result"s;
+        }, record);
+    }};
+    while (runs == 0)
+        std::this_thread::sleep_for(1ms);
+
+    // Calls for the running key wait (without blocking) for its result...
+    for (int i = 0; i < 2; i++)
+        CHECK(flight("k", [&]() noexcept { runs++; return "other"s; }, record));
+    // ... while other keys aren't held up
+    CHECK_FALSE(flight("k2", [&]() noexcept { return "k2"s; }, record));
+    CHECK(get_results() == std::vector{"k2"s});
+
+    release.set_value();
+    leader.join();
+    CHECK_FALSE(leader_coalesced);
+    CHECK(runs == 1);
+    CHECK(get_results() == std::vector{"k2"s, "result"s, "result"s, "result"s});
+    CHECK(flight.coalesced() == 2);
+
+    // Results aren't cached: once the operation is done the next call runs it again
+    CHECK_FALSE(flight("k", [&]() noexcept { runs++; return "again"s; }, record));
+    CHECK(runs == 2);
+    CHECK(get_results().back() == "again");
+}
@@ -0,0 +1,152 @@
+#include "snapshot.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+using namespace beldex;
+using namespace std::literals;
+
+namespace {
+struct counters {
+    int64_t a = 0, b = 0;
+};
+}
+
+TEST_CASE("snapshot - updates publish new values", "[snapshot]") {
+    snapshot<std::string> value{"one"};
+
+    auto first = value.load();
+    CHECK(*first == "one");
+
+    auto second = value.update([](std::string& v) { v += " two"; });
+    CHECK(*second == "one two");
+    CHECK(value.load() == second);
+    // A loaded value is not affected by later updates
+    CHECK(*first == "one");
+
+    // Nothing is published by an update that throws
+    CHECK_THROWS_AS(
+            value.update([](std::string& v) { v = "three"; throw std::runtime_error{"oops"}; }),
+            std::runtime_error);
+    CHECK(value.load() == second);
+}
+
+TEST_CASE("snapshot - concurrent updates and reads", "[snapshot]") {
+    snapshot<counters> value;
+
+    constexpr int WRITERS = 4, UPDATES = 1000;
+    std::atomic<bool> done = false;
+    std::atomic<int> inconsistent = 0;
+
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; i++)
+        readers.emplace_back([&] {
+            while (!done) {
+                auto v = value.load();
+                if (v->a != v->b)
+                    inconsistent++;
+            }
+        });
+
+    std::vector<std::thread> writers;
+    for (int i = 0; i < WRITERS; i++)
+        writers.emplace_back([&] {
+            for (int j = 0; j < UPDATES; j++)
+                value.update([](counters& c) {
+                    c.a++;
+                    c.b++;
+                });
+        });
+    for (auto& t : writers)
+        t.join();
+    done = true;
+    for (auto& t : readers)
+        t.join();
+
+    // Readers never see a partial update, and no update gets lost
+    CHECK(inconsistent == 0);
+    CHECK(value.load()->a == WRITERS * UPDATES);
+    CHECK(value.load()->b == WRITERS * UPDATES);
+}
+
+// Compares request threads reading swarm state guarded by a recursive mutex, held across the
+// request's work (as MasterNode's state used to be, e.g. across the database store of a message),
+// against reading a snapshot of it, while a writer rebuilds the state (taking ~200us, like
+// processing a block update) every millisecond.
+TEST_CASE("snapshot - read contention", "[snapshot][!benchmark]") {
+    constexpr int READS = 5000;
+    std::vector<uint64_t> initial(1000);
+    for (size_t i = 0; i < initial.size(); i++)
+        initial[i] = i * 7919;
+
+    // Each request finds a pubkey's swarm and then does about a microsecond of other work
+    auto request = [](const std::vector<uint64_t>& ids, uint64_t x) {
+        return std::lower_bound(ids.begin(), ids.end(), x) - ids.begin();
+    };
+    auto work = [](uint64_t x, std::chrono::nanoseconds d) {
+        auto until = std::chrono::steady_clock::now() + d;
+        while (std::chrono::steady_clock::now() < until)
+            x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        return int64_t(x & 1);
+    };
+    auto rebuild = [&](std::vector<uint64_t>& ids) {
+        ids = initial;
+        work(0, 200us);
+    };
+
+    auto run = [](int threads, auto read, auto write) {
+        std::atomic<bool> done = false;
+        std::thread writer{[&] {
+            while (!done) {
+                write();
+                std::this_thread::sleep_for(1ms);
+            }
+        }};
+        std::vector<std::thread> readers;
+        std::atomic<int64_t> sum = 0;
+        for (int i = 0; i < threads; i++)
+            readers.emplace_back([&, i] {
+                int64_t s = 0;
+                for (int j = 0; j < READS; j++)
+                    s += read(uint64_t(i * READS + j) * 131);
+                sum += s;
+            });
+        for (auto& t : readers)
+            t.join();
+        done = true;
+        writer.join();
+        return sum.load();
+    };
+
+    for (int threads : {1, 2, 4, 8}) {
+        std::recursive_mutex mutex;
+        std::vector<uint64_t> locked = initial;
+        BENCHMARK("recursive mutex, " + std::to_string(threads) + " threads") {
+            return run(threads,
+                    [&](uint64_t x) {
+                        std::lock_guard lock{mutex};
+                        return request(locked, x) + work(x, 1us);
+                    },
+                    [&] {
+                        std::lock_guard lock{mutex};
+                        rebuild(locked);
+                    });
+        };
+
+        snapshot<std::vector<uint64_t>> snap{initial};
+        BENCHMARK("snapshot, " + std::to_string(threads) + " threads") {
+            return run(threads,
+                    [&](uint64_t x) { return request(*snap.load(), x) + work(x, 1us); },
+                    [&] { snap.update(rebuild); });
+        };
+    }
+}
@@ -1,14 +1,27 @@
 #include "Database.hpp"
+#include "DbMaintainer.hpp"
+#include "ExpirySweeper.hpp"
+#include "HashFilter.hpp"
+#include "RetrieveCache.hpp"
+#include "time.hpp"
 #include "utils.hpp"
 
 #include "beldex_logger.h"
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <filesystem>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <optional>
+#include <set>
 #include <string>
 #include <thread>
+#include <vector>
 
+#include <SQLiteCpp/SQLiteCpp.h>
 #include <catch2/catch.hpp>
 
 using namespace beldex;
@@ -18,12 +31,22 @@ using namespace std::literals;
 struct StorageDeleter {
     StorageDeleter() {
         std::filesystem::remove("storage.db");
+        std::filesystem::remove_all("blobs");
     }
     ~StorageDeleter() {
         std::filesystem::remove("storage.db");
+        std::filesystem::remove_all("blobs");
     }
 };
 
+// Options for the tests that every storage engine must pass, which are run once with each engine.
+// This must be called before any SECTION of the test.
+static database_options test_options() {
+    database_options opts;
+    opts.engine = GENERATE(storage_engine::sqlite, storage_engine::memory);
+    return opts;
+}
+
 TEST_CASE("storage - database file creation", "[storage]") {
     StorageDeleter fixture;
 
@@ -76,7 +99,7 @@ TEST_CASE("storage - returns false when storing existing hash", "[storage]") {
     const auto ttl = 123456ms;
     const auto timestamp = std::chrono::system_clock::now();
 
-    Database storage{"."};
+    Database storage{".", test_options()};
 
     auto ins = storage.store({pubkey, hash, timestamp, timestamp + ttl, bytes});
     REQUIRE(ins);
@@ -93,7 +116,7 @@ TEST_CASE("storage - returns false when storing existing hash", "[storage]") {
 TEST_CASE("storage - only return entries for specified pubkey", "[storage]") {
     StorageDeleter fixture;
 
-    Database storage{"."};
+    Database storage{".", test_options()};
 
     user_pubkey_t pubkey1, pubkey2;
     REQUIRE(pubkey1.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
@@ -123,7 +146,7 @@ TEST_CASE("storage - only return entries for specified pubkey", "[storage]") {
 TEST_CASE("storage - return entries older than lasthash", "[storage]") {
     StorageDeleter fixture;
 
-    Database storage{"."};
+    Database storage{".", test_options()};
 
     user_pubkey_t pubkey;
     REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
@@ -162,7 +185,7 @@ TEST_CASE("storage - remove expired entries", "[storage]") {
     REQUIRE(pubkey2.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
     REQUIRE(pubkey3.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcded"));
 
-    Database storage{"."};
+    Database storage{".", test_options()};
 
     auto now = std::chrono::system_clock::now();
     CHECK(storage.store({pubkey1, "hash0", now, now + 1s, "bytesasstring0"}));
@@ -193,6 +216,75 @@ TEST_CASE("storage - remove expired entries", "[storage]") {
     CHECK(storage.get_message_count() == 2);
 }
 
+TEST_CASE("storage - chunked expiry cleanup", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey_t pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+
+    auto opts = test_options();
+    Database storage{".", opts};
+
+    auto now = std::chrono::system_clock::now();
+    for (int i = 0; i < 25; i++)
+        CHECK(storage.store({pubkey, "expired" + std::to_string(i), now - 1h, now - 5min, "data"}));
+    for (int i = 0; i < 5; i++)
+        CHECK(storage.store({pubkey, "current" + std::to_string(i), now, now + 1h, "data"}));
+
+    CHECK(storage.get_message_count() == 30);
+    CHECK(storage.get_expired_estimate() == 25);
+
+    CHECK(storage.clean_expired_chunk(10) == 10);
+    CHECK(storage.get_expired_estimate() == 15);
+    CHECK(storage.clean_expired_chunk(10) == 10);
+    CHECK(storage.clean_expired_chunk(10) == 5);
+    CHECK(storage.clean_expired_chunk(10) == 0);
+    CHECK(storage.get_expired_estimate() == 0);
+
+    CHECK(storage.get_message_count() == 5);
+    CHECK(storage.get_owner_count() == 1);
+
+    // Deleting messages behind the estimate's back leaves it too high until a cleanup finds that
+    // there is nothing left to remove (the memory engine counts exactly, so it isn't affected)
+    CHECK(storage.store({pubkey, "expired-again", now - 1h, now - 5min, "data"}));
+    CHECK(storage.delete_by_hash(pubkey, {"expired-again"}).size() == 1);
+    CHECK(storage.get_expired_estimate() == (opts.engine == storage_engine::sqlite ? 1 : 0));
+    CHECK(storage.clean_expired_chunk(10) == 0);
+    CHECK(storage.get_expired_estimate() == 0);
+}
+
+TEST_CASE("storage - background expiry sweeper", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey_t pubkey1, pubkey2;
+    REQUIRE(pubkey1.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pubkey2.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+
+    Database storage{".", test_options()};
+    ExpirySweeper sweeper{storage};
+
+    auto now = std::chrono::system_clock::now();
+    std::vector<message> msgs;
+    for (int i = 0; i < 1200; i++)
+        msgs.emplace_back(pubkey1, "expired" + std::to_string(i), now - 1h, now - 5min, "data");
+    msgs.emplace_back(pubkey2, "current", now, now + 1h, "data");
+    storage.bulk_store(msgs);
+
+    auto give_up = std::chrono::steady_clock::now() + 10s;
+    while (storage.get_message_count() > 1 && std::chrono::steady_clock::now() < give_up)
+        std::this_thread::sleep_for(50ms);
+
+    CHECK(storage.get_message_count() == 1);
+    CHECK(storage.get_owner_count() == 1);
+    CHECK(storage.retrieve(pubkey2, "").size() == 1);
+
+    auto stats = sweeper.get_stats();
+    CHECK(stats.removed == 1200);
+    // Chunked: 500 + 500 + 200
+    CHECK(stats.chunks >= 3);
+    CHECK(stats.max_chunk >= stats.last_chunk);
+}
+
 TEST_CASE("storage - bulk data storage", "[storage]") {
     StorageDeleter fixture;
 
@@ -204,7 +296,7 @@ TEST_CASE("storage - bulk data storage", "[storage]") {
 
     const size_t num_items = 100;
 
-    Database storage{"."};
+    Database storage{".", test_options()};
 
     // bulk store
     {
@@ -237,7 +329,7 @@ TEST_CASE("storage - bulk storage with overlap", "[storage]") {
 
     const size_t num_items = 100;
 
-    Database storage{"."};
+    Database storage{".", test_options()};
 
     // insert existing; the bulk store shouldn't fail when these conflicts already exist
     CHECK(storage.store({pubkey, "0", timestamp, timestamp + ttl, bytes}));
@@ -269,7 +361,7 @@ TEST_CASE("storage - bulk storage with overlap", "[storage]") {
 TEST_CASE("storage - retrieve limit", "[storage]") {
     StorageDeleter fixture;
 
-    Database storage{"."};
+    Database storage{".", test_options()};
 
     user_pubkey_t pubkey;
     REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
@@ -300,3 +392,1437 @@ TEST_CASE("storage - retrieve limit", "[storage]") {
     CHECK(storage.retrieve(pubkey, "", 101).size() == 100);
     CHECK(storage.retrieve(pubkey2, "", 10).size() == 5);
 }
+
+TEST_CASE("storage - retrieve pages by count and size", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey_t pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+
+    auto opts = test_options();
+    SECTION("inline data") {}
+    SECTION("blob segments") { opts.blob_segments = true; }
+    Database storage{".", opts};
+
+    auto now = std::chrono::system_clock::now();
+    for (int i = 0; i < 25; i++)
+        storage.store({pubkey, "hash" + std::to_string(i), now, now + 100s, std::string(100, 'a' + i)});
+
+    auto page = storage.retrieve_page(pubkey, "", 10);
+    CHECK(page.messages.size() == 10);
+    CHECK(page.more);
+    page = storage.retrieve_page(pubkey, "hash14", 10);
+    CHECK(page.messages.size() == 10);
+    CHECK_FALSE(page.more);
+    page = storage.retrieve_page(pubkey, "", 25);
+    CHECK(page.messages.size() == 25);
+    CHECK_FALSE(page.more);
+
+    // Size limits cut pages at whole messages
+    page = storage.retrieve_page(pubkey, "", -1, 350);
+    REQUIRE(page.messages.size() == 3);
+    CHECK(page.more);
+    CHECK(page.messages[2].data == std::string(100, 'c'));
+    page = storage.retrieve_page(pubkey, "", 2, 350);
+    CHECK(page.messages.size() == 2);
+    CHECK(page.more);
+    // Counted as base64 each message takes 136 bytes (padding included)
+    page = storage.retrieve_page(pubkey, "", -1, 350, size_encoding::base64);
+    CHECK(page.messages.size() == 2);
+    CHECK(page.more);
+    page = storage.retrieve_page(pubkey, "", -1, 408, size_encoding::base64);
+    CHECK(page.messages.size() == 3);
+    // ... but always include at least one message
+    page = storage.retrieve_page(pubkey, "hash23", -1, 10);
+    REQUIRE(page.messages.size() == 1);
+    CHECK(page.messages[0].hash == "hash24");
+    CHECK_FALSE(page.more);
+
+    // Following the pages from the last hash visits everything exactly once
+    std::vector<std::string> hashes;
+    std::string last;
+    do {
+        page = storage.retrieve_page(pubkey, last, 4, 250);
+        REQUIRE(!page.messages.empty());
+        CHECK(page.messages.size() <= 2);
+        for (auto& m : page.messages)
+            hashes.push_back(m.hash);
+        last = page.messages.back().hash;
+    } while (page.more);
+    REQUIRE(hashes.size() == 25);
+    for (int i = 0; i < 25; i++)
+        CHECK(hashes[i] == "hash" + std::to_string(i));
+}
+
+TEST_CASE("storage - concurrent retrieves during stores", "[storage]") {
+    StorageDeleter fixture;
+
+    Database storage{".", test_options()};
+
+    user_pubkey_t pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+
+    auto now = std::chrono::system_clock::now();
+    const size_t num_entries = 200;
+
+    std::atomic<bool> done = false;
+    std::atomic<size_t> max_seen = 0;
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; i++)
+        readers.emplace_back([&] {
+            while (!done) {
+                auto n = storage.retrieve(pubkey, "").size();
+                // Each retrieve sees a consistent snapshot, which can never go backwards
+                size_t prev = max_seen;
+                while (n > prev && !max_seen.compare_exchange_weak(prev, n)) {}
+            }
+        });
+
+    for (size_t i = 0; i < num_entries; i++)
+        CHECK(storage.store({pubkey, "hash" + std::to_string(i), now, now + 100s, "bytesasstring"}));
+
+    done = true;
+    for (auto& r : readers)
+        r.join();
+
+    CHECK(max_seen <= num_entries);
+    CHECK(storage.retrieve(pubkey, "").size() == num_entries);
+    CHECK(storage.get_message_count() == num_entries);
+}
+
+TEST_CASE("storage - concurrent retrieve throughput", "[storage][!benchmark]") {
+    StorageDeleter fixture;
+
+    auto opts = test_options();
+    auto engine = opts.engine == storage_engine::memory ? "memory" : "sqlite";
+    Database storage{".", opts};
+
+    const auto now = std::chrono::system_clock::now();
+    std::vector<user_pubkey_t> pubkeys(100);
+    std::vector<message> msgs;
+    for (size_t i = 0; i < pubkeys.size(); i++) {
+        REQUIRE(pubkeys[i].load(fmt::format("05{:064x}", i)));
+        for (int j = 0; j < 50; j++)
+            msgs.emplace_back(pubkeys[i], fmt::format("hash-{}-{}", i, j), now, now + 1h,
+                    std::string(500, 'x'));
+    }
+    storage.bulk_store(msgs);
+    REQUIRE(storage.get_message_count() == msgs.size());
+
+    // The same total amount of work split across increasing numbers of threads: with readers no
+    // longer serialized through a single connection the time per run should drop as threads grow.
+    constexpr size_t retrieves_per_run = 2000;
+    for (unsigned threads : {1, 2, 4, 8}) {
+        BENCHMARK(fmt::format("{} retrieves on {} thread(s) from {}", retrieves_per_run, threads, engine)) {
+            std::atomic<size_t> found = 0;
+            std::vector<std::thread> workers;
+            for (unsigned t = 0; t < threads; t++)
+                workers.emplace_back([&, t] {
+                    for (size_t i = t; i < retrieves_per_run; i += threads)
+                        found += storage.retrieve(pubkeys[i % pubkeys.size()], "").size();
+                });
+            for (auto& w : workers)
+                w.join();
+            return found.load();
+        };
+    }
+}
+
+TEST_CASE("storage - random message sampling", "[storage]") {
+    StorageDeleter fixture;
+
+    Database storage{".", test_options()};
+
+    CHECK_FALSE(storage.retrieve_random());
+
+    user_pubkey_t pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+
+    auto now = std::chrono::system_clock::now();
+    std::vector<message> msgs;
+    for (int i = 0; i < 100; i++)
+        msgs.emplace_back(pubkey, "hash" + std::to_string(i), now, now + 1h, "data");
+    // Some already-expired messages that haven't been cleaned up yet
+    for (int i = 0; i < 20; i++)
+        msgs.emplace_back(pubkey, "expired" + std::to_string(i), now - 1h, now - 1min, "data");
+    storage.bulk_store(msgs);
+
+    // Punch a large gap into the id range
+    std::vector<std::string> gap;
+    for (int i = 10; i < 90; i++)
+        gap.push_back("hash" + std::to_string(i));
+    REQUIRE(storage.delete_by_hash(pubkey, gap).size() == gap.size());
+
+    std::set<std::string> seen;
+    for (int i = 0; i < 500; i++) {
+        auto msg = storage.retrieve_random();
+        REQUIRE(msg);
+        CHECK(msg->pubkey == pubkey);
+        CHECK(msg->expiry > now);
+        seen.insert(msg->hash);
+    }
+    // 20 remaining unexpired messages; 500 samples should hit nearly all of them
+    CHECK(seen.size() >= 15);
+    CHECK(seen.size() <= 20);
+    CHECK(seen.count("hash5"));
+
+    // Sampling doesn't remove expired messages as a side effect
+    CHECK(storage.get_message_count() == 40);
+
+    storage.delete_all(pubkey);
+    CHECK_FALSE(storage.retrieve_random());
+}
+
+TEST_CASE("storage - streaming messages in batches", "[storage]") {
+    StorageDeleter fixture;
+
+    Database storage{".", test_options()};
+
+    // Swarm space values: 0, 0x0123456789abcdef, and 0xff00000000000000
+    user_pubkey_t pk1, pk2, pk3;
+    REQUIRE(pk1.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pk2.load("050000000000000000000000000000000000000000000000000123456789abcdef"));
+    REQUIRE(pk3.load("05ff00000000000000000000000000000000000000000000000000000000000000"));
+
+    auto now = std::chrono::system_clock::now();
+    std::vector<message> msgs;
+    for (int i = 0; i < 60; i++)
+        msgs.emplace_back(i % 3 == 0 ? pk1 : i % 3 == 1 ? pk2 : pk3,
+                "hash" + std::to_string(i), now, now + 1h, std::string(100, 'a' + i % 26));
+    storage.bulk_store(msgs);
+
+    SECTION("bounded batch count, storage order") {
+        std::vector<size_t> sizes;
+        std::vector<std::string> hashes;
+        stream_options opts;
+        opts.batch_count = 7;
+        auto n = storage.for_each([&](std::vector<message>& batch) {
+            sizes.push_back(batch.size());
+            for (auto& m : batch) {
+                CHECK(m.pubkey);
+                hashes.push_back(std::move(m.hash));
+            }
+            return true;
+        }, opts);
+        CHECK(n == 60);
+        REQUIRE(hashes.size() == 60);
+        for (size_t i = 0; i < hashes.size(); i++)
+            CHECK(hashes[i] == "hash" + std::to_string(i));
+        CHECK(sizes.size() == 9);
+        CHECK(*std::max_element(sizes.begin(), sizes.end()) == 7);
+    }
+
+    SECTION("bounded batch bytes") {
+        stream_options opts;
+        opts.batch_bytes = 250;
+        size_t batches = 0;
+        auto n = storage.for_each([&](std::vector<message>& batch) {
+            CHECK(batch.size() <= 3);
+            batches++;
+            return true;
+        }, opts);
+        CHECK(n == 60);
+        CHECK(batches == 20);
+    }
+
+    SECTION("keys only") {
+        stream_options opts;
+        opts.keys_only = true;
+        opts.batch_bytes = 250;
+        std::vector<std::string> hashes;
+        size_t batches = 0;
+        auto n = storage.for_each([&](std::vector<message>& batch) {
+            batches++;
+            for (auto& m : batch) {
+                CHECK(m.pubkey);
+                CHECK(m.data.empty());
+                hashes.push_back(std::move(m.hash));
+            }
+            return true;
+        }, opts);
+        CHECK(n == 60);
+        CHECK(hashes.size() == 60);
+        CHECK(hashes.front() == "hash0");
+        // Without any data the batches are only bounded by count
+        CHECK(batches == 1);
+    }
+
+    SECTION("stopping early") {
+        stream_options opts;
+        opts.batch_count = 10;
+        size_t batches = 0;
+        auto n = storage.for_each([&](std::vector<message>&) { return ++batches < 2; }, opts);
+        CHECK(batches == 2);
+        CHECK(n == 20);
+    }
+
+    SECTION("owner filter") {
+        stream_options opts;
+        opts.owner = pk2;
+        opts.batch_count = 4;
+        auto n = storage.for_each([&](std::vector<message>& batch) {
+            for (auto& m : batch)
+                CHECK(m.pubkey == pk2);
+            return true;
+        }, opts);
+        CHECK(n == 20);
+
+        user_pubkey_t nobody;
+        REQUIRE(nobody.load("05aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"));
+        opts.owner = nobody;
+        CHECK(storage.for_each([](auto&) { return true; }, opts) == 0);
+    }
+
+    SECTION("swarm space filter") {
+        auto count_owners = [&](std::pair<uint64_t, uint64_t> range) {
+            std::set<std::string> owners;
+            stream_options opts;
+            opts.swarm_space = range;
+            opts.batch_count = 5;
+            storage.for_each([&](std::vector<message>& batch) {
+                for (auto& m : batch)
+                    owners.insert(m.pubkey.hex());
+                return true;
+            }, opts);
+            return owners;
+        };
+        CHECK(count_owners({0, 0}) == std::set{pk1.hex()});
+        CHECK(count_owners({1, 0xf000000000000000}) == std::set{pk2.hex()});
+        CHECK(count_owners({0xf000000000000000, 0}) == std::set{pk1.hex(), pk3.hex()});
+        CHECK(count_owners({0x1000000000000000, 0x2000000000000000}).empty());
+
+        // Batches fill up across owners
+        stream_options opts;
+        opts.swarm_space = {0xf000000000000000, 0};
+        opts.batch_count = 7;
+        std::vector<size_t> sizes;
+        auto n = storage.for_each([&](std::vector<message>& batch) {
+            sizes.push_back(batch.size());
+            return true;
+        }, opts);
+        CHECK(n == 40);
+        CHECK(sizes == std::vector<size_t>{7, 7, 7, 7, 7, 5});
+    }
+
+    CHECK(storage.retrieve_all().size() == 60);
+}
+
+TEST_CASE("storage - group-committed concurrent stores", "[storage]") {
+    StorageDeleter fixture;
+
+    auto opts = test_options();
+    SECTION("default batch window") {}
+    SECTION("no batch window") { opts.store_batch_window = 0s; }
+    SECTION("small batches") { opts.store_batch_size = 3; }
+
+    Database storage{".", opts};
+
+    user_pubkey_t pk1, pk2;
+    REQUIRE(pk1.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pk2.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+
+    auto now = std::chrono::system_clock::now();
+
+    // Every thread tries to store the same 100 messages: each must be reported as inserted to
+    // exactly one caller, and as a duplicate to all the others.
+    constexpr int num_threads = 8, num_msgs = 100;
+    std::atomic<int> inserted = 0, duplicate = 0, failed = 0;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++)
+        threads.emplace_back([&, t] {
+            for (int i = 0; i < num_msgs; i++) {
+                int j = (i + t * 13) % num_msgs;
+                auto res = storage.store({j % 2 ? pk1 : pk2, "hash" + std::to_string(j), now, now + 1h, "data"});
+                (!res ? failed : *res ? inserted : duplicate)++;
+            }
+        });
+    for (auto& t : threads)
+        t.join();
+
+    CHECK(inserted == num_msgs);
+    CHECK(duplicate == (num_threads - 1) * num_msgs);
+    CHECK(failed == 0);
+    CHECK(storage.get_owner_count() == 2);
+    CHECK(storage.get_message_count() == num_msgs);
+    CHECK(storage.retrieve(pk1, "").size() == num_msgs / 2);
+    CHECK(storage.get_expired_estimate() == 0);
+}
+
+TEST_CASE("storage - owner ids follow owner removal", "[storage]") {
+    StorageDeleter fixture;
+
+    auto opts = test_options();
+    SECTION("owner cache") {}
+    SECTION("no owner cache") { opts.owner_cache_size = 0; }
+    SECTION("tiny owner cache") { opts.owner_cache_size = 1; }
+
+    Database storage{".", opts};
+
+    user_pubkey_t pk1, pk2, pk3;
+    REQUIRE(pk1.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pk2.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+    REQUIRE(pk3.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcded"));
+
+    auto now = std::chrono::system_clock::now();
+
+    REQUIRE(storage.store({pk1, "hash1", now, now + 1h, "data1"}) == true);
+    CHECK(storage.retrieve(pk1, "").size() == 1);
+
+    // Deleting pk1's only message removes pk1 from the owners table, and since the table is then
+    // empty the next owner gets pk1's old id: we must not keep using it for pk1.
+    CHECK(storage.delete_all(pk1) == std::vector<std::string>{"hash1"});
+    CHECK(storage.get_owner_count() == 0);
+    REQUIRE(storage.store({pk2, "hash2", now, now + 1h, "data2"}) == true);
+    CHECK(storage.retrieve(pk1, "").empty());
+    CHECK(storage.delete_by_hash(pk1, {"hash2"}).empty());
+    CHECK(storage.update_all_expiries(pk1, now + 1min).empty());
+    REQUIRE(storage.retrieve(pk2, "").size() == 1);
+
+    // Same again, but with the owner removed by expiry cleanup rather than an explicit delete
+    REQUIRE(storage.delete_all(pk2).size() == 1);
+    REQUIRE(storage.store({pk3, "hash3", now - 2h, now - 1h, "data3"}) == true);
+    CHECK(storage.delete_by_timestamp(pk3, now - 3h).empty());
+    storage.clean_expired();
+    CHECK(storage.get_owner_count() == 0);
+    REQUIRE(storage.store({pk1, "hash4", now, now + 1h, "data4"}) == true);
+    CHECK(storage.retrieve(pk3, "").empty());
+    CHECK(storage.delete_by_timestamp(pk3, now).empty());
+
+    REQUIRE(storage.store({pk2, "hash5", now, now + 1h, "data5"}) == true);
+
+    auto msgs = storage.retrieve(pk1, "");
+    REQUIRE(msgs.size() == 1);
+    CHECK(msgs[0].hash == "hash4");
+    CHECK(storage.retrieve(pk2, "").size() == 1);
+    CHECK(storage.delete_by_hash(pk1, {"hash4", "hash5"}) == std::vector<std::string>{"hash4"});
+    CHECK(storage.get_owner_count() == 1);
+}
+
+TEST_CASE("storage - owner cache latency", "[storage][!benchmark]") {
+    StorageDeleter fixture;
+
+    const auto now = std::chrono::system_clock::now();
+    std::vector<user_pubkey_t> pubkeys(1000);
+    std::vector<message> msgs;
+    for (size_t i = 0; i < pubkeys.size(); i++) {
+        REQUIRE(pubkeys[i].load(fmt::format("05{:064x}", i * 7919)));
+        for (int j = 0; j < 5; j++)
+            msgs.emplace_back(pubkeys[i], fmt::format("hash-{}-{}", i, j), now, now + 1h,
+                    std::string(100, 'x'));
+    }
+
+    for (size_t cache_size : {size_t{0}, database_options{}.owner_cache_size}) {
+        database_options opts;
+        opts.owner_cache_size = cache_size;
+        Database storage{".", opts};
+        storage.bulk_store(msgs);
+        const char* cache = cache_size ? "with" : "without";
+
+        size_t i = 0;
+        BENCHMARK(fmt::format("retrieve {} owner cache", cache)) {
+            return storage.retrieve(pubkeys[i++ % pubkeys.size()], "", 1).size();
+        };
+        // Deletes of a hash that doesn't exist, so that every run does the same work
+        BENCHMARK(fmt::format("delete_by_hash {} owner cache", cache)) {
+            return storage.delete_by_hash(pubkeys[i++ % pubkeys.size()], {"not-a-hash"}).size();
+        };
+    }
+}
+
+TEST_CASE("storage - blob segments", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey_t pk1, pk2;
+    REQUIRE(pk1.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pk2.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+
+    auto now = std::chrono::system_clock::now();
+    auto data = [](int i) { return std::string(1000 + i, 'a' + i % 26); };
+
+    database_options opts;
+    opts.blob_segments = true;
+    {
+        // Stored inline before switching to segments; must stay readable
+        Database storage{"."};
+        REQUIRE(storage.store({pk1, "inline", now, now + 1h, "inline data"}) == true);
+    }
+    {
+        Database storage{".", opts};
+        std::vector<message> msgs;
+        for (int i = 0; i < 100; i++)
+            msgs.emplace_back(i % 2 ? pk1 : pk2, "hash" + std::to_string(i), now, now + 1h, data(i));
+        storage.bulk_store(msgs);
+        CHECK(storage.store(msgs[0]) == false);
+        REQUIRE(storage.store({pk1, "one more", now, now + 1h, data(100)}) == true);
+        CHECK(storage.get_message_count() == 102);
+        CHECK(std::filesystem::exists("blobs"));
+
+        auto pk1_msgs = storage.retrieve(pk1, "");
+        REQUIRE(pk1_msgs.size() == 52);
+        CHECK(pk1_msgs[0].data == "inline data");
+        CHECK(pk1_msgs[1].data == data(1));
+        CHECK(pk1_msgs[51].data == data(100));
+        auto msg = storage.retrieve_by_hash("hash42");
+        REQUIRE(msg);
+        CHECK(msg->data == data(42));
+        auto random = storage.retrieve_random();
+        REQUIRE(random);
+        CHECK_FALSE(random->data.empty());
+
+        // Leave only every tenth message
+        for (int i = 0; i < 100; i++)
+            if (i % 10)
+                REQUIRE(storage.delete_by_hash(i % 2 ? pk1 : pk2, {"hash" + std::to_string(i)}).size() == 1);
+
+        // Nothing to compact yet: the only segment is still being written to
+        CHECK(storage.compact_blob_segments() == 0);
+    }
+
+    // Reopening (without segments for new messages) starts a new segment, so the one we wrote to
+    // above can now be compacted.
+    Database storage{"."};
+    auto used = storage.get_used_bytes();
+    auto reclaimed = storage.compact_blob_segments();
+    CHECK(reclaimed > 80 * 1000);
+    CHECK(storage.get_used_bytes() == used - reclaimed);
+    CHECK(storage.compact_blob_segments() == 0);
+
+    REQUIRE(storage.store({pk2, "not a blob", now, now + 1h, "more data"}) == true);
+    auto all = storage.retrieve_all();
+    REQUIRE(all.size() == 13);
+    for (auto& m : all) {
+        if (m.hash == "inline")
+            CHECK(m.data == "inline data");
+        else if (m.hash == "one more")
+            CHECK(m.data == data(100));
+        else if (m.hash == "not a blob")
+            CHECK(m.data == "more data");
+        else
+            CHECK(m.data == data(std::stoi(m.hash.substr(4))));
+    }
+}
+
+TEST_CASE("storage - partitioned tables", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey_t pk1, pk2;
+    REQUIRE(pk1.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pk2.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+
+    database_options opts;
+    opts.partitioned = true;
+    opts.partition_width = 1s;
+    Database storage{".", opts};
+
+    auto now = std::chrono::system_clock::now();
+    CHECK(storage.store({pk1, "soon", now, now + 50ms, "a"}) == true);
+    CHECK(storage.store({pk1, "later", now, now + 1h, "b"}) == true);
+    CHECK(storage.store({pk1, "latest", now, now + 2h, "c"}) == true);
+    CHECK(storage.store({pk2, "other", now, now + 2h, "d"}) == true);
+    // Duplicates are rejected even when they would go into a different partition
+    CHECK(storage.store({pk1, "later", now, now + 2h, "b"}) == false);
+    storage.bulk_store({{pk2, "bulk", now, now + 3h, "e"}, {pk2, "other", now, now + 3h, "d"}});
+
+    CHECK(storage.get_message_count() == 5);
+    auto pk1_msgs = storage.retrieve(pk1, "");
+    REQUIRE(pk1_msgs.size() == 3);
+    CHECK(pk1_msgs[0].hash == "soon");
+    CHECK(pk1_msgs[1].hash == "later");
+    CHECK(pk1_msgs[2].hash == "latest");
+    CHECK(storage.retrieve(pk1, "soon").size() == 2);
+    CHECK(storage.retrieve(pk2, "").size() == 2);
+
+    // Expired messages disappear from lookups right away, although they are only removed once
+    // their whole partition has expired.
+    std::this_thread::sleep_for(100ms);
+    CHECK(storage.get_message_count() == 4);
+    CHECK_FALSE(storage.retrieve_by_hash("soon"));
+    CHECK(storage.retrieve(pk1, "").size() == 2);
+    CHECK(storage.retrieve_all().size() == 4);
+    std::this_thread::sleep_for(1s);
+    storage.clean_expired();
+    CHECK(storage.get_message_count() == 4);
+    CHECK(storage.get_owner_count() == 2);
+
+    // Shortening an expiry leaves the message in its partition, but hides it once expired
+    now = std::chrono::system_clock::now();
+    CHECK(storage.update_expiry(pk1, {"latest"}, now + 10ms) == std::vector<std::string>{"latest"});
+    CHECK(storage.update_expiry(pk1, {"latest"}, now + 1h).empty());
+    CHECK(storage.update_all_expiries(pk2, now + 30min).size() == 2);
+    std::this_thread::sleep_for(20ms);
+    CHECK_FALSE(storage.retrieve_by_hash("latest"));
+    CHECK(storage.clean_expired_chunk(10) == 1);
+    CHECK(storage.get_message_count() == 3);
+
+    auto deleted = storage.delete_all(pk2);
+    std::sort(deleted.begin(), deleted.end());
+    CHECK(deleted == std::vector<std::string>{"bulk", "other"});
+    CHECK(storage.delete_by_hash(pk1, {"later", "soon"}) == std::vector<std::string>{"later"});
+    CHECK(storage.get_message_count() == 0);
+    CHECK_FALSE(storage.retrieve_random());
+
+    CHECK(storage.store({pk1, "again", now, now + 1h, "f"}) == true);
+    REQUIRE(storage.retrieve_random());
+    CHECK(storage.retrieve_random()->hash == "again");
+}
+
+TEST_CASE("storage - migration to partitioned tables", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey_t pk1, pk2;
+    REQUIRE(pk1.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pk2.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+
+    auto now = std::chrono::system_clock::now();
+    {
+        Database storage{"."};
+        std::vector<message> msgs;
+        for (int i = 0; i < 25'000; i++)
+            msgs.emplace_back(i % 2 ? pk1 : pk2, "hash" + std::to_string(i), now,
+                    now + std::chrono::minutes{i % 5 ? 10 + i % 1000 : -1}, "data" + std::to_string(i));
+        storage.bulk_store(msgs);
+        CHECK(storage.get_message_count() == 25'000);
+    }
+
+    database_options opts;
+    opts.partitioned = true;
+    opts.partition_width = 1h;
+    {
+        // Already expired messages (every fifth one) are dropped rather than moved
+        Database storage{".", opts};
+        CHECK(storage.get_message_count() == 20'000);
+        auto pk1_msgs = storage.retrieve(pk1, "");
+        REQUIRE(pk1_msgs.size() == 10'000);
+        CHECK(pk1_msgs[0].hash == "hash1");
+        CHECK(pk1_msgs[0].data == "data1");
+        CHECK(storage.store({pk1, "hash1", now, now + 1h, "data1"}) == false);
+        CHECK(storage.store({pk1, "new", now, now + 1h, "new"}) == true);
+        auto newer = storage.retrieve(pk1, "hash24999");
+        REQUIRE(newer.size() == 1);
+        CHECK(newer[0].hash == "new");
+    }
+
+    // Once partitioned, the database stays that way
+    Database storage{"."};
+    CHECK(storage.get_message_count() == 20'001);
+    auto msg = storage.retrieve_by_hash("hash12346");
+    REQUIRE(msg);
+    CHECK(msg->data == "data12346");
+    CHECK_FALSE(storage.retrieve_by_hash("hash12345"));
+}
+
+TEST_CASE("storage - multi-hash deletes and expiry updates", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey_t pk1, pk2;
+    REQUIRE(pk1.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pk2.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+
+    auto opts = test_options();
+    SECTION("single table") {}
+    SECTION("partitioned") { opts.partitioned = true; }
+    Database storage{".", opts};
+
+    auto now = std::chrono::system_clock::now();
+    std::vector<message> msgs;
+    for (int i = 0; i < 1000; i++)
+        msgs.emplace_back(i % 2 ? pk1 : pk2, "hash" + std::to_string(i), now, now + 1h, "data");
+    storage.bulk_store(msgs);
+
+    // Hash lists of various sizes, around and beyond the prepared IN list sizes; every other hash
+    // is owned by pk2 (and so is left alone), plus one hash that doesn't exist.
+    int next = 0;
+    for (int count : {0, 2, 3, 4, 5, 16, 17, 100, 256, 257, 300}) {
+        std::vector<std::string> hashes, expected;
+        for (int i = 0; i < count; i++, next++) {
+            hashes.push_back("hash" + std::to_string(next));
+            if (next % 2)
+                expected.push_back(hashes.back());
+        }
+        hashes.push_back("nonexistent");
+        std::sort(expected.begin(), expected.end());
+
+        auto updated = storage.update_expiry(pk1, hashes, now + 30min);
+        std::sort(updated.begin(), updated.end());
+        CHECK(updated == expected);
+        CHECK(storage.update_expiry(pk1, hashes, now + 40min).empty());
+
+        auto deleted = storage.delete_by_hash(pk1, hashes);
+        std::sort(deleted.begin(), deleted.end());
+        CHECK(deleted == expected);
+    }
+    CHECK(storage.get_message_count() == 1000 - next / 2);
+    CHECK(storage.retrieve(pk2, "").size() == 500);
+}
+
+TEST_CASE("storage - maintained counts", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey_t pk1, pk2;
+    REQUIRE(pk1.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pk2.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+
+    database_options opts;
+    SECTION("single table") {}
+    SECTION("partitioned") { opts.partitioned = true; }
+    SECTION("blob segments") { opts.blob_segments = true; }
+
+    auto now = std::chrono::system_clock::now();
+    {
+        Database storage{".", opts};
+        CHECK(storage.get_message_count() == 0);
+        CHECK(storage.get_owner_count() == 0);
+        CHECK(storage.get_data_bytes() == 0);
+
+        std::vector<message> msgs;
+        for (int i = 0; i < 100; i++)
+            msgs.emplace_back(i % 2 ? pk1 : pk2, "hash" + std::to_string(i), now,
+                    i < 10 ? now - 1s : now + 1h, std::string(i, 'x'));
+        storage.bulk_store(msgs);
+        CHECK(storage.store(msgs[0]) == false);
+        REQUIRE(storage.store({pk1, "one more", now, now + 1h, "12345"}) == true);
+        // Already expired messages are only hidden right away in the partitioned layout
+        CHECK(storage.get_message_count() == (opts.partitioned ? 91 : 101));
+        CHECK(storage.get_owner_count() == 2);
+        CHECK(storage.get_data_bytes() == 99 * 100 / 2 + 5);
+
+        CHECK(storage.delete_by_hash(pk1, {"hash11", "hash13", "hash12"}).size() == 2);
+        CHECK(storage.get_message_count() == (opts.partitioned ? 89 : 99));
+        CHECK(storage.get_data_bytes() == 99 * 100 / 2 + 5 - 24);
+    }
+
+    // Reopening (which also cleans up expired messages) counts what is already stored
+    Database storage{".", opts};
+    CHECK(storage.get_message_count() == 89);
+    CHECK(storage.get_owner_count() == 2);
+    // (expired messages 0-9 are still there until their partition goes, in the partitioned layout)
+    CHECK(storage.get_data_bytes() == 99 * 100 / 2 + 5 - 24 - (opts.partitioned ? 0 : 45));
+
+    CHECK(storage.delete_all(pk2).size() == (opts.partitioned ? 50 : 45));
+    CHECK(storage.get_owner_count() == (opts.partitioned ? 2 : 1));
+    CHECK(storage.update_all_expiries(pk1, now + 30min).size() == 44);
+    CHECK(storage.get_message_count() == 44);
+}
+
+TEST_CASE("storage - hash filter", "[storage]") {
+    HashFilter filter;
+    // Enough to make it grow a couple of times beyond its initial table
+    constexpr int N = 20'000;
+    for (int i = 0; i < N; i++)
+        filter.insert("hash" + std::to_string(i));
+    CHECK(filter.size() == N);
+    for (int i = 0; i < N; i++)
+        REQUIRE(filter.contains("hash" + std::to_string(i)));
+
+    int false_positives = 0;
+    for (int i = N; i < 2 * N; i++)
+        false_positives += filter.contains("hash" + std::to_string(i));
+    CHECK(false_positives < N / 100);
+
+    for (int i = 0; i < N; i += 2)
+        REQUIRE(filter.erase("hash" + std::to_string(i)));
+    CHECK(filter.size() == N / 2);
+    for (int i = 1; i < N; i += 2)
+        REQUIRE(filter.contains("hash" + std::to_string(i)));
+    int remaining = 0;
+    for (int i = 0; i < N; i += 2)
+        remaining += filter.contains("hash" + std::to_string(i));
+    CHECK(remaining < N / 100);
+}
+
+TEST_CASE("storage - duplicate stores skipped via hash filter", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey_t pk;
+    REQUIRE(pk.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+
+    database_options opts;
+    SECTION("single table") {}
+    SECTION("partitioned") { opts.partitioned = true; }
+
+    auto wait_for_filter = [](Database& storage) {
+        for (int i = 0; i < 500 && !storage.get_hash_filter_stats().ready; i++)
+            std::this_thread::sleep_for(10ms);
+        return storage.get_hash_filter_stats();
+    };
+
+    auto now = std::chrono::system_clock::now();
+    std::vector<message> msgs;
+    for (int i = 0; i < 50; i++)
+        msgs.emplace_back(pk, "hash" + std::to_string(i), now, now + 1h, "data" + std::to_string(i));
+    {
+        Database storage{".", opts};
+        REQUIRE(wait_for_filter(storage).ready);
+
+        storage.bulk_store(msgs);
+        auto stats = storage.get_hash_filter_stats();
+        CHECK(stats.entries == 50);
+        CHECK(stats.duplicates == 0);
+
+        // Storing them again is caught by the filter (plus a lookup) without any write
+        CHECK(storage.store(msgs[3]) == false);
+        storage.bulk_store(msgs);
+        stats = storage.get_hash_filter_stats();
+        CHECK(stats.duplicates == 51);
+        CHECK(stats.hits >= 51);
+        CHECK(storage.get_message_count() == 50);
+
+        // Deleted messages leave the filter, and can be stored again
+        CHECK(storage.delete_by_hash(pk, {"hash0", "hash1"}).size() == 2);
+        CHECK(storage.get_hash_filter_stats().entries == 48);
+        CHECK(storage.store(msgs[0]) == true);
+        CHECK(storage.get_hash_filter_stats().entries == 49);
+        CHECK(storage.retrieve_by_hash("hash0"));
+    }
+
+    // The filter is rebuilt from the database on startup
+    Database storage{".", opts};
+    auto stats = wait_for_filter(storage);
+    REQUIRE(stats.ready);
+    CHECK(stats.entries == 49);
+    CHECK(storage.store(msgs[10]) == false);
+    CHECK(storage.store(msgs[1]) == true);
+    CHECK(storage.get_hash_filter_stats().duplicates == 1);
+
+    // Expired messages are removed from it as they get cleaned up
+    CHECK(storage.update_all_expiries(pk, now - 1s).size() == 50);
+    storage.clean_expired();
+    CHECK(storage.get_message_count() == 0);
+    CHECK(storage.get_hash_filter_stats().entries == (opts.partitioned ? 50 : 0));
+}
+
+TEST_CASE("storage - query plans", "[storage]") {
+    StorageDeleter fixture;
+    Database storage{"."};
+
+    // The index (or rowid lookup) each statement has to use.  None of them may scan a table or
+    // sort (i.e. use a temp b-tree).
+    const std::map<std::string, std::string> expected{
+        {"find_owner", "sqlite_autoindex_owners_1 (pubkey=? AND type=?)"},
+        {"hash_exists", "COVERING INDEX sqlite_autoindex_messages_1 (hash=?)"},
+        {"message_by_id", "INTEGER PRIMARY KEY (rowid=?)"},
+        {"message_from_id", "INTEGER PRIMARY KEY (rowid>?)"},
+        {"message_by_hash", "sqlite_autoindex_messages_1 (hash=?)"},
+        {"owner_message_id", "sqlite_autoindex_messages_1 (hash=?)"},
+        {"owner_messages", "messages_owner_id (owner=?)"},
+        {"owner_messages_after", "messages_owner_id (owner=? AND id>?)"},
+        {"owner_recent_messages", "messages_owner_id (owner=?)"},
+        {"stream_messages", "INTEGER PRIMARY KEY (rowid>?)"},
+        {"stream_owner_messages", "messages_owner_id (owner=? AND id>?)"},
+        {"delete_all", "(owner=?)"},
+        {"delete_by_hash", "sqlite_autoindex_messages_1 (hash=?)"},
+        {"delete_by_hashes", "sqlite_autoindex_messages_1 (hash=?)"},
+        {"delete_by_timestamp", "messages_owner (owner=? AND timestamp<?)"},
+        {"update_expiry", "sqlite_autoindex_messages_1 (hash=?)"},
+        {"update_expiries", "sqlite_autoindex_messages_1 (hash=?)"},
+        {"update_all_expiries", "(owner=?)"},
+        {"delete_expired", "messages_expiry (expiry<?)"},
+        {"delete_expired_limit", "messages_expiry (expiry<?)"},
+        {"count_expired_messages", "COVERING INDEX messages_expiry (expiry<?)"},
+    };
+
+    auto plans = storage.query_plans();
+    CHECK(plans.size() == expected.size());
+    for (auto& [name, plan] : plans) {
+        INFO(name << ":\n" << plan);
+        auto it = expected.find(name);
+        REQUIRE(it != expected.end());
+        CHECK(plan.find(it->second) != std::string::npos);
+        CHECK(plan.find("SCAN") == std::string::npos);
+        CHECK(plan.find("TEMP B-TREE") == std::string::npos);
+    }
+}
+
+TEST_CASE("storage - schema migration", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey_t pk;
+    REQUIRE(pk.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+
+    // A base64 hash (of 32 bytes, so the last character only carries 2 bits), a legacy hex hash,
+    // and something else, which has to be kept as it is.
+    auto b64_hash = [](int i) {
+        auto h = std::to_string(i);
+        return std::string(42 - h.size(), 'x') + h + "A";
+    };
+    auto hex_hash = [](int i) {
+        auto h = std::to_string(i);
+        return std::string(128 - h.size(), 'f') + h;
+    };
+    auto other_hash = [](int i) { return "hash" + std::to_string(i); };
+
+    constexpr int N = 25'000;
+    auto now = std::chrono::system_clock::now();
+    {
+        // The schema as of before it was versioned
+        SQLite::Database db{"storage.db", SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE};
+        db.exec(R"(
+CREATE TABLE owners (
+    id INTEGER PRIMARY KEY,
+    type INTEGER NOT NULL,
+    pubkey BLOB NOT NULL,
+    UNIQUE(pubkey, type)
+);
+CREATE TABLE messages (
+    id INTEGER PRIMARY KEY,
+    hash TEXT NOT NULL,
+    owner INTEGER NOT NULL REFERENCES owners(id),
+    timestamp INTEGER NOT NULL,
+    expiry INTEGER NOT NULL,
+    data BLOB NOT NULL,
+    blob INTEGER,
+    UNIQUE(hash)
+);
+CREATE INDEX messages_expiry ON messages(expiry);
+CREATE INDEX messages_owner ON messages(owner, timestamp);
+CREATE INDEX messages_blob ON messages(blob) WHERE blob IS NOT NULL;
+CREATE VIEW owned_messages AS
+    SELECT owners.id AS oid, type, pubkey, messages.id AS mid, hash, timestamp, expiry, data, blob
+    FROM messages JOIN owners ON messages.owner = owners.id;
+        )");
+        SQLite::Statement owner{db, "INSERT INTO owners (type, pubkey) VALUES (?, ?)"};
+        owner.bind(1, pk.type());
+        owner.bind(2, pk.raw().data(), pk.raw().size());
+        owner.exec();
+        SQLite::Transaction t{db};
+        SQLite::Statement insert{db,
+            "INSERT INTO messages (hash, owner, timestamp, expiry, data) VALUES (?, 1, ?, ?, ?)"};
+        for (int i = 0; i < N; i++) {
+            insert.bind(1, i % 3 == 0 ? b64_hash(i) : i % 3 == 1 ? hex_hash(i) : other_hash(i));
+            insert.bind(2, to_epoch_ms(now));
+            insert.bind(3, to_epoch_ms(now + 1h));
+            insert.bind(4, "data", 4);
+            insert.exec();
+            insert.reset();
+        }
+        t.commit();
+    }
+
+    Database storage{"."};
+    {
+        SQLite::Database db{"storage.db", SQLite::OPEN_READONLY};
+        CHECK(db.execAndGet("PRAGMA user_version").getInt() == 3);
+        CHECK(db.execAndGet("SELECT COUNT(*) FROM messages WHERE typeof(hash) = 'blob'").getInt() == N / 3 * 2 + 1);
+        CHECK(db.execAndGet("SELECT COUNT(*) FROM messages WHERE length(hash) = 32").getInt() == N / 3 + 1);
+        CHECK(db.execAndGet("SELECT COUNT(*) FROM sqlite_master WHERE name = 'messages_owner_id'").getInt() == 1);
+    }
+
+    // Hashes come back out as they went in
+    auto msgs = storage.retrieve(pk, "");
+    REQUIRE(msgs.size() == N);
+    for (int i = 0; i < N; i++)
+        REQUIRE(msgs[i].hash == (i % 3 == 0 ? b64_hash(i) : i % 3 == 1 ? hex_hash(i) : other_hash(i)));
+    CHECK(storage.retrieve(pk, b64_hash(N - 10)).size() == 9);
+    CHECK(storage.retrieve_by_hash(hex_hash(N - 3)));
+    CHECK(storage.retrieve_by_hash(other_hash(N - 2)));
+
+    message dupe{pk, b64_hash(3), now, now + 1h, "data"};
+    CHECK(storage.store(dupe) == false);
+    CHECK(storage.delete_by_hash(pk, {b64_hash(0), hex_hash(1), other_hash(2)}) ==
+            std::vector<std::string>{b64_hash(0), hex_hash(1), other_hash(2)});
+    CHECK(storage.get_message_count() == N - 3);
+}
+
+TEST_CASE("storage - WAL checkpoints and incremental vacuum", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey_t pk;
+    REQUIRE(pk.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+
+    Database storage{"."};
+    storage.set_auto_checkpoint(false);
+
+    auto now = std::chrono::system_clock::now();
+    std::vector<message> msgs;
+    for (int i = 0; i < 2000; i++)
+        msgs.emplace_back(pk, "hash" + std::to_string(i), now, now + 1h, std::string(10'000, 'x'));
+    storage.bulk_store(msgs);
+    CHECK(storage.get_wal_bytes() > 20'000'000);
+
+    auto result = storage.checkpoint(checkpoint_mode::passive);
+    CHECK_FALSE(result.busy);
+    CHECK(result.log_bytes > 20'000'000);
+    CHECK(result.checkpointed_bytes == result.log_bytes);
+    // A passive checkpoint leaves the file as it is...
+    CHECK(storage.get_wal_bytes() > 20'000'000);
+    // ... which a truncating one doesn't
+    result = storage.checkpoint(checkpoint_mode::truncate);
+    CHECK_FALSE(result.busy);
+    CHECK(storage.get_wal_bytes() == 0);
+
+    CHECK(storage.get_freelist_pages() == 0);
+    CHECK(storage.delete_all(pk).size() == 2000);
+    auto free_pages = storage.get_freelist_pages();
+    CHECK(free_pages > 4000);
+    CHECK(storage.incremental_vacuum(100) == 100);
+    CHECK(storage.get_freelist_pages() == free_pages - 100);
+
+    SECTION("released in steps by the maintainer") {
+        storage.set_auto_checkpoint(true);
+        DbMaintainer maintainer{storage};
+        auto give_up = std::chrono::steady_clock::now() + 10s;
+        while (maintainer.get_stats().checkpoints < 2 && std::chrono::steady_clock::now() < give_up)
+            std::this_thread::sleep_for(50ms);
+        auto stats = maintainer.get_stats();
+        CHECK(stats.checkpoints >= 2);
+        CHECK(stats.vacuumed_pages > 0);
+        CHECK(stats.max_checkpoint >= stats.last_checkpoint);
+        CHECK(stats.freelist_pages == free_pages - 100 - stats.vacuumed_pages);
+    }
+    SECTION("released all at once") {
+        CHECK(storage.incremental_vacuum(1'000'000) == free_pages - 100);
+        CHECK(storage.get_freelist_pages() == 0);
+    }
+}
+
+TEST_CASE("storage - per-owner quotas", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey_t pk, pk2;
+    REQUIRE(pk.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pk2.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+
+    auto opts = test_options();
+    opts.owner_max_messages = 5;
+    opts.owner_max_bytes = 1000;
+    Database storage{".", opts};
+
+    auto now = std::chrono::system_clock::now();
+    for (int i = 0; i < 5; i++)
+        CHECK(storage.store({pk, "hash" + std::to_string(i), now, now + 1h, "data"}) == true);
+    // Over the message count quota: rejected as if full, unless it is a duplicate
+    CHECK(storage.store({pk, "hash5", now, now + 1h, "data"}) == std::nullopt);
+    CHECK(storage.store({pk, "hash4", now, now + 1h, "data"}) == false);
+    // Other owners have quotas of their own
+    CHECK(storage.store({pk2, "big0", now, now + 1h, std::string(600, 'x')}) == true);
+    // ... including the byte quota
+    CHECK(storage.store({pk2, "big1", now, now + 1h, std::string(600, 'x')}) == std::nullopt);
+    CHECK(storage.store({pk2, "big2", now, now + 1h, std::string(400, 'x')}) == true);
+
+    // Bulk stores skip messages over quota
+    storage.bulk_store({{pk, "hash6", now, now + 1h, "data"}, {pk2, "small", now, now + 1h, ""}});
+    CHECK_FALSE(storage.retrieve_by_hash("hash6"));
+    CHECK(storage.retrieve_by_hash("small"));
+
+    // Deleting makes room again
+    CHECK(storage.delete_by_hash(pk, {"hash0"}).size() == 1);
+    CHECK(storage.store({pk, "hash5", now, now + 1h, "data"}) == true);
+
+    auto stats = storage.get_capacity_stats();
+    CHECK(stats.quota_rejections == 3);
+    CHECK(stats.full_rejections == 0);
+    CHECK(stats.evicted == 0);
+}
+
+TEST_CASE("storage - eviction near capacity", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey_t pk;
+    REQUIRE(pk.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+
+    database_options opts;
+    SECTION("single table") {}
+    SECTION("partitioned") { opts.partitioned = true; }
+
+    auto now = std::chrono::system_clock::now();
+    std::vector<message> msgs;
+    // Stored in the reverse of expiry order, so that eviction order isn't just storage order
+    for (int i = 0; i < 20; i++)
+        msgs.emplace_back(pk, "hash" + std::to_string(i), now, now + 1h + 24h * (i % 3) + 1min * (20 - i), "data");
+
+    auto evicted = [&](Database& storage) {
+        std::vector<std::string> hashes;
+        for (auto& m : msgs)
+            if (!storage.retrieve_by_hash(m.hash))
+                hashes.push_back(m.hash);
+        std::sort(hashes.begin(), hashes.end());
+        return hashes;
+    };
+
+    SECTION("by evict_chunk") {
+        {
+            // Nowhere near the default watermark
+            Database storage{".", opts};
+            storage.bulk_store(msgs);
+            CHECK(storage.get_fill_level() > 0);
+            CHECK(storage.get_fill_level() < 0.01);
+            CHECK(storage.evict_chunk(5) == 0);
+            CHECK_FALSE(storage.get_capacity_stats().evicting);
+        }
+        opts.evict_watermark = 0;
+        opts.evict_target = 0;
+        Database storage{".", opts};
+        // The soonest expiries are those of i % 3 == 0 with the highest i
+        CHECK(storage.evict_chunk(3) == 3);
+        CHECK(evicted(storage) == std::vector<std::string>{"hash12", "hash15", "hash18"});
+        CHECK(storage.evict_chunk(2) == 2);
+        CHECK(evicted(storage) == std::vector<std::string>{"hash12", "hash15", "hash18", "hash6", "hash9"});
+        CHECK(storage.get_message_count() == 15);
+
+        auto stats = storage.get_capacity_stats();
+        CHECK(stats.evicting);
+        CHECK(stats.evicted == 5);
+        CHECK(stats.store_evicted == 0);
+    }
+
+    SECTION("by stores") {
+        opts.store_evict_watermark = 0;
+        opts.store_evict_max = 2;
+        Database storage{".", opts};
+        storage.bulk_store(msgs);
+        CHECK(storage.store({pk, "new", now, now + 100h, "data"}) == true);
+        CHECK(evicted(storage) == std::vector<std::string>{"hash15", "hash18"});
+        CHECK(storage.get_message_count() == 19);
+        auto stats = storage.get_capacity_stats();
+        CHECK(stats.evicted == 2);
+        CHECK(stats.store_evicted == 2);
+    }
+}
+
+TEST_CASE("storage - memory engine", "[storage]") {
+    std::filesystem::remove_all("memory_test");
+
+    user_pubkey_t pk;
+    REQUIRE(pk.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+
+    database_options opts;
+    opts.engine = storage_engine::memory;
+    opts.evict_watermark = 0;
+    opts.evict_target = 0;
+    SECTION("single") {}
+    SECTION("sharded") { opts.shards = 4; }
+    Database storage{"memory_test", opts};
+    // Nothing touches the disk, not even for the shards
+    CHECK_FALSE(std::filesystem::exists("memory_test"));
+
+    auto now = std::chrono::system_clock::now();
+    for (int i = 0; i < 10; i++)
+        CHECK(storage.store({pk, "hash" + std::to_string(i), now, now + 1h - 1min * i, "data"}));
+    CHECK(storage.store({pk, "expired", now - 1h, now - 1min, "data"}));
+    CHECK(storage.get_data_bytes() == 44);
+    CHECK(storage.get_used_bytes() == 44 + 10 * 5 + 7);
+    CHECK(storage.get_fill_level() > 0);
+    CHECK(storage.get_expired_estimate() == 1);
+
+    // Evicts the soonest expiries first, whether expired or not
+    CHECK(storage.evict_chunk(3) == 3);
+    CHECK_FALSE(storage.retrieve_by_hash("expired"));
+    CHECK_FALSE(storage.retrieve_by_hash("hash9"));
+    CHECK_FALSE(storage.retrieve_by_hash("hash8"));
+    CHECK(storage.retrieve_by_hash("hash7"));
+    CHECK(storage.get_expired_estimate() == 0);
+    CHECK(storage.get_capacity_stats().evicted == 3);
+    CHECK(storage.get_message_count() == 8);
+    CHECK(storage.retrieve(pk, "hash3").size() == 4);
+
+    // The maintenance of on-disk databases does nothing
+    CHECK(storage.query_plans().empty());
+    CHECK(storage.checkpoint(checkpoint_mode::truncate).log_bytes == 0);
+    CHECK(storage.incremental_vacuum(100) == 0);
+    CHECK_FALSE(storage.get_hash_filter_stats().ready);
+    CHECK_FALSE(storage.get_retrieve_cache_stats().enabled);
+}
+
+TEST_CASE("storage - retrieve cache", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey_t pk, pk2;
+    REQUIRE(pk.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pk2.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+
+    database_options opts;
+    SECTION("single table") {}
+    SECTION("partitioned") { opts.partitioned = true; }
+    Database storage{".", opts};
+
+    auto hashes = [](const std::vector<message>& msgs) {
+        std::vector<std::string> h;
+        for (auto& m : msgs)
+            h.push_back(m.hash);
+        return h;
+    };
+    auto check_stats = [&](int64_t hits, int64_t misses) {
+        auto stats = storage.get_retrieve_cache_stats();
+        CHECK(stats.enabled);
+        CHECK(stats.hits == hits);
+        CHECK(stats.misses == misses);
+    };
+
+    // Polling an owner with no messages: the first poll fills the cache, later ones hit it
+    CHECK(storage.retrieve(pk, "").empty());
+    CHECK(storage.retrieve(pk, "").empty());
+    check_stats(1, 1);
+    CHECK(storage.get_retrieve_cache_stats().empty == 1);
+
+    // Stores are added to cached entries
+    auto now = std::chrono::system_clock::now();
+    for (int i = 0; i < 5; i++)
+        CHECK(storage.store({pk, "hash" + std::to_string(i), now, now + 1h, "data" + std::to_string(i)}));
+    auto msgs = storage.retrieve(pk, "");
+    REQUIRE(msgs.size() == 5);
+    CHECK(msgs[4].hash == "hash4");
+    CHECK(msgs[4].data == "data4");
+    CHECK(to_epoch_ms(msgs[4].expiry) == to_epoch_ms(now + 1h));
+    CHECK(storage.retrieve(pk, "hash4").empty());
+    auto page = storage.retrieve_page(pk, "hash1", 2);
+    CHECK(hashes(page.messages) == std::vector<std::string>{"hash2", "hash3"});
+    CHECK(page.more);
+    page = storage.retrieve_page(pk, "", 10, 11);
+    CHECK(hashes(page.messages) == std::vector<std::string>{"hash0", "hash1"});
+    CHECK(page.more);
+    // An unknown last hash gets everything, as from the database
+    CHECK(storage.retrieve(pk, "nope").size() == 5);
+    check_stats(6, 1);
+
+    // With more than RetrieveCache::MAX_MESSAGES only polls from one of the newest can be answered
+    std::vector<message> more;
+    for (int i = 5; i < 15; i++)
+        more.emplace_back(pk, "hash" + std::to_string(i), now, now + 1h, "data");
+    storage.bulk_store(more);
+    CHECK(storage.retrieve(pk, "hash10").size() == 4);
+    CHECK(storage.retrieve(pk, "").size() == 15);
+    CHECK(storage.retrieve(pk, "hash2").size() == 12);
+    CHECK(storage.retrieve(pk, "nope").size() == 15);
+    check_stats(7, 4);
+
+    // Deletions and expiry updates drop the entry, which the next poll fills again
+    CHECK(storage.delete_by_hash(pk, {"hash14"}) == std::vector<std::string>{"hash14"});
+    CHECK(hashes(storage.retrieve(pk, "hash12")) == std::vector<std::string>{"hash13"});
+    CHECK(hashes(storage.retrieve(pk, "hash12")) == std::vector<std::string>{"hash13"});
+    check_stats(8, 5);
+    CHECK(storage.update_expiry(pk, {"hash13"}, now + 30min).size() == 1);
+    msgs = storage.retrieve(pk, "hash12");
+    REQUIRE(msgs.size() == 1);
+    CHECK(to_epoch_ms(msgs[0].expiry) == to_epoch_ms(now + 30min));
+    CHECK(storage.delete_all(pk).size() == 14);
+    CHECK(storage.retrieve(pk, "hash12").empty());
+    CHECK(storage.retrieve(pk, "").empty());
+    check_stats(9, 7);
+
+    // Messages that expire while cached stop being returned
+    CHECK(storage.store({pk2, "brief", now, std::chrono::system_clock::now() + 100ms, "data"}));
+    CHECK(storage.retrieve(pk2, "").size() == 1);
+    std::this_thread::sleep_for(150ms);
+    CHECK(storage.retrieve(pk2, "").empty());
+    check_stats(10, 8);
+}
+
+TEST_CASE("storage - retrieve cache fills racing stores", "[storage]") {
+    user_pubkey_t pk;
+    REQUIRE(pk.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    auto now = std::chrono::system_clock::now();
+    message x{pk, "x", now, now + 1h, "data"};
+
+    RetrieveCache cache{1'000'000};
+    auto polled = [&] {
+        std::vector<std::string> hashes;
+        auto more = cache.retrieve(pk, "", -1, std::numeric_limits<size_t>::max(), size_encoding::raw, now,
+                [&](const message_view& m) { hashes.emplace_back(m.hash); });
+        return more ? std::optional{hashes} : std::nullopt;
+    };
+
+    SECTION("fill between the commit and stored()") {
+        {
+            RetrieveCache::store_guard guard{&cache, {pk}};
+            // x is committed here; a retrieve now would read it from the database, but can't fill
+            CHECK(cache.begin_fill(pk) == 0);
+            cache.stored(x);
+        }
+        auto reservation = cache.begin_fill(pk);
+        REQUIRE(reservation != 0);
+        cache.fill(pk, reservation, {x});
+        CHECK(polled() == std::vector<std::string>{"x"});
+    }
+
+    SECTION("fill started before the store") {
+        auto reservation = cache.begin_fill(pk);
+        REQUIRE(reservation != 0);
+        {
+            RetrieveCache::store_guard guard{&cache, {pk, pk}};
+            cache.fill(pk, reservation, {x});
+            cache.stored(x);
+        }
+        // The fill may or may not have seen x, so it's dropped
+        CHECK_FALSE(polled());
+        reservation = cache.begin_fill(pk);
+        REQUIRE(reservation != 0);
+        cache.fill(pk, reservation, {x});
+        CHECK(polled() == std::vector<std::string>{"x"});
+    }
+
+    SECTION("stored() of a message already filled") {
+        auto reservation = cache.begin_fill(pk);
+        cache.fill(pk, reservation, {x});
+        cache.stored(x);
+        CHECK(polled() == std::vector<std::string>{"x"});
+    }
+}
+
+TEST_CASE("storage - retrieve cache memory budget", "[storage]") {
+    StorageDeleter fixture;
+
+    std::vector<user_pubkey_t> pks(5);
+    for (size_t i = 0; i < pks.size(); i++)
+        REQUIRE(pks[i].load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcde" + std::to_string(i)));
+
+    database_options opts;
+    opts.retrieve_cache_size = 3 * RetrieveCache::ENTRY_OVERHEAD + 100;
+    {
+        Database storage{".", opts};
+        for (auto& pk : pks)
+            CHECK(storage.retrieve(pk, "").empty());
+        auto stats = storage.get_retrieve_cache_stats();
+        CHECK(stats.entries == 3);
+        CHECK(stats.evictions == 2);
+        CHECK(stats.memory_bytes <= static_cast<int64_t>(opts.retrieve_cache_size));
+        // The most recently used entries are the ones kept
+        CHECK(storage.retrieve(pks[4], "").empty());
+        CHECK(storage.get_retrieve_cache_stats().hits == 1);
+        CHECK(storage.retrieve(pks[0], "").empty());
+        CHECK(storage.get_retrieve_cache_stats().hits == 1);
+    }
+
+    opts.retrieve_cache_size = 0;
+    Database storage{".", opts};
+    CHECK(storage.retrieve(pks[0], "").empty());
+    CHECK_FALSE(storage.get_retrieve_cache_stats().enabled);
+}
+
+namespace {
+
+const std::filesystem::path SHARDED_DIR{"sharded_test"};
+
+struct ShardedDeleter {
+    ShardedDeleter() {
+        std::filesystem::remove_all(SHARDED_DIR);
+        std::filesystem::create_directory(SHARDED_DIR);
+    }
+    ~ShardedDeleter() { std::filesystem::remove_all(SHARDED_DIR); }
+};
+
+} // namespace
+
+TEST_CASE("storage - sharded database", "[storage]") {
+    ShardedDeleter fixture;
+
+    auto now = std::chrono::system_clock::now();
+    std::vector<user_pubkey_t> pubkeys(16);
+    std::vector<message> msgs;
+    for (size_t i = 0; i < pubkeys.size(); i++) {
+        REQUIRE(pubkeys[i].load(fmt::format("05{:064x}", i * 7919)));
+        for (int j = 0; j < 5; j++)
+            msgs.emplace_back(pubkeys[i], fmt::format("hash-{}-{}", i, j), now, now + 1h, "data");
+    }
+
+    database_options opts;
+    opts.shards = 4;
+
+    SECTION("new database") {
+        Database storage{SHARDED_DIR, opts};
+        for (auto& m : msgs)
+            CHECK(storage.store(m) == true);
+    }
+    SECTION("migrated from a single file") {
+        {
+            Database single{SHARDED_DIR};
+            single.bulk_store(msgs);
+        }
+        Database storage{SHARDED_DIR, opts};
+        CHECK_FALSE(std::filesystem::exists(SHARDED_DIR / "storage.db"));
+        CHECK(std::filesystem::exists(SHARDED_DIR / "storage.db.unsharded"));
+    }
+    SECTION("migrated past the per-owner quotas") {
+        {
+            Database single{SHARDED_DIR};
+            single.bulk_store(msgs);
+        }
+        // Messages already accepted aren't dropped by quotas configured since
+        opts.owner_max_messages = 2;
+        Database storage{SHARDED_DIR, opts};
+        CHECK(std::filesystem::exists(SHARDED_DIR / "storage.db.unsharded"));
+    }
+
+    Database storage{SHARDED_DIR, opts};
+    REQUIRE(storage.shard_count() == 4);
+    for (size_t i = 0; i < 4; i++)
+        CHECK(std::filesystem::exists(SHARDED_DIR / fmt::format("storage-{:02d}.db", i)));
+
+    CHECK(storage.get_message_count() == 80);
+    CHECK(storage.get_owner_count() == 16);
+    CHECK(storage.get_data_bytes() == 80 * 4);
+    CHECK(storage.retrieve_all().size() == 80);
+    CHECK(storage.for_each([](auto&) { return true; }, {std::nullopt, std::nullopt, 7}) == 80);
+    // Stopping early stops going through the shards too
+    CHECK(storage.for_each([](auto&) { return false; }, {std::nullopt, std::nullopt, 7}) == 7);
+    CHECK(storage.retrieve_random());
+
+    std::set<size_t> used;
+    for (size_t i = 0; i < pubkeys.size(); i++) {
+        auto shard = Database::shard_of(pubkeys[i], 4);
+        used.insert(shard);
+        CHECK(storage.retrieve(pubkeys[i], "").size() == 5);
+        CHECK(storage.retrieve(pubkeys[i], fmt::format("hash-{}-2", i)).size() == 2);
+        // All of an owner's messages are in its shard
+        for (size_t s = 0; s < 4; s++)
+            CHECK(storage.shard(s).retrieve(pubkeys[i], "").size() == (s == shard ? 5 : 0));
+        CHECK(storage.retrieve_by_hash(fmt::format("hash-{}-4", i)));
+    }
+    CHECK(used.size() == 4);
+
+    CHECK(storage.delete_all(pubkeys[0]).size() == 5);
+    CHECK(storage.delete_by_hash(pubkeys[1], {"hash-1-0"}).size() == 1);
+    CHECK(storage.update_all_expiries(pubkeys[2], now + 30min).size() == 5);
+    CHECK(storage.get_message_count() == 74);
+    CHECK_FALSE(storage.retrieve_by_hash("hash-0-0"));
+
+    // The shard count of an existing sharded database can't be changed
+    opts.shards = 2;
+    CHECK_THROWS(Database{SHARDED_DIR, opts});
+    CHECK_THROWS(Database{SHARDED_DIR});
+}
+
+TEST_CASE("storage - sharded store throughput", "[storage][!benchmark]") {
+    const auto now = std::chrono::system_clock::now();
+    std::vector<user_pubkey_t> pubkeys(256);
+    for (size_t i = 0; i < pubkeys.size(); i++)
+        REQUIRE(pubkeys[i].load(fmt::format("05{:064x}", i * 7919)));
+
+    // Concurrent stores from 8 threads (as from the request handling threads); each shard commits
+    // its own store batches, so throughput should grow with the shard count until the disk (or
+    // the cores) are saturated.
+    constexpr unsigned threads = 8;
+    constexpr size_t stores_per_run = 4000;
+    for (size_t shards : {1, 2, 4, 8}) {
+        ShardedDeleter fixture;
+        database_options opts;
+        opts.shards = shards;
+        Database storage{SHARDED_DIR, opts};
+        std::atomic<size_t> next = 0;
+
+        auto run = [&] {
+            std::atomic<size_t> stored = 0;
+            std::vector<std::thread> workers;
+            for (unsigned t = 0; t < threads; t++)
+                workers.emplace_back([&] {
+                    for (size_t n = 0; n < stores_per_run / threads; n++) {
+                        auto i = next++;
+                        if (storage.store({pubkeys[i % pubkeys.size()], fmt::format("hash-{}", i),
+                                    now, now + 1h, std::string(500, 'x')}))
+                            stored++;
+                    }
+                });
+            for (auto& w : workers)
+                w.join();
+            return stored.load();
+        };
+
+        auto start = std::chrono::steady_clock::now();
+        auto stored = run();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << fmt::format("{} shard(s): {:.0f} stores/s\n", shards, stored / elapsed.count());
+
+        BENCHMARK(fmt::format("{} stores on {} thread(s) into {} shard(s)", stores_per_run, threads, shards)) {
+            return run();
+        };
+    }
+}
@@ -0,0 +1,394 @@
+#include "Database.hpp"
+#include "serialization.h"
+#include "swarm_sync.h"
+
+#include <catch2/catch.hpp>
+
+#include <chrono>
+#include <condition_variable>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fmt/format.h>
+
+using namespace beldex;
+using namespace beldex::swarm_sync;
+using namespace std::literals;
+
+namespace {
+
+constexpr range FULL_SPACE{0, std::numeric_limits<uint64_t>::max()};
+
+mn_record test_node(int i) {
+    mn_record mn;
+    mn.ip = "10.0.0." + std::to_string(i);
+    mn.pubkey_legacy = legacy_pubkey::from_hex(fmt::format("{:064x}", 0x1000 + i));
+    return mn;
+}
+
+database_options memory_db() {
+    database_options opts;
+    opts.engine = storage_engine::memory;
+    return opts;
+}
+
+// Builds a new index for every request, so that messages pushed to a member show up at once
+swarm_sync_options fresh_index() {
+    swarm_sync_options opts;
+    opts.index_max_age = 0ms;
+    opts.bytes_per_second = 0;
+    return opts;
+}
+
+// A few swarm members, each with its own database and SwarmSync, whose requests go straight to the
+// other member's SwarmSync (or database, for pushed messages), and whose relays (standing in for
+// the Rebalancer) copy the messages straight to the other member's database.
+struct fake_swarm {
+    struct member {
+        mn_record mn;
+        Database db{".", memory_db()};
+        std::unique_ptr<SwarmSync> sync;
+    };
+    std::vector<std::unique_ptr<member>> members;
+    std::mutex mutex;
+    std::map<std::string, int> requests;  // Requests made, by command
+    int relays = 0;                       // Relays made
+    std::set<legacy_pubkey> down;         // Members whose requests fail
+
+    explicit fake_swarm(int n, swarm_sync_options opts = fresh_index()) {
+        for (int i = 0; i < n; i++) {
+            auto& m = *members.emplace_back(std::make_unique<member>());
+            m.mn = test_node(i);
+            m.sync = std::make_unique<SwarmSync>(
+                    m.db,
+                    [this](const mn_record& mn, std::string command, std::vector<std::string> parts,
+                            std::function<void(bool, std::vector<std::string>)> cb) {
+                        {
+                            std::lock_guard lock{mutex};
+                            requests[command]++;
+                            if (down.count(mn.pubkey_legacy))
+                                return cb(false, {});
+                        }
+                        auto& to = (*this)[mn];
+                        auto reply = [cb](std::vector<std::string> reply) { cb(true, std::move(reply)); };
+                        if (command == "mn.sync_digest")
+                            return to.sync->digest(parts.at(0), reply);
+                        if (command == "mn.sync_fetch")
+                            return to.sync->fetch(parts.at(0), parts.at(1), parts.at(2), reply);
+                        REQUIRE(command == "mn.data");
+                        to.db.bulk_store(deserialize_messages(parts.at(0)));
+                        cb(true, {});
+                    },
+                    [this, &m](const mn_record& mn, std::vector<std::pair<uint64_t, uint64_t>> ranges) {
+                        auto& to = (*this)[mn];
+                        stream_options opts;
+                        for (auto& r : ranges) {
+                            opts.swarm_space = r;
+                            m.db.for_each([&to](std::vector<message>& batch) {
+                                to.db.bulk_store(batch);
+                                return true;
+                            }, opts);
+                        }
+                        std::lock_guard lock{mutex};
+                        relays++;
+                    },
+                    [] { return SERIALIZATION_VERSION_BT; },
+                    opts);
+        }
+    }
+
+    member& operator[](const mn_record& mn) {
+        for (auto& m : members)
+            if (m->mn == mn)
+                return *m;
+        throw std::logic_error{"unknown member"};
+    }
+    member& operator[](int i) { return *members[i]; }
+};
+
+// Stores messages of random pubkeys, named `prefix` + 0, 1, ..., in the given databases
+void store_messages(std::vector<Database*> dbs, std::string_view prefix, int count, size_t size) {
+    std::mt19937_64 rng{std::hash<std::string_view>{}(prefix)};
+    auto now = std::chrono::system_clock::now();
+    std::vector<message> msgs;
+    for (int i = 0; i < count; i++) {
+        user_pubkey_t pk;
+        pk.load(fmt::format("05{:016x}{:048x}", rng(), 0));
+        msgs.emplace_back(pk, fmt::format("{}{}", prefix, i), now, now + 1h, std::string(size, 'x'));
+    }
+    for (auto* db : dbs)
+        db->bulk_store(msgs);
+}
+
+std::set<std::string> hashes(Database& db) {
+    std::set<std::string> result;
+    for (auto& m : db.retrieve_all())
+        result.insert(m.hash);
+    return result;
+}
+
+SwarmSync::stats_t wait_for_syncs(const SwarmSync& sync, int64_t syncs) {
+    auto until = std::chrono::steady_clock::now() + 20s;
+    auto stats = sync.get_stats();
+    while (stats.synced + stats.failed < syncs && std::chrono::steady_clock::now() < until) {
+        std::this_thread::sleep_for(5ms);
+        stats = sync.get_stats();
+    }
+    REQUIRE(stats.synced + stats.failed == syncs);
+    return stats;
+}
+
+} // namespace
+
+TEST_CASE("swarm sync - ranges and encodings", "[swarm_sync]") {
+    // Splits cover the range exactly, in order
+    for (auto r : {FULL_SPACE, range{5, 5}, range{10, 20}, range{0, 15}, range{100, 100 + 1000}}) {
+        auto parts = split(r);
+        REQUIRE_FALSE(parts.empty());
+        CHECK(parts.size() <= FANOUT);
+        CHECK(parts.front().first == r.first);
+        CHECK(parts.back().last == r.last);
+        for (size_t i = 1; i < parts.size(); i++)
+            CHECK(parts[i].first == parts[i - 1].last + 1);
+    }
+    CHECK(split(FULL_SPACE).size() == FANOUT);
+    CHECK(split({5, 5}).size() == 1);
+    CHECK(split({0, 15}).size() == 16);
+
+    CHECK(to_ranges({10, 20}).size() == 1);
+    auto wrapped = to_ranges({20, 10});
+    REQUIRE(wrapped.size() == 2);
+    CHECK(wrapped[0].first == 20);
+    CHECK(wrapped[0].last == FULL_SPACE.last);
+    CHECK(wrapped[1].first == 0);
+    CHECK(wrapped[1].last == 10);
+
+    auto ranges = decode_ranges(encode_ranges({{1, 2}, {3, FULL_SPACE.last}}));
+    REQUIRE(ranges.size() == 2);
+    CHECK(ranges[1].first == 3);
+    CHECK(ranges[1].last == FULL_SPACE.last);
+    auto summaries = decode_summaries(encode_summaries({{7, 0x0123456789abcdef}}));
+    REQUIRE(summaries.size() == 1);
+    CHECK(summaries[0] == summary{7, 0x0123456789abcdef});
+    std::vector<std::string> hs{"abc", std::string(88, 'h')};
+    CHECK(decode_hashes(encode_hashes(hs)) == hs);
+
+    CHECK_THROWS_AS(decode_ranges("short"), std::invalid_argument);
+    CHECK_THROWS_AS(decode_ranges(encode_ranges({{2, 1}})), std::invalid_argument);
+    CHECK_THROWS_AS(decode_ranges(std::string(16 * (MAX_RANGES + 1), '\0')), std::invalid_argument);
+    CHECK_THROWS_AS(decode_hashes("\x05" "abc"), std::invalid_argument);
+
+    // The digest of a message depends on both its owner and its hash
+    user_pubkey_t a, b;
+    a.load("05" + std::string(64, 'a'));
+    b.load("05" + std::string(64, 'b'));
+    CHECK(message_digest(a, "x") == message_digest(a, "x"));
+    CHECK(message_digest(a, "x") != message_digest(b, "x"));
+    CHECK(message_digest(a, "x") != message_digest(a, "y"));
+}
+
+TEST_CASE("swarm sync - exchanges only the differing messages", "[swarm_sync]") {
+    fake_swarm swarm{2};
+    auto &a = swarm[0], &b = swarm[1];
+    store_messages({&a.db, &b.db}, "common", 2000, 1000);
+    store_messages({&a.db}, "a", 30, 1000);
+    store_messages({&b.db}, "b", 20, 1000);
+
+    a.sync->sync({b.mn}, {FULL_SPACE.first, FULL_SPACE.last});
+    auto stats = wait_for_syncs(*a.sync, 1);
+
+    CHECK(stats.synced == 1);
+    CHECK(stats.in_sync == 0);
+    CHECK(stats.fetched == 20);
+    CHECK(stats.pushed + stats.relayed == 30);
+    CHECK(hashes(a.db).size() == 2050);
+    CHECK(hashes(a.db) == hashes(b.db));
+    // Far less than sending the ~2MB of messages across
+    CHECK(stats.full_dump_bytes >= 2'000'000);
+    CHECK(stats.bytes < stats.full_dump_bytes / 10);
+    CHECK(b.sync->get_stats().served == swarm.requests["mn.sync_digest"] + swarm.requests["mn.sync_fetch"]);
+
+    // Now they're in sync, which takes a single request to find out (from either side)
+    swarm.requests.clear();
+    b.sync->sync({a.mn}, {FULL_SPACE.first, FULL_SPACE.last});
+    auto b_stats = wait_for_syncs(*b.sync, 1);
+    CHECK(b_stats.in_sync == 1);
+    CHECK(b_stats.fetched == 0);
+    CHECK(b_stats.pushed == 0);
+    CHECK(b_stats.ranges == FANOUT);
+    CHECK(swarm.requests == std::map<std::string, int>{{"mn.sync_digest", 1}});
+}
+
+TEST_CASE("swarm sync - only syncs the given range", "[swarm_sync]") {
+    fake_swarm swarm{2};
+    auto &a = swarm[0], &b = swarm[1];
+    store_messages({&a.db}, "a", 200, 100);
+
+    // The top quarter of the swarm space and (wrapping around) the bottom half
+    a.sync->sync({b.mn}, {uint64_t{3} << 62, (uint64_t{1} << 63) - 1});
+    wait_for_syncs(*a.sync, 1);
+
+    std::set<std::string> expected;
+    for (auto& m : a.db.retrieve_all()) {
+        auto ss = pubkey_to_swarm_space(m.pubkey);
+        if (ss >= uint64_t{3} << 62 || ss < uint64_t{1} << 63)
+            expected.insert(m.hash);
+    }
+    CHECK(expected.size() > 100);
+    CHECK(expected.size() < 200);
+    CHECK(hashes(b.db) == expected);
+}
+
+TEST_CASE("swarm sync - pages large differences", "[swarm_sync]") {
+    fake_swarm swarm{2};
+    auto &a = swarm[0], &b = swarm[1];
+    // ~9MB, more than fits in two replies
+    store_messages({&a.db}, "a", 300, 30'000);
+
+    SECTION("pulling into an empty node") {
+        b.sync->sync({a.mn}, {FULL_SPACE.first, FULL_SPACE.last});
+        auto stats = wait_for_syncs(*b.sync, 1);
+        CHECK(stats.fetched == 300);
+        CHECK(stats.pushed == 0);
+        CHECK(swarm.requests["mn.sync_digest"] == 1);
+        CHECK(swarm.requests["mn.sync_fetch"] == 3);
+    }
+
+    SECTION("relaying to an empty node") {
+        a.sync->sync({b.mn}, {FULL_SPACE.first, FULL_SPACE.last});
+        auto stats = wait_for_syncs(*a.sync, 1);
+        CHECK(stats.fetched == 0);
+        CHECK(stats.pushed == 0);
+        CHECK(stats.relayed == 300);
+        // The whole range goes to the Rebalancer at once, rather than as pushes
+        CHECK(swarm.relays == 1);
+        CHECK(swarm.requests["mn.sync_fetch"] == 0);
+        CHECK(swarm.requests["mn.data"] == 0);
+    }
+
+    SECTION("pushing to a node that lacks most messages") {
+        store_messages({&b.db}, "b", 200, 10);
+        a.sync->sync({b.mn}, {FULL_SPACE.first, FULL_SPACE.last});
+        auto stats = wait_for_syncs(*a.sync, 1);
+        CHECK(stats.fetched == 200);
+        CHECK(stats.pushed + stats.relayed == 300);
+        CHECK(stats.pushed > 0);
+        CHECK(swarm.requests["mn.data"] >= 3);
+    }
+
+    CHECK(hashes(b.db) == hashes(a.db));
+}
+
+TEST_CASE("swarm sync - leaves bulk transfers to the side that has the messages", "[swarm_sync]") {
+    fake_swarm swarm{2};
+    auto &a = swarm[0], &b = swarm[1];
+    store_messages({&a.db}, "a", 2000, 10);
+
+    // The empty node doesn't pull the large ranges it lacks...
+    b.sync->sync({a.mn}, {FULL_SPACE.first, FULL_SPACE.last});
+    auto b_stats = wait_for_syncs(*b.sync, 1);
+    CHECK(b_stats.deferred == 2000);
+    CHECK(b_stats.fetched == 0);
+    CHECK(b_stats.in_sync == 0);
+    CHECK(swarm.requests["mn.sync_fetch"] == 0);
+    CHECK(hashes(b.db).empty());
+
+    // ...which the node that has them relays instead
+    a.sync->sync({b.mn}, {FULL_SPACE.first, FULL_SPACE.last});
+    auto a_stats = wait_for_syncs(*a.sync, 1);
+    CHECK(a_stats.relayed == 2000);
+    CHECK(a_stats.pushed == 0);
+    CHECK(swarm.relays == 1);
+    CHECK(hashes(b.db) == hashes(a.db));
+
+    // The leaves fetched are small, and a fetch of more than that is refused
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<std::string> reply;
+    store_messages({&a.db}, "more", MAX_FETCH_HASHES, 10);
+    a.sync->fetch(encode_ranges({FULL_SPACE}), "", "", [&](std::vector<std::string> r) {
+        std::lock_guard lock{mutex};
+        reply = std::move(r);
+        cv.notify_all();
+    });
+    std::unique_lock lock{mutex};
+    REQUIRE(cv.wait_for(lock, 5s, [&] { return !reply.empty(); }));
+    CHECK(reply == std::vector<std::string>{"invalid parameters"});
+}
+
+TEST_CASE("swarm sync - picks one member to bring a new member up to date", "[swarm_sync]") {
+    std::vector<mn_record> members{test_node(0), test_node(1), test_node(2), test_node(3)};
+    // Nearest by xor distance: 0x1009 ^ 0x1001 == 8
+    CHECK(relaying_member(members, test_node(9)) == test_node(1));
+    CHECK(relaying_member({members.rbegin(), members.rend()}, test_node(9)) == test_node(1));
+    CHECK(relaying_member(members, test_node(6)) == test_node(2));
+    CHECK(relaying_member({test_node(3)}, test_node(6)) == test_node(3));
+}
+
+TEST_CASE("swarm sync - answers from a reused index of its swarm's range", "[swarm_sync]") {
+    fake_swarm swarm{2, swarm_sync_options{}};
+    auto &a = swarm[0], &b = swarm[1];
+    store_messages({&a.db, &b.db}, "common", 20000, 10);
+    store_messages({&a.db}, "a", 5, 10);
+
+    // Our swarm is the bottom half of the swarm space
+    const std::pair<uint64_t, uint64_t> space{0, (uint64_t{1} << 63) - 1};
+    b.sync->sync({}, space);
+    a.sync->sync({b.mn}, space);
+    wait_for_syncs(*a.sync, 1);
+
+    // The peer descended through several levels, all answered from a single index
+    CHECK(swarm.requests["mn.sync_digest"] > 1);
+    CHECK(b.sync->get_stats().indexes == 1);
+
+    // which only covers our swarm's range
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<std::vector<std::string>> replies;
+    auto reply = [&](std::vector<std::string> r) {
+        std::lock_guard lock{mutex};
+        replies.push_back(std::move(r));
+        cv.notify_all();
+    };
+    b.sync->digest(encode_ranges({{0, 1000}}), reply);
+    b.sync->digest(encode_ranges({{0, uint64_t{1} << 63}}), reply);
+    b.sync->digest("invalid", reply);
+    std::unique_lock lock{mutex};
+    REQUIRE(cv.wait_for(lock, 5s, [&] { return replies.size() == 3; }));
+    CHECK(replies[0].size() == 2);
+    CHECK(replies[0][0] == "OK");
+    CHECK(replies[1] == std::vector<std::string>{"invalid parameters"});
+    CHECK(replies[2] == std::vector<std::string>{"invalid parameters"});
+    CHECK(b.sync->get_stats().indexes == 1);
+}
+
+TEST_CASE("swarm sync - reports peers it can't sync with", "[swarm_sync]") {
+    fake_swarm swarm{3};
+    auto &a = swarm[0], &b = swarm[1], &c = swarm[2];
+    store_messages({&a.db}, "a", 10, 100);
+    swarm.down.insert(b.mn.pubkey_legacy);
+
+    std::mutex mutex;
+    std::vector<mn_record> failed;
+    a.sync->sync({b.mn, c.mn}, {FULL_SPACE.first, FULL_SPACE.last}, [&](const mn_record& mn) {
+        std::lock_guard lock{mutex};
+        failed.push_back(mn);
+    });
+    auto stats = wait_for_syncs(*a.sync, 2);
+
+    CHECK(stats.synced == 1);
+    CHECK(stats.failed == 1);
+    std::lock_guard lock{mutex};
+    REQUIRE(failed.size() == 1);
+    CHECK(failed[0] == b.mn);
+    CHECK(hashes(c.db).size() == 10);
+    CHECK(hashes(b.db).empty());
+}